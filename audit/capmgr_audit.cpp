@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2024 Verifoxx Limited
+ * rtld-audit module which does the restricted capability fixups of compartment libraries as the loader adds them,
+ * including libraries the compartment dlopen()s later.
+ * Use with LD_AUDIT=<path>/libcapmgr-audit.so when starting the capability manager (dynamic build only).
+ */
+
+// We use GLIBC internals...
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <cheriintrin.h>
+
+#include "CCapability.h"
+#include "CCompartmentLibs.h"
+#include "capmgr_audit_hook.h"
+#include "CCapMgrLogger.h"
+
+// DT_THISPROCNUM needed by link-internal.h
+#ifndef DT_THISPROCNUM
+#define DT_THISPROCNUM DT_AARCH64_NUM
+#endif
+
+#include "link_map_internal/link-internal.h"
+
+using namespace CapMgr;
+
+/* The loader calls la_objopen() once an object is mapped but before it is relocated, so patching there would be
+ * overwritten.  Objects are therefore held as pending from la_objopen() and patched once the loader marks them
+ * relocated: at LA_ACT_CONSISTENT, and whenever the capability manager asks whether an object is patched
+ * (capmgr_audit_patched), which it does for each object it loads.  Some loaders signal LA_ACT_CONSISTENT at the end
+ * of a dlopen() before relocating its objects, so asking is what guarantees the last objects of a dlopen() are
+ * patched here rather than left to the capability manager.
+ * Each object patched is recorded, so the capability manager skips exactly those; there is no guessing from the
+ * object's capabilities.
+ * Only objects in namespaces other than the base namespace are patched, i.e. those of the compartments.
+ */
+namespace
+{
+    std::mutex audit_mutex;
+    std::vector<struct link_map*> pending;
+    std::map<size_t, CSharedObject> loaded;         // Keyed by link map address
+    std::set<size_t> patched;                       // Link map addresses of the objects fully patched
+
+    struct link_map* main_map = nullptr;            // The capability manager executable, for its hook
+    bool hook_set = false;
+
+    void patch_relocated()
+    {
+        auto rwcap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+        auto fixup_cap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+
+        for (auto itr = pending.begin(); itr != pending.end(); )
+        {
+            struct link_map* map = *itr;
+            if (!reinterpret_cast<struct internal_link_map*>(map)->l_relocated)
+            {
+                ++itr;
+                continue;
+            }
+            itr = pending.erase(itr);
+
+            size_t key = cheri_address_get(map);
+            try
+            {
+                auto& so = loaded[key];
+                if (!CCompartmentLibs::LoadSharedObject(map, rwcap, fixup_cap, false, so))
+                {
+                    loaded.erase(key);
+                    continue;
+                }
+
+                L_(DEBUG) << "Audit: LibCapFixups for " << so.GetName();
+                if (so.DoLibCapFixups(true))
+                {
+                    patched.insert(key);
+                }
+                else
+                {
+                    L_(ERROR) << "Audit: LibCapFixups failed for " << so.GetName();
+                }
+            }
+            catch (std::exception& e)
+            {
+                L_(ERROR) << "Audit: cannot patch " << map->l_name << ": " << e.what();
+                loaded.erase(key);
+            }
+        }
+    }
+
+    bool is_patched(const struct link_map* map)
+    {
+        std::lock_guard<std::mutex> lock(audit_mutex);
+        patch_relocated();
+        return patched.count(cheri_address_get(map)) != 0;
+    }
+
+    // Give the capability manager is_patched(), once its executable is far enough loaded to look the hook up
+    void set_hook()
+    {
+        if (hook_set || !main_map)
+        {
+            return;
+        }
+
+        auto hook = reinterpret_cast<CapMgrAuditPatchedFn*>(dlsym(main_map, "capmgr_audit_patched"));
+        if (!hook)
+        {
+            L_(WARNING) << "Audit: capmgr_audit_patched not exported by the executable, so it will patch objects again";
+        }
+        else
+        {
+            *hook = &is_patched;
+        }
+        hook_set = true;
+    }
+}
+
+extern "C" unsigned int la_version(unsigned int version)
+{
+    const char* level = getenv("CAPMGR_AUDIT_LOG_LEVEL");
+    if (level)
+    {
+        int log_level = atoi(level);
+        Log::SetLevel((TLogLevel)((log_level < (int)ALWAYS || log_level > (int)VERBOSE) ? VERBOSE : log_level));
+    }
+
+    return (version < LAV_CURRENT) ? version : LAV_CURRENT;
+}
+
+extern "C" unsigned int la_objopen(struct link_map* map, Lmid_t lmid, uintptr_t* cookie)
+{
+    // The cookie identifies the object in later calls
+    *cookie = reinterpret_cast<uintptr_t>(map);
+
+    std::lock_guard<std::mutex> lock(audit_mutex);
+    if (lmid == LM_ID_BASE && !main_map)
+    {
+        main_map = map;     // The executable is always the first object
+    }
+    else if (lmid != LM_ID_BASE && map->l_name && map->l_name[0] != '\0')
+    {
+        patch_relocated();
+        pending.push_back(map);
+    }
+    return 0;
+}
+
+extern "C" void la_activity(uintptr_t* cookie, unsigned int flag)
+{
+    (void)cookie;
+
+    if (flag == LA_ACT_CONSISTENT)
+    {
+        std::lock_guard<std::mutex> lock(audit_mutex);
+        set_hook();
+        patch_relocated();
+    }
+}
+
+extern "C" unsigned int la_objclose(uintptr_t* cookie)
+{
+    auto map = reinterpret_cast<struct link_map*>(*cookie);
+
+    // Nothing to revert: the destructors have already run by now
+    std::lock_guard<std::mutex> lock(audit_mutex);
+    pending.erase(std::remove(pending.begin(), pending.end(), map), pending.end());
+    loaded.erase(cheri_address_get(map));
+    patched.erase(cheri_address_get(map));
+    return 0;
+}
@@ -0,0 +1,57 @@
+// Copyright (C) 2024 Verifoxx Limited
+// bench_common: Helpers shared by the capability manager benchmarks
+
+#ifndef _BENCH_COMMON_H__
+#define _BENCH_COMMON_H__
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "CCompartmentLibs.h"
+
+namespace CapMgrBench
+{
+    // Simple wall clock timer
+    class CBenchTimer
+    {
+        std::chrono::steady_clock::time_point m_start;
+
+    public:
+        CBenchTimer() : m_start(std::chrono::steady_clock::now()) {}
+
+        void Restart() { m_start = std::chrono::steady_clock::now(); }
+
+        double ElapsedUs() const
+        {
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_start).count();
+        }
+    };
+
+    // Match an option of the form "--name=value", returning the value
+    inline bool GetOpt(const char* arg, const char* name, std::string& value)
+    {
+        size_t len = strlen(name);
+        if (strncmp(arg, name, len) == 0 && arg[len] == '=')
+        {
+            value = arg + len + 1;
+            return true;
+        }
+        return false;
+    }
+
+    // Load (but do not fix up) the compartment library in the same way as the capability manager
+    CCompartmentLibs* LoadCompartmentLibs(const std::string& libname);
+}
+
+// Benchmarks: each takes the arguments following the benchmark name and returns the exit code
+int bench_fixup_scaling(int argc, char* argv[]);
+int bench_instance_density(int argc, char* argv[]);
+int bench_snapshot_spawn(int argc, char* argv[]);
+int bench_reloc_scan(int argc, char* argv[]);
+int bench_symbol_resolve(int argc, char* argv[]);
+int bench_huge_pages(int argc, char* argv[]);
+int bench_reloc_scaling(int argc, char* argv[]);
+
+#endif /* _BENCH_COMMON_H__ */
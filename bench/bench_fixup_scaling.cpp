@@ -0,0 +1,104 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Benchmark: compartment startup relocation patching time against number of fixup worker threads
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bench_common.h"
+
+using namespace CapMgrBench;
+
+int bench_fixup_scaling(int argc, char* argv[])
+{
+    std::string comp_lib{ "./libcompartment.so" };
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned repeat = 20;
+    std::string fixup_plan_dir;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string value;
+        if (GetOpt(argv[i], "--comp-lib", value))
+            comp_lib = value;
+        else if (GetOpt(argv[i], "--max-threads", value))
+            max_threads = std::max(1, atoi(value.c_str()));
+        else if (GetOpt(argv[i], "--repeat", value))
+            repeat = std::max(1, atoi(value.c_str()));
+        else if (GetOpt(argv[i], "--fixup-plan-dir", value))
+            fixup_plan_dir = value;
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::unique_ptr<CCompartmentLibs> libs{ LoadCompartmentLibs(comp_lib) };
+
+    // With a plan cache the tables are not scanned, only the planned targets are patched
+    if (!fixup_plan_dir.empty())
+    {
+        CBenchTimer plan_timer;
+        if (!libs->UseFixupPlanCache(fixup_plan_dir))
+        {
+            printf("Cannot use fixup plan cache %s\n", fixup_plan_dir.c_str());
+            return 1;
+        }
+        printf("Fixup plans loaded/built in %.1f us\n", plan_timer.ElapsedUs());
+    }
+
+    // The first pass moves everything to restricted, after which patching is idempotent
+    // so each timed pass does the same amount of work
+    CBenchTimer first_pass;
+    if (!libs->DoAllLibCapFixups(true, 1))
+    {
+        printf("Fixups failed for %s\n", comp_lib.c_str());
+        return 1;
+    }
+    printf("Library: %s\nFirst (cold) pass: %.1f us\n", comp_lib.c_str(), first_pass.ElapsedUs());
+    printf("Relocation entries: %zu, CPUs: %u (passes too small for the threads to pay off are done serially)\n\n",
+        libs->GetNumRelocEntries(), std::max(1u, std::thread::hardware_concurrency()));
+
+    printf("%8s %12s %12s %9s\n", "threads", "min (us)", "mean (us)", "speedup");
+
+    // Powers of two up to, and including, the maximum
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2)
+        thread_counts.push_back(threads);
+    thread_counts.push_back(max_threads);
+
+    double single_thread_min = 0;
+    for (auto threads : thread_counts)
+    {
+        std::vector<double> times;
+        for (unsigned r = 0; r < repeat; ++r)
+        {
+            CBenchTimer timer;
+            if (!libs->DoAllLibCapFixups(true, threads))
+            {
+                printf("Fixups failed with %u threads\n", threads);
+                return 1;
+            }
+            times.push_back(timer.ElapsedUs());
+        }
+
+        double min_time = *std::min_element(times.begin(), times.end());
+        double mean_time = 0;
+        for (auto t : times)
+            mean_time += t;
+        mean_time /= times.size();
+
+        if (threads == 1)
+            single_thread_min = min_time;
+
+        printf("%8u %12.1f %12.1f %8.2fx\n", threads, min_time, mean_time, single_thread_min / min_time);
+    }
+
+    // Leave the library as the capability manager would before unloading
+    libs->DoAllLibCapFixups(false, 1);
+    return 0;
+}
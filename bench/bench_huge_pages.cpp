@@ -0,0 +1,189 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Benchmark: TLB misses and call latency of compartment calls, with huge pages off and on
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+#include "CCompartmentApiProxy.h"
+#include "CHugePages.h"
+#include "example_capmgr_service_api.h"
+
+using namespace CapMgrBench;
+
+namespace
+{
+    // Counts one kind of TLB miss for this thread, if the PMU allows it
+    class CTlbMissCounter
+    {
+        int m_fd;
+
+    public:
+        explicit CTlbMissCounter(uint64_t cache)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.size = sizeof(attr);
+            attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            m_fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+
+        ~CTlbMissCounter()
+        {
+            if (m_fd >= 0)
+                close(m_fd);
+        }
+
+        bool IsValid() const { return m_fd >= 0; }
+
+        void Start()
+        {
+            if (m_fd >= 0)
+            {
+                ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+
+        uint64_t Stop()
+        {
+            uint64_t count = 0;
+            if (m_fd >= 0)
+            {
+                ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+                    count = 0;
+            }
+            return count;
+        }
+    };
+
+    struct RunResult
+    {
+        double ns_per_call;
+        double dtlb_per_call;
+        double itlb_per_call;
+        size_t remapped;
+    };
+
+    // Load the library in the given mode and time calls which touch its code, data, stack and heap
+    bool RunCalls(const std::string& comp_lib, CHugePages::Mode mode, unsigned calls, unsigned repeat, RunResult& result)
+    {
+        CHugePages::SetMode(mode);
+
+        std::unique_ptr<CCompartmentLibs> libs{ LoadCompartmentLibs(comp_lib) };
+        if (!libs->DoAllLibCapFixups(true, 1))
+        {
+            printf("Fixups failed for %s\n", comp_lib.c_str());
+            return false;
+        }
+        result.remapped = libs->RemapHugePages();
+
+        CCompartmentApiProxy proxy(libs.get(), CCompartment::CompartmentId::kCompartmentExampleId,
+            CALL_FUNC_STACK_SIZE, CALL_FUNC_SEAL_ID);
+        proxy.example_set_compartment_debug_level(0);
+
+        CTlbMissCounter dtlb(PERF_COUNT_HW_CACHE_DTLB);
+        CTlbMissCounter itlb(PERF_COUNT_HW_CACHE_ITLB);
+        const char* text = "huge page benchmark string";
+
+        double best_ns = 0;
+        for (unsigned r = 0; r < repeat; ++r)
+        {
+            dtlb.Start();
+            itlb.Start();
+            CBenchTimer timer;
+            for (unsigned i = 0; i < calls; ++i)
+            {
+                proxy.example_add_two_numbers(static_cast<int32_t>(i), 1);
+                cheri_free(proxy.example_copy_string_to_heap(text));
+            }
+            double ns = timer.ElapsedUs() * 1000 / calls;
+            uint64_t dtlb_misses = dtlb.Stop();
+            uint64_t itlb_misses = itlb.Stop();
+
+            if (r == 0 || ns < best_ns)
+            {
+                best_ns = ns;
+                result.dtlb_per_call = dtlb.IsValid() ? static_cast<double>(dtlb_misses) / calls : -1;
+                result.itlb_per_call = itlb.IsValid() ? static_cast<double>(itlb_misses) / calls : -1;
+            }
+        }
+        result.ns_per_call = best_ns;
+
+        CHugePages::SetMode(CHugePages::Mode::kOff);
+        return true;
+    }
+
+    void PrintResult(const char* name, const RunResult& result)
+    {
+        printf("%10s %12.1f", name, result.ns_per_call);
+        if (result.dtlb_per_call >= 0)
+            printf(" %12.3f", result.dtlb_per_call);
+        else
+            printf(" %12s", "n/a");
+        if (result.itlb_per_call >= 0)
+            printf(" %12.3f", result.itlb_per_call);
+        else
+            printf(" %12s", "n/a");
+        printf(" %12zu\n", result.remapped);
+    }
+}
+
+int bench_huge_pages(int argc, char* argv[])
+{
+    std::string comp_lib{ "./libcompartment.so" };
+    unsigned calls = 10000;
+    unsigned repeat = 5;
+    CHugePages::Mode mode = CHugePages::Mode::kTransparent;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string value;
+        if (GetOpt(argv[i], "--comp-lib", value))
+            comp_lib = value;
+        else if (GetOpt(argv[i], "--calls", value))
+            calls = std::max(1, atoi(value.c_str()));
+        else if (GetOpt(argv[i], "--repeat", value))
+            repeat = std::max(1, atoi(value.c_str()));
+        else if (GetOpt(argv[i], "--mode", value) && (value == "thp" || value == "explicit"))
+            mode = (value == "thp") ? CHugePages::Mode::kTransparent : CHugePages::Mode::kExplicit;
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    RunResult off_result;
+    RunResult on_result;
+    if (!RunCalls(comp_lib, CHugePages::Mode::kOff, calls, repeat, off_result) ||
+        !RunCalls(comp_lib, mode, calls, repeat, on_result))
+    {
+        return 1;
+    }
+
+    printf("Library: %s, %u calls (x2 compartment calls), huge page size %zu KiB\n\n", comp_lib.c_str(), calls,
+        CHugePages::GetHugePageSize() / 1024);
+    printf("%10s %12s %12s %12s %12s\n", "huge pages", "ns/call", "dTLB/call", "iTLB/call", "remapped");
+    PrintResult("off", off_result);
+    PrintResult((mode == CHugePages::Mode::kTransparent) ? "thp" : "explicit", on_result);
+
+    auto stats = CHugePages::GetStats();
+    if (stats.explicit_fallbacks)
+    {
+        printf("\n%zu explicit huge page maps fell back to transparent huge pages (see vm.nr_hugepages)\n",
+            stats.explicit_fallbacks);
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Benchmark: memory per instance when many instances of one compartment library are loaded
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "bench_common.h"
+
+using namespace CapMgrBench;
+
+namespace
+{
+    // Memory of the whole process, in kB, from /proc/self/smaps_rollup
+    struct ProcessMemory
+    {
+        long rss = 0;
+        long pss = 0;
+        long private_dirty = 0;
+    };
+
+    bool ReadProcessMemory(ProcessMemory& mem)
+    {
+        std::ifstream smaps("/proc/self/smaps_rollup");
+        if (!smaps)
+        {
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(smaps, line))
+        {
+            std::istringstream fields(line);
+            std::string name;
+            long kb;
+            if (!(fields >> name >> kb))
+                continue;
+
+            if (name == "Rss:")
+                mem.rss = kb;
+            else if (name == "Pss:")
+                mem.pss = kb;
+            else if (name == "Private_Dirty:")
+                mem.private_dirty = kb;
+        }
+        return true;
+    }
+
+    // Read every page of every LOAD block, as a running compartment would eventually touch them
+    void TouchPages(const CCompartmentLoader& loader)
+    {
+        size_t page_size = getpagesize();
+        volatile uint8_t sink = 0;
+
+        for (size_t i = 0; i < loader.GetNumObjects(); i++)
+        {
+            const auto& obj = loader.GetObject(i);
+            auto base = reinterpret_cast<const volatile uint8_t*>(static_cast<void*>(obj.rw_cap));
+
+            for (const auto& phdr : obj.phdrs)
+            {
+                if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_R))
+                    continue;
+
+                for (Elf64_Addr addr = cheri_align_down(phdr.p_vaddr, page_size); addr < phdr.p_vaddr + phdr.p_memsz;
+                    addr += page_size)
+                {
+                    sink = sink + base[addr];
+                }
+            }
+        }
+        (void)sink;
+    }
+}
+
+int bench_instance_density(int argc, char* argv[])
+{
+    std::string comp_lib{ "./libcompartment.so" };
+    std::vector<unsigned> counts{ 1, 10, 100 };
+    bool touch = true;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string value;
+        if (GetOpt(argv[i], "--comp-lib", value))
+            comp_lib = value;
+        else if (GetOpt(argv[i], "--counts", value))
+        {
+            counts.clear();
+            std::istringstream list(value);
+            std::string count;
+            while (std::getline(list, count, ','))
+            {
+                if (atoi(count.c_str()) > 0)
+                    counts.push_back(atoi(count.c_str()));
+            }
+        }
+        else if (!strcmp(argv[i], "--no-touch"))
+            touch = false;
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    auto rwcap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+    auto rxcap{ Capability(getauxptr(AT_CHERI_EXEC_RX_CAP)) };
+    auto fixup_cap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+
+    printf("Library: %s (native loader, pages %s)\n", comp_lib.c_str(), touch ? "touched" : "not touched");
+    printf("RSS counts each instance's mapping of a shared page, PSS and private dirty do not\n\n");
+    printf("%10s %14s %14s %20s %16s %15s\n", "instances", "RSS/inst (kB)", "PSS/inst (kB)", "priv dirty/inst (kB)",
+        "writable (kB)", "shared (kB)");
+
+    for (auto count : counts)
+    {
+        ProcessMemory before;
+        ProcessMemory after;
+        if (!ReadProcessMemory(before))
+        {
+            printf("Cannot read /proc/self/smaps_rollup\n");
+            return 1;
+        }
+
+        std::vector<std::unique_ptr<CCompartmentLibs>> instances;
+        try
+        {
+            std::unique_ptr<CCompartmentLoader> loader{ new CCompartmentLoader({}, rwcap, rxcap) };
+            instances.emplace_back(new CCompartmentLibs{ comp_lib, rwcap, fixup_cap, std::move(loader) });
+            while (instances.size() < count)
+            {
+                instances.emplace_back(instances.front()->CreateInstance(rwcap, fixup_cap));
+            }
+        }
+        catch (std::exception& e)
+        {
+            printf("Failed after %zu instances: %s\n", instances.size(), e.what());
+            return 1;
+        }
+
+        if (touch)
+        {
+            for (const auto& instance : instances)
+                TouchPages(*instance->GetLoader());
+        }
+
+        ReadProcessMemory(after);
+        auto stats{ instances.front()->GetLoader()->GetMemoryStats() };
+
+        printf("%10u %14.1f %14.1f %20.1f %16zu %15zu\n", count,
+            static_cast<double>(after.rss - before.rss) / count,
+            static_cast<double>(after.pss - before.pss) / count,
+            static_cast<double>(after.private_dirty - before.private_dirty) / count,
+            stats.private_bytes / 1024, stats.shared_bytes / 1024);
+    }
+    return 0;
+}
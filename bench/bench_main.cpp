@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2024 Verifoxx Limited
+ * Capability Manager benchmarks: runs a single named benchmark and reports the results on stdout.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include "CCapability.h"
+#include "CCapMgrLogger.h"
+#include "bench_common.h"
+
+using namespace CapMgr;
+
+namespace
+{
+    struct BenchEntry
+    {
+        const char* name;
+        const char* help;
+        int (*fn)(int argc, char* argv[]);
+    };
+
+    const BenchEntry benchmarks[] =
+    {
+        {"fixup_scaling", "[--comp-lib=<lib>] [--max-threads=n] [--repeat=n] [--fixup-plan-dir=<dir>]\n"
+            "                         Time DoAllLibCapFixups() against number of worker threads", bench_fixup_scaling},
+        {"instance_density", "[--comp-lib=<lib>] [--counts=1,10,100] [--no-touch]\n"
+            "                         Memory per instance for instances loaded by the native loader", bench_instance_density},
+        {"snapshot_spawn", "[--comp-lib=<lib>] [--repeat=n]\n"
+            "                         Time to spawn an initialised instance, fresh against from a snapshot", bench_snapshot_spawn},
+        {"reloc_scan", "[--entries=n] [--repeat=n]\n"
+            "                         Relocation scan/patch kernel against the reference scan, synthetic table", bench_reloc_scan},
+        {"symbol_resolve", "[--comp-lib=<lib>] [--repeat=n]\n"
+            "                         Resolve every exported symbol, dlsym() against the hash table lookups", bench_symbol_resolve},
+        {"huge_pages", "[--comp-lib=<lib>] [--calls=n] [--repeat=n] [--mode=thp|explicit]\n"
+            "                         TLB misses and call latency with huge pages off and on", bench_huge_pages},
+        {"reloc_scaling", "[--libs=<lib>,<lib>...] [--repeat=n] [--threads=n]\n"
+            "                         Load and fixup time per relocation, synthetic libraries by default", bench_reloc_scaling},
+    };
+
+    int print_help(const char* exe_name)
+    {
+        printf("Usage: %s <benchmark> [-options]\n", exe_name);
+        printf("benchmarks:\n");
+        for (const auto& bench : benchmarks)
+        {
+            printf("  %-22s %s\n", bench.name, bench.help);
+        }
+        return 1;
+    }
+}
+
+CCompartmentLibs* CapMgrBench::LoadCompartmentLibs(const std::string& libname)
+{
+    auto rwcap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+    auto fixup_cap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+
+#if CAPMGR_BUILT_STATIC_ENABLE
+    bool load_new = false;  // For static build, the cap mgr has no linkmap so cannot load a new one
+#else
+    bool load_new = true;
+#endif
+    return new CCompartmentLibs{ libname, rwcap, fixup_cap, load_new };
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+        return print_help(argv[0]);
+
+    // Keep the capability manager quiet unless something goes wrong
+    Log::SetLevel(ERROR);
+
+    for (const auto& bench : benchmarks)
+    {
+        if (!strcmp(argv[1], bench.name))
+        {
+#if CAPMGR_EMULATED_CAPS
+            // Emulated runs only measure the framework's own work, with none of the hardware's capability costs
+            printf("# %s: EMULATED CAPABILITIES - not a Morello hardware measurement\n", bench.name);
+#endif
+            return bench.fn(argc - 2, argv + 2);
+        }
+    }
+
+    return print_help(argv[0]);
+}
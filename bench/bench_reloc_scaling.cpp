@@ -0,0 +1,157 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Benchmark: load and relocation patching time against the size of the library, for the synthetic libraries
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "bench_common.h"
+
+using namespace CapMgrBench;
+
+namespace
+{
+    // The synthetic libraries built with the benchmark, see ADD_SYNTHETIC_COMPLIB() in macros.cmake
+#ifdef BENCH_SYNTHETIC_COMPLIBS
+    const char* const kDefaultLibs = BENCH_SYNTHETIC_COMPLIBS;
+#else
+    const char* const kDefaultLibs = "";
+#endif
+
+    struct Result
+    {
+        size_t num_sos = 0;
+        size_t num_entries = 0;
+        size_t num_patched = 0;
+        double load_us = 0;         // dlmopen() and parsing the link map
+        double cold_us = 0;         // First restricted pass, which scans the tables
+        double warm_us = 0;         // Fastest of the repeated restricted passes
+        double revert_us = 0;       // Replaying the journal
+    };
+
+    bool RunLib(const std::string& lib, unsigned repeat, unsigned threads, Result& result)
+    {
+        CBenchTimer load_timer;
+        std::unique_ptr<CCompartmentLibs> libs{ LoadCompartmentLibs(lib) };
+        result.load_us = load_timer.ElapsedUs();
+        result.num_sos = libs->GetNumSharedObjects();
+        result.num_entries = libs->GetNumRelocEntries();
+
+        CBenchTimer cold_timer;
+        if (!libs->DoAllLibCapFixups(true, threads))
+        {
+            printf("Fixups failed for %s\n", lib.c_str());
+            return false;
+        }
+        result.cold_us = cold_timer.ElapsedUs();
+
+        // The tables have been scanned, and patching again is idempotent, so every pass does the same work
+        result.warm_us = 0;
+        for (unsigned r = 0; r < repeat; ++r)
+        {
+            CBenchTimer timer;
+            if (!libs->DoAllLibCapFixups(true, threads))
+            {
+                printf("Fixups failed for %s\n", lib.c_str());
+                return false;
+            }
+            double elapsed = timer.ElapsedUs();
+            result.warm_us = r ? std::min(result.warm_us, elapsed) : elapsed;
+        }
+
+        CBenchTimer revert_timer;
+        if (!libs->DoAllLibCapFixups(false, threads))
+        {
+            printf("Reverting fixups failed for %s\n", lib.c_str());
+            return false;
+        }
+        result.revert_us = revert_timer.ElapsedUs();
+
+        // Nothing runs in the libraries, so every patched capability must revert to exactly the original
+        auto stats{ libs->GetRevertStats() };
+        result.num_patched = stats.reverted + stats.changed + stats.skipped;
+        if (stats.changed || stats.skipped)
+        {
+            printf("%s: %zu capabilities changed and %zu skipped when reverting, expected none\n", lib.c_str(),
+                stats.changed, stats.skipped);
+            return false;
+        }
+        return true;
+    }
+
+    double NsPer(double us, size_t count)
+    {
+        return count ? (us * 1000.0) / count : 0;
+    }
+}
+
+int bench_reloc_scaling(int argc, char* argv[])
+{
+    std::string lib_list{ kDefaultLibs };
+    unsigned repeat = 10;
+    unsigned threads = 1;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string value;
+        if (GetOpt(argv[i], "--libs", value))
+            lib_list = value;
+        else if (GetOpt(argv[i], "--repeat", value))
+            repeat = std::max(1, atoi(value.c_str()));
+        else if (GetOpt(argv[i], "--threads", value))
+            threads = std::max(1, atoi(value.c_str()));
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::vector<std::string> libs;
+    std::istringstream list_stream(lib_list);
+    std::string lib;
+    while (std::getline(list_stream, lib, ','))
+    {
+        if (!lib.empty())
+            libs.push_back(lib);
+    }
+
+    if (libs.empty())
+    {
+        printf("No libraries given, and the synthetic libraries were not built\n");
+        return 1;
+    }
+
+    printf("Fixup threads: %u\n\n", threads);
+    printf("%-32s %4s %8s %8s %10s %10s %10s %10s %10s %10s\n", "library", "sos", "relocs", "patched",
+        "load (us)", "cold (us)", "warm (us)", "revert(us)", "cold ns/r", "warm ns/r");
+
+    int rc = 0;
+    for (const auto& name : libs)
+    {
+        Result result;
+        try
+        {
+            if (!RunLib(name, repeat, threads, result))
+            {
+                rc = 1;
+                continue;
+            }
+        }
+        catch (std::exception& e)
+        {
+            printf("%s: %s\n", name.c_str(), e.what());
+            rc = 1;
+            continue;
+        }
+
+        printf("%-32s %4zu %8zu %8zu %10.1f %10.1f %10.1f %10.1f %10.2f %10.2f\n", name.c_str(), result.num_sos,
+            result.num_entries, result.num_patched, result.load_us, result.cold_us, result.warm_us, result.revert_us,
+            NsPer(result.cold_us, result.num_entries), NsPer(result.warm_us, result.num_entries));
+    }
+
+    return rc;
+}
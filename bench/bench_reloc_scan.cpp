@@ -0,0 +1,255 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Benchmark: relocation table scan and patch kernel, over a synthetic .rela.dyn table
+
+#include <algorithm>
+#include <cheriintrin.h>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include "bench_common.h"
+#include "CCapMgrLogger.h"
+#include "CCapMgrException.h"
+#include "CCapability.h"
+#include "CDynamicSection.h"
+#include "CRelocationTable.h"
+#include "reloc_scan_kernel.h"
+
+using namespace CapMgr;
+using namespace CapMgrBench;
+
+namespace
+{
+#if CAPMGR_EMULATED_CAPS
+    // With emulated capabilities the host's pointer relocations stand in for the Morello ones, as for the kernel
+#if defined(__x86_64__)
+    constexpr Elf64_Xword kRelative = R_X86_64_RELATIVE, kGlobDat = R_X86_64_GLOB_DAT, kJumpSlot = R_X86_64_JUMP_SLOT,
+        kCapInit = R_X86_64_64, kNone = R_X86_64_NONE, kOther = R_X86_64_PC32;
+#else
+    constexpr Elf64_Xword kRelative = R_AARCH64_RELATIVE, kGlobDat = R_AARCH64_GLOB_DAT, kJumpSlot = R_AARCH64_JUMP_SLOT,
+        kCapInit = R_AARCH64_RELATIVE, kNone = R_AARCH64_NONE, kOther = R_AARCH64_ABS64;
+#endif
+
+    // The scan as it was before the scan kernel: map lookup per entry and linear range check
+    const std::map<Elf64_Xword, std::string> reference_reloc_id_map = {
+        {kCapInit, "CAPINIT"},
+        {kGlobDat, "GLOB_DAT"},
+        {kJumpSlot, "JUMP_SLOT"},
+        {kRelative, "RELATIVE"}
+    };
+#else
+    // The scan as it was before the scan kernel: map lookup per entry and linear range check
+    const std::map<Elf64_Xword, std::string> reference_reloc_id_map = {
+        {R_MORELLO_CAPINIT, "R_MORELLO_CAPINIT"},
+        {R_MORELLO_GLOB_DAT, "R_MORELLO_GLOB_DAT"},
+        {R_MORELLO_JUMP_SLOT, "R_MORELLO_JUMP_SLOT"},
+        {R_MORELLO_RELATIVE, "R_MORELLO_RELATIVE"},
+        {R_MORELLO_TLSDESC, "R_MORELLO_TLSDESC"}
+    };
+
+    constexpr Elf64_Xword kRelative = R_MORELLO_RELATIVE, kGlobDat = R_MORELLO_GLOB_DAT, kJumpSlot = R_MORELLO_JUMP_SLOT,
+        kCapInit = R_MORELLO_CAPINIT, kNone = R_AARCH64_NONE, kOther = R_AARCH64_ABS64;
+#endif
+
+    size_t ReferenceScan(const Elf64_Rela* first, const Elf64_Rela* last, uintptr_t base,
+        const std::vector<Range>& unmodify_ranges, const Capability& fixup_cap, bool patch)
+    {
+        size_t patched = 0;
+        for (const Elf64_Rela* p = first; p < last; ++p)
+        {
+            if (reference_reloc_id_map.count(ELF64_R_TYPE(p->r_info)) == 0)
+                continue;
+
+            uintptr_t* pAddress = reinterpret_cast<uintptr_t*>(base + p->r_offset);
+            if (!CRelocationTable::IsValid(pAddress, unmodify_ranges))
+            {
+                L_(VERBOSE) << "[Fixup cap: offset=0x" << std::hex << p->r_offset << " type="
+                    << reference_reloc_id_map.at(ELF64_R_TYPE(p->r_info)) << " - SKIPPED NOT IN RANGE]";
+                continue;
+            }
+
+            if (!patch)
+            {
+                patched++;
+                continue;
+            }
+
+            uintptr_t val_to_fixup = *pAddress;
+            if (cheri_tag_get(val_to_fixup))
+            {
+                L_(VERBOSE) << "[Fixup cap: offset=0x" << std::hex << p->r_offset << " type="
+                    << reference_reloc_id_map.at(ELF64_R_TYPE(p->r_info));
+                *pAddress = CRelocationTable::DeriveFixupValue(fixup_cap, val_to_fixup, true);
+                L_(VERBOSE) << " new_val=" << Capability(reinterpret_cast<void*>(*pAddress)) << "]";
+                patched++;
+            }
+        }
+        return patched;
+    }
+
+    // Synthetic shared object image: dynamic section, .rela.dyn table, then the capability targets
+    struct SyntheticImage
+    {
+        uint8_t* base = nullptr;
+        size_t size = 0;
+        size_t dyn_offset = 0;
+        size_t dyn_size = 0;
+        size_t rela_offset = 0;
+        size_t num_entries = 0;
+        size_t targets_offset = 0;
+        size_t num_targets = 0;
+        std::vector<Range> unmodify_ranges;
+
+        SyntheticImage(size_t entries)
+        {
+            num_entries = entries;
+            num_targets = std::max<size_t>(1, entries / 2);
+
+            dyn_size = 4 * sizeof(Elf64_Dyn);
+            rela_offset = cheri_align_up(dyn_offset + dyn_size, 64);
+            targets_offset = cheri_align_up(rela_offset + num_entries * sizeof(Elf64_Rela), 64);
+            size = cheri_align_up(targets_offset + num_targets * sizeof(void*), getpagesize());
+
+            void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED)
+            {
+                throw CCapMgrException("No memory for synthetic image");
+            }
+            base = reinterpret_cast<uint8_t*>(mapping);
+
+            auto dyn = reinterpret_cast<Elf64_Dyn*>(&base[dyn_offset]);
+            dyn[0].d_tag = DT_RELA;
+            dyn[0].d_un.d_ptr = rela_offset;
+            dyn[1].d_tag = DT_RELASZ;
+            dyn[1].d_un.d_val = num_entries * sizeof(Elf64_Rela);
+            dyn[2].d_tag = DT_RELAENT;
+            dyn[2].d_un.d_val = sizeof(Elf64_Rela);
+            dyn[3].d_tag = DT_NULL;
+            dyn[3].d_un.d_val = 0;
+
+            // Mix of types similar to a real library: mostly capability relocs, some others
+            const Elf64_Xword types[] = {
+                kRelative, kRelative, kRelative, kGlobDat, kJumpSlot, kCapInit, kNone, kOther
+            };
+
+            auto rela = reinterpret_cast<Elf64_Rela*>(&base[rela_offset]);
+            for (size_t i = 0; i < num_entries; ++i)
+            {
+                rela[i].r_offset = targets_offset + (i % num_targets) * sizeof(void*);
+                rela[i].r_info = ELF64_R_INFO(0, types[i % (sizeof(types) / sizeof(types[0]))]);
+                rela[i].r_addend = 0;
+            }
+
+            // Targets are valid capabilities to somewhere in the image
+            auto targets = reinterpret_cast<void**>(&base[targets_offset]);
+            for (size_t i = 0; i < num_targets; ++i)
+            {
+                targets[i] = &base[(i * 64) % size];
+            }
+
+            // Four small ranges (like init/fini) in the targets
+            for (size_t i = 1; i <= 4; ++i)
+            {
+                size_t offset = targets_offset + (num_targets * i / 5) * sizeof(void*);
+                unmodify_ranges.push_back(Range(reinterpret_cast<uintptr_t>(&base[offset]), 8 * sizeof(void*)));
+            }
+        }
+
+        ~SyntheticImage()
+        {
+            munmap(base, size);
+        }
+    };
+
+    template <typename F>
+    double MinTimeUs(unsigned repeat, F&& fn)
+    {
+        double best = 0;
+        for (unsigned r = 0; r < repeat; ++r)
+        {
+            CBenchTimer timer;
+            fn();
+            double t = timer.ElapsedUs();
+            best = (r == 0 || t < best) ? t : best;
+        }
+        return best;
+    }
+}
+
+int bench_reloc_scan(int argc, char* argv[])
+{
+    size_t entries = 1000000;
+    unsigned repeat = 10;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string value;
+        if (GetOpt(argv[i], "--entries", value))
+            entries = std::max(1L, atol(value.c_str()));
+        else if (GetOpt(argv[i], "--repeat", value))
+            repeat = std::max(1, atoi(value.c_str()));
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    SyntheticImage image(entries);
+    uintptr_t base = reinterpret_cast<uintptr_t>(image.base);
+    auto first = reinterpret_cast<const Elf64_Rela*>(&image.base[image.rela_offset]);
+    auto last = first + image.num_entries;
+
+    auto fixup_cap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+    CDynamicSection dynsec(base, image.dyn_offset, image.dyn_size, true);
+    CRelaDyn rela_dyn(dynsec, base, fixup_cap);
+    RangeSet unmodify_offsets(image.unmodify_ranges, base);
+
+    // Scan only: classify and range filter
+    size_t ref_count = 0;
+    size_t kernel_count = 0;
+    double ref_scan = MinTimeUs(repeat, [&]() {
+        ref_count = ReferenceScan(first, last, base, image.unmodify_ranges, fixup_cap, false);
+    });
+    double kernel_scan = MinTimeUs(repeat, [&]() {
+        kernel_count = 0;
+        RelocScan::ScanFixupTargets(first, last, unmodify_offsets,
+            [&](const Elf64_Rela*) { kernel_count++; }, [](const Elf64_Rela*) {});
+    });
+
+    if (ref_count != kernel_count)
+    {
+        printf("Mismatch: reference scan found %zu targets, kernel found %zu\n", ref_count, kernel_count);
+        return 1;
+    }
+
+    // Full patch of the table, as done at compartment load.  Repeat passes are idempotent.
+    double ref_patch = MinTimeUs(repeat, [&]() {
+        ReferenceScan(first, last, base, image.unmodify_ranges, fixup_cap, true);
+    });
+    // As at load: build the plan with the kernel, then patch the tagged targets in it
+    std::vector<uint64_t> offsets;
+    offsets.reserve(kernel_count);
+    double kernel_patch = MinTimeUs(repeat, [&]() {
+        offsets.clear();
+        rela_dyn.CollectFixupOffsets(unmodify_offsets, offsets);
+        for (uint64_t offset : offsets)
+        {
+            uintptr_t* pAddress = reinterpret_cast<uintptr_t*>(base + offset);
+            uintptr_t val_to_fixup = *pAddress;
+            if (cheri_tag_get(val_to_fixup))
+            {
+                *pAddress = CRelocationTable::DeriveFixupValue(fixup_cap, val_to_fixup, true);
+            }
+        }
+    });
+
+    printf("Entries: %zu, targets to patch: %zu, best of %u\n\n", image.num_entries, kernel_count, repeat);
+    printf("%-8s %14s %14s %12s %9s\n", "", "reference (us)", "kernel (us)", "ns/entry", "speedup");
+    printf("%-8s %14.1f %14.1f %12.2f %8.2fx\n", "scan", ref_scan, kernel_scan,
+        kernel_scan * 1000.0 / image.num_entries, ref_scan / kernel_scan);
+    printf("%-8s %14.1f %14.1f %12.2f %8.2fx\n", "patch", ref_patch, kernel_patch,
+        kernel_patch * 1000.0 / image.num_entries, ref_patch / kernel_patch);
+    return 0;
+}
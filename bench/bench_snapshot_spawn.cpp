@@ -0,0 +1,115 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Benchmark: time to spawn an initialised compartment instance, loaded fresh against cloned from a snapshot
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "bench_common.h"
+#include "CCompartmentApiProxy.h"
+
+using namespace CapMgrBench;
+
+namespace
+{
+    void PrintTimes(const char* name, std::vector<double>& times, double baseline_min)
+    {
+        double min_time = *std::min_element(times.begin(), times.end());
+        double mean_time = 0;
+        for (auto t : times)
+            mean_time += t;
+        mean_time /= times.size();
+
+        printf("%10s %12.1f %12.1f %8.2fx\n", name, min_time, mean_time, baseline_min / min_time);
+    }
+}
+
+int bench_snapshot_spawn(int argc, char* argv[])
+{
+    std::string comp_lib{ "./libcompartment.so" };
+    unsigned repeat = 50;
+    int32_t comp_log_level = 1;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string value;
+        if (GetOpt(argv[i], "--comp-lib", value))
+            comp_lib = value;
+        else if (GetOpt(argv[i], "--repeat", value))
+            repeat = std::max(1, atoi(value.c_str()));
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    auto rwcap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+    auto rxcap{ Capability(getauxptr(AT_CHERI_EXEC_RX_CAP)) };
+    auto fixup_cap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+
+    std::vector<double> fresh_times;
+    std::vector<double> clone_times;
+
+    try
+    {
+        // The template instance is initialised as a fresh instance would be, then snapshotted
+        std::unique_ptr<CCompartmentLoader> loader{ new CCompartmentLoader({}, rwcap, rxcap) };
+        std::unique_ptr<CCompartmentLibs> templ{
+            new CCompartmentLibs{ comp_lib, rwcap, fixup_cap, std::move(loader) } };
+        {
+            CCompartmentApiProxy proxy(templ.get(), CCompartment::CompartmentId::kCompartmentExampleId,
+                CALL_FUNC_STACK_SIZE, CALL_FUNC_SEAL_ID);
+            proxy.example_set_compartment_debug_level(comp_log_level);
+        }
+
+        CBenchTimer snapshot_timer;
+        auto snapshot = templ->TakeSnapshot();
+        printf("Library: %s\nSnapshot taken in %.1f us (%zu capabilities)\n\n", comp_lib.c_str(),
+            snapshot_timer.ElapsedUs(), snapshot->GetNumCapabilities());
+
+        // Check a clone works before timing
+        {
+            std::unique_ptr<CCompartmentLibs> clone{ templ->CreateInstance(rwcap, fixup_cap, snapshot.get()) };
+            CCompartmentApiProxy proxy(clone.get(), CCompartment::CompartmentId::kCompartmentExampleId,
+                CALL_FUNC_STACK_SIZE, CALL_FUNC_SEAL_ID);
+            if (proxy.example_add_two_numbers(3, 8) != 11)
+            {
+                printf("Call into a cloned compartment failed\n");
+                return 1;
+            }
+        }
+
+        for (unsigned r = 0; r < repeat; ++r)
+        {
+            CBenchTimer timer;
+            std::unique_ptr<CCompartmentLibs> libs{ templ->CreateInstance(rwcap, fixup_cap) };
+            CCompartmentApiProxy proxy(libs.get(), CCompartment::CompartmentId::kCompartmentExampleId,
+                CALL_FUNC_STACK_SIZE, CALL_FUNC_SEAL_ID);
+            proxy.example_set_compartment_debug_level(comp_log_level);
+            fresh_times.push_back(timer.ElapsedUs());
+        }
+
+        for (unsigned r = 0; r < repeat; ++r)
+        {
+            CBenchTimer timer;
+            std::unique_ptr<CCompartmentLibs> libs{ templ->CreateInstance(rwcap, fixup_cap, snapshot.get()) };
+            CCompartmentApiProxy proxy(libs.get(), CCompartment::CompartmentId::kCompartmentExampleId,
+                CALL_FUNC_STACK_SIZE, CALL_FUNC_SEAL_ID);
+            clone_times.push_back(timer.ElapsedUs());
+        }
+    }
+    catch (std::exception& e)
+    {
+        printf("Failed to spawn %s: %s\n", comp_lib.c_str(), e.what());
+        return 1;
+    }
+
+    printf("%10s %12s %12s %9s\n", "spawn", "min (us)", "mean (us)", "speedup");
+    double fresh_min = *std::min_element(fresh_times.begin(), fresh_times.end());
+    PrintTimes("fresh", fresh_times, fresh_min);
+    PrintTimes("snapshot", clone_times, fresh_min);
+    return 0;
+}
@@ -0,0 +1,108 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Benchmark: resolving every symbol the compartment library exports, dlsym() against the hash table lookups
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "bench_common.h"
+
+using namespace CapMgrBench;
+
+int bench_symbol_resolve(int argc, char* argv[])
+{
+    std::string comp_lib{ "./libcompartment.so" };
+    unsigned repeat = 20;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string value;
+        if (GetOpt(argv[i], "--comp-lib", value))
+            comp_lib = value;
+        else if (GetOpt(argv[i], "--repeat", value))
+            repeat = std::max(1, atoi(value.c_str()));
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::unique_ptr<CCompartmentLibs> libs{ LoadCompartmentLibs(comp_lib) };
+
+    // Every function and object the library defines, as a compartment API table would list them
+    const auto& dynsec = libs->GetPrimarySharedObject().GetDynamicSection();
+    auto symtab = reinterpret_cast<const Elf64_Sym*>(dynsec.GetSymTab().base);
+    std::vector<const char*> names;
+    for (size_t i = 1; i < dynsec.GetNumSymbols(); i++)
+    {
+        auto type = ELF64_ST_TYPE(symtab[i].st_info);
+        if (symtab[i].st_shndx != SHN_UNDEF && ELF64_ST_BIND(symtab[i].st_info) != STB_LOCAL &&
+            (type == STT_FUNC || type == STT_OBJECT))
+        {
+            names.push_back(dynsec.GetSymbolName(symtab[i]));
+        }
+    }
+
+    if (names.empty())
+    {
+        printf("No symbols defined by %s\n", comp_lib.c_str());
+        return 1;
+    }
+
+    std::vector<void*> expected(names.size());
+    std::vector<void*> results(names.size());
+    double dlsym_min = 0;
+    double single_min = 0;
+    double bulk_min = 0;
+    size_t num_resolved = 0;
+
+    for (unsigned r = 0; r < repeat; ++r)
+    {
+        CBenchTimer dlsym_timer;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            expected[i] = dlsym(libs->GetDllHandle(), names[i]);
+        }
+        double dlsym_time = dlsym_timer.ElapsedUs();
+
+        CBenchTimer single_timer;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            results[i] = libs->GetDllSymbolByName(names[i]);
+        }
+        double single_time = single_timer.ElapsedUs();
+
+        CBenchTimer bulk_timer;
+        num_resolved = libs->ResolveSymbols(names.data(), names.size(), results.data());
+        double bulk_time = bulk_timer.ElapsedUs();
+
+        dlsym_min = (r == 0) ? dlsym_time : std::min(dlsym_min, dlsym_time);
+        single_min = (r == 0) ? single_time : std::min(single_min, single_time);
+        bulk_min = (r == 0) ? bulk_time : std::min(bulk_min, bulk_time);
+    }
+
+    // Both lookups must find the same definitions as dlsym()
+    size_t num_differ = 0;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (cheri_address_get(results[i]) != cheri_address_get(expected[i]) ||
+            cheri_address_get(libs->GetDllSymbolByName(names[i])) != cheri_address_get(expected[i]))
+        {
+            printf("%s resolved differently from dlsym()\n", names[i]);
+            num_differ++;
+        }
+    }
+
+    printf("Library: %s\n%zu symbols, %zu resolved, %zu differently from dlsym()\n\n", comp_lib.c_str(),
+        names.size(), num_resolved, num_differ);
+    printf("%22s %12s %12s %9s\n", "lookup", "min (us)", "ns/symbol", "speedup");
+    printf("%22s %12.1f %12.1f %8.2fx\n", "dlsym", dlsym_min, dlsym_min * 1000 / names.size(), 1.0);
+    printf("%22s %12.1f %12.1f %8.2fx\n", "GetDllSymbolByName", single_min, single_min * 1000 / names.size(),
+        dlsym_min / single_min);
+    printf("%22s %12.1f %12.1f %8.2fx\n", "ResolveSymbols", bulk_min, bulk_min * 1000 / names.size(),
+        dlsym_min / bulk_min);
+    return num_differ ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+# Copyright (C) 2024 Verifoxx Limited.  All rights reserved.
+# Generates the C source of a synthetic compartment library, for the relocation scaling benchmark.
+# Run in script mode, see ADD_SYNTHETIC_COMPLIB() in macros.cmake:
+#   cmake -DNAME=<name> -DOUTPUT=<file.c> [-DRELOCS=n] [-DINIT=n] [-DFINI=n] [-DDEPS=<dep,names>] [-DDATA_KB=n]
+#         [-DTEXT_KB=n] -P gen_synthetic_lib.cmake
+#
+# The library has:
+# - A table of RELOCS capabilities (pointers), each needing a dynamic relocation.  Most point into the library's
+#   own data, so are relative relocations; every eighth points to an exported object, of a dependency in DEPS if
+#   there are any, so is a symbolic relocation.
+# - INIT constructors and FINI destructors, i.e. .init_array and .fini_array entries, which are relocated too.
+# - DATA_KB of initialised data, across which the table's targets are spread, and TEXT_KB of padding code.
+# - An exported object synth_<NAME>_export for the libraries which depend on it, and synth_<NAME>_entry().
+# NAME must be a C identifier.
+
+cmake_minimum_required (VERSION 3.19)
+
+foreach (param NAME OUTPUT)
+    if (NOT DEFINED ${param})
+        message(FATAL_ERROR "gen_synthetic_lib.cmake: ${param} must be set")
+    endif ()
+endforeach ()
+
+foreach (param RELOCS INIT FINI DATA_KB TEXT_KB)
+    if (NOT DEFINED ${param})
+        set (${param} 0)
+    endif ()
+endforeach ()
+
+# Distance between neighbouring targets in the data, so the targets cover its pages
+set (TARGET_STRIDE 64)
+
+set (DATA_SIZE 0)
+math(EXPR DATA_SIZE "${DATA_KB} * 1024")
+if (DATA_SIZE LESS TARGET_STRIDE)
+    set (DATA_SIZE ${TARGET_STRIDE})
+endif ()
+
+string(REPLACE "," ";" DEPS "${DEPS}")
+list(LENGTH DEPS num_deps)
+
+set (src "/* Generated by gen_synthetic_lib.cmake - do not edit */\n")
+string(APPEND src "/* ${NAME}: relocs=${RELOCS} init=${INIT} fini=${FINI} deps=${num_deps} data_kb=${DATA_KB} text_kb=${TEXT_KB} */\n\n")
+
+# Objects the table points to
+string(APPEND src "static unsigned char synth_data[${DATA_SIZE}] = { 1 };\n")
+string(APPEND src "unsigned char synth_${NAME}_export[${TARGET_STRIDE}] = { 1 };\n")
+foreach (dep ${DEPS})
+    string(APPEND src "extern unsigned char synth_${dep}_export[];\n")
+endforeach ()
+string(APPEND src "\n")
+
+# The capability table.  Written as blocks of 64 entries expanded by the preprocessor, since generating a large
+# table an entry at a time is very slow in CMake.  Entry i of the table points to synth_data at i * TARGET_STRIDE,
+# except every eighth, and the dependencies take turns block by block.
+if (RELOCS GREATER 0)
+    string(APPEND src "#define SYNTH_DATA(i) &synth_data[((i) * ${TARGET_STRIDE}) % ${DATA_SIZE}]\n")
+    string(APPEND src "#define SYNTH_R8(i, sym) SYNTH_DATA(i), SYNTH_DATA((i) + 1), SYNTH_DATA((i) + 2), SYNTH_DATA((i) + 3), \\\n")
+    string(APPEND src "    SYNTH_DATA((i) + 4), SYNTH_DATA((i) + 5), SYNTH_DATA((i) + 6), &sym[7],\n")
+    string(APPEND src "#define SYNTH_R64(i, sym) SYNTH_R8(i, sym) SYNTH_R8((i) + 8, sym) SYNTH_R8((i) + 16, sym) \\\n")
+    string(APPEND src "    SYNTH_R8((i) + 24, sym) SYNTH_R8((i) + 32, sym) SYNTH_R8((i) + 40, sym) SYNTH_R8((i) + 48, sym) \\\n")
+    string(APPEND src "    SYNTH_R8((i) + 56, sym)\n\n")
+
+    string(APPEND src "void* synth_${NAME}_caps[${RELOCS}] =\n{\n")
+
+    set (dep_index 0)
+    set (sym "synth_${NAME}_export")
+    set (i 0)
+    while (i LESS RELOCS)
+        if (num_deps GREATER 0)
+            list(GET DEPS ${dep_index} dep)
+            set (sym "synth_${dep}_export")
+            math(EXPR dep_index "(${dep_index} + 1) % ${num_deps}")
+        endif ()
+
+        math(EXPR left "${RELOCS} - ${i}")
+        if (left GREATER_EQUAL 64)
+            string(APPEND src "    SYNTH_R64(${i}, ${sym})\n")
+            math(EXPR i "${i} + 64")
+        else ()
+            # The last, partial block
+            while (i LESS RELOCS)
+                math(EXPR slot "${i} % 8")
+                if (slot EQUAL 7)
+                    string(APPEND src "    &${sym}[7],\n")
+                else ()
+                    string(APPEND src "    SYNTH_DATA(${i}),\n")
+                endif ()
+                math(EXPR i "${i} + 1")
+            endwhile ()
+        endif ()
+    endwhile ()
+
+    string(APPEND src "};\n\n")
+endif ()
+
+# Constructors and destructors
+string(APPEND src "static volatile int synth_init_count;\n\n")
+if (INIT GREATER 0)
+    math(EXPR last "${INIT} - 1")
+    foreach (i RANGE ${last})
+        string(APPEND src "__attribute__((constructor)) static void synth_init_${i}(void) { synth_init_count++; }\n")
+    endforeach ()
+    string(APPEND src "\n")
+endif ()
+if (FINI GREATER 0)
+    math(EXPR last "${FINI} - 1")
+    foreach (i RANGE ${last})
+        string(APPEND src "__attribute__((destructor)) static void synth_fini_${i}(void) { synth_init_count--; }\n")
+    endforeach ()
+    string(APPEND src "\n")
+endif ()
+
+# Code padding, in its own section so it is not in the way of the real code
+if (TEXT_KB GREATER 0)
+    math(EXPR text_size "${TEXT_KB} * 1024")
+    string(APPEND src "__asm__(\".pushsection .text.synth_pad, \\\"ax\\\", %progbits\\n\"\n")
+    string(APPEND src "        \".balign 16\\n\"\n")
+    string(APPEND src "        \".space ${text_size}\\n\"\n")
+    string(APPEND src "        \".popsection\");\n\n")
+endif ()
+
+string(APPEND src "int synth_${NAME}_entry(void)\n{\n    return synth_init_count;\n}\n")
+
+file(WRITE ${OUTPUT} "${src}")
@@ -0,0 +1,133 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CCallDeadline
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "CCallDeadline.h"
+#include "CCompartment.h"
+#include "CSignalStack.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace
+{
+    std::atomic<CCallDeadline::ExpiryFn> s_on_expiry{ nullptr };
+
+    void DeadlineSignalHandler(int, siginfo_t*, void* context)
+    {
+        CCallDeadline::ExpiryFn on_expiry = s_on_expiry.load(std::memory_order_relaxed);
+        if (on_expiry)
+        {
+            on_expiry(context);
+        }
+    }
+
+    void InstallHandler()
+    {
+        static std::once_flag once;
+        std::call_once(once, []()
+        {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = &DeadlineSignalHandler;
+            action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+
+            if (sigaction(CCallDeadline::GetSignal(), &action, nullptr) != 0)
+            {
+                throw CCompartmentException(std::string("Cannot install the deadline signal handler: ") + strerror(errno));
+            }
+        });
+    }
+
+    // This thread's timer
+    class CThreadTimer
+    {
+        timer_t m_timer;
+
+    public:
+        CThreadTimer()
+        {
+            CSignalStack::EnsureForThread();
+
+            struct sigevent event;
+            memset(&event, 0, sizeof(event));
+            event.sigev_notify = SIGEV_THREAD_ID;
+            event.sigev_signo = CCallDeadline::GetSignal();
+            event.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+            if (timer_create(CLOCK_MONOTONIC, &event, &m_timer) != 0)
+            {
+                throw CCompartmentException(std::string("Cannot create the deadline timer: ") + strerror(errno));
+            }
+        }
+
+        ~CThreadTimer()
+        {
+            timer_delete(m_timer);
+        }
+
+        void Set(uint64_t deadline_ns)
+        {
+            struct itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+
+            // An absolute time in the past fires at once; zero disarms
+            spec.it_value.tv_sec = static_cast<time_t>(deadline_ns / 1000000000ull);
+            spec.it_value.tv_nsec = static_cast<long>(deadline_ns % 1000000000ull);
+            if (deadline_ns && !spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+            {
+                spec.it_value.tv_nsec = 1;
+            }
+
+            if (timer_settime(m_timer, TIMER_ABSTIME, &spec, nullptr) != 0)
+            {
+                L_(ERROR) << "Cannot set the deadline timer: " << strerror(errno);
+            }
+        }
+    };
+
+    thread_local std::unique_ptr<CThreadTimer> t_timer;
+}
+
+uint64_t CCallDeadline::NowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+}
+
+void CCallDeadline::Arm(uint64_t deadline_ns, ExpiryFn on_expiry)
+{
+    if (!t_timer)
+    {
+        if (!deadline_ns)
+        {
+            return;     // Never armed, so nothing to disarm
+        }
+
+        InstallHandler();
+        t_timer.reset(new CThreadTimer);
+    }
+
+    s_on_expiry.store(on_expiry, std::memory_order_relaxed);
+    t_timer->Set(deadline_ns);
+}
+
+int CCallDeadline::GetSignal()
+{
+    // Clear of the lowest real-time signals, which threading libraries tend to use
+    return SIGRTMIN + 4;
+}
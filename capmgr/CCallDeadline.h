@@ -0,0 +1,34 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CCallDeadline: Per-thread timer enforcing the hard deadlines of compartment calls
+
+#ifndef _CCALL_DEADLINE_H__
+#define _CCALL_DEADLINE_H__
+
+#include <cstdint>
+
+// CCallDeadline: Each thread making calls with a hard deadline has a POSIX timer which signals just that thread
+// (GetSignal(), a real-time signal) when the deadline passes, and the handler calls the expiry function on the thread,
+// i.e. in the middle of whatever the thread is running.  The handler runs on the thread's CSignalStack, as the
+// thread may be running on a compartment's stack.  The timer is made the first time a thread arms it, and goes
+// when the thread exits.
+// Throws CCompartmentException if the timer cannot be made.
+class CCallDeadline
+{
+public:
+    // Called from the signal handler with its ucontext_t, so must be async-signal-safe (or leave the handler with
+    // siglongjmp())
+    using ExpiryFn = void (*)(void* context);
+
+    // Now, on the clock the deadlines are on (CLOCK_MONOTONIC)
+    static uint64_t NowNs();
+
+    // Arm this thread's timer to call on_expiry at deadline_ns (from NowNs()), at once if it has passed, or disarm
+    // it for 0.  There is one expiry function for all threads.
+    // Once the thread has armed its timer this is async-signal-safe, so the expiry function can re-arm it.
+    static void Arm(uint64_t deadline_ns, ExpiryFn on_expiry);
+
+    // The signal used
+    static int GetSignal();
+};
+
+#endif /* _CCALL_DEADLINE_H__ */
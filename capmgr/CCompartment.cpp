@@ -8,12 +8,25 @@
 #include <type_traits>
 #include <cheriintrin.h>
 #include <map>
+#include <algorithm>
+#include <csetjmp>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <ucontext.h>
+#include <vector>
 
 #include "CCapMgrLogger.h"
 
 #include "CCompartment.h"
 #include "comp_caller.h"
+#include "CCapMgrException.h"
 #include "CCapability.h"
+#include "CCallDeadline.h"
+#include "CSignalStack.h"
+#include "CTracer.h"
 #include "capmgr_services.h"
 #include "capmgr_service_function_types.h"
 #include "example_capmgr_service_api.h"
@@ -22,21 +35,225 @@ using namespace std;
 using namespace CapMgr;
 
 // Map of all service functions used in our example - @ToDo make trampolines
-static const ServiceFunctionTable service_func_table =
+std::shared_ptr<const ServiceFunctionTable> CCompartment::GetDefaultServiceTable()
 {
-    {"cheri_malloc", reinterpret_cast<void*>(&cheri_malloc)},
-    {"cheri_free", reinterpret_cast<void*>(&cheri_free)}
+    static const std::shared_ptr<const ServiceFunctionTable> service_func_table =
+        std::make_shared<const ServiceFunctionTable>(ServiceFunctionTable
+        {
+            {"cheri_malloc", reinterpret_cast<void*>(&cheri_malloc)},
+            {"cheri_free", reinterpret_cast<void*>(&cheri_free)},
+            {"cheri_dlopen", reinterpret_cast<void*>(&cheri_dlopen)},
+            {"cheri_dlsym", reinterpret_cast<void*>(&cheri_dlsym)}
+        });
+
+    return service_func_table;
+}
+
+// Compartment whose call is running on this thread, so service functions know which one called them
+static thread_local CCompartment* s_current_compartment = nullptr;
+
+struct CCompartment::CallFrame
+{
+    enum State : int
+    {
+        kInSwitch,          // In the capability manager, switching into or out of the compartment
+        kInCompartment,
+        kInService,
+        kAbandoned          // Ended by a service call as its hard deadline passed
+    };
+
+    CCompartment* compartment;                      // Whose call it is
+    sigjmp_buf jmp;                                 // Back into SwitchToCompartment(), to abandon the call
+    struct CompartmentSwitchState_t switch_state;   // From before the call, restored when it is abandoned
+    uint64_t soft_deadline_ns;
+    uint64_t hard_deadline_ns;
+    volatile sig_atomic_t state;
+    volatile sig_atomic_t abandon_pending;          // Hard deadline passed in a service call
+    int fault_signal;                               // The fault, if the call was abandoned on one
+    int fault_code;
+    uint64_t fault_address;
+    CCompartment* fault_compartment;                // This one, or the callee of a call gate
+    CallFrame* prev;                                // Call this one was made from, if any
 };
 
-CCompartment::CCompartment(const CCompartmentLibs *comp_libs, CompartmentId id, uint32_t stack_size, uint32_t seal_id,
-                const std::string comp_entry_trampoine_function) : m_comp_libs(comp_libs), m_id(id)
+// Innermost call on this thread
+static thread_local CCompartment::CallFrame* s_call_frame = nullptr;
+
+// The earlier of two deadlines, either of which may be 0 for none
+static uint64_t EarlierDeadline(uint64_t a, uint64_t b)
+{
+    return (a && b) ? std::min(a, b) : (a | b);
+}
+
+// Stack pointer when a signal was taken
+static uintptr_t SignalStackPointer(void* context)
+{
+    auto uc = static_cast<const ucontext_t*>(context);
+#if defined(__x86_64__)
+    return static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RSP]);
+#else
+    return static_cast<uintptr_t>(uc->uc_mcontext.sp);
+#endif
+}
+
+// How long to wait before looking again at a call whose hard deadline passed while it was switching
+static constexpr uint64_t kHardDeadlineRetryNs = 100000;
+
+// Timer signal for the innermost call's hard deadline
+static void OnHardDeadline(void* context)
+{
+    CCompartment::CallFrame* frame = s_call_frame;
+    if (!frame || !frame->hard_deadline_ns || CCallDeadline::NowNs() < frame->hard_deadline_ns)
+    {
+        return;     // Raced with the call finishing, or re-armed
+    }
+
+    if (frame->state != CCompartment::CallFrame::kInCompartment)
+    {
+        // The capability manager's own state may be half updated, so wait until it is back in the compartment or
+        // a service call has finished
+        frame->abandon_pending = 1;
+        return;
+    }
+
+    // The state is set before the switch into the compartment and only cleared after the switch back, so the call
+    // may not have started or may have finished.  Only its own code, on a compartment's stack, is abandoned: a call
+    // which has finished is not, and one which has not started yet is looked at again shortly.
+    if (!frame->compartment->FindCompartmentOnStack(SignalStackPointer(context)))
+    {
+        CCallDeadline::Arm(CCallDeadline::NowNs() + kHardDeadlineRetryNs, &OnHardDeadline);
+        return;
+    }
+    siglongjmp(frame->jmp, CCompartment::kCallDeadline);
+}
+
+// The fault signals, and the handlers there were before, for faults which are not a compartment's
+#ifdef SIGPROT
+static const int s_fault_signals[] = { SIGSEGV, SIGBUS, SIGPROT };
+#else
+static const int s_fault_signals[] = { SIGSEGV, SIGBUS };
+#endif
+static struct sigaction s_prev_fault_actions[sizeof(s_fault_signals) / sizeof(s_fault_signals[0])];
+
+// Pass a fault on to the handler there was before
+static void ChainFault(int signo, siginfo_t* info, void* context)
+{
+    for (size_t i = 0; i < sizeof(s_fault_signals) / sizeof(s_fault_signals[0]); i++)
+    {
+        if (s_fault_signals[i] != signo)
+        {
+            continue;
+        }
+
+        const struct sigaction& prev = s_prev_fault_actions[i];
+        if (prev.sa_flags & SA_SIGINFO)
+        {
+            prev.sa_sigaction(signo, info, context);
+        }
+        else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN)
+        {
+            prev.sa_handler(signo);
+        }
+        else
+        {
+            // The faulting instruction runs again on return, and takes the default action this time
+            ::signal(signo, SIG_DFL);
+        }
+        return;
+    }
+}
+
+// Fault signal, which abandons the innermost call if the thread was running in a compartment
+static void OnFault(int signo, siginfo_t* info, void* context)
+{
+    CCompartment::CallFrame* frame = s_call_frame;
+    if (!frame || frame->state != CCompartment::CallFrame::kInCompartment || frame->fault_signal)
+    {
+        // In the capability manager itself (including a service call), or faulted again while abandoning
+        ChainFault(signo, info, context);
+        return;
+    }
+
+    // Compartments run on their own stacks, while the capability manager's code, including the switch into the
+    // compartment, runs on the thread's.  Through a call gate it is the callee's stack.
+    CCompartment* faulting = frame->compartment->FindCompartmentOnStack(SignalStackPointer(context));
+    if (!faulting)
+    {
+        ChainFault(signo, info, context);
+        return;
+    }
+
+    frame->fault_compartment = faulting;
+    frame->fault_signal = signo;
+    frame->fault_code = info->si_code;
+    frame->fault_address = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(info->si_addr));
+    siglongjmp(frame->jmp, CCompartment::kCallFault);
+}
+
+// Install OnFault() for the fault signals, once for the process
+static void InstallFaultHandler()
+{
+    static std::once_flag once;
+    std::call_once(once, []()
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &OnFault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+
+        // Not interrupted by the deadline timer while leaving the compartment
+        sigemptyset(&action.sa_mask);
+        sigaddset(&action.sa_mask, CCallDeadline::GetSignal());
+
+        for (size_t i = 0; i < sizeof(s_fault_signals) / sizeof(s_fault_signals[0]); i++)
+        {
+            if (sigaction(s_fault_signals[i], &action, &s_prev_fault_actions[i]) != 0)
+            {
+                throw CCompartmentException(std::string("Cannot install the compartment fault handler: ") +
+                    strerror(errno));
+            }
+        }
+    });
+}
+
+// Describe a fault for the call's error
+static std::string DescribeFault(int signo, int code, uint64_t address)
+{
+    std::string what;
+    switch (code)
+    {
+#ifdef SEGV_CAPTAGERR
+    case SEGV_CAPTAGERR: what = "capability tag fault"; break;
+    case SEGV_CAPSEALEDERR: what = "capability sealed fault"; break;
+    case SEGV_CAPBOUNDSERR: what = "capability bounds fault"; break;
+    case SEGV_CAPPERMERR: what = "capability permission fault"; break;
+#endif
+    default: what = strsignal(signo); break;
+    }
+
+    std::ostringstream description;
+    description << what << " (signal " << signo << ", code " << code << ") at 0x" << std::hex << address;
+    return description.str();
+}
+
+CCompartment::CCompartment(CCompartmentLibs *comp_libs, CompartmentId id, uint32_t stack_size, uint32_t seal_id,
+                const std::string comp_entry_trampoine_function, CStackPool& stack_pool) :
+    m_comp_libs(comp_libs), m_id(id), m_seal_id(seal_id), m_service_table(GetDefaultServiceTable())
 {
     L_(DEBUG) << "CCompartment: Constructing compartment id = " <<
         static_cast<typename underlying_type<CompartmentId>::type>(id) << endl;
     
-    m_comp_data.csp = CreateStack(stack_size);
+    InstallFaultHandler();
+
+    m_comp_data.csp = CreateStack(stack_pool, stack_size);
+    m_account = std::make_shared<CResourceAccount>(m_comp_libs->GetName());
     
-    void *cpidr = reinterpret_cast<void*>(SetCtpidr());
+    // A natively loaded library has its own TLS, else the compartment shares the capability manager's
+    void *cpidr = m_comp_libs->GetThreadPointer();
+    if (!cpidr)
+    {
+        cpidr = reinterpret_cast<void*>(SetCtpidr());
+    }
 
     // Need to make this restricted
     m_comp_data.ctpidr = Capability(cpidr)
@@ -44,9 +261,9 @@ CCompartment::CCompartment(const CCompartmentLibs *comp_libs, CompartmentId id,
 
     m_comp_data.ddc = nullptr;  // Should not need a DDC in use
 
-    // Create a sealer cap
+    // Create a sealer cap, bounded to just the seal id so it cannot unseal other compartments' data
     m_sealer_cap = Capability(getauxptr(AT_CHERI_SEAL_CAP))
-        .SetBounds(seal_id, seal_id + 1)
+        .SetBounds(seal_id, 1)
         .SetAddress(reinterpret_cast<void*>(seal_id))
         .SetPerms(kCompartmentSealerPerms);
     
@@ -64,7 +281,7 @@ CCompartment::CCompartment(const CCompartmentLibs *comp_libs, CompartmentId id,
         .SetPerms(kCompartmentExecPerms)
         .SEntry();
 
-    printf("COMP ENTRY = %#p\n", m_comp_entry);
+    printf("COMP ENTRY = " CAP_PRINTF_FORMAT "\n", m_comp_entry);
 
     // Return function in executive
     void* exit_fn_void = Capability(reinterpret_cast<uintptr_t>(&CompartmentSwitchReturn));
@@ -77,20 +294,19 @@ CCompartment::CCompartment(const CCompartmentLibs *comp_libs, CompartmentId id,
     // Compartment services callback handler function
     void *service_callback_void = Capability(reinterpret_cast<uintptr_t>(CompartmentServiceHandler));
     m_capmgr_service_fn = reinterpret_cast<CompServiceCallbackFnPtr>(service_callback_void);
+
+    // Call gate entry function in executive
+    void *gate_entry_void = Capability(reinterpret_cast<uintptr_t>(&CompartmentGateEntry));
+    m_gate_entry_fn = reinterpret_cast<CompGateAsmFnPtr>(gate_entry_void);
 }
 
-void* CCompartment::CreateStack(uint32_t stack_size)
+void* CCompartment::CreateStack(CStackPool& stack_pool, uint32_t stack_size)
 {
-    uint32_t page_size = getpagesize();
-    uint64_t mmap_size = cheri_align_up(stack_size, page_size);
-
-    void* mapped_stack = mmap(nullptr, mmap_size, PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-
-    if (!mapped_stack)
-    {
-        throw CCompartmentException("No memory for stack!");
-    }
+    // Stack use is recorded against the library, so its stack size can be tuned
+    m_stack = stack_pool.Acquire(stack_size, m_comp_libs->GetName());
+    Range range = m_stack->GetRange();
+    void* mapped_stack = reinterpret_cast<void*>(range.base);
+    size_t mmap_size = range.Size();
 
     L_(VERBOSE) << "Mapped stack at address" << cheri_address_get(mapped_stack);
 
@@ -109,6 +325,10 @@ void* CCompartment::CreateStack(uint32_t stack_size)
 
 uintptr_t CCompartment::SetCtpidr()
 {
+#if CAPMGR_EMULATED_CAPS
+    // The emulated switcher does not switch the thread pointer, so this is only for reference
+    return reinterpret_cast<uintptr_t>(__builtin_thread_pointer());
+#else
     // Read ctpidr register that we currently have
     register volatile uintptr_t c0 asm("c0");
 
@@ -117,6 +337,7 @@ uintptr_t CCompartment::SetCtpidr()
     );
 
     return c0;
+#endif
 }
 
 void* CCompartment::RestrictAndSeal(CCompartmentData* comp_fn_data)
@@ -128,25 +349,90 @@ void* CCompartment::RestrictAndSeal(CCompartmentData* comp_fn_data)
     return cheri_seal(restricted_cap, m_sealer_cap);
 }
 
+CCompartment::CallOutcome CCompartment::SwitchToCompartment(CallFrame& frame, void* comp_fn_data_sealed,
+    uintptr_t& result)
+{
+    // Abandoning the call jumps back to here, having left the compartment and any service calls mid-way
+    int abandoned = sigsetjmp(frame.jmp, 1);
+    if (abandoned)
+    {
+        frame.state = CallFrame::kInSwitch;
+        return static_cast<CallOutcome>(abandoned);
+    }
+
+    // Only the compartment's own code can be abandoned, from here on
+    frame.state = CallFrame::kInCompartment;
+    if (frame.abandon_pending)
+    {
+        frame.state = CallFrame::kInSwitch;
+        return kCallDeadline;
+    }
+
+    // Call the (C code) ASM wrapper. Arguments:
+    // 1. Asm func to call for entry
+    // 2. The compartment data (csp etc.)
+    // 3. The unwrapping function (pointer) in restricted
+    // 4. The sealed comp function data
+    // 5. The sealer capability
+    result = CompartmentCaller(&CompartmentSwitchEntry, reinterpret_cast<void*>(&m_comp_data),
+                                m_comp_entry, comp_fn_data_sealed, m_sealer_cap);
+
+    // A service call ends the call without returning to the compartment once its hard deadline has passed
+    bool service_abandoned = (frame.state == CallFrame::kAbandoned);
+    frame.state = CallFrame::kInSwitch;
+    return service_abandoned ? kCallDeadline : kCallReturned;
+}
+
 // Call the unwrapper function in the restricted
 // Seal the compartments data params
 uintptr_t CCompartment::CallCompartmentFunction(const std::string& fn_to_call, const std::shared_ptr<CCompartmentData> &comp_fn_data)
 {
     L_(DEBUG) << "CallCompartment: Calling ASM to call into restricted";
 
-    // Lookup the compartment's entry function
-    void* comp_fn = m_comp_libs->GetDllSymbolByName(fn_to_call);
-    if (!comp_fn)
+    if (m_needs_reset)
+    {
+        throw CCompartmentException("A call into " + m_account->GetName() + " was abandoned, so it needs a reset");
+    }
+
+    if (!m_account->CanCall())
+    {
+        throw CCompartmentException("CPU time quota used up for " + m_account->GetName());
+    }
+
+    // Lookup and then build a capability for the Compartment function
+    void* comp_fn_void = GetRestrictedFunction(fn_to_call);
+    if (!comp_fn_void)
     {
         L_(ERROR) << "CallCompartment: Compartment entry point not found!";
         throw CCompartmentException("Cannot find compartment function implementation!");
     }
 
-    // Lookup and then build a capability for the Compartment function
-    void* comp_fn_void = Capability(getauxptr(AT_CHERI_EXEC_RX_CAP))
-        .SetBoundsAndAddress(Capability(comp_fn))
-        .SetPerms(kCompartmentExecPerms)
-        .SEntry();
+    // Deadlines, no later than those of the call this one is made from
+    CallFrame frame;
+    frame.compartment = this;
+    frame.prev = s_call_frame;
+    frame.soft_deadline_ns = 0;
+    frame.hard_deadline_ns = 0;
+    if (m_soft_timeout_ns || m_hard_timeout_ns)
+    {
+        uint64_t now_ns = CCallDeadline::NowNs();
+        frame.soft_deadline_ns = m_soft_timeout_ns ? now_ns + m_soft_timeout_ns : 0;
+        frame.hard_deadline_ns = m_hard_timeout_ns ? now_ns + m_hard_timeout_ns : 0;
+    }
+    if (frame.prev)
+    {
+        frame.soft_deadline_ns = EarlierDeadline(frame.soft_deadline_ns, frame.prev->soft_deadline_ns);
+        frame.hard_deadline_ns = EarlierDeadline(frame.hard_deadline_ns, frame.prev->hard_deadline_ns);
+    }
+    frame.state = CallFrame::kInSwitch;
+    frame.abandon_pending = 0;
+    frame.fault_signal = 0;
+    frame.fault_code = 0;
+    frame.fault_address = 0;
+    frame.fault_compartment = nullptr;
+
+    // Fault handlers run off the compartment's stack
+    CSignalStack::EnsureForThread();
 
     // Finish building the compartment data
     // To avoid extra functionality being in the header, we update these parameters here
@@ -163,21 +449,224 @@ uintptr_t CCompartment::CallCompartmentFunction(const std::string& fn_to_call, c
     comp_fn_data->sealer_cap = m_sealer_cap;
 
     // Service function table
-    comp_fn_data->service_func_table = &service_func_table;
+    comp_fn_data->service_func_table = m_service_table.get();
+
+    // Call gates
+    comp_fn_data->gate_entry_fp = m_gate_entry_fn;
+    comp_fn_data->gate_table = m_gate_table.get();
+
+    comp_fn_data->deadline_ns = frame.soft_deadline_ns;
 
     // Get the compartment's data table, which now needs to be sealed
     // For the compartment, we use the underlying pointer to the shared_ptr
     void* comp_fn_data_sealed = RestrictAndSeal(comp_fn_data.get());
-    
-    // Call the (C code) ASM wrapper. Arguments:
-    // 1. Asm func to call for entry
-    // 2. The compartment data (csp etc.)
-    // 3. The unwrapping function (pointer) in restricted
-    // 4. The sealed comp function data
-    // 5. The sealer capability
 
-    uintptr_t result = CompartmentCaller(&CompartmentSwitchEntry, reinterpret_cast<void*>(&m_comp_data),
-                                m_comp_entry, comp_fn_data_sealed, m_sealer_cap);
+    // The compartment runs from the top of its stack, so cannot be re-entered, either from here or through a gate.
+    // The flag is claimed with the frame's address, which cannot be a thread pointer as a gate's claim is.
+    uint64_t idle = 0;
+    if (!__atomic_compare_exchange_n(&m_busy, &idle, cheri_address_get(&frame), false, __ATOMIC_ACQ_REL,
+        __ATOMIC_RELAXED))
+    {
+        throw CCompartmentException("Cannot call " + fn_to_call + " as " + m_account->GetName() +
+            " is already running a call");
+    }
+
+    auto caller = s_current_compartment;
+    s_current_compartment = this;
+    uint64_t start_cpu_ns = CResourceAccount::ThreadCpuNs();
+    uint32_t trace_id = CTracer::IsEnabled() ? CTracer::InternName(fn_to_call) : 0;
+    CAPMGR_TRACE(kCompartmentEnter, trace_id, 0);
+
+    CompartmentSaveSwitchState(&frame.switch_state);
+    s_call_frame = &frame;
+    if (frame.hard_deadline_ns)
+    {
+        CCallDeadline::Arm(frame.hard_deadline_ns, &OnHardDeadline);
+    }
+
+    uintptr_t result = 0;
+    CallOutcome outcome = SwitchToCompartment(frame, comp_fn_data_sealed, result);
+
+    // Back to the call this one was made from, and its deadline
+    s_call_frame = frame.prev;
+    if (frame.hard_deadline_ns)
+    {
+        CCallDeadline::Arm(frame.prev ? frame.prev->hard_deadline_ns : 0, &OnHardDeadline);
+    }
+
+    if (outcome != kCallReturned)
+    {
+        CompartmentRestoreSwitchState(&frame.switch_state);
+        ReleaseAbandonedCallees();
+
+        // A fault is the compartment's it was in, which through a call gate is not this one
+        (frame.fault_compartment ? frame.fault_compartment : this)->m_needs_reset = true;
+    }
+    __atomic_store_n(&m_busy, 0, __ATOMIC_RELEASE);
+
+    CAPMGR_TRACE(kCompartmentExit, trace_id, 0);
+    m_account->OnCall(CResourceAccount::ThreadCpuNs() - start_cpu_ns);
+    s_current_compartment = caller;
+
+    if (outcome == kCallFault)
+    {
+        std::string fault = DescribeFault(frame.fault_signal, frame.fault_code, frame.fault_address);
+        if (frame.fault_compartment != this)
+        {
+            fault += " in " + frame.fault_compartment->GetAccount().GetName() + " through a call gate";
+        }
+        L_(ERROR) << "Call to " << fn_to_call << " in " << m_account->GetName() << " abandoned on a " << fault
+            << "; the faulting compartment needs a reset";
+        throw CCompartmentFaultException("Call to " + fn_to_call + " abandoned on a " + fault,
+            frame.fault_signal, frame.fault_code, frame.fault_address);
+    }
+    if (outcome == kCallDeadline)
+    {
+        L_(WARNING) << "Call to " << fn_to_call << " in " << m_account->GetName()
+            << " abandoned at its hard deadline; the compartment needs a reset";
+        throw CCompartmentDeadlineException("Call to " + fn_to_call + " abandoned at its hard deadline");
+    }
     return result;
 }
 
+bool CCompartment::ServiceEnter()
+{
+    CallFrame* frame = s_call_frame;
+    if (!frame)
+    {
+        return true;
+    }
+
+    frame->state = CallFrame::kInService;
+    return !frame->soft_deadline_ns || CCallDeadline::NowNs() < frame->soft_deadline_ns;
+}
+
+bool CCompartment::ServiceExit()
+{
+    CallFrame* frame = s_call_frame;
+    if (!frame)
+    {
+        return false;
+    }
+
+    if (frame->abandon_pending)
+    {
+        // Stays out of the compartment, so the timer does not abandon the call as well
+        frame->state = CallFrame::kAbandoned;
+        return true;
+    }
+    frame->state = CallFrame::kInCompartment;
+    return false;
+}
+
+void CCompartment::ReleaseAbandonedCallees()
+{
+    // Gate calls return through CompartmentSwitchReturn, which clears the callee's busy flag, so those cut off still
+    // hold theirs.  A gate's callee cannot make service calls, so any gate call this thread has running was made
+    // within the call.
+    uint64_t thread = cheri_address_get(reinterpret_cast<void*>(SetCtpidr()));
+    std::vector<CCompartment*> callers{ this };
+    for (size_t i = 0; i < callers.size(); i++)
+    {
+        if (!callers[i]->m_gate_table || !CompartmentGateUnsealer)
+        {
+            continue;
+        }
+
+        for (const auto& entry : *callers[i]->m_gate_table)
+        {
+            auto gate = static_cast<const CompartmentGate_t*>(cheri_unseal(entry.second, CompartmentGateUnsealer));
+            auto callee = static_cast<CCompartment*>(gate->callee_compartment);
+            if (!gate->fn || !callee || std::find(callers.begin(), callers.end(), callee) != callers.end())
+            {
+                continue;
+            }
+            callers.push_back(callee);
+
+            uint64_t expected = thread;
+            if (__atomic_compare_exchange_n(&callee->m_busy, &expected, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            {
+                L_(WARNING) << "A gate call into " << callee->m_account->GetName()
+                    << " was abandoned with the call, so it needs a reset too";
+                callee->m_needs_reset = true;
+            }
+        }
+    }
+}
+
+CCompartment* CCompartment::GetCurrent()
+{
+    return s_current_compartment;
+}
+
+CCompartment* CCompartment::FindCompartmentOnStack(uintptr_t sp)
+{
+    if (m_stack->GetMappedRange().Contains(sp))
+    {
+        return this;
+    }
+
+    if (m_gate_table && CompartmentGateUnsealer)
+    {
+        for (const auto& entry : *m_gate_table)
+        {
+            auto gate = static_cast<const CompartmentGate_t*>(cheri_unseal(entry.second, CompartmentGateUnsealer));
+            auto callee = static_cast<CCompartment*>(gate->callee_compartment);
+            if (gate->fn && callee && callee->m_stack->GetMappedRange().Contains(sp))
+            {
+                return callee;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool CCompartment::OpenPlugin(const std::string& so_name)
+{
+    try
+    {
+        return m_comp_libs->OpenPlugin(so_name);
+    }
+    catch (const CCapMgrException& e)
+    {
+        // Called from a service function, so must not throw back through the compartment
+        L_(ERROR) << "Cannot open plugin: " << e.what();
+        return false;
+    }
+}
+
+void* CCompartment::GetRestrictedFunction(const std::string& fn_name) const
+{
+    void* fn = m_comp_libs->GetDllSymbolByName(fn_name);
+    if (!fn)
+    {
+        return nullptr;
+    }
+
+    return Capability(getauxptr(AT_CHERI_EXEC_RX_CAP))
+        .SetBoundsAndAddress(Capability(fn))
+        .SetPerms(kCompartmentExecPerms)
+        .SEntry();
+}
+
+void CCompartment::SetResetBaseline(bool allow_soft_dirty)
+{
+    auto ranges = m_comp_libs->GetWritableRanges();
+    ranges.push_back(m_stack->GetRange());
+
+    m_reset_tracker.reset();
+    m_reset_tracker.reset(new CDirtyPageTracker(ranges, allow_soft_dirty));
+}
+
+const CDirtyPageTracker::Stats& CCompartment::Reset()
+{
+    if (!m_reset_tracker)
+    {
+        throw CCompartmentException("No baseline to reset the compartment to");
+    }
+
+    const auto& stats = m_reset_tracker->Reset();
+    m_needs_reset = false;
+    L_(DEBUG) << "Compartment reset restored " << stats.dirty_pages << " of " << stats.tracked_pages << " pages";
+    return stats;
+}
@@ -10,6 +10,9 @@
 #include "comp_common_defs.h"
 #include "CCompartmentData.h"
 #include "CCompartmentLibs.h"
+#include "CDirtyPageTracker.h"
+#include "CStackPool.h"
+#include "CResourceAccount.h"
 #include "capmgr_service_function_types.h"
 
 // Comp perms
@@ -29,9 +32,13 @@ CHERI_PERM_SEAL | CHERI_PERM_UNSEAL;
 // Comp stack sizes
 constexpr uint32_t CALL_FUNC_STACK_SIZE = 1024 * 1024;
 
-// Sealing object_ids
+// Sealing object_ids: the one used by compartments created directly.  A CCompartmentRegistry allocates a distinct
+// one for each of its compartments instead.
 constexpr uint32_t CALL_FUNC_SEAL_ID = 0x1234;
 
+// Sealing object_id for call gates between compartments, see CCompartmentRegistry::GrantCall()
+constexpr uint32_t CALL_GATE_SEAL_ID = 0x1235;
+
 class CCompartmentException : public std::runtime_error
 {
 public:
@@ -41,39 +48,192 @@ public:
     }
 };
 
+// Thrown when a call into a compartment is abandoned at its hard deadline
+class CCompartmentDeadlineException : public CCompartmentException
+{
+public:
+    CCompartmentDeadlineException(const std::string& msg = "")
+        : CCompartmentException(msg)
+    {
+    }
+};
+
+// Thrown when a call into a compartment is abandoned because the compartment faulted, e.g. on a capability bounds,
+// permission or tag violation, with the fault's signal, si_code and address
+class CCompartmentFaultException : public CCompartmentException
+{
+    int m_signal;
+    int m_code;
+    uint64_t m_address;
+
+public:
+    CCompartmentFaultException(const std::string& msg, int signal, int code, uint64_t address)
+        : CCompartmentException(msg), m_signal(signal), m_code(code), m_address(address)
+    {
+    }
+
+    int GetSignal() const { return m_signal; }
+    int GetCode() const { return m_code; }
+    uint64_t GetAddress() const { return m_address; }
+};
+
 class CCompartment
 {
 public:
-    // Different compartment types - @todo Extend for multi-compartment
-    enum class CompartmentId
+    // Compartment identifiers.  Compartments hosted by a CCompartmentRegistry are numbered from kFirstRegisteredId.
+    enum class CompartmentId : uint32_t
     {
-        kCompartmentExampleId
+        kCompartmentExampleId,
+        kFirstRegisteredId
     };
 
-private:
     // Entry point in the compartment which we need to call - always a single trampoline address
     static constexpr const char* COMPARTMENT_ENTRY_POINT_FUNCTION = "CompartmentEntryPoint";
+
+    // A call into a compartment in progress on a thread, which can be abandoned
+    struct CallFrame;
+
+    // How a call ended: it returned, or was abandoned at its hard deadline or as the compartment faulted
+    enum CallOutcome : int
+    {
+        kCallReturned,
+        kCallDeadline,
+        kCallFault
+    };
+
+private:
     struct CompartmentData_t    m_comp_data;
-    const CCompartmentLibs  *m_comp_libs;
+    CCompartmentLibs  *m_comp_libs;
     CompartmentId               m_id;
-    void* m_sealer_cap;         // Capability used for sealing
+    uint32_t m_seal_id;
+    void* m_sealer_cap;         // Capability used for sealing, for just the seal id
     void* m_comp_entry;         // Capability which is the compartment's entry function (in restricted)
     CompExitAsmFnPtr m_exit_fn;   // and the exit function (in executive).
 
     CompEntryAsmFnPtr m_capmgr_service_entry_fn;      // Compartment service callback entry function pointer.
     CompServiceCallbackFnPtr m_capmgr_service_fn;    // Compartment service callback handler function pointer. 
+    CompGateAsmFnPtr m_gate_entry_fn;                 // Call gate entry function pointer.
+
+    std::unique_ptr<CStackPool::Stack> m_stack;         // From the stack pool, returned when destroyed
+
+    std::unique_ptr<CDirtyPageTracker> m_reset_tracker;   // Baseline for Reset(), if set
+
+    std::shared_ptr<CResourceAccount> m_account;          // Resources used, which may be shared with other compartments
 
-    void* CreateStack(uint32_t stack_size);
+    std::shared_ptr<const ServiceFunctionTable> m_service_table;  // Services the compartment can call
+    std::shared_ptr<const CompartmentGateTable> m_gate_table;     // Other compartments' functions it can call
+
+    uint64_t m_soft_timeout_ns = 0;     // Per call, 0 for none
+    uint64_t m_hard_timeout_ns = 0;
+    bool m_needs_reset = false;         // A call was abandoned, so its state cannot be trusted
+    uint64_t m_busy = 0;                // Set while a call runs in the compartment, see CompartmentGate_t::callee_busy
+
+    void* CreateStack(CStackPool& stack_pool, uint32_t stack_size);
     void* RestrictAndSeal(CCompartmentData* comp_fn_data);
+
+    // Switch into the compartment for the call in the frame
+    CallOutcome SwitchToCompartment(CallFrame& frame, void* comp_fn_data_sealed, uintptr_t& result);
+
+    // Release the busy flags of the gate callees an abandoned call left running, which need a reset too
+    void ReleaseAbandonedCallees();
     uintptr_t SetCtpidr();
 
 public:
     // Create compartment with needed mappings and optionally name of the unwrap function
-    explicit CCompartment(const CCompartmentLibs* comp_libs, CompartmentId id, uint32_t stack_size, uint32_t seal_id,
-        const std::string comp_entry_trampoine_function = COMPARTMENT_ENTRY_POINT_FUNCTION);
+    // The stack is acquired from the stack pool, which defaults to the pool shared by all compartments
+    explicit CCompartment(CCompartmentLibs* comp_libs, CompartmentId id, uint32_t stack_size, uint32_t seal_id,
+        const std::string comp_entry_trampoine_function = COMPARTMENT_ENTRY_POINT_FUNCTION,
+        CStackPool& stack_pool = CStackPool::GetDefault());
 
     // Call into restricted, give the compartment data to pass for the function and the name of the function
+    // Throws if the account's CPU time hard quota has been used up, if the compartment needs a reset or is already
+    // running (it runs from the top of its stack, so cannot be re-entered, e.g. from one of its service calls),
+    // CCompartmentDeadlineException if the call is abandoned at its hard deadline, or CCompartmentFaultException
+    // if the compartment faults.
+    // A fault (SIGSEGV, SIGBUS or SIGPROT) taken while the thread is running in the compartment abandons just that
+    // call, as for a hard deadline: the thread returns from it as CompartmentSwitchReturn would and the compartment
+    // needs a Reset().  Other compartments, and calls on other threads, carry on.  Faults anywhere else are passed
+    // on to the handler there was before, or kill the process as usual.
     uintptr_t CallCompartmentFunction(const std::string &fn_to_call, const std::shared_ptr<CCompartmentData> &comp_fn_data);
+
+    // Deadlines for each call, from when it starts, or 0 for none:
+    // - Past the soft deadline, the capability manager refuses the compartment's service calls (they return 0) and
+    //   the compartment runtime does not make them (CServiceCallProxy::DeadlinePassed()), so a well behaved function
+    //   returns early.
+    // - At the hard deadline a timer signal abandons the call, wherever the compartment is: the thread returns from
+    //   the call as CompartmentSwitchReturn would, and the call throws CCompartmentDeadlineException.  The
+    //   compartment is left as it was, so needs a Reset() before it can be called again.  A service call running at
+    //   the time is finished first.
+    // A call made within another call (i.e. from a service call) has the earlier of the two deadlines.
+    void SetCallTimeouts(uint64_t soft_timeout_ns, uint64_t hard_timeout_ns)
+    {
+        m_soft_timeout_ns = soft_timeout_ns;
+        m_hard_timeout_ns = hard_timeout_ns;
+    }
+
+    // Whether a call has been abandoned (at its deadline or on a fault), so the compartment must be reset (or
+    // destroyed) before it is called again
+    bool NeedsReset() const { return m_needs_reset; }
+
+    // Service call boundaries, called by the service handler on the thread of the call.  ServiceEnter() returns
+    // false if the call's soft deadline has passed, so the service should not be run.  ServiceExit() returns true if
+    // the call's hard deadline passed during the service, so the handler must end the call with
+    // CompartmentServiceCallbackAbandon() rather than return to the compartment.
+    static bool ServiceEnter();
+    static bool ServiceExit();
+
+    // The account the compartment's heap, CPU time and calls are counted in.  By default it has its own, named after
+    // the library, but an account can be shared, e.g. by all the compartments of a tenant.
+    CResourceAccount& GetAccount() const { return *m_account; }
+    void SetAccount(const std::shared_ptr<CResourceAccount>& account) { m_account = account; }
+
+    // The capability manager services the compartment can call, by name.  Defaults to all the example services
+    // (GetDefaultServiceTable()), but can be narrowed per compartment.  Set it before calling into the compartment.
+    void SetServiceTable(const std::shared_ptr<const ServiceFunctionTable>& service_table) { m_service_table = service_table; }
+    const ServiceFunctionTable& GetServiceTable() const { return *m_service_table; }
+    static std::shared_ptr<const ServiceFunctionTable> GetDefaultServiceTable();
+
+    // The call gates to other compartments' functions the compartment has been granted, by name, or nullptr for none.
+    // Set it before calling into the compartment.
+    void SetGateTable(const std::shared_ptr<const CompartmentGateTable>& gate_table) { m_gate_table = gate_table; }
+
+    // Restricted state the compartment runs with, e.g. for a call gate to it
+    const CompartmentData_t& GetCompartmentData() const { return m_comp_data; }
+
+    // Flag which is set while a call runs in the compartment, for a call gate to it to claim
+    uint64_t* GetBusyFlag() { return &m_busy; }
+
+    CompartmentId GetId() const { return m_id; }
+    uint32_t GetSealId() const { return m_seal_id; }
+
+    // Most stack the compartment has used so far, i.e. its committed stack, e.g. to tune the stack size for a library
+    size_t GetStackHighWater() const { return m_stack->MeasureHighWater(); }
+
+    // The compartment whose call is running on this thread (i.e. which made a service call), or nullptr
+    static CCompartment* GetCurrent();
+
+    // The compartment whose stack a stack pointer is on: this one, or the callee of one of its call gates, as a
+    // compartment only runs another's code through a gate.  Returns nullptr for any other stack, e.g. the capability
+    // manager's.  Safe in a signal handler.
+    CCompartment* FindCompartmentOnStack(uintptr_t sp);
+
+    // Load a plugin library into the compartment's namespace and patch only it, see CCompartmentLibs::OpenPlugin().
+    // Returns false on failure.  The plugin's writable blocks are not in any reset baseline taken before.
+    bool OpenPlugin(const std::string& so_name);
+
+    // Restricted capability (a sentry) for a function in the compartment's libraries, or nullptr if not found
+    void* GetRestrictedFunction(const std::string& fn_name) const;
+
+    // Take the current writable state of the compartment (library data and the stack) as the baseline for Reset(),
+    // e.g. once it has been initialised.  The compartment's heap allocations are the capability manager's, so are
+    // not included.  Note the library data is shared with any other compartments using the same libraries.
+    // allow_soft_dirty lets the tracker fall back to the process wide soft-dirty bits, see CDirtyPageTracker.
+    void SetResetBaseline(bool allow_soft_dirty = false);
+
+    // Restore the pages written since the baseline or last reset, e.g. between requests from different tenants, or
+    // after a call was abandoned.  The cost follows the number of pages written, unless the kernel cannot track
+    // them for the tracker, when every page is compared.  Throws if there is no baseline.
+    const CDirtyPageTracker::Stats& Reset();
 };
 
 #endif /* _CCOMPARTMENT_H__ */
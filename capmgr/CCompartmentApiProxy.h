@@ -14,11 +14,29 @@
 
 class CCompartmentApiProxy
 {
-    CCompartment m_compartment;
+    std::unique_ptr<CCompartment> m_own_compartment;    // If the proxy created the compartment
+    CCompartment& m_compartment;
 
 public:
-    CCompartmentApiProxy(const CCompartmentLibs* comp_libs, CCompartment::CompartmentId id, uint32_t stack_size, uint32_t seal_id)
-        : m_compartment(comp_libs, id, stack_size, seal_id) {}
+    CCompartmentApiProxy(CCompartmentLibs* comp_libs, CCompartment::CompartmentId id, uint32_t stack_size, uint32_t seal_id)
+        : m_own_compartment(new CCompartment(comp_libs, id, stack_size, seal_id)), m_compartment(*m_own_compartment) {}
+
+    // Proxy for a compartment owned elsewhere, e.g. by a CCompartmentRegistry, which must outlive the proxy
+    explicit CCompartmentApiProxy(CCompartment& compartment) : m_compartment(compartment) {}
+
+    // Reset the compartment's writable state between requests, see CCompartment
+    void SetResetBaseline(bool allow_soft_dirty = false) { m_compartment.SetResetBaseline(allow_soft_dirty); }
+    const CDirtyPageTracker::Stats& Reset() { return m_compartment.Reset(); }
+
+    size_t GetStackHighWater() const { return m_compartment.GetStackHighWater(); }
+
+    // Call deadlines, see CCompartment
+    void SetCallTimeouts(uint64_t soft_timeout_ns, uint64_t hard_timeout_ns) { m_compartment.SetCallTimeouts(soft_timeout_ns, hard_timeout_ns); }
+    bool NeedsReset() const { return m_compartment.NeedsReset(); }
+
+    // Resource accounting and quotas, see CCompartment
+    CResourceAccount& GetAccount() const { return m_compartment.GetAccount(); }
+    void SetAccount(const std::shared_ptr<CResourceAccount>& account) { m_compartment.SetAccount(account); }
 
     template <typename T, typename... Args>
     uintptr_t CallApiFn(const std::string& fn_name, Args&&... args)
@@ -59,6 +77,24 @@ public:
     {
         return (bool)CallApiFn<CExampleSetCompartmentDebugLevelCallCompartmentData>(__func__, std::forward<Args>(args)...);
     }
+
+    template <typename... Args>
+    int32_t example_call_gate(Args&&... args)
+    {
+        return (int32_t)CallApiFn<CExampleCallGateCallCompartmentData>(__func__, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    int32_t example_spin(Args&&... args)
+    {
+        return (int32_t)CallApiFn<CExampleSpinCallCompartmentData>(__func__, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    int32_t example_fault(Args&&... args)
+    {
+        return (int32_t)CallApiFn<CExampleFaultCallCompartmentData>(__func__, std::forward<Args>(args)...);
+    }
 };
 
 #endif /* _CCOMPARTMENT_API_PROXY_H__ */
@@ -0,0 +1,376 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CCompartmentRegistry
+
+#include <algorithm>
+#include <cheriintrin.h>
+
+#include "CCompartmentRegistry.h"
+#include "CCapMgrException.h"
+#include "CCapMgrLogger.h"
+#include "CCapability.h"
+#include "CHugePages.h"
+
+using namespace CapMgr;
+
+// Set by GetGateSealer(), the first time a gate is granted
+void* CompartmentGateUnsealer = nullptr;
+
+namespace
+{
+    size_t IdToIndex(CCompartmentRegistry::CompartmentId id)
+    {
+        return static_cast<size_t>(id) - static_cast<size_t>(CCompartmentRegistry::CompartmentId::kFirstRegisteredId);
+    }
+
+    CCompartmentRegistry::CompartmentId IndexToId(size_t index)
+    {
+        return static_cast<CCompartmentRegistry::CompartmentId>(
+            index + static_cast<size_t>(CCompartmentRegistry::CompartmentId::kFirstRegisteredId));
+    }
+
+    // Sealer for call gates, for just the gate seal id.  Shared by all registries, as CompartmentGateEntry has the
+    // one unsealer.
+    void* GetGateSealer()
+    {
+        static void* gate_sealer = []()
+        {
+            void* sealer = Capability(getauxptr(AT_CHERI_SEAL_CAP))
+                .SetBounds(CALL_GATE_SEAL_ID, 1)
+                .SetAddress(reinterpret_cast<void*>(CALL_GATE_SEAL_ID))
+                .SetPerms(kCompartmentSealerPerms);
+
+            CompartmentGateUnsealer = Capability(sealer)
+                .SetPerms(CHERI_PERM_UNSEAL);
+            return sealer;
+        }();
+
+        return gate_sealer;
+    }
+}
+
+CCompartmentRegistry::CCompartmentRegistry()
+{
+    // Seal ids must be within the seal capability the kernel gave us
+    void* seal_cap = getauxptr(AT_CHERI_SEAL_CAP);
+    uint64_t seal_base = cheri_base_get(seal_cap);
+    uint64_t seal_top = seal_base + std::min<uint64_t>(cheri_length_get(seal_cap), kSealIdLimit);
+
+    m_seal_next = static_cast<uint32_t>(std::max<uint64_t>(seal_base, kFirstSealId));
+    m_seal_limit = static_cast<uint32_t>(std::min<uint64_t>(seal_top, kSealIdLimit));
+
+    L_(DEBUG) << "Compartment registry seal ids " << m_seal_next << " to " << m_seal_limit;
+}
+
+CCompartmentRegistry::~CCompartmentRegistry()
+{
+    // Most recent first, as for the compartments' libraries
+    for (auto itr = m_entries.rbegin(); itr != m_entries.rend(); ++itr)
+    {
+        if (*itr)
+        {
+            DestroyEntry(**itr);
+        }
+    }
+}
+
+uint32_t CCompartmentRegistry::AllocateSealId()
+{
+    // Leave the seal ids of compartments created directly and of call gates
+    while (m_seal_next == CALL_FUNC_SEAL_ID || m_seal_next == CALL_GATE_SEAL_ID)
+    {
+        m_seal_next++;
+    }
+
+    if (m_seal_next < m_seal_limit)
+    {
+        return m_seal_next++;
+    }
+
+    // A freed id can still unseal what its old compartment sealed, so is only reused when there are no others
+    if (m_seal_free.empty())
+    {
+        throw CCompartmentException("No seal ids left for another compartment");
+    }
+
+    uint32_t seal_id = m_seal_free.front();
+    m_seal_free.pop_front();
+    L_(WARNING) << "Reusing seal id " << seal_id << " of an unregistered compartment, as all the others are in use";
+    return seal_id;
+}
+
+CCompartmentLibs* CCompartmentRegistry::LoadLibs(const Config& config)
+{
+    auto rwcap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+    auto fixup_cap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
+    std::unique_ptr<CCompartmentLibs> libs;
+
+    if (config.native_loader)
+    {
+        // Relocated straight into restricted capabilities, so there are no fixups to do
+        auto rxcap{ Capability(getauxptr(AT_CHERI_EXEC_RX_CAP)) };
+        std::unique_ptr<CCompartmentLoader> loader{ new CCompartmentLoader({}, rwcap, rxcap) };
+        libs.reset(new CCompartmentLibs{ config.library, rwcap, fixup_cap, std::move(loader) });
+    }
+    else
+    {
+#if CAPMGR_BUILT_STATIC_ENABLE
+        bool load_new = false;  // For static build, the cap mgr has no linkmap so cannot load a new one
+#else
+        bool load_new = true;
+#endif
+        libs.reset(new CCompartmentLibs{ config.library, rwcap, fixup_cap, load_new });
+
+        if (!libs->DoAllLibCapFixups(true, config.fixup_threads))
+        {
+            throw CCompartmentException("Capability fixups failed for " + config.library);
+        }
+    }
+
+    if (CHugePages::IsEnabled())
+    {
+        try
+        {
+            libs->RemapHugePages();
+        }
+        catch (const CCapMgrException& e)
+        {
+            L_(WARNING) << "Library segments of " << config.library << " not remapped onto huge pages: " << e.what();
+        }
+    }
+
+    return libs.release();
+}
+
+void CCompartmentRegistry::DestroyEntry(Entry& entry)
+{
+    entry.compartment.reset();
+
+#if CAPMGR_BUILT_STATIC_ENABLE
+    // As for the capability manager's own compartment, the libraries are left loaded and patched in a static build
+    entry.libs.release();
+#else
+    if (entry.libs && !entry.libs->DoAllLibCapFixups(false, entry.fixup_threads))
+    {
+        L_(ERROR) << "Error reverting the fixups of compartment library " << entry.libs->GetName();
+    }
+    entry.libs.reset();
+#endif
+}
+
+CCompartmentRegistry::CompartmentId CCompartmentRegistry::Register(const Config& config)
+{
+    std::unique_ptr<Entry> entry{ new Entry };
+    entry->fixup_threads = config.fixup_threads;
+
+    // Loading and fixing up take the time, so are done before taking the lock
+    try
+    {
+        entry->libs.reset(LoadLibs(config));
+    }
+    catch (const CCapMgrException& e)
+    {
+        throw CCompartmentException("Cannot load compartment library " + config.library + ": " + e.what());
+    }
+
+    entry->stack_pool = config.stack_pool ? config.stack_pool : std::make_shared<CStackPool>();
+    entry->gates = std::make_shared<CompartmentGateTable>();
+
+    std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+    CompartmentId id = IndexToId(m_entries.size());
+    uint32_t seal_id;
+
+    try
+    {
+        seal_id = AllocateSealId();
+        try
+        {
+            entry->compartment.reset(new CCompartment(entry->libs.get(), id, config.stack_size, seal_id,
+                CCompartment::COMPARTMENT_ENTRY_POINT_FUNCTION, *entry->stack_pool));
+        }
+        catch (...)
+        {
+            m_seal_free.push_back(seal_id);
+            throw;
+        }
+    }
+    catch (...)
+    {
+        DestroyEntry(*entry);
+        throw;
+    }
+
+    if (config.services)
+    {
+        entry->compartment->SetServiceTable(config.services);
+    }
+    if (config.account)
+    {
+        entry->compartment->SetAccount(config.account);
+    }
+    entry->compartment->SetGateTable(entry->gates);
+
+    m_entries.push_back(std::move(entry));
+
+    L_(DEBUG) << "Registered compartment " << static_cast<uint32_t>(id) << " for " << config.library
+        << " with seal id " << seal_id;
+    return id;
+}
+
+bool CCompartmentRegistry::Unregister(CompartmentId id)
+{
+    std::unique_ptr<Entry> entry;
+    {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        size_t index = IdToIndex(id);
+        if (index >= m_entries.size() || !m_entries[index])
+        {
+            return false;
+        }
+
+        entry = std::move(m_entries[index]);
+        m_seal_free.push_back(entry->compartment->GetSealId());
+        RevokeGates(id);
+    }
+
+    // Unloading takes the time, so is done after releasing the lock
+    DestroyEntry(*entry);
+
+    L_(DEBUG) << "Unregistered compartment " << static_cast<uint32_t>(id);
+    return true;
+}
+
+void CCompartmentRegistry::RevokeGates(CompartmentId id)
+{
+    for (auto& gate : m_gates)
+    {
+        if (gate->desc.fn && (gate->caller == id || gate->callee == id))
+        {
+            // The caller may still have the gate, so it stays, but no longer calls anything
+            gate->desc.fn = nullptr;
+            gate->desc.callee_compartment = nullptr;
+
+            size_t index = IdToIndex(gate->caller);
+            if (gate->caller != id && m_entries[index])
+            {
+                m_entries[index]->gates->erase(gate->name);
+            }
+        }
+    }
+}
+
+void CCompartmentRegistry::GrantCall(CompartmentId caller, CompartmentId callee, const std::string& fn_name,
+    const std::string& gate_name)
+{
+    std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+    size_t caller_index = IdToIndex(caller);
+    size_t callee_index = IdToIndex(callee);
+    if (caller_index >= m_entries.size() || !m_entries[caller_index] ||
+        callee_index >= m_entries.size() || !m_entries[callee_index])
+    {
+        throw CCompartmentException("Cannot grant a gate between compartments which are not registered");
+    }
+
+    const CCompartment& callee_compartment = *m_entries[callee_index]->compartment;
+    void* fn = callee_compartment.GetRestrictedFunction(fn_name);
+    if (!fn)
+    {
+        throw CCompartmentException("Cannot find " + fn_name + " for a call gate");
+    }
+
+    std::unique_ptr<Gate> gate{ new Gate };
+    gate->desc.callee = callee_compartment.GetCompartmentData();
+    gate->desc.fn = fn;
+    // The caller's stack pointer is derived from its top of stack, so has the same bounds
+    void* caller_csp = m_entries[caller_index]->compartment->GetCompartmentData().csp;
+    gate->desc.caller_stack_base = cheri_base_get(caller_csp);
+    gate->desc.caller_stack_size = cheri_length_get(caller_csp);
+    gate->desc.calls = 0;
+    gate->desc.callee_compartment = m_entries[callee_index]->compartment.get();
+    gate->desc.callee_busy = m_entries[callee_index]->compartment->GetBusyFlag();
+    gate->caller = caller;
+    gate->callee = callee;
+    gate->name = gate_name.empty() ? fn_name : gate_name;
+
+    // A replaced gate is revoked, so the caller cannot keep using it
+    auto& gates = *m_entries[caller_index]->gates;
+    for (auto& old_gate : m_gates)
+    {
+        if (old_gate->desc.fn && old_gate->caller == caller && old_gate->name == gate->name)
+        {
+            old_gate->desc.fn = nullptr;
+        }
+    }
+
+    gates[gate->name] = cheri_seal(Capability(&gate->desc).SetPerms(kCompartmentDataPerms), GetGateSealer());
+
+    L_(DEBUG) << "Granted compartment " << static_cast<uint32_t>(caller) << " the gate " << gate->name << " to "
+        << fn_name << " of compartment " << static_cast<uint32_t>(callee);
+    m_gates.push_back(std::move(gate));
+}
+
+uint64_t CCompartmentRegistry::GetGateCalls(CompartmentId caller, const std::string& gate_name) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    for (const auto& gate : m_gates)
+    {
+        if (gate->desc.fn && gate->caller == caller && gate->name == gate_name)
+        {
+            return __atomic_load_n(&gate->desc.calls, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+CCompartmentRegistry::Entry* CCompartmentRegistry::FindEntry(CompartmentId id) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    size_t index = IdToIndex(id);
+    return (index < m_entries.size()) ? m_entries[index].get() : nullptr;
+}
+
+CCompartment* CCompartmentRegistry::Find(CompartmentId id) const
+{
+    Entry* entry = FindEntry(id);
+    return entry ? entry->compartment.get() : nullptr;
+}
+
+CCompartment& CCompartmentRegistry::Get(CompartmentId id) const
+{
+    CCompartment* compartment = Find(id);
+    if (!compartment)
+    {
+        throw CCompartmentException("Compartment " + std::to_string(static_cast<uint32_t>(id)) + " is not registered");
+    }
+    return *compartment;
+}
+
+CCompartmentLibs& CCompartmentRegistry::GetLibs(CompartmentId id) const
+{
+    Entry* entry = FindEntry(id);
+    if (!entry)
+    {
+        throw CCompartmentException("Compartment " + std::to_string(static_cast<uint32_t>(id)) + " is not registered");
+    }
+    return *entry->libs;
+}
+
+std::vector<CCompartmentRegistry::CompartmentId> CCompartmentRegistry::GetIds() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    std::vector<CompartmentId> ids;
+    for (size_t index = 0; index < m_entries.size(); index++)
+    {
+        if (m_entries[index])
+        {
+            ids.push_back(IndexToId(index));
+        }
+    }
+    return ids;
+}
+
+size_t CCompartmentRegistry::Size() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    return static_cast<size_t>(std::count_if(m_entries.begin(), m_entries.end(),
+        [](const std::unique_ptr<Entry>& entry) { return entry != nullptr; }));
+}
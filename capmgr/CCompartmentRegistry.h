@@ -0,0 +1,144 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CCompartmentRegistry: Hosts many compartments at once, each loaded from its own library
+
+#ifndef _CCOMPARTMENT_REGISTRY_H__
+#define _CCOMPARTMENT_REGISTRY_H__
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "CCompartment.h"
+#include "CCompartmentLibs.h"
+#include "CStackPool.h"
+#include "CResourceAccount.h"
+#include "capmgr_service_function_types.h"
+
+// CCompartmentRegistry: Loads, fixes up and owns a set of compartments, so a process can be split into several
+// mutually distrusting compartments.  Each compartment has:
+// - Its own copy of its library and the library's dependencies, in its own loader namespace (or loaded by the
+//   native compartment loader).  The C library limits the number of namespaces, typically to 16.
+// - Its own seal id, allocated from the range of the AT_CHERI_SEAL_CAP capability, so its sealed data cannot be
+//   unsealed with another compartment's sealer.  Seal ids freed by Unregister() are only reused once the range has
+//   been used up, longest freed first, as data sealed by the old compartment could be unsealed by the new one.
+// - Its own service table, stack pool and resource account, unless the Config shares them.
+// - The call gates it has been granted to other compartments' functions (GrantCall()), which it calls directly
+//   rather than through a service call.
+// Compartments are found by id with an index, so lookup is O(1).  Ids are not reused, so a stale id is not found
+// rather than finding a later compartment.  Register() and Unregister() can run alongside lookups on other threads,
+// but a compartment must not be unregistered while it is being called.
+// Throws CCompartmentException on failure.
+class CCompartmentRegistry
+{
+public:
+    using CompartmentId = CCompartment::CompartmentId;
+
+    struct Config
+    {
+        std::string library;                            // Compartment library to load
+        uint32_t stack_size = CALL_FUNC_STACK_SIZE;
+        bool native_loader = false;                     // Load with CCompartmentLoader rather than dlmopen()
+        unsigned fixup_threads = 1;
+
+        std::shared_ptr<const ServiceFunctionTable> services;   // Or nullptr for CCompartment's default table
+        std::shared_ptr<CStackPool> stack_pool;                 // Or nullptr for a pool of its own
+        std::shared_ptr<CResourceAccount> account;              // Or nullptr for an account of its own
+    };
+
+private:
+    // Morello object types are 15 bits, of which the lowest are reserved for sentries
+    static constexpr uint32_t kFirstSealId = 4;
+    static constexpr uint32_t kSealIdLimit = 1u << 15;
+
+    struct Entry
+    {
+        std::unique_ptr<CCompartmentLibs> libs;
+        std::shared_ptr<CStackPool> stack_pool;
+        std::unique_ptr<CCompartment> compartment;      // Last, so it goes before its stack pool and libraries
+        unsigned fixup_threads = 1;
+        std::shared_ptr<CompartmentGateTable> gates;    // Granted by GrantCall(), shared with the compartment
+    };
+
+    // A call gate.  The caller has the address of the descriptor (sealed), so gates are kept until the registry is
+    // destroyed, even once revoked.
+    struct Gate
+    {
+        CompartmentGate_t desc;
+        CompartmentId caller;
+        CompartmentId callee;
+        std::string name;
+    };
+
+    mutable std::shared_timed_mutex m_mutex;
+    std::vector<std::unique_ptr<Entry>> m_entries;      // Indexed by id from kFirstRegisteredId, null if unregistered
+
+    // Seal ids: the range of the seal capability, the next never used and those freed by Unregister(), in the
+    // order they were freed
+    uint32_t m_seal_next;
+    uint32_t m_seal_limit;
+    std::deque<uint32_t> m_seal_free;
+
+    std::vector<std::unique_ptr<Gate>> m_gates;
+
+    uint32_t AllocateSealId();
+    static CCompartmentLibs* LoadLibs(const Config& config);
+
+    // Destroy the compartment, then revert the fixups of its libraries and unload them
+    static void DestroyEntry(Entry& entry);
+
+    // Revoke the gates from and to a compartment, with the lock held
+    void RevokeGates(CompartmentId id);
+
+    Entry* FindEntry(CompartmentId id) const;
+
+public:
+    CCompartmentRegistry();
+    ~CCompartmentRegistry();
+
+    CCompartmentRegistry(const CCompartmentRegistry&) = delete;
+    CCompartmentRegistry& operator=(const CCompartmentRegistry&) = delete;
+
+    // Load a compartment library and create a compartment for it, returning its id
+    CompartmentId Register(const Config& config);
+
+    // Destroy a compartment, revert its library's fixups and unload it, revoking the gates from and to it.
+    // Returns false if the id is not registered.
+    bool Unregister(CompartmentId id);
+
+    // Grant compartment caller a gate to the function fn_name of compartment callee, named gate_name (fn_name if
+    // empty), so the caller can call it directly (CServiceCallProxy::FindGate() and CallGate()).  The call goes
+    // through a single trampoline which switches the restricted state, with no service call and no copy of the
+    // arguments, so it suits compartments which call each other constantly, e.g. stages of a pipeline.
+    // - Only the caller can use the gate, and the function is called with its register arguments as they are.
+    // - As for a call from the capability manager, the callee runs from the top of its stack, so it cannot be
+    //   re-entered: the gate claims the callee's busy flag atomically, and returns 0 without calling it if it is
+    //   already running (through another gate, e.g. calling back into its caller, or called by the capability
+    //   manager).  The call is not counted in the callee's resource account.
+    // Grant gates before calling into the caller, as its gate table is not locked against its calls.  Granting a
+    // gate name again replaces the gate.  Throws if either compartment is not registered or the function is not
+    // found.
+    void GrantCall(CompartmentId caller, CompartmentId callee, const std::string& fn_name,
+        const std::string& gate_name = "");
+
+    // Calls made through a caller's gate so far, or 0 if there is no such gate
+    uint64_t GetGateCalls(CompartmentId caller, const std::string& gate_name) const;
+
+    // The compartment for an id, or nullptr if it is not registered
+    CCompartment* Find(CompartmentId id) const;
+
+    // The compartment for an id; throws if it is not registered
+    CCompartment& Get(CompartmentId id) const;
+
+    // The libraries loaded for a compartment, e.g. to resolve its symbols; throws if it is not registered
+    CCompartmentLibs& GetLibs(CompartmentId id) const;
+
+    // Ids of all the registered compartments, in the order registered
+    std::vector<CompartmentId> GetIds() const;
+
+    size_t Size() const;
+};
+
+#endif /* _CCOMPARTMENT_REGISTRY_H__ */
@@ -0,0 +1,427 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CDirtyPageTracker
+
+#include <cheriintrin.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/userfaultfd.h>
+
+#include "CDirtyPageTracker.h"
+#include "CCapMgrException.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+// Asynchronous write-protect and PAGEMAP_SCAN need the Linux 6.7 headers
+#if defined(PAGEMAP_SCAN) && defined(UFFD_FEATURE_WP_ASYNC) && defined(__NR_userfaultfd)
+#define CAPMGR_HAVE_PAGEMAP_SCAN 1
+#else
+#define CAPMGR_HAVE_PAGEMAP_SCAN 0
+#endif
+
+namespace
+{
+    constexpr uint64_t kPagemapSoftDirty = 1ULL << 55;
+}
+
+std::mutex CDirtyPageTracker::s_soft_dirty_mutex;
+std::set<CDirtyPageTracker*> CDirtyPageTracker::s_soft_dirty_trackers;
+
+CDirtyPageTracker::CDirtyPageTracker(const std::vector<Range>& ranges, bool allow_soft_dirty) :
+    m_page_size(getpagesize()), m_mode(Mode::kSoftDirty)
+{
+    for (const auto& range : ranges)
+    {
+        Region region;
+        region.range = range;
+
+        size_t size = range.Size();
+        if (size == 0)
+        {
+            continue;
+        }
+
+        region.baseline = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region.baseline == MAP_FAILED)
+        {
+            Release();
+            throw CCapMgrException("No memory for reset baseline");
+        }
+
+        memcpy(region.baseline, reinterpret_cast<void*>(range.base), size);
+        region.dirty.assign(size / m_page_size, false);
+        m_stats.tracked_pages += size / m_page_size;
+        m_regions.push_back(std::move(region));
+    }
+
+    m_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (m_pagemap_fd < 0)
+    {
+        Release();
+        throw CCapMgrException(std::string("Cannot open /proc/self/pagemap: ") + strerror(errno));
+    }
+
+    if (StartUffd())
+    {
+        m_mode = Mode::kUffdWriteProtect;
+    }
+    else if (allow_soft_dirty)
+    {
+        std::lock_guard<std::mutex> lock(s_soft_dirty_mutex);
+        if (ProbeSoftDirty())
+        {
+            CollectAllSoftDirty();
+            ClearSoftDirty();
+            s_soft_dirty_trackers.insert(this);
+        }
+        else
+        {
+            m_mode = Mode::kCompareAll;
+        }
+    }
+    else
+    {
+        m_mode = Mode::kCompareAll;
+    }
+
+    const char* method = "userfaultfd write-protect";
+    if (m_mode == Mode::kSoftDirty)
+    {
+        method = "soft-dirty bits";
+    }
+    else if (m_mode == Mode::kCompareAll)
+    {
+        method = allow_soft_dirty ? "comparison with the baseline, as the kernel tracks no written pages" :
+            "comparison with the baseline, as userfaultfd write-protect is not available";
+    }
+    L_(DEBUG) << "Tracking " << m_stats.tracked_pages << " pages for reset using " << method;
+}
+
+CDirtyPageTracker::~CDirtyPageTracker()
+{
+    if (m_mode == Mode::kSoftDirty)
+    {
+        std::lock_guard<std::mutex> lock(s_soft_dirty_mutex);
+        s_soft_dirty_trackers.erase(this);
+    }
+    Release();
+}
+
+void CDirtyPageTracker::Release()
+{
+    if (m_uffd >= 0)
+    {
+        close(m_uffd);      // Also unregisters the ranges
+        m_uffd = -1;
+    }
+
+    if (m_pagemap_fd >= 0)
+    {
+        close(m_pagemap_fd);
+        m_pagemap_fd = -1;
+    }
+
+    for (auto& region : m_regions)
+    {
+        if (region.baseline)
+        {
+            munmap(region.baseline, region.range.Size());
+            region.baseline = nullptr;
+        }
+    }
+}
+
+bool CDirtyPageTracker::StartUffd()
+{
+#if CAPMGR_HAVE_PAGEMAP_SCAN
+    int uffd = static_cast<int>(syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY));
+    if (uffd < 0)
+    {
+        return false;
+    }
+
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED;
+    if (ioctl(uffd, UFFDIO_API, &api) != 0)
+    {
+        close(uffd);
+        return false;
+    }
+
+    for (const auto& region : m_regions)
+    {
+        struct uffdio_register reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.range.start = static_cast<decltype(reg.range.start)>(region.range.base);
+        reg.range.len = region.range.Size();
+        reg.mode = UFFDIO_REGISTER_MODE_WP;
+        if (ioctl(uffd, UFFDIO_REGISTER, &reg) != 0)
+        {
+            close(uffd);
+            return false;
+        }
+    }
+
+    m_uffd = uffd;
+    for (const auto& region : m_regions)
+    {
+        WriteProtect(region.range.base, region.range.Size());
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CDirtyPageTracker::WriteProtect(uintptr_t start, size_t size) const
+{
+#if CAPMGR_HAVE_PAGEMAP_SCAN
+    struct uffdio_writeprotect wp;
+    memset(&wp, 0, sizeof(wp));
+    wp.range.start = static_cast<decltype(wp.range.start)>(start);
+    wp.range.len = size;
+    wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+    if (ioctl(m_uffd, UFFDIO_WRITEPROTECT, &wp) != 0)
+    {
+        throw CCapMgrException(std::string("Cannot write-protect for reset tracking: ") + strerror(errno));
+    }
+#else
+    (void)start;
+    (void)size;
+#endif
+}
+
+void CDirtyPageTracker::CollectSoftDirty()
+{
+    std::vector<uint64_t> entries;
+
+    for (auto& region : m_regions)
+    {
+        size_t num_pages = region.dirty.size();
+        entries.resize(num_pages);
+
+        off_t offset = (cheri_address_get(region.range.base) / m_page_size) * sizeof(uint64_t);
+        size_t bytes = num_pages * sizeof(uint64_t);
+        if (pread(m_pagemap_fd, entries.data(), bytes, offset) != static_cast<ssize_t>(bytes))
+        {
+            throw CCapMgrException(std::string("Cannot read /proc/self/pagemap: ") + strerror(errno));
+        }
+
+        for (size_t i = 0; i < num_pages; i++)
+        {
+            if (entries[i] & kPagemapSoftDirty)
+            {
+                region.dirty[i] = true;
+            }
+        }
+    }
+}
+
+void CDirtyPageTracker::CollectAllSoftDirty()
+{
+    for (auto tracker : s_soft_dirty_trackers)
+    {
+        tracker->CollectSoftDirty();
+    }
+}
+
+void CDirtyPageTracker::ClearSoftDirty()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, "4", 1) != 1)
+    {
+        int err = errno;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        throw CCapMgrException(std::string("Cannot clear soft-dirty bits: ") + strerror(err));
+    }
+    close(fd);
+}
+
+bool CDirtyPageTracker::ProbeSoftDirty()
+{
+    // Known after the first probe
+    static int s_works = -1;
+    if (s_works >= 0)
+    {
+        return s_works != 0;
+    }
+
+    void* page = mmap(nullptr, m_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+    {
+        throw CCapMgrException("No memory to probe for soft-dirty bits");
+    }
+
+    // Written, cleared, then written again, so only a kernel which tracks the bits has it set
+    *static_cast<volatile uint8_t*>(page) = 1;
+    CollectAllSoftDirty();
+    ClearSoftDirty();
+    *static_cast<volatile uint8_t*>(page) = 2;
+
+    uint64_t entry = 0;
+    off_t offset = (cheri_address_get(page) / m_page_size) * sizeof(uint64_t);
+    bool works = pread(m_pagemap_fd, &entry, sizeof(entry), offset) == static_cast<ssize_t>(sizeof(entry)) &&
+        (entry & kPagemapSoftDirty);
+    munmap(page, m_page_size);
+
+    if (!works)
+    {
+        L_(WARNING) << "The kernel does not set soft-dirty bits, so compartment resets compare every page";
+    }
+    s_works = works ? 1 : 0;
+    return works;
+}
+
+bool CDirtyPageTracker::PageDiffers(const Region& region, size_t page) const
+{
+    size_t offset = page * m_page_size;
+    auto current = reinterpret_cast<const uint8_t*>(region.range.base) + offset;
+    auto baseline = static_cast<const uint8_t*>(region.baseline) + offset;
+    if (memcmp(current, baseline, m_page_size) != 0)
+    {
+        return true;
+    }
+
+#if !CAPMGR_EMULATED_CAPS
+    // The same bytes can have lost or gained capability tags, which memcmp() does not see
+    auto current_caps = reinterpret_cast<void* const*>(current);
+    auto baseline_caps = reinterpret_cast<void* const*>(baseline);
+    for (size_t i = 0; i < m_page_size / sizeof(void*); i++)
+    {
+        if (cheri_tag_get(current_caps[i]) != cheri_tag_get(baseline_caps[i]))
+        {
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+void CDirtyPageTracker::RestoreRun(const Region& region, size_t first_page, size_t num_pages)
+{
+    size_t offset = first_page * m_page_size;
+    memcpy(reinterpret_cast<uint8_t*>(region.range.base) + offset,
+        static_cast<const uint8_t*>(region.baseline) + offset, num_pages * m_page_size);
+
+    m_stats.dirty_pages += num_pages;
+    m_stats.dirty_runs++;
+}
+
+const CDirtyPageTracker::Stats& CDirtyPageTracker::Reset()
+{
+    m_stats.dirty_pages = 0;
+    m_stats.dirty_runs = 0;
+
+#if CAPMGR_HAVE_PAGEMAP_SCAN
+    if (m_mode == Mode::kUffdWriteProtect)
+    {
+        // Only the written runs are returned, so this follows the pages touched
+        struct page_region runs[64];
+
+        for (const auto& region : m_regions)
+        {
+            struct pm_scan_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            arg.size = sizeof(arg);
+            arg.flags = PM_SCAN_CHECK_WPASYNC;
+            arg.start = static_cast<decltype(arg.start)>(region.range.base);
+            arg.end = static_cast<decltype(arg.end)>(region.range.top);
+            arg.vec = static_cast<decltype(arg.vec)>(reinterpret_cast<uintptr_t>(runs));
+            arg.vec_len = sizeof(runs) / sizeof(runs[0]);
+            arg.category_mask = PAGE_IS_WRITTEN;
+            arg.return_mask = PAGE_IS_WRITTEN;
+
+            while (true)
+            {
+                int num_runs = ioctl(m_pagemap_fd, PAGEMAP_SCAN, &arg);
+                if (num_runs < 0)
+                {
+                    throw CCapMgrException(std::string("PAGEMAP_SCAN failed: ") + strerror(errno));
+                }
+
+                for (int i = 0; i < num_runs; i++)
+                {
+                    size_t first_page = (runs[i].start - cheri_address_get(region.range.base)) / m_page_size;
+                    size_t num_pages = (runs[i].end - runs[i].start) / m_page_size;
+
+                    // Restoring writes the pages, so protect them again afterwards
+                    RestoreRun(region, first_page, num_pages);
+                    WriteProtect(region.range.base + first_page * m_page_size, num_pages * m_page_size);
+                }
+
+                if (arg.walk_end >= arg.end)
+                {
+                    break;
+                }
+                arg.start = arg.walk_end;
+            }
+        }
+        return m_stats;
+    }
+#endif
+
+    if (m_mode == Mode::kCompareAll)
+    {
+        // Nothing recorded the written pages, so every page is compared with the baseline
+        for (const auto& region : m_regions)
+        {
+            size_t num_pages = region.dirty.size();
+            size_t page = 0;
+            while (page < num_pages)
+            {
+                if (!PageDiffers(region, page))
+                {
+                    page++;
+                    continue;
+                }
+
+                size_t first_page = page;
+                while (page < num_pages && PageDiffers(region, page))
+                {
+                    page++;
+                }
+                RestoreRun(region, first_page, page - first_page);
+            }
+        }
+        return m_stats;
+    }
+
+    std::lock_guard<std::mutex> lock(s_soft_dirty_mutex);
+    CollectAllSoftDirty();
+
+    for (auto& region : m_regions)
+    {
+        size_t num_pages = region.dirty.size();
+        size_t page = 0;
+        while (page < num_pages)
+        {
+            if (!region.dirty[page])
+            {
+                page++;
+                continue;
+            }
+
+            size_t first_page = page;
+            while (page < num_pages && region.dirty[page])
+            {
+                region.dirty[page++] = false;
+            }
+            RestoreRun(region, first_page, page - first_page);
+        }
+    }
+
+    // The restore itself dirtied the pages, which the clear forgets (the other trackers already collected theirs)
+    ClearSoftDirty();
+    return m_stats;
+}
@@ -0,0 +1,95 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CDirtyPageTracker: Restores the pages of memory ranges written since a baseline was taken
+
+#ifndef _CDIRTY_PAGE_TRACKER_H__
+#define _CDIRTY_PAGE_TRACKER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "Range.h"
+
+// CDirtyPageTracker: Takes a baseline copy of page aligned ranges, then Reset() copies back just the pages which
+// have been written since, so the cost follows the pages a request touched rather than the size of the ranges.
+// The baseline is private anonymous memory, so capability tags are kept.
+// Written pages are found with userfaultfd asynchronous write-protect and PAGEMAP_SCAN where the kernel has them,
+// which is per range.  Otherwise Reset() compares every page with the baseline, which costs the size of the ranges.
+// The soft-dirty bits in /proc/self/pagemap can be used instead if allowed, but they are only cleared for the whole
+// process: each Reset() write-protects every writable page of the process, and the faults on them afterwards cost
+// the size of the process, not of the ranges.  Every tracker's bits are collected before a clear, but pages written
+// by another thread between the collection and the clear can be missed, so do not reset while other tracked memory
+// is being written.  Some kernels (e.g. arm64) accept the clear but never set soft-dirty bits, which is probed for.
+// The memory must not be in use (e.g. the compartment running) during Reset().
+// Throws CCapMgrException on failure.
+class CDirtyPageTracker
+{
+public:
+    enum class Mode
+    {
+        kUffdWriteProtect,
+        kSoftDirty,
+        kCompareAll
+    };
+
+    struct Stats
+    {
+        size_t tracked_pages = 0;
+        size_t dirty_pages = 0;         // Restored by the last Reset()
+        size_t dirty_runs = 0;          // Runs of neighbouring dirty pages, each a copy
+    };
+
+private:
+    struct Region
+    {
+        Range range;
+        void* baseline = nullptr;           // Copy of the range
+        std::vector<bool> dirty;            // Soft-dirty bits collected before a clear
+    };
+
+    std::vector<Region> m_regions;
+    size_t m_page_size;
+    Mode m_mode;
+    int m_uffd = -1;
+    int m_pagemap_fd = -1;
+    Stats m_stats;
+
+    // Soft-dirty bits are for the whole process, so all the trackers must collect theirs before a clear
+    static std::mutex s_soft_dirty_mutex;
+    static std::set<CDirtyPageTracker*> s_soft_dirty_trackers;
+
+    bool StartUffd();
+    void WriteProtect(uintptr_t start, size_t size) const;
+
+    // Add the written pages to the regions' dirty bits (soft-dirty mode).
+    // Every tracker must collect its bits before they are cleared.  Call with s_soft_dirty_mutex held.
+    void CollectSoftDirty();
+    static void CollectAllSoftDirty();
+    static void ClearSoftDirty();
+    // Does the kernel set soft-dirty bits?  Clears them, so call with s_soft_dirty_mutex held.
+    bool ProbeSoftDirty();
+
+    void Release();
+
+    void RestoreRun(const Region& region, size_t first_page, size_t num_pages);
+    bool PageDiffers(const Region& region, size_t page) const;
+
+public:
+    // Ranges must be page aligned, and writable through the capability of their base.
+    // allow_soft_dirty uses the soft-dirty bits, if the kernel sets them, when userfaultfd cannot be used.
+    explicit CDirtyPageTracker(const std::vector<Range>& ranges, bool allow_soft_dirty = false);
+    ~CDirtyPageTracker();
+
+    CDirtyPageTracker(const CDirtyPageTracker&) = delete;
+    CDirtyPageTracker& operator=(const CDirtyPageTracker&) = delete;
+
+    // Restore the pages written since the baseline (or last reset) and track again
+    const Stats& Reset();
+
+    Mode GetMode() const { return m_mode; }
+    const Stats& GetStats() const { return m_stats; }
+};
+
+#endif /* _CDIRTY_PAGE_TRACKER_H__ */
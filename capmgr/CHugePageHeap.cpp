@@ -0,0 +1,106 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CHugePageHeap
+
+#include <cheriintrin.h>
+#include <cstring>
+#include <sys/mman.h>
+
+#include "CHugePageHeap.h"
+#include "CHugePages.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+CHugePageHeap::CHugePageHeap() : m_chunk_size(CHugePages::GetHugePageSize())
+{
+    m_classes.resize(ClassIndex(kMaxBlockSize) + 1);
+}
+
+CHugePageHeap& CHugePageHeap::GetDefault()
+{
+    static CHugePageHeap heap;
+    return heap;
+}
+
+size_t CHugePageHeap::ClassIndex(size_t size)
+{
+    size_t index = 0;
+    for (size_t block_size = kMinBlockSize; block_size < size; block_size <<= 1)
+    {
+        index++;
+    }
+    return index;
+}
+
+void* CHugePageHeap::Allocate(size_t size)
+{
+    if (size > kMaxBlockSize)
+    {
+        return nullptr;
+    }
+
+    size_t index = ClassIndex(size);
+    size_t block_size = kMinBlockSize << index;
+    void* block = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& size_class = m_classes[index];
+
+        if (!size_class.free.empty())
+        {
+            block = size_class.free.back();
+            size_class.free.pop_back();
+        }
+        else
+        {
+            if (size_class.next == size_class.end)
+            {
+                void* chunk = CHugePages::MapAligned(0, m_chunk_size);
+                if (chunk == MAP_FAILED)
+                {
+                    L_(ERROR) << "No memory for huge page heap chunk";
+                    return nullptr;
+                }
+
+                size_class.next = static_cast<uint8_t*>(chunk);
+                size_class.end = size_class.next + m_chunk_size;
+                m_chunks[cheri_address_get(chunk)] = Chunk{ chunk, index };
+            }
+
+            block = size_class.next;
+            size_class.next += block_size;
+        }
+    }
+
+    // Freed blocks may hold old data, and new ones are zero anyway
+    block = cheri_bounds_set_exact(block, block_size);
+    memset(block, 0, block_size);
+    return block;
+}
+
+bool CHugePageHeap::Owns(const void* ptr)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t addr = cheri_address_get(ptr);
+    auto itr = m_chunks.upper_bound(addr);
+    return itr != m_chunks.begin() && addr < (--itr)->first + m_chunk_size;
+}
+
+size_t CHugePageHeap::Free(void* ptr)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t addr = cheri_address_get(ptr);
+
+    auto itr = m_chunks.upper_bound(addr);
+    if (itr == m_chunks.begin() || addr >= (--itr)->first + m_chunk_size)
+    {
+        return 0;
+    }
+
+    // The block's class is the chunk's, and its start is aligned to the block size
+    const auto& chunk = itr->second;
+    size_t block_size = kMinBlockSize << chunk.class_index;
+    m_classes[chunk.class_index].free.push_back(cheri_address_set(chunk.cap, cheri_align_down(addr, block_size)));
+    return block_size;
+}
@@ -0,0 +1,68 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CHugePageHeap: Compartment heap allocator backed by huge pages
+
+#ifndef _CHUGE_PAGE_HEAP_H__
+#define _CHUGE_PAGE_HEAP_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// CHugePageHeap: Allocates compartment heap memory from huge page chunks, so a compartment's heap data is spread
+// over few TLB entries.  Allocations up to kMaxBlockSize are rounded up to a power of two size class, and each
+// chunk holds blocks of one class, so a block's class is found from its chunk and freed blocks are reused by the
+// next allocation of the class.  Blocks are naturally aligned, so their capabilities are bounded to the block
+// exactly.  Larger allocations return nullptr, for the caller to allocate elsewhere.
+// Thread safe.  Chunks are never returned to the system.
+class CHugePageHeap
+{
+public:
+    static constexpr size_t kMinBlockSize = 16;
+    static constexpr size_t kMaxBlockSize = 64 * 1024;
+
+private:
+    struct SizeClass
+    {
+        std::vector<void*> free;        // Freed blocks
+        uint8_t* next = nullptr;        // Next unused block in the newest chunk, and the end of it
+        uint8_t* end = nullptr;
+    };
+
+    struct Chunk
+    {
+        void* cap;                      // Blocks are derived from this, not from the pointers freed
+        size_t class_index;
+    };
+
+    std::mutex m_mutex;
+    size_t m_chunk_size;
+    std::vector<SizeClass> m_classes;
+    std::map<uint64_t, Chunk> m_chunks;     // By chunk address
+
+    static size_t ClassIndex(size_t size);
+
+public:
+    CHugePageHeap();
+
+    CHugePageHeap(const CHugePageHeap&) = delete;
+    CHugePageHeap& operator=(const CHugePageHeap&) = delete;
+
+    // Heap shared by all compartments
+    static CHugePageHeap& GetDefault();
+
+    // Size of the block Allocate() returns for size bytes
+    static size_t BlockSize(size_t size) { return kMinBlockSize << ClassIndex(size); }
+
+    // Zeroed block for size bytes, bounded to the block, or nullptr if too big or out of memory
+    void* Allocate(size_t size);
+
+    // Free a block, returning its size, or 0 if it is not from this heap
+    size_t Free(void* ptr);
+
+    // Is the pointer to a block from this heap?
+    bool Owns(const void* ptr);
+};
+
+#endif /* _CHUGE_PAGE_HEAP_H__ */
@@ -0,0 +1,186 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CHugePages
+
+#include <cheriintrin.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "CHugePages.h"
+#include "CCapMgrException.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+namespace
+{
+    constexpr size_t kDefaultHugePageSize = 2 * 1024 * 1024;
+
+    std::mutex s_stats_mutex;
+    CHugePages::Stats s_stats;
+}
+
+CHugePages::Mode CHugePages::s_mode = CHugePages::Mode::kOff;
+
+size_t CHugePages::GetHugePageSize()
+{
+    static size_t huge_page_size = []()
+    {
+        size_t size = 0;
+        std::ifstream pmd_size("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+        if (!(pmd_size >> size) || size == 0)
+        {
+            // Or the explicit huge page size, given in kB
+            std::ifstream meminfo("/proc/meminfo");
+            std::string field;
+            while (meminfo >> field)
+            {
+                if (field == "Hugepagesize:")
+                {
+                    meminfo >> size;
+                    size *= 1024;
+                    break;
+                }
+            }
+        }
+        return size ? size : kDefaultHugePageSize;
+    }();
+    return huge_page_size;
+}
+
+void* CHugePages::MapAligned(size_t lead, size_t size)
+{
+    size_t page_size = getpagesize();
+    size_t huge_size = GetHugePageSize();
+    lead = cheri_align_up(lead, page_size);
+    size = cheri_align_up(size, huge_size);
+
+    // Reserve enough to align, then trim either side
+    size_t reserve_size = lead + size + huge_size;
+    auto reserve = static_cast<uint8_t*>(mmap(nullptr, reserve_size, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    if (reserve == MAP_FAILED)
+    {
+        return MAP_FAILED;
+    }
+
+    uint8_t* aligned = cheri_align_up(reserve + lead, huge_size);
+    uint8_t* start = aligned - lead;
+    if (start > reserve)
+    {
+        munmap(reserve, start - reserve);
+    }
+    if (aligned + size < reserve + reserve_size)
+    {
+        munmap(aligned + size, (reserve + reserve_size) - (aligned + size));
+    }
+
+    void* mapped = MAP_FAILED;
+    if (s_mode == Mode::kExplicit)
+    {
+        mapped = mmap(aligned, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+            -1, 0);
+        if (mapped == MAP_FAILED)
+        {
+            std::lock_guard<std::mutex> lock(s_stats_mutex);
+            s_stats.explicit_fallbacks++;
+        }
+    }
+
+    if (mapped == MAP_FAILED)
+    {
+        // A failed MAP_FIXED may have unmapped the range, so map it again rather than mprotect()
+        mapped = mmap(aligned, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+            -1, 0);
+        if (mapped == MAP_FAILED)
+        {
+            munmap(start, lead + size);
+            return MAP_FAILED;
+        }
+        if (s_mode != Mode::kOff)
+        {
+            madvise(mapped, size, MADV_HUGEPAGE);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(s_stats_mutex);
+        s_stats.mapped_bytes += size;
+    }
+
+    return cheri_bounds_set(start, lead + size);
+}
+
+void CHugePages::Advise(void* addr, size_t size)
+{
+    if (s_mode == Mode::kOff)
+    {
+        return;
+    }
+
+    size_t huge_size = GetHugePageSize();
+    auto begin = cheri_align_up(static_cast<uint8_t*>(addr), huge_size);
+    auto end = cheri_align_down(static_cast<uint8_t*>(addr) + size, huge_size);
+    if (end > begin)
+    {
+        madvise(begin, end - begin, MADV_HUGEPAGE);
+    }
+}
+
+size_t CHugePages::Remap(void* addr, size_t size, int prot)
+{
+    if (s_mode == Mode::kOff)
+    {
+        return 0;
+    }
+
+    size_t huge_size = GetHugePageSize();
+    auto begin = cheri_align_up(static_cast<uint8_t*>(addr), huge_size);
+    auto end = cheri_align_down(static_cast<uint8_t*>(addr) + size, huge_size);
+    if (end <= begin)
+    {
+        return 0;
+    }
+    size_t len = end - begin;
+
+    // Build the copy on huge pages, then move it over the original in one step so the range is never unmapped
+    void* copy = MapAligned(0, len);
+    if (copy == MAP_FAILED)
+    {
+        throw CCapMgrException(std::string("No memory to remap onto huge pages: ") + strerror(errno));
+    }
+
+    memcpy(copy, begin, len);
+#ifdef MADV_COLLAPSE
+    // Collapse now rather than waiting for khugepaged
+    madvise(copy, len, MADV_COLLAPSE);
+#endif
+
+    if (mprotect(copy, len, prot) != 0 ||
+        mremap(copy, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, begin) == MAP_FAILED)
+    {
+        int err = errno;
+        munmap(copy, len);
+        throw CCapMgrException(std::string("Cannot remap onto huge pages: ") + strerror(err));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(s_stats_mutex);
+        s_stats.remapped_bytes += len;
+    }
+
+    L_(DEBUG) << "Remapped " << len << " bytes at " << cheri_address_get(begin) << " onto huge pages";
+    return len;
+}
+
+CHugePages::Stats CHugePages::GetStats()
+{
+    std::lock_guard<std::mutex> lock(s_stats_mutex);
+    return s_stats;
+}
@@ -0,0 +1,60 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CHugePages: Opt-in use of huge pages for compartment memory, to cut TLB misses
+
+#ifndef _CHUGE_PAGES_H__
+#define _CHUGE_PAGES_H__
+
+#include <cstddef>
+#include <cstdint>
+
+// CHugePages: Process-wide huge page mode, and helpers to map and remap memory onto huge pages.
+// kTransparent advises the kernel to back aligned memory with transparent huge pages (which needs THP set to
+// "madvise" or "always"), kExplicit maps from the reserved hugetlbfs pool (vm.nr_hugepages) and falls back to
+// transparent huge pages when the pool is empty.
+// The mode is used by the stack pool, the compartment heap (cheri_malloc()) and CCompartmentLibs::RemapHugePages().
+class CHugePages
+{
+public:
+    enum class Mode
+    {
+        kOff,
+        kTransparent,
+        kExplicit
+    };
+
+    struct Stats
+    {
+        size_t remapped_bytes = 0;      // Library segments moved onto huge pages
+        size_t mapped_bytes = 0;        // Memory mapped for huge pages, including the remapped segments
+        size_t explicit_fallbacks = 0;  // Explicit huge page maps which fell back to transparent huge pages
+    };
+
+private:
+    static Mode s_mode;
+
+public:
+    static void SetMode(Mode mode) { s_mode = mode; }
+    static Mode GetMode() { return s_mode; }
+    static bool IsEnabled() { return s_mode != Mode::kOff; }
+
+    // PMD huge page size, e.g. 2MiB with 4KiB pages
+    static size_t GetHugePageSize();
+
+    // Map anonymous read/write memory so that (result + lead) is huge page aligned, with lead bytes below that are
+    // left PROT_NONE (e.g. a guard).  size is rounded up to huge pages, and the memory backed by huge pages as the
+    // mode allows.  Returns MAP_FAILED on failure.
+    static void* MapAligned(size_t lead, size_t size);
+
+    // Advise transparent huge pages for the huge page aligned part of a range, if the mode is on
+    static void Advise(void* addr, size_t size);
+
+    // Move the huge page aligned part of a mapped range onto huge pages, keeping its contents (including capability
+    // tags) and giving it prot.  Nothing in the range may be running or in use while it is moved.
+    // Returns the number of bytes moved, which is 0 if no huge page fits in the range or the mode is off.
+    // Throws CCapMgrException on failure.
+    static size_t Remap(void* addr, size_t size, int prot);
+
+    static Stats GetStats();
+};
+
+#endif /* _CHUGE_PAGES_H__ */
@@ -0,0 +1,119 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CResourceAccount
+
+#include <time.h>
+
+#include "CResourceAccount.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+bool CResourceAccount::CanAllocate(size_t bytes)
+{
+    if (!m_quotas.heap_hard_bytes)
+    {
+        m_heap_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Reserved here rather than when allocated, so allocations on other threads cannot all pass the check
+    size_t heap_bytes = m_heap_bytes.load(std::memory_order_relaxed);
+    do
+    {
+        if (heap_bytes + bytes > m_quotas.heap_hard_bytes)
+        {
+            m_denied_allocs.fetch_add(1, std::memory_order_relaxed);
+            L_(DEBUG) << m_name << ": allocation of " << bytes << " bytes denied by the heap quota";
+            return false;
+        }
+    } while (!m_heap_bytes.compare_exchange_weak(heap_bytes, heap_bytes + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+void CResourceAccount::OnAllocate(size_t reserved, size_t bytes)
+{
+    // The allocator may round the size up, which is counted but was not checked against the hard quota
+    size_t heap_bytes = m_heap_bytes.fetch_add(bytes - reserved, std::memory_order_relaxed) + bytes - reserved;
+    m_heap_allocs.fetch_add(1, std::memory_order_relaxed);
+
+    size_t peak = m_heap_peak_bytes.load(std::memory_order_relaxed);
+    while (heap_bytes > peak && !m_heap_peak_bytes.compare_exchange_weak(peak, heap_bytes, std::memory_order_relaxed))
+    {
+    }
+
+    if (m_quotas.heap_soft_bytes && heap_bytes > m_quotas.heap_soft_bytes &&
+        !m_heap_soft_warned.exchange(true, std::memory_order_relaxed))
+    {
+        L_(WARNING) << m_name << ": heap of " << heap_bytes << " bytes is over the soft quota";
+    }
+}
+
+void CResourceAccount::OnAllocateFailed(size_t reserved)
+{
+    SubtractHeap(reserved);
+}
+
+void CResourceAccount::OnFree(size_t bytes)
+{
+    SubtractHeap(bytes);
+}
+
+void CResourceAccount::SubtractHeap(size_t bytes)
+{
+    // Never wraps, even if the compartment frees memory accounted elsewhere
+    size_t heap_bytes = m_heap_bytes.load(std::memory_order_relaxed);
+    while (!m_heap_bytes.compare_exchange_weak(heap_bytes, (heap_bytes > bytes) ? heap_bytes - bytes : 0,
+        std::memory_order_relaxed))
+    {
+    }
+}
+
+bool CResourceAccount::CanCall()
+{
+    if (m_quotas.cpu_hard_ns && m_cpu_ns.load(std::memory_order_relaxed) >= m_quotas.cpu_hard_ns)
+    {
+        m_denied_calls.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void CResourceAccount::OnCall(uint64_t cpu_ns)
+{
+    uint64_t total_ns = m_cpu_ns.fetch_add(cpu_ns, std::memory_order_relaxed) + cpu_ns;
+    m_calls.fetch_add(1, std::memory_order_relaxed);
+
+    if (m_quotas.cpu_soft_ns && total_ns > m_quotas.cpu_soft_ns &&
+        !m_cpu_soft_warned.exchange(true, std::memory_order_relaxed))
+    {
+        L_(WARNING) << m_name << ": CPU time of " << total_ns << "ns is over the soft quota";
+    }
+}
+
+void CResourceAccount::OnServiceCall(uint64_t cpu_ns)
+{
+    m_service_cpu_ns.fetch_add(cpu_ns, std::memory_order_relaxed);
+    m_service_calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+CResourceAccount::Usage CResourceAccount::GetUsage() const
+{
+    Usage usage;
+    usage.heap_bytes = m_heap_bytes.load(std::memory_order_relaxed);
+    usage.heap_peak_bytes = m_heap_peak_bytes.load(std::memory_order_relaxed);
+    usage.heap_allocs = m_heap_allocs.load(std::memory_order_relaxed);
+    usage.cpu_ns = m_cpu_ns.load(std::memory_order_relaxed);
+    usage.service_cpu_ns = m_service_cpu_ns.load(std::memory_order_relaxed);
+    usage.calls = m_calls.load(std::memory_order_relaxed);
+    usage.service_calls = m_service_calls.load(std::memory_order_relaxed);
+    usage.denied_allocs = m_denied_allocs.load(std::memory_order_relaxed);
+    usage.denied_calls = m_denied_calls.load(std::memory_order_relaxed);
+    return usage;
+}
+
+uint64_t CResourceAccount::ThreadCpuNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
@@ -0,0 +1,96 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CResourceAccount: Resources used by a compartment (or a tenant's compartments), with optional quotas
+
+#ifndef _CRESOURCE_ACCOUNT_H__
+#define _CRESOURCE_ACCOUNT_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// CResourceAccount: Counts the heap, CPU time, calls and service callbacks of the compartments using it, and checks
+// them against optional quotas.  A compartment has its own account unless it is given one, so one account can be
+// shared by all of a tenant's compartments.
+// Crossing a soft quota logs a warning (once); a hard quota fails allocations (cheri_malloc() returns NULL) or calls
+// (which throw).  An allocation reserves its size against the heap quota before it is made, so concurrent
+// allocations cannot together go over it (other than by the allocator rounding sizes up).  CPU time is only known
+// after a call, checked with a single atomic load, so a call can take the CPU time over its hard quota, and the next
+// call fails.
+// Counters are atomic, so the usage can be read from any thread while the compartment runs.
+class CResourceAccount
+{
+public:
+    // 0 is no quota
+    struct Quotas
+    {
+        size_t heap_soft_bytes = 0;
+        size_t heap_hard_bytes = 0;
+        uint64_t cpu_soft_ns = 0;
+        uint64_t cpu_hard_ns = 0;
+    };
+
+    struct Usage
+    {
+        size_t heap_bytes = 0;          // Currently allocated by cheri_malloc()
+        size_t heap_peak_bytes = 0;
+        uint64_t heap_allocs = 0;
+        uint64_t cpu_ns = 0;            // Thread CPU time inside compartment calls, including service callbacks
+        uint64_t service_cpu_ns = 0;    // Of which in service callbacks
+        uint64_t calls = 0;             // Compartment entries
+        uint64_t service_calls = 0;     // Service callbacks made by the compartment
+        uint64_t denied_allocs = 0;     // Failed by the heap hard quota
+        uint64_t denied_calls = 0;      // Failed by the CPU hard quota
+    };
+
+private:
+    std::string m_name;
+    Quotas m_quotas;
+
+    std::atomic<size_t> m_heap_bytes{ 0 };
+    std::atomic<size_t> m_heap_peak_bytes{ 0 };
+    std::atomic<uint64_t> m_heap_allocs{ 0 };
+    std::atomic<uint64_t> m_cpu_ns{ 0 };
+    std::atomic<uint64_t> m_service_cpu_ns{ 0 };
+    std::atomic<uint64_t> m_calls{ 0 };
+    std::atomic<uint64_t> m_service_calls{ 0 };
+    std::atomic<uint64_t> m_denied_allocs{ 0 };
+    std::atomic<uint64_t> m_denied_calls{ 0 };
+
+    std::atomic<bool> m_heap_soft_warned{ false };
+    std::atomic<bool> m_cpu_soft_warned{ false };
+
+    void SubtractHeap(size_t bytes);
+
+public:
+    explicit CResourceAccount(const std::string& name) : m_name(name) {}
+    CResourceAccount(const std::string& name, const Quotas& quotas) : m_name(name), m_quotas(quotas) {}
+
+    CResourceAccount(const CResourceAccount&) = delete;
+    CResourceAccount& operator=(const CResourceAccount&) = delete;
+
+    const std::string& GetName() const { return m_name; }
+
+    // Quotas are not synchronised with the compartment, so set them before it runs
+    void SetQuotas(const Quotas& quotas) { m_quotas = quotas; }
+    const Quotas& GetQuotas() const { return m_quotas; }
+
+    // Heap: reserve the size before allocating, then either record the size actually allocated in place of the
+    // reservation, or give the reservation back if the allocation failed.  Record the size freed too.
+    bool CanAllocate(size_t bytes);
+    void OnAllocate(size_t reserved, size_t bytes);
+    void OnAllocateFailed(size_t reserved);
+    void OnFree(size_t bytes);
+
+    // Calls: check before entering, then record the thread CPU time the call took
+    bool CanCall();
+    void OnCall(uint64_t cpu_ns);
+    void OnServiceCall(uint64_t cpu_ns);
+
+    Usage GetUsage() const;
+
+    // Thread CPU time now, for measuring calls
+    static uint64_t ThreadCpuNs();
+};
+
+#endif /* _CRESOURCE_ACCOUNT_H__ */
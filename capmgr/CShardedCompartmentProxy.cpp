@@ -0,0 +1,290 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CShardedCompartmentProxy
+
+#include <algorithm>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "CShardedCompartmentProxy.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+CShardedCompartmentProxy::Replica::Replica(ReplicaId id_, CCompartmentRegistry::CompartmentId compartment_id_,
+    CCompartment& compartment, int cpu) :
+    id(id_), compartment_id(compartment_id_), proxy(new CCompartmentApiProxy(compartment))
+{
+    m_thread = std::thread(&Replica::Run, this, cpu);
+}
+
+CShardedCompartmentProxy::Replica::~Replica()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    m_thread.join();
+}
+
+void CShardedCompartmentProxy::Replica::Post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(std::move(task));
+    }
+    m_cond.notify_one();
+}
+
+void CShardedCompartmentProxy::Replica::Run(int cpu)
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+        if (err)
+        {
+            L_(WARNING) << "Cannot pin the worker of replica " << id << " to core " << cpu << ": " << strerror(err);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_cond.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty())
+        {
+            return;     // Stopped, with nothing left to run
+        }
+
+        auto task = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+CShardedCompartmentProxy::CShardedCompartmentProxy(CCompartmentRegistry& registry, const Config& config,
+    uint32_t num_replicas) :
+    m_config(config), m_registry(registry), m_shard_owner(config.num_shards, nullptr)
+{
+    if (!num_replicas || num_replicas > config.num_shards)
+    {
+        throw CCompartmentException("Need from 1 to " + std::to_string(config.num_shards) + " replicas");
+    }
+
+    try
+    {
+        for (uint32_t r = 0; r < num_replicas; r++)
+        {
+            AddReplica();
+        }
+    }
+    catch (...)
+    {
+        for (auto& replica : m_replicas)
+        {
+            auto compartment_id = replica.second->compartment_id;
+            replica.second.reset();
+            m_registry.Unregister(compartment_id);
+        }
+        throw;
+    }
+}
+
+CShardedCompartmentProxy::~CShardedCompartmentProxy()
+{
+    for (auto& replica : m_replicas)
+    {
+        auto compartment_id = replica.second->compartment_id;
+        replica.second.reset();
+        m_registry.Unregister(compartment_id);
+    }
+}
+
+int CShardedCompartmentProxy::NextCpu()
+{
+    if (!m_config.pin_threads)
+    {
+        return -1;
+    }
+
+    if (m_config.cpus.empty())
+    {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return static_cast<int>(m_next_cpu++ % static_cast<size_t>(std::max(1L, num_cpus)));
+    }
+    return m_config.cpus[m_next_cpu++ % m_config.cpus.size()];
+}
+
+void CShardedCompartmentProxy::MoveShard(uint32_t shard, Replica* to)
+{
+    Replica* from = m_shard_owner[shard];
+    if (from)
+    {
+        from->num_shards--;
+    }
+    to->num_shards++;
+    m_shard_owner[shard] = to;
+
+    if (m_config.on_move)
+    {
+        m_config.on_move(shard, from ? &from->id : nullptr, to->id);
+    }
+}
+
+CShardedCompartmentProxy::Replica& CShardedCompartmentProxy::Route(uint64_t key_hash) const
+{
+    return *m_shard_owner[key_hash % m_shard_owner.size()];
+}
+
+CShardedCompartmentProxy::ReplicaId CShardedCompartmentProxy::AddReplica()
+{
+    // Creating the compartment takes the time, so is done before taking the lock
+    auto compartment_id = m_registry.Register(m_config.compartment);
+
+    std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+    if (m_replicas.size() >= m_shard_owner.size())
+    {
+        m_registry.Unregister(compartment_id);
+        throw CCompartmentException("No shards left for another replica");
+    }
+
+    Replica* replica;
+    try
+    {
+        replica = new Replica(m_next_id, compartment_id, m_registry.Get(compartment_id), NextCpu());
+    }
+    catch (...)
+    {
+        m_registry.Unregister(compartment_id);
+        throw;
+    }
+    ReplicaId id = m_next_id++;
+    m_replicas[id].reset(replica);
+
+    if (m_replicas.size() == 1)
+    {
+        // The first replica owns every shard
+        for (uint32_t shard = 0; shard < m_shard_owner.size(); shard++)
+        {
+            MoveShard(shard, replica);
+        }
+    }
+    else
+    {
+        // Take shards from whichever replica has the most, until the new one has its share
+        uint32_t share = static_cast<uint32_t>(m_shard_owner.size() / m_replicas.size());
+        while (replica->num_shards < share)
+        {
+            Replica* largest = nullptr;
+            for (auto& other : m_replicas)
+            {
+                if (!largest || other.second->num_shards > largest->num_shards)
+                {
+                    largest = other.second.get();
+                }
+            }
+
+            // Its highest numbered shard, so the shards a replica owns stay mostly in runs
+            for (uint32_t shard = static_cast<uint32_t>(m_shard_owner.size()); shard-- > 0;)
+            {
+                if (m_shard_owner[shard] == largest)
+                {
+                    MoveShard(shard, replica);
+                    break;
+                }
+            }
+        }
+    }
+
+    L_(DEBUG) << "Added replica " << id << " (compartment " << static_cast<uint32_t>(compartment_id) << ") with "
+        << replica->num_shards << " shards";
+    return id;
+}
+
+bool CShardedCompartmentProxy::RemoveReplica(ReplicaId id)
+{
+    std::unique_ptr<Replica> replica;
+    {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        auto itr = m_replicas.find(id);
+        if (itr == m_replicas.end())
+        {
+            return false;
+        }
+        if (m_replicas.size() == 1)
+        {
+            throw CCompartmentException("Cannot remove the last replica");
+        }
+
+        replica = std::move(itr->second);
+        m_replicas.erase(itr);
+
+        // Each of its shards goes to whichever replica has the fewest
+        for (uint32_t shard = 0; shard < m_shard_owner.size(); shard++)
+        {
+            if (m_shard_owner[shard] == replica.get())
+            {
+                Replica* smallest = nullptr;
+                for (auto& other : m_replicas)
+                {
+                    if (!smallest || other.second->num_shards < smallest->num_shards)
+                    {
+                        smallest = other.second.get();
+                    }
+                }
+                MoveShard(shard, smallest);
+            }
+        }
+    }
+
+    // Its calls already queued run before its worker stops, then the compartment can go
+    auto compartment_id = replica->compartment_id;
+    replica.reset();
+    m_registry.Unregister(compartment_id);
+
+    L_(DEBUG) << "Removed replica " << id;
+    return true;
+}
+
+CShardedCompartmentProxy::ReplicaId CShardedCompartmentProxy::GetReplicaFor(uint64_t key_hash) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    return Route(key_hash).id;
+}
+
+CCompartmentRegistry::CompartmentId CShardedCompartmentProxy::GetCompartmentId(ReplicaId id) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    auto itr = m_replicas.find(id);
+    if (itr == m_replicas.end())
+    {
+        throw CCompartmentException("No replica " + std::to_string(id));
+    }
+    return itr->second->compartment_id;
+}
+
+std::vector<CShardedCompartmentProxy::ReplicaId> CShardedCompartmentProxy::GetReplicaIds() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    std::vector<ReplicaId> ids;
+    for (const auto& replica : m_replicas)
+    {
+        ids.push_back(replica.first);
+    }
+    return ids;
+}
+
+uint32_t CShardedCompartmentProxy::GetNumShards(ReplicaId id) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    auto itr = m_replicas.find(id);
+    return (itr == m_replicas.end()) ? 0 : itr->second->num_shards;
+}
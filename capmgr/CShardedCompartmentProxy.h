@@ -0,0 +1,158 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CShardedCompartmentProxy: Replicas of a compartment, with calls routed to a replica by key
+
+#ifndef _CSHARDED_COMPARTMENT_PROXY_H__
+#define _CSHARDED_COMPARTMENT_PROXY_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CCompartmentApiProxy.h"
+#include "CCompartmentRegistry.h"
+
+// CShardedCompartmentProxy: Holds replicas of a compartment, for state kept per session or per key (parsers, caches)
+// in the compartment.  A call carries a hash of its key, which picks one of a fixed number of shards, and each shard
+// is owned by one replica, so all the calls for a key go to the same replica and find its state there.
+// - Each replica is a compartment of its own in a CCompartmentRegistry, with its own copy of the library, and has
+//   a worker thread, optionally pinned to a core, which makes all the calls into it.  So a replica's state stays in
+//   one core's caches, and a replica is never called by two threads at once.
+// - AddReplica() and RemoveReplica() rebalance by moving the ownership of as few shards as they can, the ones moved
+//   being reported to the Config's on_move, e.g. to move the state of the keys in them.  A call already queued for
+//   a replica still runs on it.
+// Calls are the CCompartmentApiProxy's methods, run on the replica, so existing calls only need wrapping:
+//   auto result = sharded.Call(key_hash, [&](CCompartmentApiProxy& proxy) { return proxy.example_add_two_numbers(a, b); });
+// Throws CCompartmentException on failure, and a call rethrows what the call throws.
+class CShardedCompartmentProxy
+{
+public:
+    using ReplicaId = uint32_t;
+
+    // Given the shard moved, and the replica it moved from (if any) and to.  Called with the proxy locked, so it
+    // must not call the proxy.
+    using MoveFn = std::function<void(uint32_t shard, const ReplicaId* from, ReplicaId to)>;
+
+    struct Config
+    {
+        CCompartmentRegistry::Config compartment;   // How to create each replica's compartment
+        uint32_t num_shards = 256;                  // Fixed, and at least the most replicas there will be
+        bool pin_threads = false;                   // Pin each replica's worker to a core
+        std::vector<int> cpus;                      // Cores to pin to, in turn, or empty for all the online cores
+        MoveFn on_move;                             // Or nullptr
+    };
+
+private:
+    // A replica: its compartment, and the worker making the calls into it
+    class Replica
+    {
+        std::deque<std::function<void()>> m_queue;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        bool m_stop = false;
+        std::thread m_thread;
+
+        void Run(int cpu);
+
+    public:
+        ReplicaId id;
+        CCompartmentRegistry::CompartmentId compartment_id;
+        std::unique_ptr<CCompartmentApiProxy> proxy;
+        uint32_t num_shards = 0;
+
+        Replica(ReplicaId id_, CCompartmentRegistry::CompartmentId compartment_id_, CCompartment& compartment, int cpu);
+        ~Replica();     // Runs the calls still queued, then stops the worker
+
+        void Post(std::function<void()> task);
+    };
+
+    Config m_config;
+    CCompartmentRegistry& m_registry;
+
+    mutable std::shared_timed_mutex m_mutex;
+    std::map<ReplicaId, std::unique_ptr<Replica>> m_replicas;
+    std::vector<Replica*> m_shard_owner;            // Indexed by shard
+    ReplicaId m_next_id = 0;
+    size_t m_next_cpu = 0;
+
+    int NextCpu();
+    void MoveShard(uint32_t shard, Replica* to);
+    Replica& Route(uint64_t key_hash) const;
+
+    template <typename Fn>
+    auto Queue(Replica& replica, Fn&& fn) -> std::future<decltype(fn(std::declval<CCompartmentApiProxy&>()))>
+    {
+        using Result = decltype(fn(std::declval<CCompartmentApiProxy&>()));
+
+        CCompartmentApiProxy& proxy = *replica.proxy;
+        auto task = std::make_shared<std::packaged_task<Result()>>(
+            [&proxy, fn]() mutable { return fn(proxy); });
+        auto result = task->get_future();
+        replica.Post([task]() { (*task)(); });
+        return result;
+    }
+
+public:
+    // Create num_replicas replicas of the Config's compartment in the registry, which must outlive the proxy
+    CShardedCompartmentProxy(CCompartmentRegistry& registry, const Config& config, uint32_t num_replicas);
+    ~CShardedCompartmentProxy();
+
+    CShardedCompartmentProxy(const CShardedCompartmentProxy&) = delete;
+    CShardedCompartmentProxy& operator=(const CShardedCompartmentProxy&) = delete;
+
+    // Run fn(proxy) on the replica owning the key's shard, and wait for its result
+    template <typename Fn>
+    auto Call(uint64_t key_hash, Fn&& fn) -> decltype(fn(std::declval<CCompartmentApiProxy&>()))
+    {
+        return Submit(key_hash, std::forward<Fn>(fn)).get();
+    }
+
+    // Queue fn(proxy) on the replica owning the key's shard, e.g. to have calls for several keys in flight at once
+    template <typename Fn>
+    auto Submit(uint64_t key_hash, Fn&& fn) -> std::future<decltype(fn(std::declval<CCompartmentApiProxy&>()))>
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        return Queue(Route(key_hash), std::forward<Fn>(fn));
+    }
+
+    // Run fn(proxy) on a given replica, and wait for its result, e.g. to set up each replica
+    template <typename Fn>
+    auto CallReplica(ReplicaId id, Fn&& fn) -> decltype(fn(std::declval<CCompartmentApiProxy&>()))
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        auto itr = m_replicas.find(id);
+        if (itr == m_replicas.end())
+        {
+            throw CCompartmentException("No replica " + std::to_string(id));
+        }
+
+        auto result = Queue(*itr->second, std::forward<Fn>(fn));
+        lock.unlock();
+        return result.get();
+    }
+
+    // Add a replica, taking an even share of the shards from the others.  Returns its id.
+    ReplicaId AddReplica();
+
+    // Remove a replica once its queued calls have run, giving its shards to the others, and unregister its
+    // compartment.  The last replica cannot be removed.  Returns false if there is no such replica.
+    bool RemoveReplica(ReplicaId id);
+
+    // Which replica a key goes to, and the compartment it calls
+    ReplicaId GetReplicaFor(uint64_t key_hash) const;
+    CCompartmentRegistry::CompartmentId GetCompartmentId(ReplicaId id) const;
+
+    std::vector<ReplicaId> GetReplicaIds() const;
+
+    // Shards owned by a replica, or 0 if there is no such replica
+    uint32_t GetNumShards(ReplicaId id) const;
+};
+
+#endif /* _CSHARDED_COMPARTMENT_PROXY_H__ */
@@ -0,0 +1,64 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CSignalStack
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+
+#include "CSignalStack.h"
+#include "CCompartment.h"
+
+namespace
+{
+    // Whether this thread has been checked, and the stack made for it if it had none of its own
+    thread_local bool t_checked = false;
+    thread_local std::unique_ptr<CSignalStack> t_stack;
+}
+
+CSignalStack::CSignalStack()
+{
+    m_stack = mmap(nullptr, kStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_stack == MAP_FAILED)
+    {
+        throw CCompartmentException(std::string("Cannot map the signal stack: ") + strerror(errno));
+    }
+
+    stack_t alt_stack;
+    alt_stack.ss_sp = m_stack;
+    alt_stack.ss_size = kStackSize;
+    alt_stack.ss_flags = 0;
+    if (sigaltstack(&alt_stack, nullptr) != 0)
+    {
+        int err = errno;
+        munmap(m_stack, kStackSize);
+        throw CCompartmentException(std::string("Cannot set the signal stack: ") + strerror(err));
+    }
+}
+
+CSignalStack::~CSignalStack()
+{
+    stack_t disable;
+    memset(&disable, 0, sizeof(disable));
+    disable.ss_flags = SS_DISABLE;
+    sigaltstack(&disable, nullptr);
+    munmap(m_stack, kStackSize);
+}
+
+void CSignalStack::EnsureForThread()
+{
+    if (t_checked)
+    {
+        return;
+    }
+
+    // Keep an alternate stack the thread already has
+    stack_t current;
+    if (sigaltstack(nullptr, &current) != 0 || (current.ss_flags & SS_DISABLE))
+    {
+        t_stack.reset(new CSignalStack);
+    }
+    t_checked = true;
+}
@@ -0,0 +1,32 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CSignalStack: Per-thread alternate stack for the signals which can arrive while a compartment is running
+
+#ifndef _CSIGNAL_STACK_H__
+#define _CSIGNAL_STACK_H__
+
+#include <cstddef>
+
+// CSignalStack: A thread running in a compartment is on the compartment's stack, which the capability manager's
+// signal handlers must not use (it may even be the stack which overflowed), so handlers installed with SA_ONSTACK
+// run on an alternate signal stack instead.  EnsureForThread() gives the thread one, unless it already has one, and
+// it goes when the thread exits.
+// Throws CCompartmentException if the stack cannot be made.
+class CSignalStack
+{
+    // Room for a handler and whatever it runs before leaving with siglongjmp()
+    static constexpr size_t kStackSize = 64 * 1024;
+
+    void* m_stack;
+
+    CSignalStack();
+
+public:
+    ~CSignalStack();
+
+    CSignalStack(const CSignalStack&) = delete;
+    CSignalStack& operator=(const CSignalStack&) = delete;
+
+    static void EnsureForThread();
+};
+
+#endif /* _CSIGNAL_STACK_H__ */
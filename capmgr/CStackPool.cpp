@@ -0,0 +1,193 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CStackPool
+
+#include <cheriintrin.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "CStackPool.h"
+#include "CHugePages.h"
+#include "CCapMgrException.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+CStackPool::Stack::~Stack()
+{
+    m_pool->Release(*this);
+}
+
+Range CStackPool::Stack::GetRange() const
+{
+    return Range(reinterpret_cast<uintptr_t>(static_cast<uint8_t*>(m_map) + m_pool->m_guard_size), m_size);
+}
+
+Range CStackPool::Stack::GetMappedRange() const
+{
+    return Range(reinterpret_cast<uintptr_t>(m_map), m_pool->m_guard_size + m_size);
+}
+
+size_t CStackPool::Stack::MeasureHighWater() const
+{
+    size_t page_size = m_pool->m_page_size;
+    size_t num_pages = m_size / page_size;
+    std::vector<unsigned char> resident(num_pages);
+
+    auto base = static_cast<uint8_t*>(m_map) + m_pool->m_guard_size;
+    if (mincore(base, m_size, resident.data()) != 0)
+    {
+        L_(ERROR) << "Cannot measure stack use: " << strerror(errno);
+        return 0;
+    }
+
+    // The stack grows down, so the lowest page touched marks the most used
+    for (size_t i = 0; i < num_pages; i++)
+    {
+        if (resident[i] & 1)
+        {
+            return m_size - i * page_size;
+        }
+    }
+    return 0;
+}
+
+CStackPool::CStackPool(size_t guard_size, size_t max_free) : m_page_size(getpagesize()), m_max_free(max_free)
+{
+    m_guard_size = cheri_align_up(guard_size, m_page_size);
+}
+
+CStackPool::~CStackPool()
+{
+    for (const auto& free_list : m_free)
+    {
+        for (auto map : free_list.second)
+        {
+            munmap(map, m_guard_size + free_list.first.first);
+        }
+    }
+}
+
+CStackPool& CStackPool::GetDefault()
+{
+    static CStackPool pool;
+    return pool;
+}
+
+std::unique_ptr<CStackPool::Stack> CStackPool::Acquire(size_t size, const std::string& tag)
+{
+    bool huge_pages = CHugePages::IsEnabled();
+    size = cheri_align_up(size, huge_pages ? CHugePages::GetHugePageSize() : m_page_size);
+    void* map = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto& usage = m_usage[tag];
+        usage.stack_size = size;
+        usage.acquired++;
+
+        auto itr = m_free.find(std::make_pair(size, huge_pages));
+        if (itr != m_free.end() && !itr->second.empty())
+        {
+            map = itr->second.back();
+            itr->second.pop_back();
+            m_stats.reused++;
+            m_stats.free--;
+        }
+        m_stats.in_use++;
+    }
+
+    if (!map && huge_pages)
+    {
+        // The stack is huge page aligned above the guard
+        map = CHugePages::MapAligned(m_guard_size, size);
+        if (map == MAP_FAILED)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.in_use--;
+            throw CCapMgrException(std::string("No memory for stack: ") + strerror(errno));
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.mapped++;
+    }
+    else if (!map)
+    {
+        // Reserve the whole region inaccessible, then open up the stack above the guard.
+        // MAP_NORESERVE: only the pages the compartment touches are ever committed.
+        map = mmap(nullptr, m_guard_size + size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+            -1, 0);
+        if (map == MAP_FAILED || mprotect(static_cast<uint8_t*>(map) + m_guard_size, size, PROT_READ | PROT_WRITE) != 0)
+        {
+            int err = errno;
+            if (map != MAP_FAILED)
+            {
+                munmap(map, m_guard_size + size);
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.in_use--;
+            throw CCapMgrException(std::string("No memory for stack: ") + strerror(err));
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.mapped++;
+    }
+
+    return std::unique_ptr<Stack>(new Stack(this, map, size, huge_pages, tag));
+}
+
+void CStackPool::Release(Stack& stack)
+{
+    size_t high_water = stack.MeasureHighWater();
+
+    // Drop the touched pages, so the next user starts with zeroed memory and nothing stays committed.
+    // Explicit huge pages can only be dropped whole.
+    Range range = stack.GetRange();
+    if (high_water)
+    {
+        size_t drop_size = stack.m_huge_pages ? range.Size() : high_water;
+        madvise(reinterpret_cast<void*>(range.top - drop_size), drop_size, MADV_DONTNEED);
+    }
+
+    bool keep;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto& usage = m_usage[stack.m_tag];
+        usage.high_water = std::max(usage.high_water, high_water);
+
+        auto& free_list = m_free[std::make_pair(stack.m_size, stack.m_huge_pages)];
+        keep = free_list.size() < m_max_free;
+        if (keep)
+        {
+            free_list.push_back(stack.m_map);
+            m_stats.free++;
+        }
+        m_stats.in_use--;
+    }
+
+    if (!keep)
+    {
+        munmap(stack.m_map, m_guard_size + stack.m_size);
+    }
+
+    L_(DEBUG) << "Stack for " << (stack.m_tag.empty() ? "(untagged)" : stack.m_tag) << " returned, used "
+        << high_water << " of " << stack.m_size << " bytes";
+}
+
+std::map<std::string, CStackPool::Usage> CStackPool::GetUsage() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_usage;
+}
+
+CStackPool::Stats CStackPool::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
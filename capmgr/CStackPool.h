@@ -0,0 +1,108 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CStackPool: Pool of compartment stacks with guard regions, reused across compartments and threads
+
+#ifndef _CSTACK_POOL_H__
+#define _CSTACK_POOL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Range.h"
+
+// CStackPool: Hands out stacks of a requested size, each with an unmapped guard region below it so an overflow
+// faults rather than running into other memory.  Pages are only committed when the compartment first touches them.
+// A returned stack has its touched pages dropped, so the next user gets zeroed memory (nothing leaks between
+// compartments), and is kept for reuse by the next request of the same size, from any compartment or thread.
+// When a stack is returned its high-water mark (the lowest page touched) is recorded against the tag it was
+// acquired with, e.g. the compartment library, so stack sizes can be tuned per library.
+// With huge pages on (see CHugePages), stacks are rounded up to huge pages and backed by them.
+// Throws CCapMgrException on failure.
+class CStackPool
+{
+public:
+    static constexpr size_t kDefaultGuardSize = 64 * 1024;
+    static constexpr size_t kDefaultMaxFree = 64;
+
+    // A stack acquired from the pool, which is returned to it on destruction.  The pool must outlive it.
+    class Stack
+    {
+        friend class CStackPool;
+
+        CStackPool* m_pool;
+        void* m_map;            // Whole mapping, guard first
+        size_t m_size;          // Usable size, above the guard
+        bool m_huge_pages;
+        std::string m_tag;
+
+        Stack(CStackPool* pool, void* map, size_t size, bool huge_pages, const std::string& tag) :
+            m_pool(pool), m_map(map), m_size(size), m_huge_pages(huge_pages), m_tag(tag) {}
+
+    public:
+        ~Stack();
+
+        Stack(const Stack&) = delete;
+        Stack& operator=(const Stack&) = delete;
+
+        // Usable stack memory (a capability to it as the base), excluding the guard
+        Range GetRange() const;
+        size_t GetSize() const { return m_size; }
+
+        // The whole mapping, including the guard, e.g. to tell if a stack pointer is on the stack after an overflow
+        Range GetMappedRange() const;
+
+        // Bytes used so far, from the lowest page touched to the top
+        size_t MeasureHighWater() const;
+    };
+
+    // Stack use recorded for a tag
+    struct Usage
+    {
+        size_t stack_size = 0;      // Size of the last stack for the tag
+        size_t high_water = 0;      // Most ever used
+        size_t acquired = 0;        // Number of stacks acquired
+    };
+
+    struct Stats
+    {
+        size_t mapped = 0;          // Stacks mmap()ed
+        size_t reused = 0;          // Stacks handed out again from the free lists
+        size_t in_use = 0;
+        size_t free = 0;
+    };
+
+private:
+    size_t m_page_size;
+    size_t m_guard_size;
+    size_t m_max_free;              // Free stacks kept per size, beyond which returned stacks are unmapped
+
+    mutable std::mutex m_mutex;
+    std::map<std::pair<size_t, bool>, std::vector<void*>> m_free;    // Free mappings by usable size and huge pages
+    std::map<std::string, Usage> m_usage;
+    Stats m_stats;
+
+    void Release(Stack& stack);
+
+public:
+    explicit CStackPool(size_t guard_size = kDefaultGuardSize, size_t max_free = kDefaultMaxFree);
+    ~CStackPool();
+
+    CStackPool(const CStackPool&) = delete;
+    CStackPool& operator=(const CStackPool&) = delete;
+
+    // Pool shared by all compartments
+    static CStackPool& GetDefault();
+
+    // Get a stack of at least size bytes (rounded up to pages), reusing a free one if there is one
+    std::unique_ptr<Stack> Acquire(size_t size, const std::string& tag = std::string());
+
+    std::map<std::string, Usage> GetUsage() const;
+    Stats GetStats() const;
+};
+
+#endif /* _CSTACK_POOL_H__ */
@@ -1,13 +1,50 @@
 // Copyright (C) 2024 Verifoxx Limited
 // Implements CCompartmentLibs
 #include <sstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <cerrno>
+#include <unistd.h>
+#include <thread>
 
 #include "CCompartmentLibs.h"
+#include "capmgr_audit_hook.h"
 #include "CCapMgrException.h"
+#include "CFixupWorkerPool.h"
 
 #include "CCapMgrLogger.h"
+#include "CTracer.h"
 using namespace CapMgr;
 
+// Set by the rtld-audit module, if loaded.  Exported from the executable (see CMakeLists.txt) so the module finds it.
+__attribute__((visibility("default"))) CapMgrAuditPatchedFn capmgr_audit_patched = nullptr;
+
+#if CAPMGR_EMULATED_CAPS
+
+#include <cstring>
+#include <link.h>
+#include <sys/auxv.h>
+
+namespace
+{
+    // The host's glibc has its own internal link map layout, and dl_iterate_phdr() only visits the caller's
+    // namespace, so find an object's program headers from its ELF header, which is mapped by the first segment
+    bool FindProgramHeaders(Elf64_Addr laddr, const ElfW(Phdr)*& phdr, ElfW(Half)& phnum)
+    {
+        auto ehdr = reinterpret_cast<const ElfW(Ehdr)*>(laddr);
+        if (!ehdr || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_phentsize != sizeof(ElfW(Phdr)))
+        {
+            return false;
+        }
+
+        phdr = reinterpret_cast<const ElfW(Phdr)*>(laddr + ehdr->e_phoff);
+        phnum = ehdr->e_phnum;
+        return true;
+    }
+}
+
+#else
+
 // DT_THISPROCNUM needed by link-internal.h
 #ifndef DT_THISPROCNUM
 #define DT_THISPROCNUM DT_AARCH64_NUM
@@ -15,8 +52,11 @@ using namespace CapMgr;
 
 #include "link_map_internal/link-internal.h"
 
+#endif
+
 CCompartmentLibs::CCompartmentLibs(const std::string& so_name, const Capability &base_cap,
-    const Capability &fixup_cap, bool load_new_linkmap, bool include_loader) : m_include_loader{include_loader}
+    const Capability &fixup_cap, bool load_new_linkmap, bool include_loader) : m_include_loader{include_loader},
+    m_base_cap{ base_cap }, m_fixup_cap{ fixup_cap }
 {
     std::ostringstream strstr;
 
@@ -50,9 +90,252 @@ CCompartmentLibs::CCompartmentLibs(const std::string& so_name, const Capability
         throw CCapMgrException("Did not load any shared libs from linkmap!");
     }
 
+    BuildScope();
     L_(DEBUG) << "Loaded " << numloaded << " shared objects";
 }
 
+CCompartmentLibs::CCompartmentLibs(const std::string& so_name, const Capability& base_cap,
+    const Capability& fixup_cap, std::unique_ptr<CCompartmentLoader> loader, const CCompartmentSnapshot* snapshot) :
+    m_loader{ std::move(loader) }, m_include_loader{ false }, m_base_cap{ base_cap }, m_fixup_cap{ fixup_cap }
+{
+    if (snapshot)
+    {
+        m_loader->LoadSnapshot(*snapshot);
+    }
+    else
+    {
+        m_loader->Load(so_name);
+    }
+
+    // Shared objects for each mapped object, so the tables can still be dumped and checked
+    for (size_t i = 0; i < m_loader->GetNumObjects(); i++)
+    {
+        const auto& obj = m_loader->GetObject(i);
+
+        Capability cap{ base_cap };
+        cap.SetBoundsAndAddress(obj.rw_cap);
+
+        auto& so = m_so_map[obj.path];
+        so = CSharedObject{ obj.path, cap };
+        so.Load(obj.phdrs.data(), static_cast<Elf64_Half>(obj.phdrs.size()), fixup_cap);
+        m_search_order.push_back(&so);
+    }
+
+    m_so_full_name = m_loader->GetObject(0).path;
+    BuildScope();
+    L_(DEBUG) << "Natively loaded " << m_so_map.size() << " shared objects";
+}
+
+CCompartmentLibs* CCompartmentLibs::CreateInstance(const Capability& base_cap, const Capability& fixup_cap,
+    const CCompartmentSnapshot* snapshot) const
+{
+    if (!m_loader)
+    {
+        throw CCapMgrException("Instances of " + m_so_full_name + " need the native compartment loader");
+    }
+    return new CCompartmentLibs{ m_so_full_name, base_cap, fixup_cap, m_loader->NewInstance(), snapshot };
+}
+
+std::shared_ptr<CCompartmentSnapshot> CCompartmentLibs::TakeSnapshot(bool allow_external_caps) const
+{
+    if (!m_loader)
+    {
+        throw CCapMgrException("Snapshots of " + m_so_full_name + " need the native compartment loader");
+    }
+    return std::make_shared<CCompartmentSnapshot>(*m_loader, allow_external_caps);
+}
+
+void CCompartmentLibs::BuildScope()
+{
+    // Shared objects by the names a DT_NEEDED entry may use: the soname, or the file name
+    std::map<std::string, const CSharedObject*> by_name;
+    for (auto so : m_search_order)
+    {
+        const auto& path = so->GetName();
+        by_name[path.substr(path.rfind('/') + 1)] = so;
+        if (so->GetDynamicSection().HasEntry(DT_SONAME))
+        {
+            by_name[so->GetDynamicSection().GetSoName()] = so;
+        }
+    }
+
+    // Breadth first from the requested so, each object once, as the loader builds the handle's search list.
+    // Lookups defer to dlsym() at a dependency which was not parsed, so the scope ends there.
+    m_scope.clear();
+    if (!m_so_map.count(m_so_full_name))
+    {
+        m_scope.push_back(nullptr);
+        return;
+    }
+
+    m_scope.push_back(&GetPrimarySharedObject());
+    for (size_t i = 0; i < m_scope.size(); i++)
+    {
+        for (const auto& needed : m_scope[i]->GetDynamicSection().GetNeeded())
+        {
+            auto itr = by_name.find(needed);
+            if (itr == by_name.end())
+            {
+                m_scope.push_back(nullptr);
+                return;
+            }
+
+            if (std::find(m_scope.begin(), m_scope.end(), itr->second) == m_scope.end())
+            {
+                m_scope.push_back(itr->second);
+            }
+        }
+    }
+}
+
+void* CCompartmentLibs::LookupSymbol(const char* name) const
+{
+    CDynamicSection::SymbolHash hash{ name };
+    for (size_t i = 0; i < m_scope.size(); i++)
+    {
+        auto so = m_scope[i];
+        void* symb = nullptr;
+        auto found = so ? so->FindSymbol(name, hash, symb) : CSharedObject::SymbolLookup::kNotResolvable;
+        if (found == CSharedObject::SymbolLookup::kFound)
+        {
+            return symb;
+        }
+
+        // The definition (or an object which may have it) needs the loader, and a later one must not be used
+        if (found == CSharedObject::SymbolLookup::kNotResolvable)
+        {
+            return FindSymbolWithLoader(name);
+        }
+    }
+    return nullptr;
+}
+
+void* CCompartmentLibs::FindSymbolWithLoader(const char* name) const
+{
+    if (m_loader)
+    {
+        return m_loader->FindSymbol(name);
+    }
+
+    void* symb = dlsym(m_dll_handle, name);
+    for (auto itr = m_plugin_handles.begin(); !symb && itr != m_plugin_handles.end(); ++itr)
+    {
+        symb = dlsym(*itr, name);
+    }
+    return symb;
+}
+
+const CSharedObject* CCompartmentLibs::FindAllocatorObject() const
+{
+    // Not m_scope: calls from every object (the C library's own included) bind through the global scope, so an
+    // earlier definition interposes on the C library's
+    static const char* const name = "malloc";
+    CDynamicSection::SymbolHash hash{ name };
+    for (auto so : m_search_order)
+    {
+        void* symb = nullptr;
+        if (so->FindSymbol(name, hash, symb) != CSharedObject::SymbolLookup::kNotFound)
+        {
+            return so;
+        }
+    }
+    return nullptr;
+}
+
+size_t CCompartmentLibs::ResolveSymbols(const char* const names[], size_t num_names, void* results[]) const
+{
+    size_t num_resolved = 0;
+    for (size_t i = 0; i < num_names; i++)
+    {
+        results[i] = LookupSymbol(names[i]);
+        if (results[i])
+        {
+            num_resolved++;
+        }
+    }
+    return num_resolved;
+}
+
+const char* CCompartmentLibs::FindSymbolName(const void* addr) const
+{
+    for (auto so : m_search_order)
+    {
+        auto name = so->FindSymbolName(cheri_address_get(addr));
+        if (name)
+        {
+            return name;
+        }
+    }
+    return nullptr;
+}
+
+bool CCompartmentLibs::LoadSharedObject(struct link_map* link_map, const Capability& base_cap,
+    const Capability& fixup_cap, bool include_loader, CSharedObject& so)
+{
+    Elf64_Addr laddr = link_map->l_addr;
+    std::string full_name{ link_map->l_name };
+
+#if CAPMGR_EMULATED_CAPS
+    // The loader is mapped once, at AT_BASE, and listed in each namespace
+    if (laddr == getauxval(AT_BASE) && !include_loader)
+    {
+        L_(DEBUG) << "Rejecting lib=" << full_name << " as found ld.so";
+        return false;
+    }
+
+    const ElfW(Phdr)* phdr_ptr = nullptr;
+    ElfW(Half) phdr_num = 0;
+    FindProgramHeaders(laddr, phdr_ptr, phdr_num);
+#else
+    // Use the internal API of link_map to grab the phdrs
+    auto internal_link_map = reinterpret_cast<struct internal_link_map*>(link_map);
+
+    // If l_real is not equal link_map then reject if flagged, as would be the loader
+    if ((cheri_address_get(internal_link_map) != cheri_address_get(internal_link_map->l_real)) && !include_loader)
+    {
+        L_(DEBUG) << "Rejecting lib=" << full_name << " as found ld.so";
+        return false;
+    }
+
+    // Update pointers in the case we have the loader
+    internal_link_map = internal_link_map->l_real;
+
+    auto phdr_ptr = internal_link_map->l_phdr;
+    auto phdr_num = internal_link_map->l_phnum;
+#endif
+
+    // Reject if no headers
+    if ( phdr_num == 0 || phdr_ptr == nullptr)
+    {
+        L_(DEBUG) << "Rejecting lib=" << full_name << " as no valid phdrs";
+        return false;
+    }
+
+    L_(VERBOSE) << "Parsing lib=" << full_name << "...";
+    // Construct the .so
+    // Build the capability from the base address of the DLL
+    // Note: problem is the base won't give us write perms, so source from the parsed in cap
+
+    Capability cap{ base_cap };
+
+#if CAPMGR_EMULATED_CAPS
+    cap.SetAddress(reinterpret_cast<void*>(laddr));
+#else
+    if (internal_link_map->l_addr == cheri_address_get(internal_link_map->l_map_start))
+    {
+        cap.SetBoundsAndAddress(Capability(internal_link_map->l_map_start));
+    }
+    else
+    {
+        cap.SetAddress(reinterpret_cast<void*>(laddr));
+    }
+#endif
+
+    so = CSharedObject{ full_name,  cap };
+    so.Load(phdr_ptr, phdr_num, fixup_cap);
+    so.SetPatchedAtLoad(capmgr_audit_patched && capmgr_audit_patched(link_map));
+    return true;
+}
 
 int CCompartmentLibs::ParseLinkMap(const std::string &so_name, const Capability &base_cap, const Capability &fixup_cap)
 {
@@ -60,7 +343,7 @@ int CCompartmentLibs::ParseLinkMap(const std::string &so_name, const Capability
     std::ostringstream strstr;
     int map_count = 0;
 
-    if (0 != dlinfo(m_dll_handle, RTLD_DI_LINKMAP, &link_map))
+    if (0 != dlinfo(m_dll_handle, RTLD_DI_LINKMAP, &link_map) || 0 != dlinfo(m_dll_handle, RTLD_DI_LMID, &m_lmid))
     {
         strstr << "Failed get linkmap(): " << dlerror();
         throw CCapMgrException(strstr.str());
@@ -77,7 +360,6 @@ int CCompartmentLibs::ParseLinkMap(const std::string &so_name, const Capability
     // Parse link map from start
     while (link_map)
     {
-        Elf64_Addr laddr = link_map->l_addr;
         std::string full_name{ link_map->l_name };
 
         if (full_name.empty())
@@ -87,62 +369,340 @@ int CCompartmentLibs::ParseLinkMap(const std::string &so_name, const Capability
         }
         else
         {
-            // Use the internal API of link_map to grab the phdrs
-            auto internal_link_map = reinterpret_cast<struct internal_link_map*>(link_map);
-
-            // If l_real is not equal link_map then reject if flagged, as would be the loader
-            if ((cheri_address_get(internal_link_map) != cheri_address_get(internal_link_map->l_real)) && !m_include_loader)
+            // Construct the .so in our list, as it must not move once loaded
+            if (LoadSharedObject(link_map, base_cap, fixup_cap, m_include_loader, m_so_map[full_name]))
             {
-                L_(DEBUG) << "Rejecting lib=" << full_name << " as found ld.so";
+                map_count++;
+                m_search_order.push_back(&m_so_map[full_name]);
+
+                // Check for match with loaded lib name & save as needed
+                if (m_so_full_name.empty() && CCompartmentLibs::NameMatch(so_name, full_name))
+                {
+                    m_so_full_name = full_name;
+                }
             }
             else
             {
-                // Update pointers in the case we have the loader
-                internal_link_map = internal_link_map->l_real;
+                m_so_map.erase(full_name);
+            }
+        }
+        m_link_map_tail = link_map;
+        link_map = link_map->l_next;
+    }
 
-                auto phdr_ptr = internal_link_map->l_phdr;
-                auto phdr_num = internal_link_map->l_phnum;
+    return map_count;
+}
 
-                // Reject if no headers
-                if ( phdr_num == 0 || phdr_ptr == nullptr)
-                {
-                    L_(DEBUG) << "Rejecting lib=" << full_name << " as no valid phdrs";
-                }
-                else
-                {
-                    map_count++;
-                    L_(VERBOSE) << "Parsing lib=" << full_name << "...";
-                    // Construct the .so and add it to our list
-                    // Build the capability from the base address of the DLL
-                    // Note: problem is the base won't give us write perms, so source from the parsed in cap
-
-                    Capability cap{ base_cap };
-
-                    if (internal_link_map->l_addr == cheri_address_get(internal_link_map->l_map_start))
-                    {
-                        cap.SetBoundsAndAddress(Capability(internal_link_map->l_map_start));
-                    }
-                    else
-                    {
-                        cap.SetAddress(reinterpret_cast<void*>(laddr));
-                    }
-
-                    auto& elem = m_so_map[full_name] = CSharedObject{ full_name,  cap };
-
-                    elem.Load(phdr_ptr, phdr_num, fixup_cap);
-
-                    // Check for match with loaded lib name & save as needed
-                    if (m_so_full_name.empty() && CCompartmentLibs::NameMatch(so_name, full_name))
-                    {
-                        m_so_full_name = full_name;
-                    }
-                }
+int CCompartmentLibs::LoadNewSharedObjects()
+{
+    if (m_loader || !m_link_map_tail)
+    {
+        throw CCapMgrException("Cannot add shared objects to " + m_so_full_name + ": not loaded by dlopen()");
+    }
+
+    // Only the entries after the last one parsed are new, so the existing ones are not walked again
+    std::vector<const CSharedObject*> added;
+    for (auto link_map = m_link_map_tail->l_next; link_map; link_map = link_map->l_next)
+    {
+        m_link_map_tail = link_map;
+
+        std::string full_name{ link_map->l_name };
+        if (full_name.empty() || m_so_map.count(full_name))
+        {
+            continue;
+        }
+
+        if (LoadSharedObject(link_map, m_base_cap, m_fixup_cap, m_include_loader, m_so_map[full_name]))
+        {
+            added.push_back(&m_so_map[full_name]);
+            m_search_order.push_back(added.back());
+            m_scope.push_back(added.back());
+        }
+        else
+        {
+            m_so_map.erase(full_name);
+        }
+    }
+
+    for (auto so : added)
+    {
+        // The rtld-audit module may have patched it already
+        if (so->IsPatchedAtLoad())
+        {
+            L_(DEBUG) << "LibCapFixups already done for " << so->GetName();
+            continue;
+        }
+
+        L_(VERBOSE) << "Process LibCapFixups for new shared object " << so->GetName() << ":" << std::endl;
+        if (!so->DoLibCapFixups(true))
+        {
+            throw CCapMgrException("LibCapFixups failed for " + so->GetName());
+        }
+    }
+
+    L_(DEBUG) << "Added " << added.size() << " shared objects";
+    return static_cast<int>(added.size());
+}
+
+bool CCompartmentLibs::OpenPlugin(const std::string& so_name)
+{
+    if (m_loader)
+    {
+        throw CCapMgrException("Cannot open plugin " + so_name + " with the native compartment loader");
+    }
+
+    void* handle = dlmopen(m_lmid, so_name.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        L_(ERROR) << "Failed dlmopen() plugin " << so_name << " : " << dlerror();
+        return false;
+    }
+    m_plugin_handles.push_back(handle);
+
+    try
+    {
+        LoadNewSharedObjects();
+    }
+    catch (const CCapMgrException& e)
+    {
+        L_(ERROR) << "Cannot patch plugin " << so_name << ": " << e.what();
+        return false;
+    }
+    return true;
+}
+
+
+bool CCompartmentLibs::DoAllLibCapFixups(bool makeRestricted, unsigned num_threads) const
+{
+    // The native loader relocated straight into restricted capabilities, and its mapping is simply unmapped
+    if (m_loader)
+    {
+        L_(DEBUG) << "No LibCapFixups needed for natively loaded shared objects";
+        return true;
+    }
+
+    static const uint32_t trace_id = CTracer::InternName("lib_cap_fixups");
+    CTraceScope trace_scope(trace_id, m_so_map.size());
+
+    // Shared objects already patched when mapped (by the rtld-audit module) are left alone
+    std::vector<const CSharedObject*> sos;
+    for (const auto& so : m_so_map)
+    {
+        if (makeRestricted && so.second.IsPatchedAtLoad())
+        {
+            L_(DEBUG) << "LibCapFixups already done for " << so.first;
+            continue;
+        }
+        sos.push_back(&so.second);
+    }
+
+    size_t num_fixups = 0;
+    for (auto so : sos)
+    {
+        num_fixups += so->GetNumFixups();
+    }
+
+    // More threads than CPUs only adds switching, and a small pass is over before the workers are awake
+    num_threads = std::min(num_threads, std::max(1u, std::thread::hardware_concurrency()));
+    num_threads = static_cast<unsigned>(std::min<size_t>(num_threads, num_fixups / kMinFixupEntriesPerThread));
+
+    if (num_threads <= 1)
+    {
+        for (auto so : sos)
+        {
+            L_(VERBOSE) << "Process LibCapFixups for " << so->GetName() << ":" << std::endl;
+            if (!so->DoLibCapFixups(makeRestricted))
+            {
+                return false;
             }
+        }
+        return true;
+    }
 
+    // Multi-threaded: every shared object is made writable up front, then the tables of all
+    // shared objects are split into chunks and patched by the pool, then permissions are restored.
+    std::vector<const CSharedObject*> prepared;
+    bool result = true;
+
+    for (auto so : sos)
+    {
+        L_(VERBOSE) << "Prepare LibCapFixups for " << so->GetName() << ":" << std::endl;
+        if (!so->PrepareFixups())
+        {
+            result = false;
+            break;
         }
-        link_map = link_map->l_next;
+        prepared.push_back(so);
     }
 
-    return map_count;
+    if (result)
+    {
+        size_t num_chunks = num_threads * kFixupChunksPerThread;
+        size_t chunk_entries = (num_fixups + num_chunks - 1) / num_chunks;
+        if (chunk_entries < kMinFixupChunkEntries)
+        {
+            chunk_entries = kMinFixupChunkEntries;
+        }
+
+        std::vector<CFixupWorkerPool::Task> chunks;
+        for (auto so : prepared)
+        {
+            so->AppendFixupChunks(chunks, chunk_entries, makeRestricted);
+        }
+
+        L_(DEBUG) << "Patching " << chunks.size() << " fixup chunks using " << num_threads << " threads";
+
+        size_t failed_chunk;
+        try
+        {
+            failed_chunk = CFixupWorkerPool::GetDefault().RunAll(chunks, num_threads);
+        }
+        catch (...)
+        {
+            for (auto so : prepared)
+            {
+                so->FinishFixups();
+            }
+            throw;
+        }
+
+        if (failed_chunk != CFixupWorkerPool::kNoFailure)
+        {
+            L_(ERROR) << "Fixup chunk " << failed_chunk << " of " << chunks.size() << " failed";
+            result = false;
+        }
+    }
+
+    // Always restore whatever was made writable, even on failure
+    for (auto so : prepared)
+    {
+        result &= so->FinishFixups();
+    }
+
+    return result;
+}
+
+size_t CCompartmentLibs::RemapHugePages() const
+{
+    // In the base namespace the shared objects (e.g. the C library) are the capability manager's too
+    if (!m_loader && m_lmid == LM_ID_BASE)
+    {
+        L_(WARNING) << "Not remapping " << m_so_full_name << " onto huge pages: shared with the capability manager";
+        return 0;
+    }
+
+    size_t remapped = 0;
+    for (auto so : m_search_order)
+    {
+        remapped += so->RemapHugePages();
+    }
+
+    L_(DEBUG) << "Remapped " << remapped << " bytes of shared objects onto huge pages";
+    return remapped;
+}
+
+bool CCompartmentLibs::UseFixupPlanCache(const std::string& cache_dir)
+{
+    // The plans decide which capabilities are left executive, so only we may be able to write them
+    if (mkdir(cache_dir.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+    {
+        L_(ERROR) << "Cannot create fixup plan cache folder " << cache_dir << ": " << strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (lstat(cache_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        L_(ERROR) << "Fixup plan cache folder " << cache_dir << " is not a folder";
+        return false;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        L_(ERROR) << "Fixup plan cache folder " << cache_dir << " must be owned by this user and not writable by others";
+        return false;
+    }
+
+    int num_loaded = 0;
+    int num_built = 0;
+
+    for (auto& so : m_so_map)
+    {
+        std::string build_id = so.second.GetBuildId();
+        if (build_id.empty() || build_id.size() > CFixupPlan::kMaxBuildIdLen)
+        {
+            L_(DEBUG) << "No usable build ID for " << so.first << ", fixup plan not cached";
+            continue;
+        }
+
+        std::string path = cache_dir + "/" + CFixupPlan::CacheFileName(build_id);
+
+        auto plan = CFixupPlan::Load(path, build_id, so.second.GetNumRelocEntries(), so.second.GetImageRange());
+        if (plan)
+        {
+            num_loaded++;
+        }
+        else
+        {
+            // Missing, stale or corrupt - rebuild and replace
+            plan = so.second.BuildFixupPlan();
+            plan->Save(path);
+            num_built++;
+        }
+
+        so.second.SetFixupPlan(plan);
+    }
+
+    L_(DEBUG) << "Fixup plans: " << num_loaded << " loaded from cache, " << num_built << " built";
+    return true;
 }
 
+size_t CCompartmentLibs::GetNumRelocEntries() const
+{
+    size_t total = 0;
+    for (const auto& so : m_so_map)
+    {
+        total += so.second.GetNumRelocEntries();
+    }
+    return total;
+}
+
+CFixupPageSet::Stats CCompartmentLibs::GetFixupPageStats() const
+{
+    CFixupPageSet::Stats stats;
+    for (const auto& so : m_so_map)
+    {
+        stats += so.second.GetFixupPageStats();
+    }
+    return stats;
+}
+
+CFixupJournal::Stats CCompartmentLibs::GetRevertStats() const
+{
+    CFixupJournal::Stats stats;
+    for (const auto& so : m_so_map)
+    {
+        stats += so.second.GetRevertStats();
+    }
+    return stats;
+}
+
+std::vector<Range> CCompartmentLibs::GetWritableRanges() const
+{
+    // The allocator's writable pages hold its state, but its heap is in mappings which are not tracked, so restoring
+    // one without the other would corrupt the heap
+    const CSharedObject* allocator = FindAllocatorObject();
+
+    std::vector<Range> ranges;
+    for (const auto& so : m_so_map)
+    {
+        if (&so.second == allocator)
+        {
+            L_(DEBUG) << "Writable ranges exclude " << so.first << ", which defines malloc()";
+            continue;
+        }
+
+        auto so_ranges = so.second.GetWritableRanges();
+        ranges.insert(ranges.end(), so_ranges.begin(), so_ranges.end());
+    }
+    return ranges;
+}
@@ -7,24 +7,67 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <memory>
 
 #include "shared_object_common.h"
 #include "comp_common_defs.h"
 #include "CSharedObject.h"
 #include "CCapability.h"
+#include "CCompartmentLoader.h"
+#include "CCompartmentSnapshot.h"
 
 class CCompartmentLibs
 {
 private:
+    // Multi-threaded fixups, sized from the fixup_scaling bench: patching costs around 1.5ns an entry, and waking a
+    // pooled worker around 5us.  A worker is only used if it gets at least kMinFixupEntriesPerThread entries (about
+    // ten times its wake up cost), so smaller passes are patched serially.  Each thread gets kFixupChunksPerThread
+    // chunks to even out the load, but no chunk is smaller than kMinFixupChunkEntries.
+    static constexpr size_t kMinFixupEntriesPerThread = 32768;
+    static constexpr size_t kFixupChunksPerThread = 4;
+    static constexpr size_t kMinFixupChunkEntries = 4096;
 
     std::map<std::string, CSharedObject> m_so_map;      // All loaded sos for the link map, keyed by full pathname
+    std::vector<const CSharedObject*> m_search_order;       // The sos in load order
+    // Symbol lookup order: that of dlsym() on the handle (the so then its dependencies, breadth first), then the
+    // plugins.  nullptr for a dependency which was not parsed (e.g. ld.so), where the lookup defers to dlsym().
+    std::vector<const CSharedObject*> m_scope;
     void* m_dll_handle = nullptr;                           // Handle of requested DLL
+    std::unique_ptr<CCompartmentLoader> m_loader;           // Or the native loader, if used instead of dlopen()
     std::string m_so_full_name;                               // Name of the requested so (resolved)
     bool m_include_loader;
 
+    // For shared objects added to the namespace after construction, e.g. plugins
+    Lmid_t m_lmid = LM_ID_BASE;                             // Namespace the so was loaded into
+    struct link_map* m_link_map_tail = nullptr;             // Last link map entry parsed: new entries follow it
+    std::vector<void*> m_plugin_handles;                    // Libraries loaded by OpenPlugin()
+    Capability m_base_cap;
+    Capability m_fixup_cap;
+
     // Parse the link map and return number of sos loaded
     int ParseLinkMap(const std::string &so_name, const Capability& base_cap, const Capability& fixup_cap);
 
+    // Set m_scope from the requested so's dependencies
+    void BuildScope();
+
+    // Look a name up through m_scope, deferring to dlsym() (or the native loader) for an object not parsed or a
+    // definition only the loader can resolve
+    void* LookupSymbol(const char* name) const;
+
+    // dlsym() on the handle then the plugins, or the native loader's lookup
+    void* FindSymbolWithLoader(const char* name) const;
+
+    // The shared object whose malloc() the link map binds to, i.e. the first definition in load order, or nullptr
+    const CSharedObject* FindAllocatorObject() const;
+
+public:
+    // Load the shared object for a link map entry, using the same rules as for the whole link map.
+    // so must already be where it will be kept, since once loaded its relocation tables refer to it.
+    // Returns false if the entry is rejected (the loader, unless include_loader, or no phdrs).
+    static bool LoadSharedObject(struct link_map* link_map, const Capability& base_cap, const Capability& fixup_cap,
+        bool include_loader, CSharedObject& so);
+
+private:
     static bool NameMatch(const std::string& test_name, const std::string& full_name)
     {
         // Simple check for match
@@ -42,8 +85,20 @@ public:
     CCompartmentLibs(const std::string& so_name, const Capability &base_cap, const Capability &fixup_cap,
         bool load_new_linkmap=true, bool include_loader=false);
 
+    // Constructor which loads the so and its dependencies with the native compartment loader instead of dlopen().
+    // The loader does the relocations into restricted capabilities, so no fixups are needed afterwards,
+    // and the so and all its dependencies are always a separate copy for the compartment.
+    // With a snapshot, the so is cloned from the snapshot instead of loaded (so_name is then just for information).
+    CCompartmentLibs(const std::string& so_name, const Capability& base_cap, const Capability& fixup_cap,
+        std::unique_ptr<CCompartmentLoader> loader, const CCompartmentSnapshot* snapshot = nullptr);
+
     ~CCompartmentLibs()
     {
+        for (auto itr = m_plugin_handles.rbegin(); itr != m_plugin_handles.rend(); ++itr)
+        {
+            dlclose(*itr);
+        }
+
         if (m_dll_handle)
         {
             dlclose(m_dll_handle); 
@@ -68,11 +123,50 @@ public:
         return dump;
     }
 
-    // Get DLL symbol by name for the primary loaded shared object 
-    void* GetDllSymbolByName(const std::string& name) const
-    {
-        return dlsym(m_dll_handle, name.c_str());
-    }
+    // Get DLL symbol by name for the primary loaded shared object, or one in a plugin.
+    // Looks in the shared objects' hash tables, in dlsym()'s order, only calling dlsym() for what they cannot give
+    // (e.g. IFUNCs, or a symbol of ld.so), so gives the same answer as dlsym() on the handle then the plugins.
+    void* GetDllSymbolByName(const char* name) const { return LookupSymbol(name); }
+    void* GetDllSymbolByName(const std::string& name) const { return LookupSymbol(name.c_str()); }
+
+    // Resolve many symbols at once, as GetDllSymbolByName() for each.  results[i] is the capability for names[i],
+    // or nullptr if it is not defined.  Returns the number resolved.
+    size_t ResolveSymbols(const char* const names[], size_t num_names, void* results[]) const;
+
+    // Name of the function or object holding an address in any of the shared objects, or nullptr, e.g. to
+    // attribute a PC when profiling.  Scans the symbol table of the shared object holding it.
+    const char* FindSymbolName(const void* addr) const;
+
+    const CSharedObject& GetPrimarySharedObject() const { return m_so_map.at(m_so_full_name); }
+
+    // Number of shared objects loaded, i.e. the requested so and its dependencies
+    size_t GetNumSharedObjects() const { return m_so_map.size(); }
+
+    // Total number of entries in the relocation tables of all shared objects
+    size_t GetNumRelocEntries() const;
+
+    void* GetDllHandle() const { return m_dll_handle; }
+
+    // Full name of the requested so
+    const std::string& GetName() const { return m_so_full_name; }
+
+    // Was the native compartment loader used?
+    bool IsNativeLoaded() const { return m_loader != nullptr; }
+
+    const CCompartmentLoader* GetLoader() const { return m_loader.get(); }
+
+    // Thread pointer for the compartment's TLS, if the native compartment loader laid any out, else nullptr
+    void* GetThreadPointer() const { return m_loader ? m_loader->GetThreadPointer() : nullptr; }
+
+    // Load another instance of a natively loaded so, which shares the read-only blocks with this one,
+    // or clone it from a snapshot of an initialised instance.
+    // Throws if the native compartment loader was not used
+    CCompartmentLibs* CreateInstance(const Capability& base_cap, const Capability& fixup_cap,
+        const CCompartmentSnapshot* snapshot = nullptr) const;
+
+    // Snapshot the writable state of a natively loaded so, e.g. once the compartment has been initialised.
+    // Throws if the native compartment loader was not used, see CCompartmentSnapshot for other limitations.
+    std::shared_ptr<CCompartmentSnapshot> TakeSnapshot(bool allow_external_caps = false) const;
 
     void* ResolveSymbolAddr(const std::string& name, const Capability &basecap) const
     {
@@ -90,20 +184,47 @@ public:
         return nullptr;
     }
 
+    // Parse the link map entries added since it was last parsed, e.g. by a dlopen() in the namespace, and do the
+    // restricted fixups for just those shared objects, so already patched ones are left alone and the cost follows
+    // the new libraries only.  Returns the number of shared objects added.
+    // Not for the native compartment loader; must not run alongside symbol lookups on other threads.
+    int LoadNewSharedObjects();
+
+    // Load a library (and any dependencies it adds) into the compartment's namespace and patch it as for
+    // LoadNewSharedObjects(), e.g. for a plugin the compartment asks for with the cheri_dlopen() service.
+    // Its symbols are then found by GetDllSymbolByName().  It stays loaded for the lifetime of this object.
+    // Returns false if it cannot be loaded or patched; throws for the native compartment loader.
+    bool OpenPlugin(const std::string& so_name);
+
+    // Move the LOAD blocks of all shared objects onto huge pages where they are big enough, when huge pages are on
+    // (see CHugePages).  Read-only blocks are then private copies, no longer shared with other instances.
+    // Not for shared objects in the capability manager's own namespace, which may be running.
+    // Returns the number of bytes moved; throws on failure.
+    size_t RemapHugePages() const;
+
+    // Use the fixup plan cache in cache_dir for all shared objects: plans which are found and are valid are used,
+    // otherwise the plan is built by scanning the relocation tables and written to the cache.
+    // Shared objects without a build ID are always scanned.
+    // The folder is created (mode 0700) if it does not exist.  As the plans decide which capabilities are made
+    // restricted, the folder and each plan must be owned by the effective user and not writable by group or others.
+    // Returns false if the cache folder cannot be used.
+    bool UseFixupPlanCache(const std::string& cache_dir);
+
     // Fixup all capabilities
     // Can set for compartment or capability manager (restricted or executive)
-    bool DoAllLibCapFixups(bool makeRestricted=true) const
-    {
-        for (const auto& so : m_so_map)
-        {
-            L_(VERBOSE) << "Process LibCapFixups for " << so.first << ":" << std::endl;
-            if (!so.second.DoLibCapFixups(makeRestricted))
-            {
-                return false;
-            }
-        }
-        return true;
-    }
+    // num_threads > 1 splits the patching into chunks which are run on a pool of worker threads, if there are enough
+    // CPUs and enough entries for the threads to pay off (see kMinFixupEntriesPerThread)
+    bool DoAllLibCapFixups(bool makeRestricted=true, unsigned num_threads=1) const;
+
+    // Page protection costs of the fixups for all shared objects, compared to making all LOAD blocks writable
+    CFixupPageSet::Stats GetFixupPageStats() const;
+
+    // Pages of the writable LOAD blocks of all shared objects, i.e. the state a compartment can change, except
+    // for those of the object defining malloc() (normally the C library), as its allocator state goes with its heap
+    std::vector<Range> GetWritableRanges() const;
+
+    // Results of the last fixup journal replay for all shared objects
+    CFixupJournal::Stats GetRevertStats() const;
 
     friend std::ostream& operator<<(std::ostream& o, const CCompartmentLibs& obj)
     {
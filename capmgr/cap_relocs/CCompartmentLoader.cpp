@@ -0,0 +1,795 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CCompartmentLoader
+
+#include <cheriintrin.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "CCompartmentLoader.h"
+#include "CCapMgrException.h"
+#include "fixup_page_runs.h"
+#include "CCompartmentSnapshot.h"
+#include "comp_common_asm.h"
+
+#include "CCapMgrLogger.h"
+using namespace CapMgr;
+
+namespace
+{
+    // Permission byte in the top of the second word of a R_MORELLO_RELATIVE fragment
+    constexpr uint64_t kFragmentPermRead = 1;
+    constexpr uint64_t kFragmentPermReadWrite = 2;
+    constexpr uint64_t kFragmentPermExec = 4;
+    constexpr uint64_t kFragmentLengthMask = (1ULL << 56) - 1;
+
+    // The TCB at the thread pointer, before the TLS blocks: the DTV and a private pointer, which are left null
+    constexpr size_t kTlsTcbSize = 2 * sizeof(void*);
+
+    // Generic AArch64 relocations which can appear alongside the Morello ones
+#ifndef R_AARCH64_NONE
+    constexpr Elf64_Word R_AARCH64_NONE = 0;
+#endif
+#ifndef R_AARCH64_ABS64
+    constexpr Elf64_Word R_AARCH64_ABS64 = 257;
+#endif
+#ifndef R_AARCH64_RELATIVE
+    constexpr Elf64_Word R_AARCH64_RELATIVE = 1027;
+#endif
+#ifndef R_MORELLO_TPREL128
+    constexpr Elf64_Word R_MORELLO_TPREL128 = 59398;
+#endif
+
+#if CAPMGR_EMULATED_CAPS
+    // Emulated capabilities load the host's objects, whose pointer relocations stand in for the Morello ones
+#if defined(__x86_64__)
+    constexpr Elf64_Half kLoaderMachine = EM_X86_64;
+    constexpr Elf64_Word kHostGlobDat = R_X86_64_GLOB_DAT;
+    constexpr Elf64_Word kHostJumpSlot = R_X86_64_JUMP_SLOT;
+#else
+    constexpr Elf64_Half kLoaderMachine = EM_AARCH64;
+    constexpr Elf64_Word kHostGlobDat = R_AARCH64_GLOB_DAT;
+    constexpr Elf64_Word kHostJumpSlot = R_AARCH64_JUMP_SLOT;
+#endif
+#else
+    constexpr Elf64_Half kLoaderMachine = EM_AARCH64;
+#endif
+
+    std::string DirName(const std::string& path)
+    {
+        auto pos = path.find_last_of('/');
+        return (pos == std::string::npos) ? std::string(".") : path.substr(0, pos);
+    }
+
+    bool FileExists(const std::string& path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    void ReadExact(int fd, void* buff, size_t size, off_t offset, const std::string& path)
+    {
+        if (pread(fd, buff, size, offset) != static_cast<ssize_t>(size))
+        {
+            throw CCapMgrException("Cannot read ELF headers from " + path);
+        }
+    }
+}
+
+CCompartmentLoader::CCompartmentLoader(const std::vector<std::string>& search_paths, const Capability& rw_cap,
+    const Capability& rx_cap) : m_images(std::make_shared<ImageCache>()), m_search_paths(search_paths), m_rw_cap(rw_cap), m_rx_cap(rx_cap),
+    m_page_size(getpagesize())
+{
+    // LD_LIBRARY_PATH is honoured after the given folders, as the system loader would
+    const char* ld_library_path = getenv("LD_LIBRARY_PATH");
+    if (ld_library_path)
+    {
+        std::istringstream dirs(ld_library_path);
+        std::string dir;
+        while (std::getline(dirs, dir, ':'))
+        {
+            m_search_paths.push_back(dir);
+        }
+    }
+
+#if !CAPMGR_EMULATED_CAPS
+    // Static TLS descriptors resolve in the compartment, so the resolver is restricted
+    void* resolver = Capability(reinterpret_cast<uintptr_t>(&CompartmentTlsDescReturn));
+    m_tlsdesc_resolver = Capability(m_rx_cap)
+        .SetBoundsAndAddress(Capability(resolver))
+        .SetPerms(kLoaderExecPerms)
+        .SEntry();
+#endif
+}
+
+CCompartmentLoader::~CCompartmentLoader()
+{
+    for (auto itr = m_objects.rbegin(); itr != m_objects.rend(); ++itr)
+    {
+        if ((*itr)->map)
+        {
+            munmap((*itr)->map, (*itr)->span);
+        }
+    }
+
+    if (m_tls_map)
+    {
+        munmap(m_tls_map, m_tls_span);
+    }
+}
+
+std::unique_ptr<CCompartmentLoader> CCompartmentLoader::NewInstance() const
+{
+    std::unique_ptr<CCompartmentLoader> instance{ new CCompartmentLoader({}, m_rw_cap, m_rx_cap) };
+    instance->m_search_paths = m_search_paths;
+    instance->m_images = m_images;
+    return instance;
+}
+
+std::string CCompartmentLoader::FindLibrary(const std::string& name, const LoadedObject& needed_by) const
+{
+    if (name.find('/') != std::string::npos)
+    {
+        return FileExists(name) ? name : std::string();
+    }
+
+    std::vector<std::string> dirs;
+
+    std::istringstream runpath_dirs(needed_by.dynsec.GetRunPath());
+    std::string dir;
+    while (std::getline(runpath_dirs, dir, ':'))
+    {
+        auto pos = dir.find("$ORIGIN");
+        if (pos != std::string::npos)
+        {
+            dir.replace(pos, 7, DirName(needed_by.path));
+        }
+        dirs.push_back(dir);
+    }
+
+    dirs.insert(dirs.end(), m_search_paths.begin(), m_search_paths.end());
+    dirs.push_back(DirName(m_objects.front()->path));
+
+    for (const auto& search_dir : dirs)
+    {
+        if (!search_dir.empty() && FileExists(search_dir + "/" + name))
+        {
+            return search_dir + "/" + name;
+        }
+    }
+    return std::string();
+}
+
+std::shared_ptr<const CCompartmentLoader::Image> CCompartmentLoader::OpenImage(const std::string& path) const
+{
+    std::lock_guard<std::mutex> lock(m_images->mutex);
+
+    auto itr = m_images->images.find(path);
+    if (itr != m_images->images.end())
+    {
+        return itr->second;
+    }
+
+    std::shared_ptr<Image> image{ std::make_shared<Image>() };
+    image->path = path;
+    image->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (image->fd < 0)
+    {
+        throw CCapMgrException("Cannot open " + path + ": " + strerror(errno));
+    }
+
+    Elf64_Ehdr ehdr;
+    ReadExact(image->fd, &ehdr, sizeof(ehdr), 0, path);
+
+    if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr.e_type != ET_DYN || ehdr.e_machine != kLoaderMachine || ehdr.e_phentsize != sizeof(Elf64_Phdr))
+    {
+        throw CCapMgrException(path + " is not a shared object for this machine");
+    }
+
+    image->phdrs.resize(ehdr.e_phnum);
+    ReadExact(image->fd, image->phdrs.data(), ehdr.e_phnum * sizeof(Elf64_Phdr), ehdr.e_phoff, path);
+
+    m_images->images[path] = image;
+    return image;
+}
+
+void CCompartmentLoader::MapObject(LoadedObject& obj, const CCompartmentSnapshot* snapshot, size_t index) const
+{
+    auto image = OpenImage(obj.path);
+    obj.phdrs = image->phdrs;
+
+    // Work out the span of all the LOAD blocks
+    Elf64_Addr min_vaddr = UINT64_MAX;
+    Elf64_Addr max_vaddr = 0;
+    const Elf64_Phdr* dyn_phdr = nullptr;
+    for (const auto& phdr : obj.phdrs)
+    {
+        if (phdr.p_type == PT_LOAD)
+        {
+            min_vaddr = std::min(min_vaddr, cheri_align_down(phdr.p_vaddr, m_page_size));
+            max_vaddr = std::max(max_vaddr, cheri_align_up(phdr.p_vaddr + phdr.p_memsz, m_page_size));
+        }
+        else if (phdr.p_type == PT_DYNAMIC)
+        {
+            dyn_phdr = &phdr;
+        }
+        else if (phdr.p_type == PT_TLS && phdr.p_memsz != 0)
+        {
+            obj.tls = &phdr;
+        }
+    }
+
+    if (max_vaddr <= min_vaddr || !dyn_phdr)
+    {
+        throw CCapMgrException(obj.path + " has no LOAD blocks or no dynamic section");
+    }
+
+    // Reserve the whole span, then map the blocks into it
+    obj.span = cheri_representable_length(max_vaddr - min_vaddr);
+    obj.map = mmap(nullptr, obj.span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (obj.map == MAP_FAILED)
+    {
+        obj.map = nullptr;
+        throw CCapMgrException("No memory to map " + obj.path);
+    }
+
+    Elf64_Addr map_addr = cheri_address_get(obj.map);
+
+    // The loader's own capability over the object, and the restricted code capability given to the compartment
+    obj.rw_cap = Capability(m_rw_cap).SetBounds(map_addr, obj.span);
+    obj.rx_cap = Capability(m_rx_cap).SetBounds(map_addr, obj.span).SetPerms(kLoaderExecPerms);
+
+    uint8_t* base = reinterpret_cast<uint8_t*>(static_cast<void*>(obj.rw_cap)) - min_vaddr;
+
+    for (const auto& phdr : obj.phdrs)
+    {
+        if (phdr.p_type != PT_LOAD)
+        {
+            continue;
+        }
+
+        // Read-only blocks get their final protection now, so they are never copied and stay shared by all
+        // instances.  Writable blocks hold the relocations, then ProtectObject() makes the RELRO part read-only.
+        int prot = (phdr.p_flags & PF_W) ? (PROT_READ | PROT_WRITE) : FixupPages::ProtFromFlags(phdr.p_flags);
+        Elf64_Addr seg_start = cheri_align_down(phdr.p_vaddr, m_page_size);
+        Elf64_Addr file_end = phdr.p_vaddr + phdr.p_filesz;
+        Elf64_Addr file_map_end = cheri_align_up(file_end, m_page_size);
+        Elf64_Addr mem_end = cheri_align_up(phdr.p_vaddr + phdr.p_memsz, m_page_size);
+
+        if (snapshot && (phdr.p_flags & PF_W))
+        {
+            // Copy on write from the snapshot, which includes the .bss
+            const auto& block = snapshot->GetBlock(index, seg_start);
+            void* seg = mmap(&base[seg_start], block.size, prot, MAP_PRIVATE | MAP_FIXED, snapshot->GetFd(),
+                block.file_offset);
+            if (seg == MAP_FAILED)
+            {
+                throw CCapMgrException("Cannot map snapshot block of " + obj.path + ": " + strerror(errno));
+            }
+            continue;
+        }
+
+        if (phdr.p_filesz != 0)
+        {
+            void* seg = mmap(&base[seg_start], file_map_end - seg_start, prot,
+                MAP_PRIVATE | MAP_FIXED, image->fd, cheri_align_down(phdr.p_offset, m_page_size));
+            if (seg == MAP_FAILED)
+            {
+                throw CCapMgrException("Cannot map LOAD block of " + obj.path + ": " + strerror(errno));
+            }
+
+            // The .bss starts part way through the last file page
+            if (phdr.p_memsz > phdr.p_filesz && (phdr.p_flags & PF_W))
+            {
+                memset(&base[file_end], 0, std::min(file_map_end, phdr.p_vaddr + phdr.p_memsz) - file_end);
+            }
+        }
+        else
+        {
+            file_map_end = seg_start;
+        }
+
+        // And any remaining .bss pages are anonymous
+        if (mem_end > file_map_end)
+        {
+            void* bss = mmap(&base[file_map_end], mem_end - file_map_end, prot,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            if (bss == MAP_FAILED)
+            {
+                throw CCapMgrException("Cannot map .bss of " + obj.path + ": " + strerror(errno));
+            }
+        }
+    }
+
+    // Base capability has the address of the load base, like l_addr
+    obj.rw_cap.SetAddress(base);
+
+    obj.dynsec = CDynamicSection(obj.rw_cap, dyn_phdr->p_vaddr, dyn_phdr->p_memsz, true);
+
+    obj.strtab = reinterpret_cast<const char*>(obj.dynsec.GetStrTab().base);
+    obj.symtab = reinterpret_cast<const Elf64_Sym*>(obj.dynsec.GetSymTab().base);
+    obj.num_syms = obj.dynsec.GetNumSymbols();
+
+    if (obj.dynsec.HasEntry(DT_TEXTREL))
+    {
+        throw CCapMgrException(obj.path + " has text relocations, which the compartment loader does not support");
+    }
+
+    L_(DEBUG) << "Compartment loader mapped " << obj.path << " at " << obj.rw_cap << " span 0x" << std::hex << obj.span;
+}
+
+bool CCompartmentLoader::FindDefinition(const char* name, const LoadedObject*& def_obj,
+    const Elf64_Sym*& def_sym) const
+{
+    CDynamicSection::SymbolHash hash{ name };
+    for (const auto& obj : m_objects)
+    {
+        auto sym = obj->dynsec.LookupSymbol(name, hash);
+        if (sym)
+        {
+            def_obj = obj.get();
+            def_sym = sym;
+            return true;
+        }
+    }
+    return false;
+}
+
+uintptr_t CCompartmentLoader::SymbolCapability(const LoadedObject& obj, const Elf64_Sym& sym, bool sentry) const
+{
+    Elf64_Addr addr = obj.LoadAddress() + sym.st_value;
+
+    switch (ELF64_ST_TYPE(sym.st_info))
+    {
+    case STT_FUNC:
+    {
+        Capability cap{ obj.rx_cap };
+        cap.SetAddress(reinterpret_cast<void*>(addr));
+        if (sentry)
+        {
+            cap.SEntry();
+        }
+        return cap;
+    }
+
+    case STT_GNU_IFUNC:
+        throw CCapMgrException(std::string("Symbol ") + &obj.strtab[sym.st_name] +
+            " is an IFUNC, which the compartment loader does not support");
+
+    case STT_TLS:
+        throw CCapMgrException(std::string("Symbol ") + &obj.strtab[sym.st_name] +
+            " is TLS, which only has an address relative to the thread pointer");
+
+    default:
+    {
+        // Data is bounded to the symbol, and only writable if its LOAD block is
+        size_t perms = kLoaderReadPerms;
+        for (const auto& phdr : obj.phdrs)
+        {
+            if (phdr.p_type == PT_LOAD && sym.st_value >= phdr.p_vaddr && sym.st_value < phdr.p_vaddr + phdr.p_memsz)
+            {
+                perms = (phdr.p_flags & PF_W) ? kLoaderDataPerms : kLoaderReadPerms;
+                break;
+            }
+        }
+
+        Capability cap{ obj.rw_cap };
+        if (sym.st_size != 0)
+        {
+            cap.SetBounds(addr, sym.st_size);
+        }
+        else
+        {
+            cap.SetAddress(reinterpret_cast<void*>(addr));
+        }
+        return cap.SetPerms(perms);
+    }
+    }
+}
+
+void CCompartmentLoader::RelocateObject(const LoadedObject& obj) const
+{
+    std::vector<Range> tables;
+    size_t elem_size;
+
+    try
+    {
+        tables.push_back(obj.dynsec.GetRelaRel(elem_size));
+    }
+    catch (std::out_of_range&) {}
+
+    try
+    {
+        bool isRela;
+        auto plt_rel = obj.dynsec.GetPltRel(isRela, elem_size);
+        if (!isRela)
+        {
+            throw CCapMgrException(obj.path + " has a DT_REL PLT table, which the compartment loader does not support");
+        }
+        tables.push_back(plt_rel);
+    }
+    catch (std::out_of_range&) {}
+
+    try
+    {
+        obj.dynsec.GetRelRel(elem_size);
+        throw CCapMgrException(obj.path + " has a DT_REL table, which the compartment loader does not support");
+    }
+    catch (std::out_of_range&) {}
+
+    uint8_t* base = reinterpret_cast<uint8_t*>(static_cast<void*>(obj.rw_cap));
+    size_t num_relocs = 0;
+
+    for (const auto& table : tables)
+    {
+        auto rela = reinterpret_cast<const Elf64_Rela*>(table.base);
+        size_t num_entries = table.Size() / sizeof(Elf64_Rela);
+
+        for (size_t i = 0; i < num_entries; i++, rela++)
+        {
+            auto type = ELF64_R_TYPE(rela->r_info);
+            auto sym_index = ELF64_R_SYM(rela->r_info);
+            auto target = reinterpret_cast<uintptr_t*>(&base[rela->r_offset]);
+
+            switch (type)
+            {
+            case R_AARCH64_NONE:
+                break;
+
+            case R_MORELLO_RELATIVE:
+            {
+                // The target holds a fragment: address and length|permissions, from which the capability is built
+                auto fragment = reinterpret_cast<const uint64_t*>(target);
+                uint64_t frag_addr = fragment[0];
+                uint64_t frag_len = fragment[1] & kFragmentLengthMask;
+                uint64_t frag_perm = fragment[1] >> 56;
+
+                Capability cap{ (frag_perm == kFragmentPermExec) ? obj.rx_cap : obj.rw_cap };
+                cap.SetBounds(obj.LoadAddress() + frag_addr, frag_len);
+                if (frag_perm == kFragmentPermReadWrite)
+                {
+                    cap.SetPerms(kLoaderDataPerms);
+                }
+                else if (frag_perm == kFragmentPermRead)
+                {
+                    cap.SetPerms(kLoaderReadPerms);
+                }
+                else if (frag_perm != kFragmentPermExec)
+                {
+                    throw CCapMgrException(obj.path + " has an invalid R_MORELLO_RELATIVE fragment");
+                }
+
+                void* value = cheri_address_set(cap, obj.LoadAddress() + frag_addr + rela->r_addend);
+                if (frag_perm == kFragmentPermExec)
+                {
+                    value = cheri_sentry_create(value);
+                }
+                *target = reinterpret_cast<uintptr_t>(value);
+                break;
+            }
+
+            case R_MORELLO_GLOB_DAT:
+            case R_MORELLO_JUMP_SLOT:
+            case R_MORELLO_CAPINIT:
+#if CAPMGR_EMULATED_CAPS
+            case kHostGlobDat:
+            case kHostJumpSlot:
+#endif
+            {
+                const Elf64_Sym& sym = obj.symtab[sym_index];
+                const char* name = &obj.strtab[sym.st_name];
+                const LoadedObject* def_obj = &obj;
+                const Elf64_Sym* def_sym = &sym;
+
+                if ((sym.st_shndx == SHN_UNDEF || ELF64_ST_BIND(sym.st_info) != STB_LOCAL) &&
+                    !FindDefinition(name, def_obj, def_sym))
+                {
+                    if (ELF64_ST_BIND(sym.st_info) != STB_WEAK)
+                    {
+                        throw CCapMgrException(std::string("Undefined symbol ") + name + " in " + obj.path);
+                    }
+                    *target = 0;
+                    break;
+                }
+
+                uintptr_t value = SymbolCapability(*def_obj, *def_sym, true);
+                if (rela->r_addend != 0)
+                {
+                    value = reinterpret_cast<uintptr_t>(cheri_address_set(value,
+                        cheri_address_get(value) + rela->r_addend));
+                }
+                *target = value;
+                break;
+            }
+
+            case R_AARCH64_RELATIVE:
+#if CAPMGR_EMULATED_CAPS && defined(__x86_64__)
+            case R_X86_64_RELATIVE:
+#endif
+                *reinterpret_cast<uint64_t*>(target) = obj.LoadAddress() + rela->r_addend;
+                break;
+
+            case R_AARCH64_ABS64:
+#if CAPMGR_EMULATED_CAPS && defined(__x86_64__)
+            case R_X86_64_64:
+#endif
+            {
+                const LoadedObject* def_obj = &obj;
+                const Elf64_Sym* def_sym = &obj.symtab[sym_index];
+                if (sym_index != 0 && !FindDefinition(&obj.strtab[def_sym->st_name], def_obj, def_sym))
+                {
+                    if (ELF64_ST_BIND(def_sym->st_info) != STB_WEAK)
+                    {
+                        throw CCapMgrException(std::string("Undefined symbol ") + &obj.strtab[def_sym->st_name] +
+                            " in " + obj.path);
+                    }
+                    *reinterpret_cast<uint64_t*>(target) = 0;
+                    break;
+                }
+                *reinterpret_cast<uint64_t*>(target) = def_obj->LoadAddress() + def_sym->st_value + rela->r_addend;
+                break;
+            }
+
+#if !CAPMGR_EMULATED_CAPS
+            case R_MORELLO_TPREL128:
+            case R_MORELLO_TLSDESC:
+            {
+                // Static TLS: the offset of the variable from the thread pointer, and its size
+                const LoadedObject* def_obj = &obj;
+                const Elf64_Sym* def_sym = &obj.symtab[sym_index];
+                if (sym_index != 0 && ELF64_ST_BIND(def_sym->st_info) != STB_LOCAL &&
+                    !FindDefinition(&obj.strtab[def_sym->st_name], def_obj, def_sym))
+                {
+                    throw CCapMgrException(std::string("Undefined TLS symbol ") + &obj.strtab[def_sym->st_name] +
+                        " in " + obj.path);
+                }
+                if (!def_obj->tls)
+                {
+                    throw CCapMgrException(obj.path + " has a TLS relocation to " + def_obj->path + ", which has no TLS");
+                }
+
+                uint64_t offset = def_sym->st_value + rela->r_addend;
+                uint64_t size = def_sym->st_size ? def_sym->st_size : def_obj->tls->p_memsz - offset;
+
+                // A descriptor is the resolver, then the fragment it returns
+                auto fragment = reinterpret_cast<uint64_t*>(target);
+                if (type == R_MORELLO_TLSDESC)
+                {
+                    *target = m_tlsdesc_resolver;
+                    fragment = reinterpret_cast<uint64_t*>(target + 1);
+                }
+                fragment[0] = def_obj->tls_offset + offset;
+                fragment[1] = size;
+                break;
+            }
+#endif
+
+            default:
+            {
+                std::ostringstream strstr;
+                strstr << obj.path << " has relocation type " << type << " at offset 0x" << std::hex << rela->r_offset
+                    << ", which the compartment loader does not support";
+                throw CCapMgrException(strstr.str());
+            }
+            }
+            num_relocs++;
+        }
+    }
+
+    L_(DEBUG) << "Compartment loader relocated " << num_relocs << " entries for " << obj.name;
+}
+
+void CCompartmentLoader::ProtectObject(const LoadedObject& obj) const
+{
+    uint8_t* base = reinterpret_cast<uint8_t*>(static_cast<void*>(obj.rw_cap));
+
+    // The other blocks were mapped with their final protection
+    for (const auto& phdr : obj.phdrs)
+    {
+        if (phdr.p_type != PT_GNU_RELRO)
+        {
+            continue;
+        }
+
+        Elf64_Addr start = cheri_align_down(phdr.p_vaddr, m_page_size);
+        Elf64_Addr end = cheri_align_down(phdr.p_vaddr + phdr.p_memsz, m_page_size);
+        if (end > start && 0 != mprotect(&base[start], end - start, PROT_READ))
+        {
+            throw CCapMgrException("Cannot make RELRO read-only for " + obj.path + ": " + strerror(errno));
+        }
+    }
+}
+
+void CCompartmentLoader::LayoutTls()
+{
+    // Variant I, as AArch64: the TCB at the thread pointer, then each object's block aligned, in load order
+    size_t end = kTlsTcbSize;
+    for (const auto& obj : m_objects)
+    {
+        if (!obj->tls)
+        {
+            continue;
+        }
+        if (obj->tls->p_align > m_page_size)
+        {
+            throw CCapMgrException(obj->path + " has TLS aligned beyond a page");
+        }
+        obj->tls_offset = cheri_align_up(end, std::max<Elf64_Xword>(obj->tls->p_align, 1));
+        end = obj->tls_offset + obj->tls->p_memsz;
+    }
+
+    if (end == kTlsTcbSize)
+    {
+        return;
+    }
+
+    m_tls_span = cheri_representable_length(cheri_align_up(end, m_page_size));
+    m_tls_map = mmap(nullptr, m_tls_span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_tls_map == MAP_FAILED)
+    {
+        m_tls_map = nullptr;
+        throw CCapMgrException("No memory for the TLS of " + m_objects.front()->name);
+    }
+
+    // The anonymous map is zero, which is the TCB and each .tbss; copy in each .tdata
+    Capability tls_cap{ m_rw_cap };
+    tls_cap.SetBounds(cheri_address_get(m_tls_map), m_tls_span);
+    uint8_t* tls = reinterpret_cast<uint8_t*>(static_cast<void*>(tls_cap));
+    for (const auto& obj : m_objects)
+    {
+        if (obj->tls)
+        {
+            uint8_t* base = reinterpret_cast<uint8_t*>(static_cast<void*>(obj->rw_cap));
+            memcpy(&tls[obj->tls_offset], &base[obj->tls->p_vaddr], obj->tls->p_filesz);
+        }
+    }
+
+    m_thread_pointer = tls_cap.SetPerms(kLoaderDataPerms);
+    L_(DEBUG) << "Compartment loader laid out 0x" << std::hex << end << " bytes of TLS for " << m_objects.front()->name;
+}
+
+void CCompartmentLoader::Load(const std::string& so_name)
+{
+    if (!m_objects.empty())
+    {
+        throw CCapMgrException("Compartment loader has already loaded " + m_objects.front()->name);
+    }
+
+    // Map the closure breadth first, which is also the symbol search order.
+    // Each needed library is searched for from the object which needs it.
+    std::deque<std::pair<std::string, size_t>> pending{ std::make_pair(so_name, 0) };
+    while (!pending.empty())
+    {
+        std::string name = pending.front().first;
+        size_t needed_by = pending.front().second;
+        pending.pop_front();
+
+        bool loaded = false;
+        for (const auto& obj : m_objects)
+        {
+            if (obj->name == name)
+            {
+                loaded = true;
+                break;
+            }
+        }
+        if (loaded)
+        {
+            continue;
+        }
+
+        std::unique_ptr<LoadedObject> obj{ new LoadedObject };
+        obj->name = name;
+        obj->path = m_objects.empty() ? name : FindLibrary(name, *m_objects[needed_by]);
+        if (obj->path.empty() || !FileExists(obj->path))
+        {
+            throw CCapMgrException("Compartment loader cannot find " + name);
+        }
+
+        m_objects.push_back(std::move(obj));
+        auto& mapped = *m_objects.back();
+        MapObject(mapped);
+
+        for (const auto& needed : mapped.dynsec.GetNeeded())
+        {
+            pending.emplace_back(needed, m_objects.size() - 1);
+        }
+    }
+
+    LayoutTls();
+
+    for (const auto& obj : m_objects)
+    {
+        RelocateObject(*obj);
+    }
+
+    for (const auto& obj : m_objects)
+    {
+        ProtectObject(*obj);
+
+        if (obj->dynsec.HasEntry(DT_INIT) || obj->dynsec.HasEntry(DT_INIT_ARRAY))
+        {
+            L_(WARNING) << obj->name << " has constructors, which the compartment loader does not run";
+        }
+    }
+
+    L_(DEBUG) << "Compartment loader loaded " << m_objects.size() << " objects for " << so_name;
+}
+
+void CCompartmentLoader::LoadSnapshot(const CCompartmentSnapshot& snapshot)
+{
+    if (!m_objects.empty())
+    {
+        throw CCapMgrException("Compartment loader has already loaded " + m_objects.front()->name);
+    }
+
+    for (size_t i = 0; i < snapshot.GetNumObjects(); i++)
+    {
+        std::unique_ptr<LoadedObject> obj{ new LoadedObject };
+        obj->name = snapshot.GetObjectState(i).name;
+        obj->path = snapshot.GetObjectState(i).path;
+
+        m_objects.push_back(std::move(obj));
+        MapObject(*m_objects.back(), &snapshot, i);
+    }
+
+    // The layout is the same as the snapshot's, so its TLS relocations still hold; the TLS starts afresh though
+    LayoutTls();
+
+    snapshot.RestoreCapabilities(*this);
+
+    for (const auto& obj : m_objects)
+    {
+        ProtectObject(*obj);
+    }
+
+    L_(DEBUG) << "Compartment loader cloned " << m_objects.size() << " objects from snapshot";
+}
+
+void* CCompartmentLoader::FindSymbol(const std::string& name) const
+{
+    const LoadedObject* def_obj = nullptr;
+    const Elf64_Sym* def_sym = nullptr;
+
+    if (!FindDefinition(name.c_str(), def_obj, def_sym))
+    {
+        return nullptr;
+    }
+
+    // Unsealed, so the caller can make the entry capability it needs
+    return reinterpret_cast<void*>(SymbolCapability(*def_obj, *def_sym, false));
+}
+
+CCompartmentLoader::MemoryStats CCompartmentLoader::GetMemoryStats() const
+{
+    MemoryStats stats;
+    for (const auto& obj : m_objects)
+    {
+        for (const auto& phdr : obj->phdrs)
+        {
+            if (phdr.p_type != PT_LOAD)
+            {
+                continue;
+            }
+
+            size_t size = cheri_align_up(phdr.p_vaddr + phdr.p_memsz, m_page_size) -
+                cheri_align_down(phdr.p_vaddr, m_page_size);
+            if (phdr.p_flags & PF_W)
+            {
+                stats.private_bytes += size;
+            }
+            else
+            {
+                stats.shared_bytes += size;
+            }
+        }
+    }
+    return stats;
+}
@@ -0,0 +1,160 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CCompartmentLoader: Loads compartment libraries directly, without dlopen()/dlmopen(), into restricted capabilities
+
+#ifndef __CCOMPARTMENTLOADER_H_
+#define __CCOMPARTMENTLOADER_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "shared_object_common.h"
+#include "CCapability.h"
+#include "CDynamicSection.h"
+
+class CCompartmentSnapshot;
+
+// Permissions for capabilities the loader gives to the compartment: never executive
+constexpr size_t kLoaderReadPerms =
+CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP | ARM_CAP_PERMISSION_MUTABLE_LOAD | CHERI_PERM_GLOBAL;
+
+constexpr size_t kLoaderDataPerms =
+kLoaderReadPerms | CHERI_PERM_STORE | CHERI_PERM_STORE_CAP | CHERI_PERM_STORE_LOCAL_CAP;
+
+constexpr size_t kLoaderExecPerms =
+kLoaderReadPerms | CHERI_PERM_EXECUTE;
+
+// CCompartmentLoader: Maps a library and its DT_NEEDED closure with mmap(), then processes the Morello capability
+// relocations directly into restricted capabilities, so there is no second copy of the C library per namespace and
+// no executive capabilities to patch afterwards.  It works the same in a static capability manager.
+// Symbols are resolved in load order (breadth first from the library), as for the system loader.
+// Limitations, which a slim compartment C library must keep within:
+// - Static TLS only (R_MORELLO_TPREL128, R_MORELLO_TLSDESC): the TLS blocks of all the objects are laid out once
+//   after the thread pointer, which the compartment gets from GetThreadPointer().  There is one copy per instance, so
+//   one thread in the compartment at a time, as for its stack.  With emulated capabilities the host TLS relocations
+//   are not supported, as the emulated switcher does not switch the thread pointer.
+// - No IFUNCs (R_MORELLO_IRELATIVE): loading fails.
+// - Constructors and destructors (DT_INIT, DT_INIT_ARRAY etc) are not run.
+// - No symbol versioning; the first definition of a name is used.
+// - No text relocations (DT_TEXTREL).
+// Further instances of the same library, from NewInstance(), share the opened files: read-only LOAD blocks are
+// mapped read-only from the same file and never written, so their pages are shared through the page cache and each
+// instance only costs its writable blocks (.data, .bss, GOT and the relocated capabilities) plus page tables.
+// The read-only blocks cannot share one virtual mapping, as code reaches its own instance's GOT PC-relative.
+// Throws CCapMgrException on any failure.
+class CCompartmentLoader
+{
+public:
+    struct LoadedObject
+    {
+        std::string name;               // As needed (or requested)
+        std::string path;
+        void* map = nullptr;            // Whole object reservation from mmap()
+        size_t span = 0;
+        Capability rw_cap;              // Executive RW capability over the object at the load base, only used by the loader
+        Capability rx_cap;              // Restricted RX capability over the object, for code pointers
+        std::vector<Elf64_Phdr> phdrs;
+        CDynamicSection dynsec;
+        const Elf64_Sym* symtab = nullptr;
+        size_t num_syms = 0;
+        const char* strtab = nullptr;
+        const Elf64_Phdr* tls = nullptr;    // PT_TLS, if the object has TLS
+        uint64_t tls_offset = 0;            // Of its TLS block from the thread pointer
+
+        // Address the ELF virtual addresses are relative to, like l_addr
+        Elf64_Addr LoadAddress() const { return cheri_address_get(static_cast<void*>(rw_cap)); }
+    };
+
+    // Bytes mapped for the loaded objects
+    struct MemoryStats
+    {
+        size_t shared_bytes = 0;        // Read-only LOAD blocks, shared by all instances
+        size_t private_bytes = 0;       // Writable LOAD blocks, private to the instance
+    };
+
+private:
+    // An opened library file, shared by all instances
+    struct Image
+    {
+        std::string path;
+        int fd = -1;
+        std::vector<Elf64_Phdr> phdrs;
+
+        ~Image() { if (fd >= 0) close(fd); }
+    };
+
+    struct ImageCache
+    {
+        std::mutex mutex;
+        std::map<std::string, std::shared_ptr<const Image>> images;     // Keyed by path
+    };
+
+    std::shared_ptr<ImageCache> m_images;
+    std::vector<std::string> m_search_paths;
+    Capability m_rw_cap;
+    Capability m_rx_cap;
+    size_t m_page_size;
+    void* m_tls_map = nullptr;              // TCB and TLS blocks of all the objects
+    size_t m_tls_span = 0;
+    void* m_thread_pointer = nullptr;       // Restricted, over the TLS map
+    uintptr_t m_tlsdesc_resolver = 0;       // Restricted sentry for static TLS descriptors
+
+    // In load order, which is the symbol lookup order
+    std::vector<std::unique_ptr<LoadedObject>> m_objects;
+
+    std::string FindLibrary(const std::string& name, const LoadedObject& needed_by) const;
+    std::shared_ptr<const Image> OpenImage(const std::string& path) const;
+    // Map the LOAD blocks; with a snapshot, the writable blocks are copy on write from it instead of the file
+    void MapObject(LoadedObject& obj, const CCompartmentSnapshot* snapshot = nullptr, size_t index = 0) const;
+    void RelocateObject(const LoadedObject& obj) const;
+    void ProtectObject(const LoadedObject& obj) const;
+    // Lay out the static TLS of the mapped objects and initialise it from their TLS images
+    void LayoutTls();
+
+    // Find the definition of a symbol with the hash tables, searching in load order.  Returns false if not found.
+    bool FindDefinition(const char* name, const LoadedObject*& def_obj, const Elf64_Sym*& def_sym) const;
+
+    // Restricted capability for a symbol definition: a sentry for functions, else bounded to the object
+    uintptr_t SymbolCapability(const LoadedObject& obj, const Elf64_Sym& sym, bool sentry) const;
+
+public:
+    // search_paths are folders to search for needed libraries, after the DT_RUNPATH of the library needing it
+    // rw_cap and rx_cap are executive capabilities covering the address space (e.g. AT_CHERI_EXEC_RW/RX_CAP)
+    CCompartmentLoader(const std::vector<std::string>& search_paths, const Capability& rw_cap, const Capability& rx_cap);
+    ~CCompartmentLoader();
+
+    // A loader for another instance, sharing the opened files with this one
+    std::unique_ptr<CCompartmentLoader> NewInstance() const;
+
+    CCompartmentLoader(const CCompartmentLoader&) = delete;
+    CCompartmentLoader& operator=(const CCompartmentLoader&) = delete;
+
+    // Load the library and its closure.  Can only be called once.
+    void Load(const std::string& so_name);
+
+    // Or load a clone of the instance in a snapshot.  The read-only blocks are mapped from the library files as
+    // for Load(), the writable blocks are copy on write from the snapshot, and the capabilities in them are rebuilt
+    // for this instance, so there is no relocation or symbol lookup.
+    void LoadSnapshot(const CCompartmentSnapshot& snapshot);
+
+    size_t GetNumObjects() const { return m_objects.size(); }
+    const LoadedObject& GetObject(size_t index) const { return *m_objects.at(index); }
+
+    MemoryStats GetMemoryStats() const;
+
+    // Restricted thread pointer for the compartment, over the TLS of the loaded objects, or nullptr if none has TLS
+    void* GetThreadPointer() const { return m_thread_pointer; }
+
+    // Is the capability the resolver put in static TLS descriptors?  It is in the capability manager.
+    bool IsTlsDescResolver(const void* cap) const
+    {
+        return m_tlsdesc_resolver != 0 && reinterpret_cast<uintptr_t>(cap) == m_tlsdesc_resolver;
+    }
+
+    // Restricted capability for a symbol, bounded to the defining object (unsealed for functions), or nullptr
+    void* FindSymbol(const std::string& name) const;
+};
+
+#endif /* __CCOMPARTMENTLOADER_H_ */
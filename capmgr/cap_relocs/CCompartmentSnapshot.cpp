@@ -0,0 +1,187 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CCompartmentSnapshot
+
+#include <cheriintrin.h>
+#include <cerrno>
+#include <sstream>
+#include <sys/mman.h>
+
+#include "CCompartmentSnapshot.h"
+#include "CCapMgrException.h"
+
+#include "CCapMgrLogger.h"
+using namespace CapMgr;
+
+CCompartmentSnapshot::CCompartmentSnapshot(const CCompartmentLoader& loader, bool allow_external_caps)
+{
+#if CAPMGR_EMULATED_CAPS
+    // Every non-null word looks like a capability, so the capabilities to rebuild cannot be told apart
+    (void)loader;
+    (void)allow_external_caps;
+    throw CCapMgrException("Snapshots need capability tags, which emulated capabilities do not have");
+#endif
+
+    if (loader.GetNumObjects() == 0)
+    {
+        throw CCapMgrException("Cannot snapshot a compartment loader which has not loaded anything");
+    }
+
+    m_fd = memfd_create("capmgr-snapshot", MFD_CLOEXEC);
+    if (m_fd < 0)
+    {
+        throw CCapMgrException(std::string("Cannot create snapshot memory file: ") + strerror(errno));
+    }
+
+    size_t page_size = getpagesize();
+    off_t file_size = 0;
+
+    for (size_t i = 0; i < loader.GetNumObjects(); i++)
+    {
+        const auto& obj = loader.GetObject(i);
+        auto base = reinterpret_cast<uint8_t*>(static_cast<void*>(obj.rw_cap));
+
+        ObjectState state;
+        state.name = obj.name;
+        state.path = obj.path;
+
+        for (const auto& phdr : obj.phdrs)
+        {
+            if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_W))
+            {
+                continue;
+            }
+
+            Block block;
+            block.vaddr = cheri_align_down(phdr.p_vaddr, page_size);
+            block.size = cheri_align_up(phdr.p_vaddr + phdr.p_memsz, page_size) - block.vaddr;
+            block.file_offset = file_size;
+
+            if (pwrite(m_fd, &base[block.vaddr], block.size, block.file_offset) != static_cast<ssize_t>(block.size))
+            {
+                close(m_fd);
+                throw CCapMgrException("Cannot write snapshot of " + obj.path + ": " + strerror(errno));
+            }
+            file_size += block.size;
+            state.blocks.push_back(block);
+
+            // Record the tagged capabilities, which the file loses
+            for (Elf64_Addr vaddr = block.vaddr; vaddr < block.vaddr + block.size; vaddr += sizeof(void*))
+            {
+                void* cap = *reinterpret_cast<void**>(&base[vaddr]);
+                if (!cheri_tag_get(cap))
+                {
+                    continue;
+                }
+
+                CapSlot slot;
+                slot.object = i;
+                slot.vaddr = vaddr;
+                slot.target_object = FindTarget(loader, cap);
+                slot.perms = cheri_perms_get(cap);
+                slot.sentry = cheri_is_sentry(cap);
+                slot.external = 0;
+
+                if (slot.target_object == kExternal)
+                {
+                    slot.base = slot.length = slot.address = 0;
+                    slot.external = reinterpret_cast<uintptr_t>(cap);
+                    if (!loader.IsTlsDescResolver(cap))
+                    {
+                        m_num_external++;
+                    }
+                }
+                else
+                {
+                    Elf64_Addr load_addr = loader.GetObject(slot.target_object).LoadAddress();
+                    slot.base = cheri_base_get(cap) - load_addr;
+                    slot.length = cheri_length_get(cap);
+                    slot.address = cheri_address_get(cap) - load_addr;
+                }
+                m_slots.push_back(slot);
+            }
+        }
+
+        m_objects.push_back(state);
+    }
+
+    if (m_num_external && !allow_external_caps)
+    {
+        close(m_fd);
+        std::ostringstream strstr;
+        strstr << "Snapshot has " << m_num_external << " capabilities to memory outside the compartment libraries";
+        throw CCapMgrException(strstr.str());
+    }
+
+    L_(DEBUG) << "Snapshot of " << m_objects.size() << " objects: " << file_size << " bytes, " << m_slots.size()
+        << " capabilities (" << m_num_external << " external)";
+}
+
+CCompartmentSnapshot::~CCompartmentSnapshot()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+    }
+}
+
+size_t CCompartmentSnapshot::FindTarget(const CCompartmentLoader& loader, void* cap)
+{
+    Elf64_Addr base = cheri_base_get(cap);
+    Elf64_Addr top = base + cheri_length_get(cap);
+
+    for (size_t i = 0; i < loader.GetNumObjects(); i++)
+    {
+        const auto& obj = loader.GetObject(i);
+        Elf64_Addr map_addr = cheri_address_get(obj.map);
+        if (base >= map_addr && top <= map_addr + obj.span)
+        {
+            return i;
+        }
+    }
+    return kExternal;
+}
+
+const CCompartmentSnapshot::Block& CCompartmentSnapshot::GetBlock(size_t index, Elf64_Addr vaddr) const
+{
+    for (const auto& block : m_objects.at(index).blocks)
+    {
+        if (block.vaddr == vaddr)
+        {
+            return block;
+        }
+    }
+    throw CCapMgrException("Snapshot has no block for " + m_objects.at(index).path);
+}
+
+void CCompartmentSnapshot::RestoreCapabilities(const CCompartmentLoader& clone) const
+{
+    if (clone.GetNumObjects() != m_objects.size())
+    {
+        throw CCapMgrException("Clone does not match the snapshot");
+    }
+
+    for (const auto& slot : m_slots)
+    {
+        auto base = reinterpret_cast<uint8_t*>(static_cast<void*>(clone.GetObject(slot.object).rw_cap));
+        auto target = reinterpret_cast<uintptr_t*>(&base[slot.vaddr]);
+
+        if (slot.target_object == kExternal)
+        {
+            *target = slot.external;
+            continue;
+        }
+
+        const auto& target_obj = clone.GetObject(slot.target_object);
+        Elf64_Addr load_addr = target_obj.LoadAddress();
+
+        Capability cap{ (slot.perms & CHERI_PERM_EXECUTE) ? target_obj.rx_cap : target_obj.rw_cap };
+        cap.SetBounds(load_addr + slot.base, slot.length)
+            .SetAddress(reinterpret_cast<void*>(load_addr + slot.address))
+            .SetPerms(slot.perms);
+        if (slot.sentry)
+        {
+            cap.SEntry();
+        }
+        *target = cap;
+    }
+}
@@ -0,0 +1,87 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CCompartmentSnapshot: Snapshot of the writable state of an initialised compartment instance, for cloning
+
+#ifndef __CCOMPARTMENTSNAPSHOT_H_
+#define __CCOMPARTMENTSNAPSHOT_H_
+
+#include <string>
+#include <vector>
+
+#include "shared_object_common.h"
+#include "CCompartmentLoader.h"
+
+// CCompartmentSnapshot: Copies the writable LOAD blocks of every object of a natively loaded instance into a memory
+// file, which clones map copy on write with CCompartmentLoader::LoadSnapshot().
+// Capability tags do not survive a file, so every tagged capability in the blocks is recorded when the snapshot is
+// taken and rebuilt by the clone with the same bounds, offset and permissions relative to its own objects.
+// The compartment stack needs no snapshot, as it is empty between calls.  Capabilities to memory outside the
+// instance (e.g. from cheri_malloc(), which the capability manager owns) would be shared by every clone, so taking
+// the snapshot throws unless allow_external_caps is set, in which case they are copied as they are.
+// Throws CCapMgrException on any failure.
+class CCompartmentSnapshot
+{
+public:
+    // Writable block of an object, page aligned
+    struct Block
+    {
+        Elf64_Addr vaddr;
+        size_t size;
+        off_t file_offset;      // In the memory file
+    };
+
+    struct ObjectState
+    {
+        std::string name;
+        std::string path;
+        std::vector<Block> blocks;
+    };
+
+    // Tagged capability in a writable block
+    struct CapSlot
+    {
+        size_t object;                  // Object and vaddr of the slot
+        Elf64_Addr vaddr;
+        size_t target_object;           // Object the capability is to, or kExternal
+        Elf64_Addr base;                // Bounds and address as vaddrs of the target object
+        size_t length;
+        Elf64_Addr address;
+        size_t perms;
+        bool sentry;
+        uintptr_t external;             // The capability itself, if external
+    };
+
+    static constexpr size_t kExternal = static_cast<size_t>(-1);
+
+private:
+    int m_fd = -1;
+    std::vector<ObjectState> m_objects;
+    std::vector<CapSlot> m_slots;
+    size_t m_num_external = 0;
+
+    // Which object of the loader holds the capability, or kExternal
+    static size_t FindTarget(const CCompartmentLoader& loader, void* cap);
+
+public:
+    // Snapshot an initialised instance, which must not be running in the compartment
+    explicit CCompartmentSnapshot(const CCompartmentLoader& loader, bool allow_external_caps = false);
+    ~CCompartmentSnapshot();
+
+    CCompartmentSnapshot(const CCompartmentSnapshot&) = delete;
+    CCompartmentSnapshot& operator=(const CCompartmentSnapshot&) = delete;
+
+    int GetFd() const { return m_fd; }
+
+    size_t GetNumObjects() const { return m_objects.size(); }
+    const ObjectState& GetObjectState(size_t index) const { return m_objects.at(index); }
+
+    // The block of an object starting at vaddr, throws if there is not one
+    const Block& GetBlock(size_t index, Elf64_Addr vaddr) const;
+
+    // Rebuild the capabilities in the writable blocks of a clone loaded from this snapshot
+    void RestoreCapabilities(const CCompartmentLoader& clone) const;
+
+    size_t GetNumCapabilities() const { return m_slots.size(); }
+    size_t GetNumExternal() const { return m_num_external; }
+};
+
+#endif /* __CCOMPARTMENTSNAPSHOT_H_ */
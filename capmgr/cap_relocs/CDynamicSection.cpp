@@ -2,6 +2,8 @@
 // Implements CDynamicSection
 
 #include <cheriintrin.h>
+#include <algorithm>
+#include <cstring>
 
 #include "CDynamicSection.h"
 #include "CCapMgrException.h"
@@ -17,9 +19,63 @@ CDynamicSection::CDynamicSection(elfptr_t base_addr, Elf64_Addr vaddr,
     // Traverse the elements
     while (dyn_addr_start < dyn_addr_end)
     {
-        m_secmap[dyn_addr_start->d_tag] = dyn_addr_start->d_un.d_ptr;
+        if (dyn_addr_start->d_tag == DT_NEEDED)
+        {
+            m_needed.push_back(dyn_addr_start->d_un.d_val);
+        }
+        else
+        {
+            m_secmap[dyn_addr_start->d_tag] = dyn_addr_start->d_un.d_ptr;
+        }
         dyn_addr_start++;
     }
+
+    // A loader which relocates a writable dynamic section adds the load address to the table addresses it uses,
+    // ref glibc elf_get_dynamic_info(), so make those relative to the base again
+    if (!m_readonly)
+    {
+        auto base = static_cast<Elf64_Addr>(reinterpret_cast<uintptr_t>(m_base));
+        for (auto tag : { DT_HASH, DT_PLTGOT, DT_STRTAB, DT_SYMTAB, DT_RELA, DT_REL, DT_JMPREL, DT_VERSYM,
+            DT_GNU_HASH })
+        {
+            auto itr = m_secmap.find(tag);
+            if (itr != m_secmap.end() && itr->second >= base)
+            {
+                itr->second -= base;
+            }
+        }
+    }
+
+    // Keep the symbol lookup tables to hand
+    auto itr = m_secmap.find(DT_SYMTAB);
+    if (itr != m_secmap.end())
+    {
+        m_symtab = reinterpret_cast<const Elf64_Sym*>(m_base + itr->second);
+    }
+
+    itr = m_secmap.find(DT_STRTAB);
+    if (itr != m_secmap.end())
+    {
+        m_strtab = reinterpret_cast<const char*>(m_base + itr->second);
+    }
+
+    itr = m_secmap.find(DT_GNU_HASH);
+    if (itr != m_secmap.end())
+    {
+        m_gnu_hash = reinterpret_cast<const uint32_t*>(m_base + itr->second);
+    }
+
+    itr = m_secmap.find(DT_HASH);
+    if (itr != m_secmap.end())
+    {
+        m_sysv_hash = reinterpret_cast<const uint32_t*>(m_base + itr->second);
+    }
+
+    itr = m_secmap.find(DT_VERSYM);
+    if (itr != m_secmap.end())
+    {
+        m_versym = reinterpret_cast<const uint16_t*>(m_base + itr->second);
+    }
 }
 
 Range CDynamicSection::GetPltRel(bool& isRela, size_t& elem_size) const
@@ -71,7 +127,193 @@ Range CDynamicSection::GetStrTab() const
 
 Range CDynamicSection::GetSymTab() const
 {
-    throw CCapMgrException("GetSymTab(): not implemented yet!");
+    uintptr_t addr = reinterpret_cast<uintptr_t>(m_base + GetEntry(DT_SYMTAB));
+    size_t sz = GetNumSymbols() * sizeof(Elf64_Sym);
+    return Range(addr, sz);
+}
+
+size_t CDynamicSection::GetNumSymbols() const
+{
+    // DT_HASH gives the count directly, as nchain
+    if (m_secmap.count(DT_HASH))
+    {
+        return reinterpret_cast<const uint32_t*>(GetHashAddr())[1];
+    }
+
+    if (!m_secmap.count(DT_GNU_HASH))
+    {
+        throw CCapMgrException("No hash table to size the symbol table");
+    }
+
+    // DT_GNU_HASH: the highest symbol is at the end of the chain of the highest bucket
+    auto gnu_hash = reinterpret_cast<const uint32_t*>(GetGnuHashAddr());
+    uint32_t nbuckets = gnu_hash[0];
+    uint32_t symoffset = gnu_hash[1];
+    uint32_t bloom_size = gnu_hash[2];
+
+    auto buckets = &gnu_hash[4 + bloom_size * (sizeof(uint64_t) / sizeof(uint32_t))];
+    auto chain = &buckets[nbuckets];
+
+    uint32_t last_sym = 0;
+    for (uint32_t i = 0; i < nbuckets; ++i)
+    {
+        last_sym = std::max(last_sym, buckets[i]);
+    }
+
+    if (last_sym < symoffset)
+    {
+        return symoffset;
+    }
+
+    while ((chain[last_sym - symoffset] & 1) == 0)
+    {
+        last_sym++;
+    }
+    return last_sym + 1;
+}
+
+uint32_t CDynamicSection::GnuHash(const char* name)
+{
+    // h * 33 + c for each character, expanded to eight characters a statement so the multiplies are independent
+    // and h stays in a register even when not optimised: the hash is most of the cost of a lookup
+    const uint32_t p1 = 33;
+    const uint32_t p2 = p1 * 33;
+    const uint32_t p3 = p2 * 33;
+    const uint32_t p4 = p3 * 33;
+    const uint32_t p5 = p4 * 33;
+    const uint32_t p6 = p5 * 33;
+    const uint32_t p7 = p6 * 33;
+    const uint32_t p8 = p7 * 33;
+
+    auto c = reinterpret_cast<const uint8_t*>(name);
+    auto end = c + strlen(name);
+    uint32_t h = 5381;
+    for (; end - c >= 8; c += 8)
+    {
+        h = h * p8 + c[0] * p7 + c[1] * p6 + c[2] * p5 + c[3] * p4 + c[4] * p3 + c[5] * p2 + c[6] * p1 + c[7];
+    }
+    for (; c < end; ++c)
+    {
+        h = h * 33 + *c;
+    }
+    return h;
+}
+
+uint32_t CDynamicSection::SysvHash(const char* name)
+{
+    uint32_t h = 0;
+    for (auto c = reinterpret_cast<const uint8_t*>(name); *c; ++c)
+    {
+        h = (h << 4) + *c;
+        uint32_t g = h & 0xf0000000;
+        if (g)
+        {
+            h ^= g >> 24;
+        }
+        h &= ~g;
+    }
+    return h;
+}
+
+const Elf64_Sym* CDynamicSection::LookupSymbol(const char* name, const SymbolHash& hash) const
+{
+    if (!m_symtab || !m_strtab)
+    {
+        return nullptr;
+    }
+
+    // The top bit of a DT_VERSYM entry marks a hidden version, which only a versioned lookup can find
+    auto is_match = [&](uint32_t index)
+    {
+        const auto& sym = m_symtab[index];
+        return sym.st_shndx != SHN_UNDEF && ELF64_ST_BIND(sym.st_info) != STB_LOCAL &&
+            !(m_versym && (m_versym[index] & 0x8000)) && strcmp(name, &m_strtab[sym.st_name]) == 0;
+    };
+
+    if (m_gnu_hash)
+    {
+        uint32_t nbuckets = m_gnu_hash[0];
+        uint32_t symoffset = m_gnu_hash[1];
+        uint32_t bloom_size = m_gnu_hash[2];
+        uint32_t bloom_shift = m_gnu_hash[3];
+        auto bloom = reinterpret_cast<const uint64_t*>(&m_gnu_hash[4]);
+
+        // Most names not defined here are rejected by the bloom filter without touching the chains
+        uint64_t word = bloom[(hash.gnu / 64) % bloom_size];
+        uint64_t mask = (1ULL << (hash.gnu % 64)) | (1ULL << ((hash.gnu >> bloom_shift) % 64));
+        if ((word & mask) != mask)
+        {
+            return nullptr;
+        }
+
+        auto buckets = reinterpret_cast<const uint32_t*>(&bloom[bloom_size]);
+        auto chain = &buckets[nbuckets];
+
+        uint32_t index = buckets[hash.gnu % nbuckets];
+        if (index < symoffset)
+        {
+            return nullptr;
+        }
+
+        while (true)
+        {
+            // The chain holds the hashes, with the bottom bit marking the end of the chain
+            uint32_t chain_hash = chain[index - symoffset];
+            if ((chain_hash | 1) == (hash.gnu | 1) && is_match(index))
+            {
+                return &m_symtab[index];
+            }
+            if (chain_hash & 1)
+            {
+                return nullptr;
+            }
+            index++;
+        }
+    }
+
+    if (m_sysv_hash)
+    {
+        uint32_t nbucket = m_sysv_hash[0];
+        auto buckets = &m_sysv_hash[2];
+        auto chain = &buckets[nbucket];
+
+        for (uint32_t index = buckets[hash.GetSysv() % nbucket]; index != STN_UNDEF; index = chain[index])
+        {
+            if (is_match(index))
+            {
+                return &m_symtab[index];
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+const Elf64_Sym* CDynamicSection::FindSymbolByAddress(Elf64_Addr vaddr) const
+{
+    if (!m_symtab || !m_strtab)
+    {
+        return nullptr;
+    }
+
+    size_t num_syms = GetNumSymbols();
+    for (size_t i = 1; i < num_syms; i++)
+    {
+        const auto& sym = m_symtab[i];
+        auto type = ELF64_ST_TYPE(sym.st_info);
+        if (sym.st_shndx == SHN_UNDEF || (type != STT_FUNC && type != STT_OBJECT))
+        {
+            continue;
+        }
+
+        // C64 function symbols have the bottom bit set
+        Elf64_Addr start = (type == STT_FUNC) ? (sym.st_value & ~1ULL) : sym.st_value;
+        if (vaddr >= start && vaddr < start + std::max<Elf64_Xword>(sym.st_size, 1))
+        {
+            return &sym;
+        }
+    }
+    return nullptr;
 }
 
 std::string CDynamicSection::GetSoName() const
@@ -81,11 +323,39 @@ std::string CDynamicSection::GetSoName() const
     return std::string(&addr[GetEntry(DT_SONAME)]);
 }
 
+std::vector<std::string> CDynamicSection::GetNeeded() const
+{
+    std::vector<std::string> needed;
+    if (!m_needed.empty())
+    {
+        auto strtab_info = GetStrTab();
+        char* addr = reinterpret_cast<char*>(strtab_info.base);
+        for (auto offset : m_needed)
+        {
+            needed.emplace_back(&addr[offset]);
+        }
+    }
+    return needed;
+}
+
+std::string CDynamicSection::GetRunPath() const
+{
+    auto strtab_info = GetStrTab();
+    char* addr = reinterpret_cast<char*>(strtab_info.base);
+    auto itr = m_secmap.find(DT_RUNPATH);
+    return std::string(&addr[(itr != m_secmap.end()) ? itr->second : GetEntry(DT_RPATH)]);
+}
+
 uintptr_t CDynamicSection::GetHashAddr() const
 {
     return reinterpret_cast<uintptr_t>(m_base + GetEntry(DT_HASH));
 }
 
+uintptr_t CDynamicSection::GetGnuHashAddr() const
+{
+    return reinterpret_cast<uintptr_t>(m_base + GetEntry(DT_GNU_HASH));
+}
+
 Range CDynamicSection::GetInitFn() const
 {
     uintptr_t addr = reinterpret_cast<uintptr_t>(m_base + GetEntry(DT_INIT));
@@ -6,6 +6,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <iostream>
 
 #include "CCapMgrLogger.h"
@@ -22,6 +23,14 @@ private:
     bool m_readonly;
     uint8_t *m_base;                    // Base address
     std::map<Elf64_Sxword, Elf64_Addr> m_secmap;
+    std::vector<Elf64_Addr> m_needed;   // DT_NEEDED can appear many times, so kept separately
+
+    // Tables for symbol lookup, or null if not present
+    const Elf64_Sym* m_symtab = nullptr;
+    const char* m_strtab = nullptr;
+    const uint32_t* m_gnu_hash = nullptr;
+    const uint32_t* m_sysv_hash = nullptr;
+    const uint16_t* m_versym = nullptr;
 
     //Get entry and throw if not found
     Elf64_Addr GetEntry(Elf64_Sxword tag) const
@@ -30,6 +39,33 @@ private:
     }
 
 public:
+    // Hashes of a symbol name for both hash tables, so a name is hashed once when looked up in many objects.
+    // The DT_HASH hash is only made for an object without DT_GNU_HASH, as it costs more than the lookup.
+    struct SymbolHash
+    {
+        const char* name;
+        uint32_t gnu;
+
+        explicit SymbolHash(const char* name_) : name(name_), gnu(GnuHash(name_)) {}
+
+        uint32_t GetSysv() const
+        {
+            if (!m_has_sysv)
+            {
+                m_sysv = SysvHash(name);
+                m_has_sysv = true;
+            }
+            return m_sysv;
+        }
+
+    private:
+        mutable uint32_t m_sysv = 0;
+        mutable bool m_has_sysv = false;
+    };
+
+    static uint32_t GnuHash(const char* name);
+    static uint32_t SysvHash(const char* name);
+
     CDynamicSection() {}
     CDynamicSection(elfptr_t base_addr, Elf64_Addr vaddr,
         Elf64_Xword mem_size, bool dyn_readonly);
@@ -45,12 +81,37 @@ public:
     Range GetRelaRel(size_t &elem_size) const;
 
     Range GetStrTab() const;
-    Range GetSymTab() const;
+    Range GetSymTab() const;               // Sized from the hash table
 
 
     std::string GetSoName() const;
 
+    // Names of the needed libraries, in order.  Empty rather than throwing if there are none.
+    std::vector<std::string> GetNeeded() const;
+
+    // DT_RUNPATH, or else DT_RPATH
+    std::string GetRunPath() const;
+
     uintptr_t GetHashAddr() const;
+    uintptr_t GetGnuHashAddr() const;
+
+    // Number of entries in the symbol table, which is only known from the hash tables
+    size_t GetNumSymbols() const;
+
+    // Find the definition of a symbol exported by this object with DT_GNU_HASH (and its bloom filter), or else
+    // DT_HASH.  Does not allocate, so is safe anywhere.  Returns nullptr if there is no definition.
+    // As for dlsym(), definitions marked hidden in DT_VERSYM (old versions, e.g. foo@VER beside foo@@VER) are
+    // skipped, so the default version is found; which version that is is not checked.
+    const Elf64_Sym* LookupSymbol(const char* name) const { return LookupSymbol(name, SymbolHash(name)); }
+    const Elf64_Sym* LookupSymbol(const char* name, const SymbolHash& hash) const;
+
+    // Defined function or object whose extent holds the vaddr, e.g. to name a PC when profiling.
+    // Scans the whole symbol table.  Returns nullptr if there is none.
+    const Elf64_Sym* FindSymbolByAddress(Elf64_Addr vaddr) const;
+
+    const char* GetSymbolName(const Elf64_Sym& sym) const { return &m_strtab[sym.st_name]; }
+
+    bool HasEntry(Elf64_Sxword tag) const { return m_secmap.count(tag) != 0; }
 
     Range GetInitFn() const;
     Range GetFiniFn() const;
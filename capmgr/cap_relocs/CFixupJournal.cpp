@@ -0,0 +1,49 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CFixupJournal
+
+#include <cheriintrin.h>
+
+#include "CCapMgrLogger.h"
+#include "CCapability.h"
+#include "CRelocationTable.h"
+#include "CFixupJournal.h"
+
+using namespace CapMgr;
+
+void CFixupJournal::Replay(uint8_t* base, const uint64_t* offsets, size_t first_entry, size_t last_entry,
+    const Capability& fixup_cap) const
+{
+    Stats stats;
+
+    for (size_t i = first_entry; i < last_entry; ++i)
+    {
+        uintptr_t original = m_originals[i];
+        if (!cheri_tag_get(original))
+        {
+            continue;   // Was not patched
+        }
+
+        uintptr_t* pAddress = reinterpret_cast<uintptr_t*>(&base[offsets[i]]);
+        uintptr_t current = *pAddress;
+
+        if (!cheri_tag_get(current))
+        {
+            L_(VERBOSE) << "[Revert cap: target addr=" << Capability(pAddress) << " - SKIPPED NO VALID TAG]";
+            stats.skipped++;
+        }
+        else if (cheri_is_equal_exact(current, CRelocationTable::DeriveFixupValue(fixup_cap, original, true)))
+        {
+            *pAddress = original;
+            stats.reverted++;
+        }
+        else
+        {
+            // Overwritten with a different capability since patching, so treat it as the table walk did
+            *pAddress = CRelocationTable::DeriveFixupValue(fixup_cap, current, false);
+            stats.changed++;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    m_stats += stats;
+}
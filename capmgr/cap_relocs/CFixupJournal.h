@@ -0,0 +1,78 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CFixupJournal: Record of the capabilities changed by the fixups of a shared object, so they can be reverted
+
+#ifndef __CFIXUPJOURNAL_H_
+#define __CFIXUPJOURNAL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "CCapability.h"
+
+// CFixupJournal: Holds the original capability for each fixup plan entry, so the address of an entry is the
+// plan offset and the journal only stores the capability.  Entries which were not patched (no valid tag) are NULL.
+// Replay writes back the original capabilities without walking the relocation tables.
+// Record and Replay may be called from different threads for different entries.
+class CFixupJournal
+{
+public:
+    struct Stats
+    {
+        size_t reverted = 0;            // Original capability written back
+        size_t changed = 0;             // Capability changed since patched, so derived from the current value instead
+        size_t skipped = 0;             // Tag no longer valid, so left alone
+
+        Stats& operator+=(const Stats& other)
+        {
+            reverted += other.reverted;
+            changed += other.changed;
+            skipped += other.skipped;
+            return *this;
+        }
+    };
+
+private:
+    std::vector<uintptr_t> m_originals;
+    bool m_recorded = false;
+
+    mutable std::mutex m_stats_mutex;
+    mutable Stats m_stats;
+
+public:
+    CFixupJournal() {}
+
+    // Clear the journal ready to record num_entries entries
+    void Start(size_t num_entries)
+    {
+        m_originals.assign(num_entries, 0);
+        m_recorded = true;
+        m_stats = Stats();
+    }
+
+    // Is there a journal to replay?
+    bool IsRecorded() const { return m_recorded; }
+
+    void Record(size_t entry, uintptr_t original) { m_originals[entry] = original; }
+
+    // Replay entries [first_entry, last_entry) of the plan offsets from base.
+    // fixup_cap is the capability the patched values were derived from, to detect changed entries.
+    void Replay(uint8_t* base, const uint64_t* offsets, size_t first_entry, size_t last_entry,
+        const Capability& fixup_cap) const;
+
+    // Finished replaying so the journal is used up
+    void Finish()
+    {
+        std::vector<uintptr_t>().swap(m_originals);
+        m_recorded = false;
+    }
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        return m_stats;
+    }
+};
+
+#endif /* __CFIXUPJOURNAL_H_ */
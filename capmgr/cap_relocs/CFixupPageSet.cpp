@@ -0,0 +1,51 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CFixupPageSet
+
+#include <cheriintrin.h>
+#include <cerrno>
+
+#include "CCapMgrLogger.h"
+#include "CFixupPageSet.h"
+
+using namespace CapMgr;
+
+CFixupPageSet::CFixupPageSet(const Capability& base, const uint64_t* offsets, size_t num_offsets,
+    const std::multimap<Elf64_Word, Elf64_Phdr>& phdrs, size_t page_size) : m_base(base),
+    m_stats(FixupPages::BuildRuns(offsets, num_offsets, phdrs, page_size, m_runs))
+{
+}
+
+bool CFixupPageSet::ProtectRun(const Run& run, int prot) const
+{
+    uint8_t* start = &reinterpret_cast<uint8_t*>(static_cast<void*>(m_base))[run.offset];
+
+    L_(VERBOSE) << "call mprotect(" << Capability(start) << ", 0x" << std::hex << run.size << ", 0x" << prot << ")";
+    if (0 != mprotect(start, run.size, prot))
+    {
+        L_(ERROR) << "Page run mprotect failed with error: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool CFixupPageSet::Unprotect() const
+{
+    for (const auto& run : m_runs)
+    {
+        if (!ProtectRun(run, PROT_READ | PROT_WRITE))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CFixupPageSet::Restore() const
+{
+    bool result = true;
+    for (const auto& run : m_runs)
+    {
+        result &= ProtectRun(run, run.orig_prot);
+    }
+    return result;
+}
@@ -0,0 +1,48 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CFixupPageSet: The pages of a shared object holding capability fixup targets, and their protection
+
+#ifndef __CFIXUPPAGESET_H_
+#define __CFIXUPPAGESET_H_
+
+#include <map>
+#include <vector>
+
+#include "shared_object_common.h"
+#include "CCapability.h"
+#include "fixup_page_runs.h"
+
+// CFixupPageSet: Rather than making every LOAD block writable for the fixups, only the pages which contain fixup
+// targets are made writable, and pages which are already writable are left alone.
+// Neighbouring pages with the same original protection are merged, so each run costs one mprotect() to unprotect
+// and one to restore.  See FixupPages::BuildRuns().
+class CFixupPageSet
+{
+public:
+    using Run = FixupPages::Run;
+    using Stats = FixupPages::Stats;
+
+private:
+    Capability m_base;
+    std::vector<Run> m_runs;
+    Stats m_stats;
+
+    bool ProtectRun(const Run& run, int prot) const;
+
+public:
+    CFixupPageSet() {}
+
+    // base must have the permissions needed to mprotect() the shared object
+    // offsets are the fixup targets, in ascending order
+    CFixupPageSet(const Capability& base, const uint64_t* offsets, size_t num_offsets,
+        const std::multimap<Elf64_Word, Elf64_Phdr>& phdrs, size_t page_size);
+
+    // Make the runs writable
+    bool Unprotect() const;
+
+    // Restore the runs to original protection.  Keeps going on error.
+    bool Restore() const;
+
+    const Stats& GetStats() const { return m_stats; }
+};
+
+#endif /* __CFIXUPPAGESET_H_ */
@@ -0,0 +1,185 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CFixupPlan
+
+#include <cheriintrin.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+#include <iomanip>
+
+#include "CCapMgrLogger.h"
+#include "CFixupPlan.h"
+
+using namespace CapMgr;
+
+CFixupPlan::CFixupPlan(const std::string& build_id, uint64_t reloc_entries, std::vector<uint64_t>&& offsets) :
+    m_owned_offsets(std::move(offsets)), m_build_id(build_id), m_reloc_entries(reloc_entries)
+{
+    m_offsets = m_owned_offsets.data();
+    m_num_offsets = m_owned_offsets.size();
+}
+
+CFixupPlan::~CFixupPlan()
+{
+    if (m_mapping)
+    {
+        munmap(m_mapping, m_mapping_size);
+    }
+}
+
+// FNV-1a over the offset values
+uint64_t CFixupPlan::Checksum(const uint64_t* offsets, size_t num_offsets)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < num_offsets; ++i)
+    {
+        hash ^= offsets[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::string CFixupPlan::CacheFileName(const std::string& build_id)
+{
+    std::ostringstream strstr;
+    for (auto c : build_id)
+    {
+        strstr << std::hex << std::setw(2) << std::setfill('0') << static_cast<unsigned>(static_cast<uint8_t>(c));
+    }
+    strstr << ".fxp";
+    return strstr.str();
+}
+
+std::shared_ptr<CFixupPlan> CFixupPlan::Load(const std::string& path, const std::string& build_id,
+    uint64_t reloc_entries, const Range& valid_range)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        L_(DEBUG) << "No fixup plan " << path;
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FileHeader))
+    {
+        L_(WARNING) << "Fixup plan " << path << " is truncated, rebuilding";
+        close(fd);
+        return nullptr;
+    }
+
+    // The checksum only catches damage, so a plan anyone else could have written is not trusted
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        L_(WARNING) << "Fixup plan " << path << " is not owned by this user or is writable by others, rebuilding";
+        close(fd);
+        return nullptr;
+    }
+
+    size_t file_size = static_cast<size_t>(st.st_size);
+    void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        L_(WARNING) << "Cannot mmap fixup plan " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+
+    std::shared_ptr<CFixupPlan> plan{ new CFixupPlan() };
+    plan->m_mapping = mapping;
+    plan->m_mapping_size = file_size;
+
+    auto header = reinterpret_cast<const FileHeader*>(mapping);
+    auto offsets = reinterpret_cast<const uint64_t*>(&header[1]);
+
+    // Stale: different library, different capability manager transform or different plan format
+    if (header->magic != kMagic || header->version != kVersion ||
+        header->build_id_len != build_id.size() || build_id.size() > kMaxBuildIdLen ||
+        0 != memcmp(header->build_id, build_id.data(), build_id.size()) ||
+        header->transform_perms != ARM_CAP_PERMISSION_EXECUTIVE ||
+        header->reloc_entries != reloc_entries)
+    {
+        L_(WARNING) << "Fixup plan " << path << " is stale, rebuilding";
+        return nullptr;
+    }
+
+    // Corrupt: sizes and contents must agree
+    if (header->num_offsets != (file_size - sizeof(FileHeader)) / sizeof(uint64_t) ||
+        (file_size - sizeof(FileHeader)) % sizeof(uint64_t) != 0 ||
+        header->checksum != Checksum(offsets, header->num_offsets))
+    {
+        L_(WARNING) << "Fixup plan " << path << " is corrupt, rebuilding";
+        return nullptr;
+    }
+
+    // Every offset must be a capability slot within the shared object
+    for (size_t i = 0; i < header->num_offsets; ++i)
+    {
+        if (!valid_range.Contains(Range(offsets[i], sizeof(void*))) || (offsets[i] % sizeof(void*)) != 0)
+        {
+            L_(WARNING) << "Fixup plan " << path << " has invalid offset 0x" << std::hex << offsets[i] << ", rebuilding";
+            return nullptr;
+        }
+    }
+
+    plan->m_offsets = offsets;
+    plan->m_num_offsets = header->num_offsets;
+    plan->m_build_id = build_id;
+    plan->m_reloc_entries = reloc_entries;
+
+    L_(DEBUG) << "Loaded fixup plan " << path << " with " << std::dec << plan->m_num_offsets << " fixups";
+    return plan;
+}
+
+bool CFixupPlan::Save(const std::string& path) const
+{
+    if (m_build_id.empty() || m_build_id.size() > kMaxBuildIdLen)
+    {
+        L_(ERROR) << "Cannot save fixup plan " << path << ": invalid build ID";
+        return false;
+    }
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.build_id_len = static_cast<uint32_t>(m_build_id.size());
+    memcpy(header.build_id, m_build_id.data(), m_build_id.size());
+    header.transform_perms = ARM_CAP_PERMISSION_EXECUTIVE;
+    header.reloc_entries = m_reloc_entries;
+    header.num_offsets = m_num_offsets;
+    header.checksum = Checksum(m_offsets, m_num_offsets);
+
+    // Write a temporary then rename, so a reader never sees a partial file
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    FILE* file = (fd < 0) ? nullptr : fdopen(fd, "wb");
+    if (!file)
+    {
+        L_(ERROR) << "Cannot create fixup plan " << tmp_path << ": " << strerror(errno);
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp_path.c_str());
+        }
+        return false;
+    }
+
+    bool result = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+        (m_num_offsets == 0 || fwrite(m_offsets, sizeof(uint64_t), m_num_offsets, file) == m_num_offsets);
+
+    result &= (fclose(file) == 0);
+
+    if (!result || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        L_(ERROR) << "Failed to write fixup plan " << path << ": " << strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    L_(DEBUG) << "Saved fixup plan " << path << " with " << std::dec << m_num_offsets << " fixups";
+    return true;
+}
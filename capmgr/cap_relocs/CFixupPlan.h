@@ -0,0 +1,80 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CFixupPlan: Persistent list of the capability fixups needed for one shared object
+
+#ifndef __CFIXUPPLAN_H_
+#define __CFIXUPPLAN_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "shared_object_common.h"
+#include "Range.h"
+
+// CFixupPlan: The offsets (from the shared object base) of every relocation target which needs its capability
+// patching, i.e the result of scanning all the relocation tables for the Morello relocation types and rejecting
+// the targets within the init/fini ranges.
+// This only depends on the ELF file, so it is cached on disk keyed by the NT_GNU_BUILD_ID of the shared object,
+// and subsequent loads of the same shared object apply the plan directly without scanning the tables.
+//
+// File layout: FileHeader followed by num_offsets uint64_t offsets, in ascending order.
+class CFixupPlan
+{
+public:
+    static constexpr uint32_t kMagic = 0x50584643;     // "CFXP"
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kMaxBuildIdLen = 64;
+
+    struct FileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t build_id_len;
+        uint32_t reserved;
+        uint8_t  build_id[kMaxBuildIdLen];
+        uint64_t transform_perms;       // Permissions which the fixup adds (executive) or removes (restricted)
+        uint64_t reloc_entries;         // Total entries in all relocation tables when the plan was built
+        uint64_t num_offsets;
+        uint64_t checksum;              // Over the offsets
+    };
+
+private:
+    std::vector<uint64_t> m_owned_offsets;  // Plan built in memory
+    void* m_mapping = nullptr;              // Plan loaded from a file, which is mmap()ed
+    size_t m_mapping_size = 0;
+    const uint64_t* m_offsets = nullptr;
+    size_t m_num_offsets = 0;
+    std::string m_build_id;
+    uint64_t m_reloc_entries = 0;
+
+    static uint64_t Checksum(const uint64_t* offsets, size_t num_offsets);
+
+    CFixupPlan() {}     // Used by Load()
+
+public:
+    // Construct from the result of scanning the relocation tables
+    CFixupPlan(const std::string& build_id, uint64_t reloc_entries, std::vector<uint64_t>&& offsets);
+
+    // Use Load() to construct from a file
+    CFixupPlan(const CFixupPlan&) = delete;
+    CFixupPlan& operator=(const CFixupPlan&) = delete;
+    ~CFixupPlan();
+
+    // Load and validate a plan from file.  Returns nullptr if the file does not exist, is corrupt or stale, or is not
+    // owned by the effective user or is writable by group or others, in which case the plan needs to be rebuilt.
+    // Each offset must be capability aligned and fall within the (offset) range valid_range
+    static std::shared_ptr<CFixupPlan> Load(const std::string& path, const std::string& build_id,
+        uint64_t reloc_entries, const Range& valid_range);
+
+    // Write to file (mode 0600), replacing any existing file atomically
+    bool Save(const std::string& path) const;
+
+    // File name to use in the cache for a shared object with the given build ID
+    static std::string CacheFileName(const std::string& build_id);
+
+    const uint64_t* GetOffsets() const { return m_offsets; }
+    size_t GetNumOffsets() const { return m_num_offsets; }
+    bool IsMapped() const { return m_mapping != nullptr; }
+};
+
+#endif /* __CFIXUPPLAN_H_ */
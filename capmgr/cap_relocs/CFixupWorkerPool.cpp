@@ -0,0 +1,133 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CFixupWorkerPool
+
+#include <algorithm>
+
+#include "CFixupWorkerPool.h"
+
+CFixupWorkerPool::~CFixupWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    for (auto& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+CFixupWorkerPool& CFixupWorkerPool::GetDefault()
+{
+    static CFixupWorkerPool pool;
+    return pool;
+}
+
+void CFixupWorkerPool::RunTasks()
+{
+    const std::vector<Task>& tasks = *m_tasks;
+    size_t idx;
+    while ((idx = m_next_task.fetch_add(1, std::memory_order_relaxed)) < tasks.size())
+    {
+        try
+        {
+            m_results[idx] = tasks[idx]() ? 1 : 0;
+        }
+        catch (...)
+        {
+            m_results[idx] = 0;
+            m_exceptions[idx] = std::current_exception();
+        }
+    }
+}
+
+void CFixupWorkerPool::WorkerMain(unsigned index)
+{
+    uint64_t seen_generation = 0;
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (;;)
+    {
+        m_wake.wait(lock, [&]() { return m_stopping || m_generation != seen_generation; });
+        if (m_stopping)
+        {
+            return;
+        }
+        seen_generation = m_generation;
+
+        // Workers beyond those wanted for this pass sit it out
+        if (index >= m_num_workers)
+        {
+            continue;
+        }
+
+        lock.unlock();
+        RunTasks();
+        lock.lock();
+
+        if (--m_running == 0)
+        {
+            m_done.notify_one();
+        }
+    }
+}
+
+size_t CFixupWorkerPool::RunAll(const std::vector<Task>& tasks, unsigned num_threads)
+{
+    std::lock_guard<std::mutex> run_lock(m_run_lock);
+
+    if (tasks.empty())
+    {
+        return kNoFailure;
+    }
+
+    // No point having more threads than tasks
+    unsigned num_workers = static_cast<unsigned>(std::min<size_t>(num_threads ? num_threads : 1, tasks.size())) - 1;
+
+    m_results.assign(tasks.size(), 1);
+    m_exceptions.assign(tasks.size(), nullptr);
+    m_next_task.store(0, std::memory_order_relaxed);
+    m_tasks = &tasks;
+
+    if (num_workers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            while (m_threads.size() < num_workers)
+            {
+                m_threads.emplace_back(&CFixupWorkerPool::WorkerMain, this, static_cast<unsigned>(m_threads.size()));
+            }
+            m_num_workers = num_workers;
+            m_running = num_workers;
+            ++m_generation;
+        }
+        m_wake.notify_all();
+    }
+
+    // Calling thread does its share too
+    RunTasks();
+
+    if (num_workers)
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_done.wait(lock, [&]() { return m_running == 0; });
+    }
+    m_tasks = nullptr;
+
+    // Report in task order, so the result does not depend on scheduling
+    for (size_t idx = 0; idx < tasks.size(); ++idx)
+    {
+        if (!m_results[idx])
+        {
+            if (m_exceptions[idx])
+            {
+                std::rethrow_exception(m_exceptions[idx]);
+            }
+            return idx;
+        }
+    }
+
+    return kNoFailure;
+}
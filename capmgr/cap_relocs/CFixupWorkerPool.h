@@ -0,0 +1,68 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CFixupWorkerPool: Runs independent capability fixup chunks across a number of worker threads
+
+#ifndef __CFIXUPWORKERPOOL_H_
+#define __CFIXUPWORKERPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// CFixupWorkerPool: Each task is one chunk of fixup work (e.g a range of entries in one relocation table).
+// Tasks must be independent of each other as they can be run in any order on any thread.
+// Errors are reported deterministically: whatever the scheduling, the failure reported is always
+// the one from the lowest indexed task which failed.
+// The worker threads are started the first time they are needed and then wait for the next RunAll(), so a
+// fixup pass only pays for waking them rather than creating them.
+class CFixupWorkerPool
+{
+public:
+    using Task = std::function<bool()>;
+
+    static constexpr size_t kNoFailure = static_cast<size_t>(-1);
+
+private:
+    std::mutex m_run_lock;                      // Held for the whole of a RunAll(), one pass at a time
+    std::mutex m_lock;                          // Protects the rest
+    std::condition_variable m_wake;             // Signalled to start a pass or stop
+    std::condition_variable m_done;             // Signalled when the last worker of a pass finishes
+    std::vector<std::thread> m_threads;
+    uint64_t m_generation = 0;                  // Incremented for each pass
+    unsigned m_num_workers = 0;                 // Workers taking part in the current pass
+    unsigned m_running = 0;                     // Of those, the number not yet finished
+    bool m_stopping = false;
+
+    // Current pass
+    const std::vector<Task>* m_tasks = nullptr;
+    std::vector<char> m_results;                // Per task outcome, written only by the thread which ran the task
+    std::vector<std::exception_ptr> m_exceptions;
+    std::atomic<size_t> m_next_task{ 0 };
+
+    void WorkerMain(unsigned index);
+    void RunTasks();
+
+public:
+    CFixupWorkerPool() = default;
+    ~CFixupWorkerPool();
+
+    CFixupWorkerPool(const CFixupWorkerPool&) = delete;
+    CFixupWorkerPool& operator=(const CFixupWorkerPool&) = delete;
+
+    // Pool shared by all compartments
+    static CFixupWorkerPool& GetDefault();
+
+    // Run all the tasks and wait for completion.
+    // num_threads is the total number of threads to use, including the calling thread.
+    // Returns the index of the first (lowest indexed) task which returned false, or kNoFailure.
+    // If any task throws then the exception from the lowest indexed throwing task is rethrown, provided
+    // no lower indexed task returned false.
+    size_t RunAll(const std::vector<Task>& tasks, unsigned num_threads);
+};
+
+#endif /* __CFIXUPWORKERPOOL_H_ */
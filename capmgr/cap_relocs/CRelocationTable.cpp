@@ -10,9 +10,25 @@
 #include "CCapability.h"
 #include "CRelocationTable.h"
 #include "CCapMgrException.h"
+#include "reloc_scan_kernel.h"
 
 using namespace CapMgr;
 
+#if CAPMGR_EMULATED_CAPS
+// The host's pointer relocations stand in for the Morello ones
+const std::map< Elf64_Xword, std::string> CRelocationTable::m_reloc_id_map = {
+#if defined(__x86_64__)
+    {R_X86_64_64, "R_X86_64_64"},
+    {R_X86_64_GLOB_DAT, "R_X86_64_GLOB_DAT"},
+    {R_X86_64_JUMP_SLOT, "R_X86_64_JUMP_SLOT"},
+    {R_X86_64_RELATIVE, "R_X86_64_RELATIVE"}
+#else
+    {R_AARCH64_GLOB_DAT, "R_AARCH64_GLOB_DAT"},
+    {R_AARCH64_JUMP_SLOT, "R_AARCH64_JUMP_SLOT"},
+    {R_AARCH64_RELATIVE, "R_AARCH64_RELATIVE"}
+#endif
+};
+#else
 // Ref Morello Aarch64 ABI for the below
 const std::map< Elf64_Xword, std::string> CRelocationTable::m_reloc_id_map = {
     {R_MORELLO_CAPINIT, "R_MORELLO_CAPINIT"},
@@ -22,6 +38,7 @@ const std::map< Elf64_Xword, std::string> CRelocationTable::m_reloc_id_map = {
     // Add TLSDESC support too
     {R_MORELLO_TLSDESC, "R_MORELLO_TLSDESC"}
 };
+#endif
 
 Range CRelocationTable::CheckAndGetRange() const
 {
@@ -82,77 +99,58 @@ std::string CRelocationTable::DumpTable() const
     return strstr.str();
 }
 
-bool CRelocationTable::PatchCaps(const std::vector<Range> &unmodify_ranges, bool makeRestricted) const
+size_t CRelocationTable::GetNumEntries() const
 {
-    /* For each relocation symbol in the table:
-        (1) Check relocation type, if not one we care about then move on.
-        (2) else resolve the full target address.
-        (3) read the value at the target address.
-        (4) if it is a valid capability (with tag) clear executive permission and set bounds(todo)
-     */
-     // Get table dynamics along with check
     Range range{ CheckAndGetRange() };
+    return range.Size() / (IsRela() ? sizeof(Elf64_Rela) : sizeof(Elf64_Rel));
+}
 
-    uint8_t* start = reinterpret_cast<uint8_t*>(range.base);
-    uint8_t* stop = reinterpret_cast<uint8_t*>(range.top);
+void CRelocationTable::CollectFixupOffsets(const std::vector<Range>& unmodify_ranges, std::vector<uint64_t>& offsets) const
+{
+    CollectFixupOffsets(RangeSet(unmodify_ranges, m_base), offsets);
+}
 
-    size_t increment = IsRela() ? sizeof(Elf64_Rela) : sizeof(Elf64_Rel);
+void CRelocationTable::CollectFixupOffsets(const RangeSet& unmodify_offsets, std::vector<uint64_t>& offsets) const
+{
+    Range range{ CheckAndGetRange() };
 
-    // Flag to note quick skip of range checks
-    bool skip_range_checks = unmodify_ranges.empty() ? true : false;
+    auto on_fixup = [&](const auto* p) { offsets.push_back(p->r_offset); };
+    auto on_skipped = [](const auto*) {};
 
-    while (start < stop)
+    if (IsRela())
     {
-        Elf64_Rela* p = reinterpret_cast<Elf64_Rela*>(start);
+        RelocScan::ScanFixupTargets(reinterpret_cast<const Elf64_Rela*>(range.base), reinterpret_cast<const Elf64_Rela*>(range.top),
+            unmodify_offsets, on_fixup, on_skipped);
+    }
+    else
+    {
+        RelocScan::ScanFixupTargets(reinterpret_cast<const Elf64_Rel*>(range.base), reinterpret_cast<const Elf64_Rel*>(range.top),
+            unmodify_offsets, on_fixup, on_skipped);
+    }
+}
 
-        // Check cap type
-        if (RelocTypeNeedFixUp(p->r_info))
-        {
+bool CRelocationTable::FindFirstFixupValue(const RangeSet& unmodify_offsets, uintptr_t& value) const
+{
+    Range range{ CheckAndGetRange() };
+    size_t increment = IsRela() ? sizeof(Elf64_Rela) : sizeof(Elf64_Rel);
 
-            // Resolve target address
-            uintptr_t* pAddress = reinterpret_cast<uintptr_t*>(m_base + p->r_offset);
-
-            // Check if it is needed for reloc
-            if (!skip_range_checks && !CRelocationTable::IsValid(pAddress, unmodify_ranges))
-            {
-                L_(VERBOSE) << "[Fixup cap: offset=0x" << std::hex << p->r_offset << " type="
-                    << CRelocationTable::m_reloc_id_map.at(ELF64_R_TYPE(p->r_info)) << " target addr="
-                    << Capability(pAddress) << " - SKIPPED NOT IN RANGE]";
-            }
-            else
-            {
-                uintptr_t val_to_fixup = *pAddress;
-
-                if (!cheri_tag_get(val_to_fixup))
-                {
-                    L_(VERBOSE) << "[Fixup cap: offset=0x" << std::hex << p->r_offset << " type="
-                        << CRelocationTable::m_reloc_id_map.at(ELF64_R_TYPE(p->r_info)) << " target addr="
-                        << Capability(pAddress) << " - SKIPPED NO VALID TAG]";
-                }
-                else
-                {
-                    L_(VERBOSE) << "[Fixup cap: offset=0x" << std::hex << p->r_offset << " type="
-                        << CRelocationTable::m_reloc_id_map.at(ELF64_R_TYPE(p->r_info)) << " target addr="
-                        << Capability(pAddress);
-
-                    // Only proceed if valid tag found
-                    L_(VERBOSE) << " curr_val=" << Capability(reinterpret_cast<void*>(val_to_fixup));
-
-                    // We will derive a capability from the base.  Set address, bounds and perms to what is already there except
-                    // optionally set executive perm too.
-
-                    val_to_fixup = DeriveFixupValue(val_to_fixup, makeRestricted);
-
-                    *pAddress = val_to_fixup;
-                    L_(VERBOSE) << " new_val=" << Capability(reinterpret_cast<void*>(*pAddress)) << "]";
-                }
-            }
+    // Rel and Rela entries both start with r_offset and r_info
+    for (uintptr_t entry = range.base; entry < range.top; entry += increment)
+    {
+        auto p = reinterpret_cast<const Elf64_Rel*>(entry);
+        if (!RelocTypeNeedFixUp(p->r_info) || unmodify_offsets.Intersects(Range(p->r_offset, sizeof(void*))))
+        {
+            continue;
         }
 
-        start += increment;
+        uintptr_t val = *reinterpret_cast<uintptr_t*>(m_base + p->r_offset);
+        if (cheri_tag_get(val))
+        {
+            value = val;
+            return true;
+        }
     }
-
-    return true;
+    return false;
 }
 
 // Check if address is in one of the given ranges - if so, it isn't valid for reloc
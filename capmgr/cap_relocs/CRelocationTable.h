@@ -4,6 +4,7 @@
 #ifndef __CRELOCATIONTABLE_H_
 #define __CRELOCATIONTABLE_H_
 
+#include <stdexcept>
 #include <string>
 #include <iostream>
 #include <vector>
@@ -11,6 +12,7 @@
 #include "shared_object_common.h"
 #include "Range.h"
 #include "CDynamicSection.h"
+#include "reloc_scan_kernel.h"
 
 // A relocation table either .rela.dyn or .rela.plt
 // Note dynamic tags of interest:
@@ -29,7 +31,7 @@
 // CRelocationTable: Virtual base for common reltable fns
 class CRelocationTable
 {
-    // Morello IDs which are interested in
+    // Names of the Morello IDs which are interested in (the set itself is RelocScan::kFixupRelocTypes)
     static const std::map< Elf64_Xword, std::string> m_reloc_id_map;
 
 protected:
@@ -47,7 +49,7 @@ protected:
     // Given an r_info field, check if the reloc type is one of those which needs fixing up
     bool RelocTypeNeedFixUp(Elf64_Xword r_info) const
     {
-        return (m_reloc_id_map.count(ELF64_R_TYPE(r_info)) != 0);
+        return RelocScan::NeedsFixup(r_info);
     }
 
 public:
@@ -67,9 +69,19 @@ public:
     // Dump the whole table to a string
     std::string DumpTable() const;
 
-    // Patch-up target caps
-    // Can supply ignore range and choose if to set restricted or to executive
-    bool PatchCaps(const std::vector<Range>& unmodify_ranges = {}, bool makeRestricted=true) const;
+    // Number of relocation entries in the table, throws if the table is not present
+    size_t GetNumEntries() const;
+
+    const std::string& GetName() const { return m_tabname; }
+
+    // Append the offset of every target which needs patching (i.e. the fixup plan), without patching anything
+    // Whether the target actually holds a valid capability is only known when patching.
+    void CollectFixupOffsets(const std::vector<Range>& unmodify_ranges, std::vector<uint64_t>& offsets) const;
+    void CollectFixupOffsets(const RangeSet& unmodify_offsets, std::vector<uint64_t>& offsets) const;
+
+    // Find the first fixup target which holds a valid capability, stopping there rather than scanning the table.
+    // Returns false if there is none.
+    bool FindFirstFixupValue(const RangeSet& unmodify_offsets, uintptr_t& value) const;
 
     // Check if an address is valid, reject if it is within one of the skip ranges
     static bool IsValid(uintptr_t *pAddress, const std::vector<Range>& unmodify_ranges);
@@ -77,7 +89,12 @@ public:
     // Work out the fixup value from the base cap
     uintptr_t DeriveFixupValue(uintptr_t val_to_fixup, bool makeRestricted = true) const
     {
-        auto cap = Capability(m_fixup_cap)
+        return DeriveFixupValue(m_fixup_cap, val_to_fixup, makeRestricted);
+    }
+
+    static uintptr_t DeriveFixupValue(const Capability& fixup_cap, uintptr_t val_to_fixup, bool makeRestricted)
+    {
+        auto cap = Capability(fixup_cap)
             .DeriveFromCap(reinterpret_cast<void*>(val_to_fixup),
                 makeRestricted ? 0 : ARM_CAP_PERMISSION_EXECUTIVE,  // Perms we explicitly want to add
                 makeRestricted ? ARM_CAP_PERMISSION_EXECUTIVE : 0   // Perms we explicitly want to remove
@@ -128,12 +145,19 @@ public:
 //.plt.rel(a)
 class CPltRel : public CRelocationTable
 {
-    bool m_is_rela;
-    size_t m_elem_size;
+    bool m_is_rela = false;
+    size_t m_elem_size = 0;
     Range m_plt_range;
+    bool m_has_plt = false;             // An so with no PLT (e.g. no calls to other sos) has no DT_JMPREL
 
     virtual Range GetRelTableRange(size_t& elem_size) const
     {
+        if (!m_has_plt)
+        {
+            // As the dynamic section getters do for the other tables
+            throw std::out_of_range(".rel(a).plt not present");
+        }
+
         elem_size = m_elem_size;
         return m_plt_range;
     }
@@ -148,7 +172,12 @@ public:
         CRelocationTable(dynsec, elf_base_addr, ".rel(a).plt", fixup_cap)
     {
         // In the constructor we get the table so we can read the rela flag
-        m_plt_range = m_dynsec.GetPltRel(m_is_rela, m_elem_size);
+        try
+        {
+            m_plt_range = m_dynsec.GetPltRel(m_is_rela, m_elem_size);
+            m_has_plt = true;
+        }
+        catch (std::out_of_range&) {}
     }
 };
 
@@ -3,6 +3,7 @@
 
 #include <cheriintrin.h>
 #include <vector>
+#include <algorithm>
 #include <sstream>
 
 #include "CCapMgrLogger.h"
@@ -10,9 +11,22 @@
 #include "CSharedObject.h"
 #include "CCapMgrException.h"
 #include "CRelocationTable.h"
+#include "CHugePages.h"
+#include "fixup_page_runs.h"
+#include "CTracer.h"
 
 using namespace CapMgr;
 
+// Per entry fixup tracing is only compiled in when CAPMGR_FIXUP_TRACE is set, since building the trace output
+// costs far more than the patching itself
+#ifndef CAPMGR_FIXUP_TRACE
+#define CAPMGR_FIXUP_TRACE 0
+#endif
+
+#define FIXUP_TRACE \
+    if (!CAPMGR_FIXUP_TRACE) ; \
+    else L_(VERBOSE)
+
 void CSharedObject::Load(const Elf64_Phdr* phdrs, Elf64_Half num_hdrs, const Capability& fixup_cap)
 {
     if (m_loaded)
@@ -27,6 +41,7 @@ void CSharedObject::Load(const Elf64_Phdr* phdrs, Elf64_Half num_hdrs, const Cap
     }
 
     m_loaded = true;
+    m_fixup_cap = fixup_cap;
 
     if (m_phdrs.empty())
     {
@@ -42,6 +57,9 @@ void CSharedObject::Load(const Elf64_Phdr* phdrs, Elf64_Half num_hdrs, const Cap
         std::make_shared<CRelDyn>(m_dynsec, GetBase(), fixup_cap),
         std::make_shared<CRelaDyn>(m_dynsec, GetBase(), fixup_cap)
     };
+
+    m_unmodify_ranges = parseUnmodifyRanges();
+    m_unmodify_offsets = RangeSet(m_unmodify_ranges, m_base);
 }
 
 // Generate a dynamic section from the loaded data
@@ -70,146 +88,463 @@ CDynamicSection CSharedObject::parseDynamicSection() const
     return CDynamicSection(m_base, phdr_ref.p_vaddr, phdr_ref.p_memsz, dyn_readonly);
 }
 
-bool CSharedObject::ProtectAllBlocks(Elf64_Word type, bool restore_original, int64_t prot_required) const
+std::string CSharedObject::DumpRelocTables() const
 {
-    // Find matches
-    auto itrs = m_phdrs.equal_range(type);
-    bool result = true;
+    std::stringstream strstr;
 
-    for (auto itr = itrs.first; itr != itrs.second; ++itr)
+    if (!m_loaded)
     {
-        // Keep going on error
-        result &= ProtectBlock(itr->second, restore_original, prot_required);
+        throw CCapMgrException("Shared object is not loaded!");
     }
-    return result;
+
+    strstr << "Relocation Tables for " << m_name_full << ":" << std::endl;
+    for (const auto& p_reloc_table : m_reloctables)
+    {
+        try
+        {
+            strstr << p_reloc_table->DumpTable();
+        }
+        catch (std::out_of_range&)
+        {
+        }
+    }
+
+    return strstr.str();
+
 }
 
-bool CSharedObject::ProtectBlock(const Elf64_Phdr& phdr, bool restore_original, int64_t prot_required) const
+// Build an array of ranges, whereby if the target is within any range then
+// it's capability should not be modified
+std::vector<Range> CSharedObject::parseUnmodifyRanges() const
 {
-    // Get the address of the start of the block and the size
-    void* base = m_base;
-    uint8_t* block_start = &(reinterpret_cast<uint8_t*>(base))[phdr.p_vaddr];
-    uint8_t* block_aligned = cheri_align_down(block_start, m_page_size);
+    // The getters throw on no entry for these in dynamic section
+    std::vector<Range> unmodify_ranges;
+
+    try
+    {
+        unmodify_ranges.push_back(m_dynsec.GetInitFn());
+    }
+    catch (std::out_of_range&) {}
 
-    size_t sz = phdr.p_memsz + reinterpret_cast<ptrdiff_t>((block_start - block_aligned));
+    try
+    {
+        unmodify_ranges.push_back(m_dynsec.GetFiniFn());
+    }
+    catch (std::out_of_range&) {}
 
-    L_(VERBOSE) << "ProtectBlock: type=" << phdr.p_type << " vaddr_offset=0x" << std::hex << phdr.p_vaddr
-        << " size=0x" << phdr.p_memsz << " flags=0x" << phdr.p_flags;
+    try
+    {
+        unmodify_ranges.push_back(m_dynsec.GetInitArray());
+    }
+    catch (std::out_of_range&) {}
 
-    // Figure out the perms we need
-    if (restore_original)
+    try
     {
-        prot_required = 0;
-        if (phdr.p_flags & PF_X)
-            prot_required |= PROT_EXEC;
+        unmodify_ranges.push_back(m_dynsec.GetFiniArray());
+    }
+    catch (std::out_of_range&) {}
+
+    return unmodify_ranges;
+}
+
+const CFixupPlan& CSharedObject::GetFixupPlan() const
+{
+    if (!m_fixup_plan)
+    {
+        m_fixup_plan = BuildFixupPlan();
+    }
+    return *m_fixup_plan;
+}
 
-        if (phdr.p_flags & PF_W)
-            prot_required |= PROT_WRITE;
+const CFixupPageSet& CSharedObject::GetPageSet() const
+{
+    if (!m_page_set)
+    {
+        const CFixupPlan& plan = GetFixupPlan();
+        m_page_set = std::make_shared<CFixupPageSet>(m_base, plan.GetOffsets(), plan.GetNumOffsets(), m_phdrs, m_page_size);
+    }
+    return *m_page_set;
+}
 
-        if (phdr.p_flags & PF_R)
-            prot_required |= PROT_READ;
+bool CSharedObject::PrepareFixups() const
+{
+    if (!m_loaded)
+    {
+        throw CCapMgrException("Shared object is not loaded!");
     }
 
-    L_(VERBOSE) << "call mprotect(" << Capability(block_aligned) << ", 0x" << sz << ", 0x" << prot_required << ")";
-    if (0 != mprotect(block_aligned, sz, prot_required))
+    static const uint32_t trace_id = CTracer::InternName("fixup_unprotect");
+    CTraceScope trace_scope(trace_id);
+
+    const CFixupPageSet& page_set = GetPageSet();
+
+    L_(VERBOSE) << "Make fixup target pages writable";
+    if (!page_set.Unprotect())
     {
-        L_(ERROR) << "Block mprotect failed with error: " << strerror(errno);
+        L_(ERROR) << "Failed to mprotect fixup target pages";
+        page_set.Restore();
         return false;
     }
     return true;
 }
 
-std::string CSharedObject::DumpRelocTables() const
+bool CSharedObject::FinishFixups() const
 {
-    std::stringstream strstr;
+    static const uint32_t trace_id = CTracer::InternName("fixup_restore");
+    CTraceScope trace_scope(trace_id);
 
+    if (m_replaying)
+    {
+        auto stats{ m_journal->GetStats() };
+        L_(VERBOSE) << "Fixup journal for " << m_name_full << ": " << stats.reverted << " reverted, "
+            << stats.changed << " changed, " << stats.skipped << " skipped";
+        m_journal->Finish();
+        m_replaying = false;
+    }
+
+    L_(VERBOSE) << "Restore fixup target pages to original access settings";
+    if (!GetPageSet().Restore())
+    {
+        L_(ERROR) << "Failed to mprotect fixup target pages";
+        return false;
+    }
+    return true;
+}
+
+void CSharedObject::AppendFixupChunks(std::vector<std::function<bool()>>& chunks, size_t max_chunk_entries,
+    bool makeRestricted) const
+{
     if (!m_loaded)
     {
         throw CCapMgrException("Shared object is not loaded!");
     }
 
-    strstr << "Relocation Tables for " << m_name_full << ":" << std::endl;
+    if (max_chunk_entries == 0)
+    {
+        max_chunk_entries = SIZE_MAX;
+    }
+
+    bool replay = StartJournal(makeRestricted);
+    size_t num_entries = GetFixupPlan().GetNumOffsets();
+    for (size_t first = 0; first < num_entries; first += max_chunk_entries)
+    {
+        size_t count = std::min(max_chunk_entries, num_entries - first);
+        if (replay)
+        {
+            chunks.emplace_back([this, first, count]()
+            {
+                return RevertFromJournal(first, count);
+            });
+        }
+        else
+        {
+            chunks.emplace_back([this, first, count, makeRestricted]()
+            {
+                return PatchFromPlan(first, count, makeRestricted);
+            });
+        }
+    }
+}
+
+// Do all the reloc fixups
+bool CSharedObject::DoLibCapFixups(bool makeRestricted) const
+{
+    if (!PrepareFixups())
+    {
+        return false;
+    }
+
+    bool result = StartJournal(makeRestricted) ?
+        RevertFromJournal(0, SIZE_MAX) : PatchFromPlan(0, SIZE_MAX, makeRestricted);
+
+    if (!result)
+    {
+        L_(ERROR) << "Process fixups FAILED for " << m_name_full;
+        FinishFixups();
+        return false;
+    }
+
+    return FinishFixups();
+}
+
+bool CSharedObject::PatchFromPlan(size_t first_entry, size_t num_entries, bool makeRestricted) const
+{
+    const CFixupPlan& plan = GetFixupPlan();
+    const uint64_t* offsets = plan.GetOffsets();
+    size_t last_entry = (num_entries > plan.GetNumOffsets()) ? plan.GetNumOffsets() :
+        std::min(first_entry + num_entries, plan.GetNumOffsets());
+
+    static const uint32_t trace_id = CTracer::InternName("fixup_patch");
+    CTraceScope trace_scope(trace_id, last_entry - first_entry);
+    uint8_t* base = reinterpret_cast<uint8_t*>(static_cast<void*>(m_base));
+
+    // Type and range checks were done when the plan was built, so only the tag needs checking
+    for (size_t i = first_entry; i < last_entry; ++i)
+    {
+        uintptr_t* pAddress = reinterpret_cast<uintptr_t*>(&base[offsets[i]]);
+        uintptr_t val_to_fixup = *pAddress;
+
+        if (cheri_tag_get(val_to_fixup))
+        {
+            *pAddress = CRelocationTable::DeriveFixupValue(m_fixup_cap, val_to_fixup, makeRestricted);
+
+            FIXUP_TRACE << "[Fixup cap: offset=0x" << std::hex << offsets[i] << " curr_val="
+                << Capability(val_to_fixup) << " new_val=" << Capability(*pAddress) << "]";
+
+            if (makeRestricted)
+            {
+                m_journal->Record(i, val_to_fixup);
+            }
+        }
+        else
+        {
+            FIXUP_TRACE << "[Fixup cap: offset=0x" << std::hex << offsets[i] << " - SKIPPED NO VALID TAG]";
+        }
+    }
+
+    return true;
+}
+
+bool CSharedObject::StartJournal(bool makeRestricted) const
+{
+    if (makeRestricted)
+    {
+        m_journal->Start(GetFixupPlan().GetNumOffsets());
+        return false;
+    }
+
+    // Without a journal, fall back to patching every plan entry
+    m_replaying = m_journal->IsRecorded();
+    return m_replaying;
+}
+
+bool CSharedObject::RevertFromJournal(size_t first_entry, size_t num_entries) const
+{
+    const CFixupPlan& plan = GetFixupPlan();
+    size_t last_entry = (num_entries > plan.GetNumOffsets()) ? plan.GetNumOffsets() :
+        std::min(first_entry + num_entries, plan.GetNumOffsets());
+
+    static const uint32_t trace_id = CTracer::InternName("fixup_revert");
+    CTraceScope trace_scope(trace_id, last_entry - first_entry);
+
+    m_journal->Replay(reinterpret_cast<uint8_t*>(static_cast<void*>(m_base)), plan.GetOffsets(),
+        first_entry, last_entry, m_fixup_cap);
+    return true;
+}
+
+std::string CSharedObject::GetBuildId() const
+{
+    auto itrs = m_phdrs.equal_range(PT_NOTE);
+    uint8_t* base = reinterpret_cast<uint8_t*>(static_cast<void*>(m_base));
+
+    for (auto itr = itrs.first; itr != itrs.second; ++itr)
+    {
+        const Elf64_Phdr& phdr = itr->second;
+
+        // Notes are padded to 4 or 8 bytes, as given by the segment alignment
+        size_t align = (phdr.p_align == 8) ? 8 : 4;
+        uint8_t* note = &base[phdr.p_vaddr];
+        uint8_t* note_end = &base[phdr.p_vaddr + phdr.p_memsz];
+
+        while (note + sizeof(Elf64_Nhdr) <= note_end)
+        {
+            auto nhdr = reinterpret_cast<const Elf64_Nhdr*>(note);
+            uint8_t* name = note + sizeof(Elf64_Nhdr);
+            uint8_t* desc = name + cheri_align_up(nhdr->n_namesz, align);
+            uint8_t* next = desc + cheri_align_up(nhdr->n_descsz, align);
+
+            if (next > note_end)
+            {
+                break;
+            }
+
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == sizeof(ELF_NOTE_GNU) &&
+                0 == memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)))
+            {
+                return std::string(reinterpret_cast<const char*>(desc), nhdr->n_descsz);
+            }
+
+            note = next;
+        }
+    }
+
+    return std::string();
+}
+
+size_t CSharedObject::GetNumRelocEntries() const
+{
+    size_t total = 0;
     for (const auto& p_reloc_table : m_reloctables)
     {
         try
         {
-            strstr << p_reloc_table->DumpTable();
+            total += p_reloc_table->GetNumEntries();
         }
         catch (std::out_of_range&)
         {
         }
     }
+    return total;
+}
 
-    return strstr.str();
+Range CSharedObject::GetImageRange() const
+{
+    Elf64_Addr top = 0;
+    auto itrs = m_phdrs.equal_range(PT_LOAD);
+    for (auto itr = itrs.first; itr != itrs.second; ++itr)
+    {
+        top = std::max(top, itr->second.p_vaddr + itr->second.p_memsz);
+    }
+    return Range(0, top);
+}
+
+std::vector<Range> CSharedObject::GetWritableRanges() const
+{
+    // RELRO pages are read-only once relocated
+    Elf64_Addr relro_start = 0;
+    Elf64_Addr relro_end = 0;
+    auto relro = m_phdrs.find(PT_GNU_RELRO);
+    if (relro != m_phdrs.end())
+    {
+        relro_start = cheri_align_down(relro->second.p_vaddr, m_page_size);
+        relro_end = cheri_align_down(relro->second.p_vaddr + relro->second.p_memsz, m_page_size);
+    }
+
+    std::vector<Range> ranges;
+    auto add_range = [&](Elf64_Addr start, Elf64_Addr end)
+    {
+        if (end > start)
+        {
+            ranges.emplace_back(static_cast<uintptr_t>(m_base) + start, end - start);
+        }
+    };
 
+    auto itrs = m_phdrs.equal_range(PT_LOAD);
+    for (auto itr = itrs.first; itr != itrs.second; ++itr)
+    {
+        if (!(itr->second.p_flags & PF_W))
+        {
+            continue;
+        }
+
+        Elf64_Addr start = cheri_align_down(itr->second.p_vaddr, m_page_size);
+        Elf64_Addr end = cheri_align_up(itr->second.p_vaddr + itr->second.p_memsz, m_page_size);
+
+        if (relro_end > start && relro_start < end)
+        {
+            add_range(start, relro_start);
+            add_range(relro_end, end);
+        }
+        else
+        {
+            add_range(start, end);
+        }
+    }
+    return ranges;
 }
 
-// Do all the reloc fixups
-bool CSharedObject::DoLibCapFixups(bool makeRestricted) const
+CSharedObject::SymbolLookup CSharedObject::FindSymbol(const char* name, const CDynamicSection::SymbolHash& hash,
+    void*& symb) const
 {
     if (!m_loaded)
     {
-        throw CCapMgrException("Shared object is not loaded!");
+        return SymbolLookup::kNotFound;
     }
 
-    // Build an array of ranges, whereby if the target is within any range then
-    // it's capability should not be modified
+    auto sym = m_dynsec.LookupSymbol(name, hash);
+    if (!sym)
+    {
+        return SymbolLookup::kNotFound;
+    }
 
-    // The getters throw on no entry for these in dynamic section
-    std::vector<Range> unmodify_ranges;
+    // IFUNCs need their resolver run, and TLS needs the thread pointer.  Either way this is the definition, so
+    // one in a later shared object must not be used instead.
+    auto type = ELF64_ST_TYPE(sym->st_info);
+    if (type == STT_GNU_IFUNC || type == STT_TLS)
+    {
+        return SymbolLookup::kNotResolvable;
+    }
 
-    try
+    Capability cap{ m_base };
+    cap.SetAddress(reinterpret_cast<void*>(cheri_address_get(static_cast<void*>(m_base)) + sym->st_value));
+    symb = cap;
+    return SymbolLookup::kFound;
+}
+
+const char* CSharedObject::FindSymbolName(Elf64_Addr addr) const
+{
+    if (!m_loaded)
     {
-        unmodify_ranges.push_back(m_dynsec.GetInitFn());
+        return nullptr;
     }
-    catch (std::out_of_range&) {}
 
-    try
+    Elf64_Addr base = cheri_address_get(static_cast<void*>(m_base));
+    if (addr < base || addr - base >= GetImageRange().Size())
     {
-        unmodify_ranges.push_back(m_dynsec.GetFiniFn());
+        return nullptr;
     }
-    catch (std::out_of_range&) {}
 
-    try
+    auto sym = m_dynsec.FindSymbolByAddress(addr - base);
+    return sym ? m_dynsec.GetSymbolName(*sym) : nullptr;
+}
+
+size_t CSharedObject::RemapHugePages() const
+{
+    if (!m_loaded)
     {
-        unmodify_ranges.push_back(m_dynsec.GetInitArray());
+        return 0;
     }
-    catch (std::out_of_range&) {}
 
-    try
+    uint8_t* base = reinterpret_cast<uint8_t*>(static_cast<void*>(m_base));
+    size_t remapped = 0;
+
+    auto itrs = m_phdrs.equal_range(PT_LOAD);
+    for (auto itr = itrs.first; itr != itrs.second; ++itr)
     {
-        unmodify_ranges.push_back(m_dynsec.GetFiniArray());
+        const auto& phdr = itr->second;
+        remapped += CHugePages::Remap(&base[phdr.p_vaddr], phdr.p_memsz, FixupPages::ProtFromFlags(phdr.p_flags));
     }
-    catch (std::out_of_range&) {}
 
-    L_(VERBOSE) << "Make LOAD blocks writable";
-    if (!ProtectAllBlocks(PT_LOAD, false, PROT_READ | PROT_WRITE))
+    // The move gave whole blocks their LOAD protection, so RELRO must be read-only again
+    auto relro = m_phdrs.find(PT_GNU_RELRO);
+    if (remapped && relro != m_phdrs.end())
     {
-        L_(ERROR) << "Failed to mprotect blocks";
-        return false;
+        Elf64_Addr start = cheri_align_down(relro->second.p_vaddr, m_page_size);
+        Elf64_Addr end = cheri_align_down(relro->second.p_vaddr + relro->second.p_memsz, m_page_size);
+        if (end > start && 0 != mprotect(&base[start], end - start, PROT_READ))
+        {
+            throw CCapMgrException("Cannot make RELRO read-only for " + m_name_full + ": " + strerror(errno));
+        }
+    }
+
+    return remapped;
+}
+
+std::shared_ptr<CFixupPlan> CSharedObject::BuildFixupPlan() const
+{
+    if (!m_loaded)
+    {
+        throw CCapMgrException("Shared object is not loaded!");
     }
 
+    static const uint32_t trace_id = CTracer::InternName("fixup_plan");
+    CTraceScope trace_scope(trace_id, GetNumRelocEntries());
+
+    std::vector<uint64_t> offsets;
     for (const auto& p_reloc_table : m_reloctables)
     {
         try
         {
-            if (!p_reloc_table->PatchCaps(unmodify_ranges, makeRestricted))
-            {
-                L_(ERROR) << "Process table FAILED: " << *p_reloc_table;
-                return false;
-            }
+            p_reloc_table->CollectFixupOffsets(m_unmodify_offsets, offsets);
         }
         catch (std::out_of_range&)
         {
         }
     }
 
-    L_(VERBOSE) << "Make LOAD blocks restored to original access settings";
-    if (!ProtectAllBlocks(PT_LOAD))
-    {
-        L_(ERROR) << "Failed to mprotect blocks";
-        return false;
-    }
+    // Ascending order gives the best locality when applying
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
 
-    return true;
+    return std::make_shared<CFixupPlan>(GetBuildId(), GetNumRelocEntries(), std::move(offsets));
 }
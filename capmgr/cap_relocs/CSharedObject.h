@@ -9,11 +9,15 @@
 #include <map>
 #include <vector>
 #include <memory>
+#include <functional>
 
 #include "shared_object_common.h"
 #include "CCapability.h"
 #include "CDynamicSection.h"
 #include "CRelocationTable.h"
+#include "CFixupPlan.h"
+#include "CFixupPageSet.h"
+#include "CFixupJournal.h"
 
 // CSharedObject: Info about single shared object loaded from the Dlopen
 class CSharedObject
@@ -27,27 +31,52 @@ private:
     CDynamicSection m_dynsec;           // Dynamic section created after phdrs
 
     bool m_loaded = false;                      // Loaded yet?
+    bool m_patched_at_load = false;             // Restricted by the rtld-audit module
     uint64_t    m_page_size;
 
     // Pointers to all the different relocation tables for the so;
     std::vector<std::shared_ptr<CRelocationTable>>  m_reloctables;
 
-    // ProtectBlock: mprotect() the phdr block either to restore original or to provided protection flags
-    bool ProtectBlock(const Elf64_Phdr& phdr, bool restore_original = true, int64_t prot_required = PROT_NONE) const;
+    // Ranges where if the target is within the range then its capability should not be modified
+    std::vector<Range> m_unmodify_ranges;
+    RangeSet m_unmodify_offsets;                // The same, as offsets from the base for the fixup scan
 
-    // ProtectAllBlocks: Change the protection for all blocks matching the given type to the given value / original
-    bool ProtectAllBlocks(Elf64_Word type, bool restore_original = true, int64_t prot_required = PROT_NONE) const;
+    Capability m_fixup_cap;                     // Capability used to derive fixed up capabilities
+
+    // Fixups are applied from the plan, which is from the cache or else built by scanning the tables on first use.
+    // The page set is the pages the plan's targets are in, which are made writable for the fixups.
+    mutable std::shared_ptr<CFixupPlan> m_fixup_plan;
+    mutable std::shared_ptr<CFixupPageSet> m_page_set;
+
+    // The restricted fixups record the original capabilities in the journal, and are reverted by replaying it
+    std::shared_ptr<CFixupJournal> m_journal;
+    mutable bool m_replaying = false;
+
+    // Get the plan and page set, building them if needed
+    const CFixupPlan& GetFixupPlan() const;
+    const CFixupPageSet& GetPageSet() const;
 
     // Generate a dynamic section from the loaded data
     CDynamicSection parseDynamicSection() const;
 
+    // Build the ranges from the dynamic section which must not be patched
+    std::vector<Range> parseUnmodifyRanges() const;
+
+    // Patch the targets of a range of fixup plan entries
+    bool PatchFromPlan(size_t first_entry, size_t num_entries, bool makeRestricted) const;
+
+    // Start recording or replaying the journal for a fixup pass; returns true if the pass replays it
+    bool StartJournal(bool makeRestricted) const;
+
+    // Revert a range of fixup plan entries from the journal
+    bool RevertFromJournal(size_t first_entry, size_t num_entries) const;
 
 
 public:
     CSharedObject() {}
     // fullcap is a capability with needed permissions - used to construct base
     CSharedObject(const std::string& so_name, const Capability& base_addr) :
-        m_base(base_addr), m_name_full(so_name), m_page_size(getpagesize()) {}
+        m_base(base_addr), m_name_full(so_name), m_page_size(getpagesize()), m_journal(std::make_shared<CFixupJournal>()) {}
 
     // Load phdr data
     // Fixup cap is a capability which will be used to derive all the fixed up caabilities
@@ -59,9 +88,76 @@ public:
     std::string DumpRelocTables() const;
 
     // Do all the reloc fixups
-    // Can make restricted or executive
+    // Can make restricted or executive; making executive after making restricted replays the journal
     bool DoLibCapFixups(bool makeRestricted) const;
 
+    // Split fixups into phases so the patching can be done by chunks run on different threads:
+    // PrepareFixups() makes the pages holding fixup targets writable, then every chunk added by AppendFixupChunks()
+    // must be run, then FinishFixups() restores the page permissions.
+    // Each chunk covers at most max_chunk_entries entries from one relocation table.
+    bool PrepareFixups() const;
+    void AppendFixupChunks(std::vector<std::function<bool()>>& chunks, size_t max_chunk_entries, bool makeRestricted) const;
+    bool FinishFixups() const;
+
+    // Number of entries in the fixup plan, i.e. the number of targets a fixup pass looks at
+    size_t GetNumFixups() const { return GetFixupPlan().GetNumOffsets(); }
+
+    const std::string& GetName() const { return m_name_full; }
+
+    // NT_GNU_BUILD_ID of the shared object as raw bytes, or empty if it does not have one
+    std::string GetBuildId() const;
+
+    // Total number of entries in all the relocation tables
+    size_t GetNumRelocEntries() const;
+
+    // Range of offsets from the base covered by the LOAD blocks
+    Range GetImageRange() const;
+
+    // Pages of the writable LOAD blocks, less any RELRO pages, as ranges based on the shared object's capability
+    std::vector<Range> GetWritableRanges() const;
+
+    enum class SymbolLookup
+    {
+        kNotFound,
+        kFound,
+        kNotResolvable      // Defined here, but only the loader can resolve it (an IFUNC or TLS)
+    };
+
+    // Look for a function or object defined by this shared object.  If found, symb is the capability to it, from
+    // the shared object's base capability.  Uses the hash tables, so does not allocate.
+    SymbolLookup FindSymbol(const char* name, const CDynamicSection::SymbolHash& hash, void*& symb) const;
+
+    // Name of the defined function or object holding an address in this shared object, or nullptr
+    const char* FindSymbolName(Elf64_Addr addr) const;
+
+    const CDynamicSection& GetDynamicSection() const { return m_dynsec; }
+
+    // Move the LOAD blocks onto huge pages where a huge page fits in them, see CHugePages::Remap().
+    // Nothing in the shared object may be running.  Returns the number of bytes moved.
+    size_t RemapHugePages() const;
+
+    // Whether the restricted fixups were already done when the shared object was loaded, i.e. by the rtld-audit
+    // module, so the capability manager leaves them
+    bool IsPatchedAtLoad() const { return m_patched_at_load; }
+    void SetPatchedAtLoad(bool patched) { m_patched_at_load = patched; }
+
+    // Scan the relocation tables to build a fixup plan for this shared object
+    std::shared_ptr<CFixupPlan> BuildFixupPlan() const;
+
+    // Use a fixup plan for all subsequent fixups, which must be done before the fixups are done
+    void SetFixupPlan(const std::shared_ptr<CFixupPlan>& plan)
+    {
+        m_fixup_plan = plan;
+        m_page_set.reset();
+        m_journal->Finish();     // Journal entries are indexed by plan entry
+    }
+
+    // Page protection costs of the fixups, compared to making all LOAD blocks writable
+    CFixupPageSet::Stats GetFixupPageStats() const { return GetPageSet().GetStats(); }
+
+    // Results of the last journal replay
+    CFixupJournal::Stats GetRevertStats() const { return m_journal->GetStats(); }
+
     // Stream out whole thing
     friend std::ostream& operator<<(std::ostream& ostr, const CSharedObject& soinfo)
     {
@@ -0,0 +1,26 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Hook through which the rtld-audit module tells the capability manager which objects it has patched
+
+#ifndef _CAPMGR_AUDIT_HOOK_H__
+#define _CAPMGR_AUDIT_HOOK_H__
+
+#include <link.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Whether the rtld-audit module has done the restricted fixups of an object.  It first patches any objects
+    // the loader has relocated since its last audit call, so an object is never left for the capability manager
+    // just because no audit call followed its relocation.
+    typedef bool (*CapMgrAuditPatchedFn)(const struct link_map* map);
+
+    // Exported by the capability manager executable, and set by the rtld-audit module (libcapmgr-audit.so) once it
+    // is loaded, or nullptr without it
+    extern CapMgrAuditPatchedFn capmgr_audit_patched;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CAPMGR_AUDIT_HOOK_H__ */
@@ -0,0 +1,126 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements the fixup page run calculation
+
+#include <stdexcept>
+
+#include "fixup_page_runs.h"
+#include "CCapMgrException.h"
+
+int FixupPages::ProtFromFlags(Elf64_Word flags)
+{
+    int prot = 0;
+    if (flags & PF_X)
+        prot |= PROT_EXEC;
+
+    if (flags & PF_W)
+        prot |= PROT_WRITE;
+
+    if (flags & PF_R)
+        prot |= PROT_READ;
+
+    return prot;
+}
+
+FixupPages::Stats FixupPages::BuildRuns(const uint64_t* offsets, size_t num_offsets,
+    const std::multimap<Elf64_Word, Elf64_Phdr>& phdrs, size_t page_size, std::vector<Run>& runs)
+{
+    Stats stats;
+
+    // Page ranges of LOAD and RELRO blocks
+    struct Block
+    {
+        uint64_t first_page;
+        uint64_t end_page;
+        Elf64_Word flags;
+    };
+
+    std::vector<Block> loads;
+    std::vector<Block> relros;
+
+    for (const auto& phdr_entry : phdrs)
+    {
+        const Elf64_Phdr& phdr = phdr_entry.second;
+        if (phdr.p_type != PT_LOAD && phdr.p_type != PT_GNU_RELRO)
+        {
+            continue;
+        }
+
+        Block block{ phdr.p_vaddr / page_size, (phdr.p_vaddr + phdr.p_memsz + page_size - 1) / page_size, phdr.p_flags };
+
+        if (phdr.p_type == PT_LOAD)
+        {
+            loads.push_back(block);
+            stats.load_blocks++;
+            stats.load_pages += block.end_page - block.first_page;
+        }
+        else
+        {
+            // Only whole pages are made read only by the loader
+            block.end_page = (phdr.p_vaddr + phdr.p_memsz) / page_size;
+            relros.push_back(block);
+        }
+    }
+
+    // Original protection of a page.  A page shared by two LOAD blocks gets both sets of permissions.
+    auto page_prot = [&](uint64_t page) -> int
+    {
+        int prot = -1;
+        for (const auto& block : loads)
+        {
+            if (page >= block.first_page && page < block.end_page)
+            {
+                prot = (prot < 0) ? ProtFromFlags(block.flags) : (prot | ProtFromFlags(block.flags));
+            }
+        }
+
+        for (const auto& block : relros)
+        {
+            if (prot >= 0 && page >= block.first_page && page < block.end_page)
+            {
+                prot &= ~PROT_WRITE;
+            }
+        }
+        return prot;
+    };
+
+    uint64_t prev_page = UINT64_MAX;
+    for (size_t i = 0; i < num_offsets; ++i)
+    {
+        // A capability is aligned so never straddles two pages
+        uint64_t page = offsets[i] / page_size;
+        if (page == prev_page)
+        {
+            continue;
+        }
+        prev_page = page;
+        stats.target_pages++;
+
+        int prot = page_prot(page);
+        if (prot < 0)
+        {
+            throw CCapMgrException("Capability fixup target is outside of all LOAD blocks");
+        }
+
+        // Already writable and not executable: patch in place
+        if ((prot & PROT_WRITE) && !(prot & PROT_EXEC))
+        {
+            continue;
+        }
+
+        stats.unprotected_pages++;
+
+        // Extend the current run if this is the next page with the same protection
+        if (!runs.empty() && runs.back().orig_prot == prot &&
+            runs.back().offset + runs.back().size == page * page_size)
+        {
+            runs.back().size += page_size;
+        }
+        else
+        {
+            runs.push_back(Run{ page * page_size, page_size, prot });
+        }
+    }
+
+    stats.runs = runs.size();
+    return stats;
+}
@@ -0,0 +1,59 @@
+// Copyright (C) 2024 Verifoxx Limited
+// fixup_page_runs: Works out which pages must be made writable for capability fixups.
+// Deliberately independent of the Capability helpers so that it can also be used on non-CHERI hosts.
+
+#ifndef __FIXUP_PAGE_RUNS_H_
+#define __FIXUP_PAGE_RUNS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "shared_object_common.h"
+
+namespace FixupPages
+{
+    // Pages to make writable, with the original protection to restore afterwards
+    struct Run
+    {
+        uint64_t offset;        // From the shared object base, page aligned
+        size_t size;
+        int orig_prot;
+    };
+
+    struct Stats
+    {
+        size_t load_pages = 0;          // Pages in all LOAD blocks, which would all be mprotect()ed without the runs
+        size_t load_blocks = 0;         // LOAD blocks, each costing two mprotect() calls without the runs
+        size_t target_pages = 0;        // Distinct pages containing fixup targets
+        size_t unprotected_pages = 0;   // Of those, the pages which needed to be made writable
+        size_t runs = 0;                // Runs of unprotected pages, each costing two mprotect() calls
+
+        size_t BaselineSyscalls() const { return 2 * load_blocks; }
+        size_t Syscalls() const { return 2 * runs; }
+
+        Stats& operator+=(const Stats& other)
+        {
+            load_pages += other.load_pages;
+            load_blocks += other.load_blocks;
+            target_pages += other.target_pages;
+            unprotected_pages += other.unprotected_pages;
+            runs += other.runs;
+            return *this;
+        }
+    };
+
+    // mprotect() protection for the p_flags of a program header
+    int ProtFromFlags(Elf64_Word flags);
+
+    // Build the runs for the fixup target offsets, which must be in ascending order.
+    // The original protection is from the LOAD block flags, and PT_GNU_RELRO pages are read only.
+    // Pages which are already writable (and not executable) are left out, and neighbouring pages with the same
+    // original protection are merged into one run.
+    // Throws CCapMgrException if a target is outside all the LOAD blocks.
+    Stats BuildRuns(const uint64_t* offsets, size_t num_offsets, const std::multimap<Elf64_Word, Elf64_Phdr>& phdrs,
+        size_t page_size, std::vector<Run>& runs);
+}
+
+#endif /* __FIXUP_PAGE_RUNS_H_ */
@@ -0,0 +1,103 @@
+// Copyright (C) 2024 Verifoxx Limited
+// reloc_scan_kernel: Relocation table scanning used for capability fixups.
+// Deliberately independent of the Capability helpers so that it can also be used on non-CHERI hosts.
+
+#ifndef __RELOC_SCAN_KERNEL_H_
+#define __RELOC_SCAN_KERNEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "shared_object_common.h"
+#include "Range.h"
+
+namespace RelocScan
+{
+#if CAPMGR_EMULATED_CAPS
+    // Emulated capabilities: the host's relocation types whose targets hold pointers, which take the place of the
+    // Morello capability relocations, so the same fixups are done on them
+    constexpr Elf64_Xword kFixupRelocTypes[] = {
+#if defined(__x86_64__)
+        R_X86_64_64,
+        R_X86_64_GLOB_DAT,
+        R_X86_64_JUMP_SLOT,
+        R_X86_64_RELATIVE
+#else
+        // R_AARCH64_ABS64 is too far from these for the type mask, and is rare in position independent code
+        R_AARCH64_GLOB_DAT,
+        R_AARCH64_JUMP_SLOT,
+        R_AARCH64_RELATIVE
+#endif
+    };
+#else
+    // Ref Morello Aarch64 ABI: the relocation types whose targets hold capabilities needing fixup
+    constexpr Elf64_Xword kFixupRelocTypes[] = {
+        R_MORELLO_CAPINIT,
+        R_MORELLO_GLOB_DAT,
+        R_MORELLO_JUMP_SLOT,
+        R_MORELLO_RELATIVE,
+        R_MORELLO_TLSDESC
+    };
+#endif
+
+    constexpr Elf64_Xword MinFixupType()
+    {
+        Elf64_Xword min_type = kFixupRelocTypes[0];
+        for (auto type : kFixupRelocTypes)
+        {
+            min_type = (type < min_type) ? type : min_type;
+        }
+        return min_type;
+    }
+
+    constexpr uint64_t FixupTypeMask()
+    {
+        uint64_t mask = 0;
+        for (auto type : kFixupRelocTypes)
+        {
+            mask |= (1ULL << (type - MinFixupType()));
+        }
+        return mask;
+    }
+
+    // Compile time bitset of the fixup types, relative to the lowest type
+    constexpr Elf64_Xword kFixupTypeBase = MinFixupType();
+    constexpr uint64_t kFixupTypeMask = FixupTypeMask();
+
+    // Given an r_info field, check if the reloc type is one of those which needs fixing up.
+    // Types below the base wrap to large values, so a single compare handles both ends of the window.
+    inline bool NeedsFixup(Elf64_Xword r_info)
+    {
+        Elf64_Xword bit = ELF64_R_TYPE(r_info) - kFixupTypeBase;
+        return bit < 64 && ((kFixupTypeMask >> bit) & 1);
+    }
+
+    // Visit every entry in [first, last) of a REL or RELA table which needs fixing up.
+    // unmodify_offsets holds the ranges, as offsets from the shared object base, whose targets are not modified;
+    // entries with a target in these ranges go to on_skipped instead.
+    template <typename Rel, typename Visitor, typename SkipVisitor>
+    inline void ScanFixupTargets(const Rel* first, const Rel* last, const RangeSet& unmodify_offsets,
+        Visitor&& on_fixup, SkipVisitor&& on_skipped)
+    {
+        bool check_ranges = !unmodify_offsets.Empty();
+
+        for (const Rel* p = first; p < last; ++p)
+        {
+            if (!NeedsFixup(p->r_info))
+            {
+                continue;
+            }
+
+            if (check_ranges && unmodify_offsets.Intersects(Range(p->r_offset, sizeof(void*))))
+            {
+                on_skipped(p);
+            }
+            else
+            {
+                on_fixup(p);
+            }
+        }
+    }
+}
+
+#endif /* __RELOC_SCAN_KERNEL_H_ */
@@ -16,8 +16,9 @@ extern "C"
 #define _GNU_SOURCE
 #endif
 
-// On morello, dynamic section is readonly (hard-coded with constant)
-#ifndef DL_RO_DYN_SECTION
+// On morello, dynamic section is readonly (hard-coded with constant).
+// A non-CHERI host's loader relocates the dynamic section in place when it is writable.
+#if !CAPMGR_EMULATED_CAPS && !defined(DL_RO_DYN_SECTION)
 #define DL_RO_DYN_SECTION
 #endif
 
@@ -10,10 +10,27 @@
 #include "CCapMgrLogger.h"
 #include "comp_common_asm.h"
 #include "example_capmgr_service_api.h"
+#include "CCompartment.h"
+#include "CTracer.h"
 
 using namespace CapMgr;
 
 
+// Trace id of a service function
+static uint32_t ServiceTraceId(ServiceCall_t call_type)
+{
+    static const uint32_t ids[] =
+    {
+        CTracer::InternName("cheri_malloc"),
+        CTracer::InternName("cheri_free"),
+        CTracer::InternName("cheri_dlopen"),
+        CTracer::InternName("cheri_dlsym")
+    };
+    static const uint32_t unknown_id = CTracer::InternName("unknown_service");
+
+    return (static_cast<size_t>(call_type) < sizeof(ids) / sizeof(ids[0])) ? ids[call_type] : unknown_id;
+}
+
 static uintptr_t CallServiceFunction(CCapMgrServiceData* p)
 {
     uintptr_t result{ 0 };
@@ -40,6 +57,26 @@ static uintptr_t CallServiceFunction(CCapMgrServiceData* p)
     }
     break;
 
+    case ServiceCall_cheri_dlopen:
+    {
+        auto p_d = static_cast<CCheriDlopenCapMgrServiceData*>(p);
+        auto real_fp = reinterpret_cast<ServiceHandlerCheriDlopenFp>(p_d->fp);
+
+        L_(DEBUG) << "Calling cheri_dlopen()";
+        result = (uintptr_t)real_fp(p_d->so_name);
+    }
+    break;
+
+    case ServiceCall_cheri_dlsym:
+    {
+        auto p_d = static_cast<CCheriDlsymCapMgrServiceData*>(p);
+        auto real_fp = reinterpret_cast<ServiceHandlerCheriDlsymFp>(p_d->fp);
+
+        L_(DEBUG) << "Calling cheri_dlsym()";
+        result = (uintptr_t)real_fp(p_d->fn_name);
+    }
+    break;
+
     default:
     {
         L_(ERROR) << "Failed to call capability manager function - unsupported service";
@@ -56,12 +93,39 @@ static uintptr_t CallServiceFunction(CCapMgrServiceData* p)
 // Compartment Service Handler is passed a CCapMgrServiceData object as void *
 extern "C" uintptr_t CompartmentServiceHandler(void* service_data_object)
 {
+    // First, so the call is not abandoned part way through the capability manager's work
+    bool in_time = CCompartment::ServiceEnter();
+
     auto capmgr_service_data_ptr = reinterpret_cast<CCapMgrServiceData*>(service_data_object);
+    uintptr_t result{ 0 };
+
+    if (!in_time)
+    {
+        L_(WARNING) << "CompartmentServiceHandler: Call deadline passed, service refused";
+    }
+    else
+    {
+        L_(DEBUG) << "CompartmentServiceHandler: Handling service function...";
+        uint64_t start_cpu_ns = CResourceAccount::ThreadCpuNs();
+        CAPMGR_TRACE(kServiceEnter, ServiceTraceId(capmgr_service_data_ptr->call_type), 0);
+        result = CallServiceFunction(capmgr_service_data_ptr);
+        CAPMGR_TRACE(kServiceExit, ServiceTraceId(capmgr_service_data_ptr->call_type), 0);
+        L_(DEBUG) << "CompartmentServiceHandler: Returned from actual service function";
 
-    L_(DEBUG) << "CompartmentServiceHandler: Handling service function...";
-    uintptr_t result = CallServiceFunction(capmgr_service_data_ptr);
-    L_(DEBUG) << "CompartmentServiceHandler: Returned from actual service function";
+        auto compartment = CCompartment::GetCurrent();
+        if (compartment)
+        {
+            compartment->GetAccount().OnServiceCall(CResourceAccount::ThreadCpuNs() - start_cpu_ns);
+        }
+    }
 
+    // Last, as the call may be abandoned here: it then returns from the compartment call rather than into the
+    // compartment, so nothing is left half done on either side
+    if (CCompartment::ServiceExit())
+    {
+        L_(WARNING) << "CompartmentServiceHandler: Call deadline passed, call abandoned";
+        CompartmentServiceCallbackAbandon(0);
+    }
     CompartmentServiceCallbackSwitchReturn(result);
     __builtin_unreachable();
 }
@@ -14,7 +14,9 @@
 typedef enum
 {
     ServiceCall_cheri_malloc,
-    ServiceCall_cheri_free
+    ServiceCall_cheri_free,
+    ServiceCall_cheri_dlopen,
+    ServiceCall_cheri_dlsym
 } ServiceCall_t;
 
 
@@ -54,4 +56,28 @@ public:
     ) : CCapMgrServiceData(ServiceCall_cheri_free), ptr(ptr_) {}
 };
 
+// Params for the cheri_dlopen() service function call
+class alignas(__BIGGEST_ALIGNMENT__) CCheriDlopenCapMgrServiceData : public CCapMgrServiceData
+{
+public:
+    const char* so_name;
+
+public:
+    CCheriDlopenCapMgrServiceData(
+        const char* so_name_
+    ) : CCapMgrServiceData(ServiceCall_cheri_dlopen), so_name(so_name_) {}
+};
+
+// Params for the cheri_dlsym() service function call
+class alignas(__BIGGEST_ALIGNMENT__) CCheriDlsymCapMgrServiceData : public CCapMgrServiceData
+{
+public:
+    const char* fn_name;
+
+public:
+    CCheriDlsymCapMgrServiceData(
+        const char* fn_name_
+    ) : CCapMgrServiceData(ServiceCall_cheri_dlsym), fn_name(fn_name_) {}
+};
+
 #endif /* _CAPMGR_SERVICE_DATA_H__ */
@@ -20,7 +20,10 @@ typedef enum
     CompCall_callExampleCopyStringToHeap,
     CompCall_callExamplePrintHeapStringAndFree,
     CompCall_callExampleDumpStruct,
-    CompCall_callExampleSetCompartmentDebugLevel
+    CompCall_callExampleSetCompartmentDebugLevel,
+    CompCall_callExampleCallGate,
+    CompCall_callExampleSpin,
+    CompCall_callExampleFault
 } CompCall_t;
 
 // Base class for any Compartment Call function data
@@ -37,9 +40,14 @@ public:
     CompCall_t       comp_call_type;                // Which derived class it is
 
     const ServiceFunctionTable* service_func_table; // Table for capability manager service callback functions
+
+    CompGateAsmFnPtr gate_entry_fp;                 // Function pointer to the call gate entry point in the cap manager
+    const CompartmentGateTable* gate_table;         // Call gates to other compartments granted to this one
+
+    uint64_t deadline_ns;                           // Soft deadline of the call (CLOCK_MONOTONIC), or 0 for none
 public:
     CCompartmentData(CompCall_t call_type) : comp_exit_fp(nullptr), capmgr_service_fp(nullptr), 
-        fp(nullptr), comp_call_type(call_type) {}
+        fp(nullptr), comp_call_type(call_type), gate_entry_fp(nullptr), gate_table(nullptr), deadline_ns(0) {}
 
     virtual ~CCompartmentData() {}
 };
@@ -108,4 +116,46 @@ public:
     ) : CCompartmentData(CompCall_callExampleSetCompartmentDebugLevel), debug_level(debug_level_) {}
 };
 
+// Params for the call example_call_gate()
+class alignas(__BIGGEST_ALIGNMENT__) CExampleCallGateCallCompartmentData : public CCompartmentData
+{
+public:
+    const char* gate_name;
+    int32_t a;
+    int32_t b;
+
+public:
+    CExampleCallGateCallCompartmentData(
+        const char* gate_name_,
+        int32_t a_,
+        int32_t b_
+    ) : CCompartmentData(CompCall_callExampleCallGate), gate_name(gate_name_), a(a_), b(b_) {}
+};
+
+// Params for the call example_spin()
+class alignas(__BIGGEST_ALIGNMENT__) CExampleSpinCallCompartmentData : public CCompartmentData
+{
+public:
+    int32_t ms;
+    bool cooperative;
+
+public:
+    CExampleSpinCallCompartmentData(
+        int32_t ms_,
+        bool cooperative_
+    ) : CCompartmentData(CompCall_callExampleSpin), ms(ms_), cooperative(cooperative_) {}
+};
+
+// Params for the call example_fault()
+class alignas(__BIGGEST_ALIGNMENT__) CExampleFaultCallCompartmentData : public CCompartmentData
+{
+public:
+    int32_t kind;
+
+public:
+    CExampleFaultCallCompartmentData(
+        int32_t kind_
+    ) : CCompartmentData(CompCall_callExampleFault), kind(kind_) {}
+};
+
 #endif /* _COMPARTMENT_DATA_H__ */
@@ -15,6 +15,8 @@ extern "C"
     // Service function pointer types (C types)
     typedef uintptr_t(*ServiceHandlerCheriMallocFp)(size_t sz_bytes);
     typedef uintptr_t(*ServiceHandlerCheriFreeFp)(void* ptr);
+    typedef uintptr_t(*ServiceHandlerCheriDlopenFp)(const char* so_name);
+    typedef uintptr_t(*ServiceHandlerCheriDlsymFp)(const char* fn_name);
 #ifdef __cplusplus
 }
 
@@ -24,6 +26,9 @@ extern "C"
 #include <string>
 using ServiceFunctionTable = std::map<std::string, void*>;
 
+// Type for the table of call gates granted to a compartment, by name: the gates are sealed
+using CompartmentGateTable = std::map<std::string, void*>;
+
 #endif
 
 #endif /* _CAPMGR_SERVICE_FUNCTION_TYPES_H__ */
@@ -3,6 +3,22 @@
 
 #include "comp_caller.h"
 
+#if CAPMGR_EMULATED_CAPS
+
+// Emulated switcher is an ordinary function, called directly.  It is the capability manager's, even when called
+// from a compartment, so its state is the capability manager's.
+uintptr_t CompartmentCaller(CompEntryAsmFnPtr switcher_fp, void *comp_data, void* target_fp, void* sealed_arg_data, void* sealer_cap)
+{
+    return switcher_fp(comp_data, target_fp, sealed_arg_data, sealer_cap);
+}
+
+uintptr_t CompartmentGateCaller(CompGateAsmFnPtr gate_entry_fp, void* gate, const uintptr_t* args)
+{
+    return gate_entry_fp(gate, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+#else
+
 uintptr_t CompartmentCaller(CompEntryAsmFnPtr switcher_fp, void *comp_data, void* target_fp, void* sealed_arg_data, void* sealer_cap)
 {
     register volatile uintptr_t c0 asm("c0") = comp_data;
@@ -23,3 +39,25 @@ uintptr_t CompartmentCaller(CompEntryAsmFnPtr switcher_fp, void *comp_data, void
     return c0;
 }
 
+uintptr_t CompartmentGateCaller(CompGateAsmFnPtr gate_entry_fp, void* gate, const uintptr_t* args)
+{
+    register volatile uintptr_t c0 asm("c0") = gate;
+    register volatile uintptr_t c1 asm("c1") = args[0];
+    register volatile uintptr_t c2 asm("c2") = args[1];
+    register volatile uintptr_t c3 asm("c3") = args[2];
+    register volatile uintptr_t c4 asm("c4") = args[3];
+    register volatile uintptr_t c5 asm("c5") = args[4];
+    register volatile uintptr_t c6 asm("c6") = args[5];
+
+    asm("blr %[fn]"
+        : "+C"(c0), "+C"(c1), "+C"(c2), "+C"(c3), "+C"(c4), "+C"(c5), "+C"(c6)
+        : [fn] "C"(gate_entry_fp)
+            // As for CompartmentCaller(), the callee-saved registers are not preserved.  The gate also clears
+            // the temporaries, which the compiler does not know about as this is not a function call to it.
+            : "c7", "c8", "c9", "c10", "c11", "c12", "c13", "c14", "c15", "c16", "c17", "c18",
+              "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "c29", "c30");
+
+    return c0;
+}
+
+#endif /* CAPMGR_EMULATED_CAPS */
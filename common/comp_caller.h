@@ -25,6 +25,15 @@ extern "C"
     /// <returns>return value from "target_fp", cast to uintptr_t</returns>
     uintptr_t CompartmentCaller(CompEntryAsmFnPtr switcher_fp, void* comp_data, void* target_fp, void* sealed_arg_data, void* sealer_cap);
 
+    /// <summary>
+    /// Call a function of another compartment from a compartment, through a call gate.
+    /// </summary>
+    /// <param name="gate_entry_fp">Asm gate function in Capability Manager (Executive)</param>
+    /// <param name="gate">Gate granted to the calling compartment (sealed)</param>
+    /// <param name="args">COMPARTMENT_GATE_MAX_ARGS arguments for the function, unused ones zero</param>
+    /// <returns>return value from the function, cast to uintptr_t, or 0 if the gate cannot be used</returns>
+    uintptr_t CompartmentGateCaller(CompGateAsmFnPtr gate_entry_fp, void* gate, const uintptr_t* args);
+
 
 #ifdef __cplusplus
 }
@@ -14,7 +14,21 @@ extern "C"
     #define COMPDATA_DDC_OFFSET (1 * 16)
     #define COMPDATA_CTPIDR_OFFSET (2 * 16)
     #define COMPDATA_CLR_OFFSET (3 * 16)    // Not part of C structure, but need space on stack for it 
-    #define COMPDATA_STRUCT_SIZE (4 * 16)   // Includes CLR space
+    #define COMPDATA_BUSY_OFFSET (4 * 16)   // Nor is this: on the stack, the busy flag to clear on return, or null
+    #define COMPDATA_STRUCT_SIZE (5 * 16)   // Includes CLR and busy flag space
+
+    // Call gate descriptor, see CompartmentGate_t
+    #define GATE_CALLEE_OFFSET (0 * 16)     // The callee's compartment data (CSP etc), COMPDATA_* offsets from here
+    #define GATE_FN_OFFSET (3 * 16)
+    #define GATE_CALLER_STACK_BASE_OFFSET (4 * 16)
+    #define GATE_CALLER_STACK_SIZE_OFFSET (4 * 16 + 8)
+    #define GATE_CALLS_OFFSET (5 * 16)
+    #define GATE_CALLEE_COMPARTMENT_OFFSET (6 * 16)     // Not used by the switch
+    #define GATE_CALLEE_BUSY_OFFSET (7 * 16)
+    #define GATE_STRUCT_SIZE (8 * 16)
+
+    // Most arguments passed through a call gate, all in registers
+    #define COMPARTMENT_GATE_MAX_ARGS 6
 
 #ifndef __ASSEMBLER__
     
@@ -24,7 +38,12 @@ extern "C"
     // (2) The handling function (pointer) to switch to (Compartment Entry or service callback handler)
     // (3) The sealed data needed by the handling function
     // (4) The sealer capability used to seal the above
+#if CAPMGR_EMULATED_CAPS
+    // Emulated switcher is an ordinary function which returns the handling function's result
+    uintptr_t CompartmentSwitchEntry(void *comp_data, void *pf, void *comp_ptr_sealed, void *sealer_cap);
+#else
     void CompartmentSwitchEntry(void *comp_data, void *pf, void *comp_ptr_sealed, void *sealer_cap);
+#endif
     
     // CompartmentSwitchReturn: Return from a Compartment handling function, with a state change restricted->executive
     // Given: return value from the handling function
@@ -34,8 +53,25 @@ extern "C"
     // Given: return value from the handling function
     void CompartmentServiceCallbackSwitchReturn(uintptr_t retval);
 
+    // CompartmentServiceCallbackAbandon: End the compartment call a capability service callback function was called
+    // from, instead of returning to the compartment, so the call returns (with state change restricted->executive)
+    // as if the compartment had returned.
+    // Given: return value for the compartment call
+    void CompartmentServiceCallbackAbandon(uintptr_t retval);
+
+    // CompartmentSaveSwitchState / CompartmentRestoreSwitchState: Save the thread's switch state before a call into a
+    // compartment, and restore it to abandon the call, i.e. return from it as CompartmentSwitchReturn would without
+    // the compartment returning.
+    struct CompartmentSwitchState_t;
+    void CompartmentSaveSwitchState(struct CompartmentSwitchState_t* state);
+    void CompartmentRestoreSwitchState(const struct CompartmentSwitchState_t* state);
+
     // Fn pointer for the compartment entry fn which is ASM function in executive
+#if CAPMGR_EMULATED_CAPS
+    typedef uintptr_t(*CompEntryAsmFnPtr)(void*, void*, void*, void*);
+#else
     typedef void(*CompEntryAsmFnPtr)(void*, void*, void*, void*);
+#endif
 
     // Fn pointer for the compartment exit fn which is ASM function in executive
     typedef void(*CompExitAsmFnPtr)(uintptr_t);
@@ -47,6 +83,47 @@ extern "C"
         void* ddc;
         void* ctpidr;
     };
+
+    // Switch state: the restricted registers, or for the emulated switcher its chain of switch frames
+    struct CompartmentSwitchState_t
+    {
+        struct CompartmentData_t restricted;    // Same layout as the compartment data
+        void* switch_frame;
+    };
+
+    // CompartmentGateEntry: ASM call from a compartment straight to a function of another compartment, through a gate
+    // granted by the capability manager.  Given:
+    // (1) The gate (sealed)
+    // (2..) Up to COMPARTMENT_GATE_MAX_ARGS arguments for the function
+    // Returns the function's result, or 0 if the gate cannot be used (not a gate, revoked, granted to another
+    // compartment, or the callee is already running), without calling it.
+    uintptr_t CompartmentGateEntry(void* gate, uintptr_t a0, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4,
+        uintptr_t a5);
+
+    // Fn pointer for the gate entry fn which is ASM function in executive
+    typedef uintptr_t(*CompGateAsmFnPtr)(void*, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+
+    // Call gate from one compartment (the caller) to a function of another (the callee).  Owned by the capability
+    // manager, and given to the caller sealed with the gate seal id, so only CompartmentGateEntry can use it.
+    struct CompartmentGate_t
+    {
+        struct CompartmentData_t callee;    // Restricted state to switch to
+        void* fn;                           // Function to call (restricted sentry), or null once revoked
+        uint64_t caller_stack_base;         // The caller's stack, which identifies the caller
+        uint64_t caller_stack_size;
+        uint64_t calls;                     // Calls made through the gate
+        void* callee_compartment;           // The capability manager's callee, to tell which compartment faulted
+        uint64_t* callee_busy;              // The callee's busy flag: 0 unless a call runs in it, and for a call
+                                            // through a gate, the calling thread's (executive) thread pointer
+    };
+
+    // CompartmentTlsDescReturn: TLS descriptor resolver for the static TLS of natively loaded compartments, which runs
+    // in the compartment.  Given the descriptor, returns the offset of the variable from the thread pointer in x0 and
+    // its size in x1, from the fragment after the resolver in the descriptor.
+    void CompartmentTlsDescReturn(void* descriptor);
+
+    // Capability to unseal gates, set by the capability manager before granting any
+    extern void* CompartmentGateUnsealer;
 #endif  /* ASSEMBLER */
 
 #ifdef __cplusplus
@@ -29,6 +29,9 @@ extern "C"
     typedef bool(*FnPtr_example_print_heap_string_and_free)(char*, int16_t);
     typedef void(*FnPtr_example_dump_struct)(const struct example_struct*);
     typedef bool(*FnPtr_example_set_compartment_debug_level)(int32_t);
+    typedef int32_t(*FnPtr_example_call_gate)(const char*, int32_t, int32_t);
+    typedef int32_t(*FnPtr_example_spin)(int32_t, bool);
+    typedef int32_t(*FnPtr_example_fault)(int32_t);
 
     // Declare the initial function in the compartment
     void CompartmentUnwrap(void* comp_data_table);
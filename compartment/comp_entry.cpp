@@ -79,6 +79,36 @@ static uintptr_t CallFunction(CCompartmentData* p)
         }
         break;
 
+        case CompCall_callExampleCallGate:
+        {
+            auto p_d = static_cast<CExampleCallGateCallCompartmentData*>(p);
+            auto real_fp = reinterpret_cast<FnPtr_example_call_gate>(p_d->fp);
+
+            LOG_DEBUG("Calling example_call_gate()");
+            result = (uintptr_t)real_fp(p_d->gate_name, p_d->a, p_d->b);
+        }
+        break;
+
+        case CompCall_callExampleSpin:
+        {
+            auto p_d = static_cast<CExampleSpinCallCompartmentData*>(p);
+            auto real_fp = reinterpret_cast<FnPtr_example_spin>(p_d->fp);
+
+            LOG_DEBUG("Calling example_spin()");
+            result = (uintptr_t)real_fp(p_d->ms, p_d->cooperative);
+        }
+        break;
+
+        case CompCall_callExampleFault:
+        {
+            auto p_d = static_cast<CExampleFaultCallCompartmentData*>(p);
+            auto real_fp = reinterpret_cast<FnPtr_example_fault>(p_d->fp);
+
+            LOG_DEBUG("Calling example_fault()");
+            result = (uintptr_t)real_fp(p_d->kind);
+        }
+        break;
+
         default:
         {
             LOG_ERROR("Failed to call Compartment function - unsupported function");
@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <string>
 #include <memory>
+#include <time.h>
 #include <cheriintrin.h>
 
 #include "comp_caller.h"
@@ -34,9 +35,30 @@ public:
 
     CServiceCallProxy(const CCompartmentData* compartment_data) : m_compartment_data(compartment_data) {}
 
+    // Whether the soft deadline of the call has passed, so the function should return as soon as it can.
+    // Once it has, service calls are not made, returning 0.
+    bool DeadlinePassed() const
+    {
+        if (!m_compartment_data->deadline_ns)
+        {
+            return false;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec >= m_compartment_data->deadline_ns;
+    }
+
     // Call the function with transfer to the compartment
     uintptr_t CompartmentServiceCallback(std::string service_fn_name, const std::shared_ptr<CCapMgrServiceData>& service_fn_data)
     {
+        // The capability manager would refuse it anyway, so save the round trip
+        if (DeadlinePassed())
+        {
+            LOG_WARNING("Call deadline passed, service \"%s\" not called", service_fn_name.c_str());
+            return 0;
+        }
+
         // Lookup the service function pointer which we require
         auto service_fn_ptr_entry = m_compartment_data->service_func_table->find(service_fn_name);
 
@@ -90,6 +112,33 @@ public:
         );
     }
 
+    // Call gates: calls to functions of other compartments, granted to this one by the capability manager.
+    // Find a gate once, then call it as often as needed: a call goes straight to the other compartment through the
+    // capability manager's gate trampoline, with no lookup or allocation.  The function runs without a
+    // CServiceCallProxy of its own, so it cannot make service calls.
+    // FindGate() returns nullptr if no gate of that name has been granted.
+    void* FindGate(const std::string& gate_name) const
+    {
+        if (!m_compartment_data->gate_table)
+        {
+            return nullptr;
+        }
+
+        auto gate_entry = m_compartment_data->gate_table->find(gate_name);
+        return (gate_entry == m_compartment_data->gate_table->end()) ? nullptr : gate_entry->second;
+    }
+
+    // Call through a gate from FindGate(), with up to COMPARTMENT_GATE_MAX_ARGS integer or pointer arguments.
+    // Returns the function's result, or 0 if the gate has been revoked.
+    template <typename... Args>
+    uintptr_t CallGate(void* gate, Args... args)
+    {
+        static_assert(sizeof...(Args) <= COMPARTMENT_GATE_MAX_ARGS, "Too many arguments for a call gate");
+        const uintptr_t gate_args[COMPARTMENT_GATE_MAX_ARGS] = { (uintptr_t)args... };
+
+        return CompartmentGateCaller(m_compartment_data->gate_entry_fp, gate, gate_args);
+    }
+
     template <typename... Args>
     void *cheri_malloc(Args&&... args)
     {
@@ -102,6 +151,18 @@ public:
         CallServiceFn<CCheriFreeCapMgrServiceData>(__func__, std::forward<Args>(args)...);
     }
 
+    template <typename... Args>
+    bool cheri_dlopen(Args&&... args)
+    {
+        return CallServiceFn<CCheriDlopenCapMgrServiceData>(__func__, std::forward<Args>(args)...) != 0;
+    }
+
+    template <typename... Args>
+    void *cheri_dlsym(Args&&... args)
+    {
+        return (void*)CallServiceFn<CCheriDlsymCapMgrServiceData>(__func__, std::forward<Args>(args)...);
+    }
+
 };
 
 #endif /* _SERVICECALL_PROXY_H__ */
@@ -0,0 +1,161 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Emulated compartment switcher: the capability manager side of CompartmentCaller() on a non-CHERI host
+
+#include <cstdlib>
+#include <cheriintrin.h>
+
+#include "comp_common_asm.h"
+#include "CCapMgrLogger.h"
+
+using namespace CapMgr;
+
+// Without restricted and executive banked registers, the switcher keeps the stack pointer each switch left from
+// in a chain of frames per thread, and the switch returns resume the most recent one.
+// - Entering a compartment (comp_data has a stack) runs the entry function on the compartment's stack.
+// - A service call (comp_data has no stack) runs the handler on the executive stack, below where the executive
+//   entered the compartment, as the banked stack pointer would.
+// - A gate call runs the gate's function on the callee compartment's stack, like entering it.
+// No registers are cleared and DDC/CTPIDR are not switched; the compartment shares the thread pointer anyway.
+
+extern "C"
+{
+    // Save the callee saved registers, store the stack pointer to *saved_sp, and call fn(arg) on new_sp.
+    // Returns the value passed to EmulatedResumeStack() with the saved stack pointer; fn itself must not return.
+    uintptr_t EmulatedSwitchStack(void* new_sp, void (*fn)(void*), void* arg, void** saved_sp);
+
+    // Resume the EmulatedSwitchStack() call which saved saved_sp, returning value from it
+    [[noreturn]] void EmulatedResumeStack(void* saved_sp, uintptr_t value);
+}
+
+namespace
+{
+    // Space left below the executive's saved stack pointer, covering the red zone of the x86-64 ABI
+    constexpr uintptr_t kExecutiveStackGap = 128;
+
+    struct SwitchFrame
+    {
+        void* saved_sp;         // Where the switch came from
+        SwitchFrame* prev;
+        uint64_t* busy;         // A gate call's callee busy flag, cleared on return
+    };
+
+    thread_local SwitchFrame* t_switch_frame = nullptr;
+
+    [[noreturn]] void SwitchReturn(uintptr_t retval)
+    {
+        SwitchFrame* frame = t_switch_frame;
+        if (!frame)
+        {
+            L_(ERROR) << "Emulated switch return without a switch entry";
+            Log::Flush();
+            std::abort();
+        }
+
+        if (frame->busy)
+        {
+            __atomic_store_n(frame->busy, 0, __ATOMIC_RELEASE);
+        }
+        t_switch_frame = frame->prev;
+        EmulatedResumeStack(frame->saved_sp, retval);
+    }
+
+    using GateFnPtr = uintptr_t (*)(uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+
+    struct GateCall
+    {
+        GateFnPtr fn;
+        uintptr_t args[COMPARTMENT_GATE_MAX_ARGS];
+    };
+
+    // Runs on the callee's stack: call the gate's function, then switch back as CompartmentSwitchReturn would
+    [[noreturn]] void GateThunk(void* arg)
+    {
+        auto call = static_cast<GateCall*>(arg);
+        SwitchReturn(call->fn(call->args[0], call->args[1], call->args[2], call->args[3], call->args[4],
+            call->args[5]));
+    }
+}
+
+extern "C" uintptr_t CompartmentSwitchEntry(void* comp_data, void* pf, void* comp_ptr_sealed, void* sealer_cap)
+{
+    auto data = static_cast<CompartmentData_t*>(comp_data);
+    void* sp = data->csp;
+
+    if (!sp)
+    {
+        if (!t_switch_frame)
+        {
+            L_(ERROR) << "Emulated service call from outside a compartment";
+            Log::Flush();
+            std::abort();
+        }
+
+        // Service calls only come from compartments, so the most recent switch came from the executive stack
+        sp = cheri_align_down(static_cast<uint8_t*>(t_switch_frame->saved_sp) - kExecutiveStackGap, 16);
+    }
+
+    SwitchFrame frame{ nullptr, t_switch_frame, nullptr };
+    t_switch_frame = &frame;
+
+    return EmulatedSwitchStack(sp, reinterpret_cast<void (*)(void*)>(pf), cheri_unseal(comp_ptr_sealed, sealer_cap),
+        &frame.saved_sp);
+}
+
+extern "C" void CompartmentSwitchReturn(uintptr_t retval)
+{
+    SwitchReturn(retval);
+}
+
+extern "C" void CompartmentServiceCallbackSwitchReturn(uintptr_t retval)
+{
+    SwitchReturn(retval);
+}
+
+extern "C" void CompartmentServiceCallbackAbandon(uintptr_t retval)
+{
+    // Drop the service call's frame, so the switch returns from the compartment call it was made from
+    t_switch_frame = t_switch_frame->prev;
+    SwitchReturn(retval);
+}
+
+extern "C" uintptr_t CompartmentGateEntry(void* gate_sealed, uintptr_t a0, uintptr_t a1, uintptr_t a2, uintptr_t a3,
+    uintptr_t a4, uintptr_t a5)
+{
+    auto gate = static_cast<CompartmentGate_t*>(cheri_unseal(gate_sealed, CompartmentGateUnsealer));
+
+    // The caller is identified by the bounds of the stack it is running on, as on the target, which here are
+    // unlimited
+    uintptr_t sp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    if (!gate || !gate->fn || sp - gate->caller_stack_base >= gate->caller_stack_size)
+    {
+        return 0;
+    }
+
+    // The callee runs from the top of its stack, so must not be running already: claim it for this thread, as the
+    // trampoline does
+    uint64_t idle = 0;
+    uint64_t thread = reinterpret_cast<uintptr_t>(__builtin_thread_pointer());
+    if (!__atomic_compare_exchange_n(gate->callee_busy, &idle, thread, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+
+    __atomic_fetch_add(&gate->calls, 1, __ATOMIC_RELAXED);
+
+    GateCall call{ reinterpret_cast<GateFnPtr>(gate->fn), { a0, a1, a2, a3, a4, a5 } };
+    SwitchFrame frame{ nullptr, t_switch_frame, gate->callee_busy };
+    t_switch_frame = &frame;
+
+    return EmulatedSwitchStack(gate->callee.csp, &GateThunk, &call, &frame.saved_sp);
+}
+
+extern "C" void CompartmentSaveSwitchState(struct CompartmentSwitchState_t* state)
+{
+    state->switch_frame = t_switch_frame;
+}
+
+extern "C" void CompartmentRestoreSwitchState(const struct CompartmentSwitchState_t* state)
+{
+    // The frames of the abandoned call were on the stacks left behind
+    t_switch_frame = static_cast<SwitchFrame*>(state->switch_frame);
+}
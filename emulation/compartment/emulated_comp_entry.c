@@ -0,0 +1,9 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Compartment entry point for the emulated switcher, in place of the trampoline assembler
+
+#include "comp_common_defs.h"
+
+void CompartmentEntryPoint(void* comp_data_table)
+{
+    CompartmentUnwrap(comp_data_table);
+}
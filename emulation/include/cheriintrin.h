@@ -0,0 +1,117 @@
+// Copyright (C) 2024 Verifoxx Limited
+// cheriintrin.h: Software emulated capabilities, standing in for the CHERI intrinsics on a non-CHERI host.
+// Used instead of the toolchain's header when built with CAPMGR_EMULATED_CAPS.
+
+#ifndef __EMULATED_CHERIINTRIN_H_
+#define __EMULATED_CHERIINTRIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <elf.h>
+
+// An emulated capability is only its address, so the capability types are the plain pointer types:
+// - Every non-null value is tagged, with base 0, unlimited length and all permissions.
+// - Bounds, permissions and sealing are accepted and ignored, so nothing is enforced and out of bounds accesses
+//   are not caught.  Code relying on reading back bounds (e.g. a capability's length) must not be used.
+// - Sealing and sentries are identities: a sealed capability can be used without unsealing it.
+// Which is enough to run and measure the framework's own work (loading, fixups, switching, service calls) on any
+// host, but not its security properties.
+
+// On a purecap target this is a capability; here it is an address
+typedef uintptr_t elfptr_t;
+
+// Permissions, ref Morello Aarch64 ABI.  Kept distinct so permission masks are built the same as on the target.
+#define CHERI_PERM_GLOBAL                       (1 << 0)
+#define ARM_CAP_PERMISSION_EXECUTIVE            (1 << 1)
+#define ARM_CAP_PERMISSION_MUTABLE_LOAD         (1 << 6)
+#define ARM_CAP_PERMISSION_COMPARTMENT_ID       (1 << 7)
+#define ARM_CAP_PERMISSION_BRANCH_SEALED_PAIR   (1 << 8)
+#define CHERI_PERM_SYSTEM_REGS                  (1 << 9)
+#define CHERI_PERM_UNSEAL                       (1 << 10)
+#define CHERI_PERM_SEAL                         (1 << 11)
+#define CHERI_PERM_STORE_LOCAL_CAP              (1 << 12)
+#define CHERI_PERM_STORE_CAP                    (1 << 13)
+#define CHERI_PERM_LOAD_CAP                     (1 << 14)
+#define CHERI_PERM_EXECUTE                      (1 << 15)
+#define CHERI_PERM_STORE                        (1 << 16)
+#define CHERI_PERM_LOAD                         (1 << 17)
+
+#define CHERI_EMULATED_ALL_PERMS                ((1 << 18) - 1)
+
+// Auxiliary vector entries for the root capabilities, ref Morello Linux ABI
+#ifndef AT_CHERI_EXEC_RW_CAP
+#define AT_CHERI_EXEC_RW_CAP    61
+#define AT_CHERI_EXEC_RX_CAP    62
+#define AT_CHERI_INTERP_RW_CAP  63
+#define AT_CHERI_INTERP_RX_CAP  64
+#define AT_CHERI_STACK_CAP      65
+#define AT_CHERI_SEAL_CAP       66
+#define AT_CHERI_CID_CAP        67
+#endif
+
+// Morello relocation types, ref Morello Aarch64 ELF ABI
+#ifndef R_MORELLO_CAPINIT
+#define R_MORELLO_CAPINIT       59392
+#define R_MORELLO_GLOB_DAT      59393
+#define R_MORELLO_JUMP_SLOT     59394
+#define R_MORELLO_RELATIVE      59395
+#define R_MORELLO_IRELATIVE     59396
+#define R_MORELLO_TLSDESC       59397
+#define R_MORELLO_TPREL128      59398
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// The root capabilities span the whole address space, i.e. are null
+static inline void* getauxptr(unsigned long type)
+{
+    (void)type;
+    return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+// Address
+#define cheri_address_get(c)            ((uintptr_t)(c))
+#define cheri_address_set(c, a)         ((__typeof__(c))(uintptr_t)(a))
+
+// Bounds
+#define cheri_base_get(c)               ((void)(c), (uintptr_t)0)
+#define cheri_length_get(c)             ((void)(c), (size_t)-1)
+#define cheri_offset_get(c)             ((size_t)(uintptr_t)(c))
+#define cheri_offset_set(c, o)          ((__typeof__(c))(uintptr_t)(o))
+#define cheri_bounds_set(c, l)          ((void)(l), (c))
+#define cheri_bounds_set_exact(c, l)    ((void)(l), (c))
+#define cheri_representable_length(l)   (l)
+#define cheri_representable_alignment_mask(l)   ((void)(l), (size_t)-1)
+
+// Permissions
+#define cheri_perms_get(c)              ((void)(c), (size_t)CHERI_EMULATED_ALL_PERMS)
+#define cheri_perms_and(c, m)           ((void)(m), (c))
+#define cheri_perms_clear(c, m)         ((void)(m), (c))
+
+// Tag
+#define cheri_tag_get(c)                ((uintptr_t)(c) != 0)
+#define cheri_tag_clear(c)              (c)
+#define cheri_is_valid(c)               cheri_tag_get(c)
+#define cheri_is_equal_exact(a, b)      ((uintptr_t)(a) == (uintptr_t)(b))
+
+// Sealing
+#define cheri_type_get(c)               ((void)(c), (long)0)
+#define cheri_is_sealed(c)              ((void)(c), 0)
+#define cheri_is_sentry(c)              ((void)(c), 0)
+#define cheri_sentry_create(c)          (c)
+#define cheri_seal(c, s)                ((void)(s), (c))
+#define cheri_unseal(c, s)              ((void)(s), (c))
+
+// Alignment
+#define cheri_align_up(c, a)            ((__typeof__(c))(((uintptr_t)(c) + (a) - 1) & ~((uintptr_t)(a) - 1)))
+#define cheri_align_down(c, a)          ((__typeof__(c))((uintptr_t)(c) & ~((uintptr_t)(a) - 1)))
+#define cheri_is_aligned(c, a)          (((uintptr_t)(c) & ((uintptr_t)(a) - 1)) == 0)
+
+#endif /* __EMULATED_CHERIINTRIN_H_ */
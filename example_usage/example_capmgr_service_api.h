@@ -21,6 +21,13 @@ extern "C" {
     void* cheri_malloc(size_t sz_bytes);
     void  cheri_free(void* ptr);
 
+    // Load a plugin library into the calling compartment, patched for the compartment.  Returns false on failure.
+    bool  cheri_dlopen(const char* so_name);
+
+    // Restricted capability (a sentry) for a function in the calling compartment's libraries, including plugins
+    // loaded by cheri_dlopen(), or NULL if not found
+    void* cheri_dlsym(const char* fn_name);
+
     //@todo: Add printf() support
 
 #ifdef __cplusplus
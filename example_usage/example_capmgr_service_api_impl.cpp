@@ -5,28 +5,134 @@
 
 #include "example_capmgr_service_api.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <string>
+#include <malloc.h>
 #include <cheriintrin.h>
 #include "CCapMgrLogger.h"
+#include "CCompartment.h"
+#include "CHugePages.h"
+#include "CHugePageHeap.h"
+#include "CTracer.h"
 
 using namespace CapMgr;
 
+namespace
+{
+    // Copy a string from the compartment, which need not be terminated within its capability
+    bool CompartmentString(const char* str, std::string& value)
+    {
+        if (!str || !cheri_tag_get(str))
+        {
+            return false;
+        }
+
+        size_t max_len = cheri_length_get(str) - std::min(cheri_offset_get(str), cheri_length_get(str));
+        value.assign(str, strnlen(str, max_len));
+        return true;
+    }
+}
+
 void* cheri_malloc(size_t size)
 {
-    L_(DEBUG) << "System malloc: size=" << size;
-    void* ptr = std::malloc(size);
+    // Reserved against the calling compartment's account, which may refuse it
+    auto compartment = CCompartment::GetCurrent();
+    CResourceAccount* account = compartment ? &compartment->GetAccount() : nullptr;
+    if (account && !account->CanAllocate(size))
+    {
+        return nullptr;
+    }
 
+    // With huge pages on, small allocations come from huge page chunks (already cleared)
+    size_t allocated = 0;
+    void* ptr = CHugePages::IsEnabled() ? CHugePageHeap::GetDefault().Allocate(size) : nullptr;
     if (ptr)
     {
-        std::memset(ptr, 0, size);  // Slight extension, we clear the memory buffer after alloc
+        L_(DEBUG) << "Huge page heap malloc: size=" << size;
+        allocated = CHugePageHeap::BlockSize(size);
+    }
+    else
+    {
+        L_(DEBUG) << "System malloc: size=" << size;
+        ptr = std::malloc(size);
+
+        if (ptr)
+        {
+            std::memset(ptr, 0, size);  // Slight extension, we clear the memory buffer after alloc
+            allocated = malloc_usable_size(ptr);
+        }
+    }
+
+    if (account)
+    {
+        if (ptr)
+        {
+            account->OnAllocate(size, allocated);
+        }
+        else
+        {
+            account->OnAllocateFailed(size);
+        }
     }
+    CAPMGR_TRACE(kAlloc, CTracer::InternName("cheri_malloc"), allocated);
 
     return cheri_perms_clear(ptr, ARM_CAP_PERMISSION_EXECUTIVE);    // Set suitable for restricted
 }
 
 void  cheri_free(void* ptr)
 {
-    L_(DEBUG) << "System free memory";
-    std::free(ptr);
+    if (!ptr)
+    {
+        return;
+    }
+
+    // Blocks stay in the huge page heap if it was used, even if huge pages were turned off since.
+    // The sizes come from the heaps, not the capability, which the compartment may have narrowed.
+    size_t freed = CHugePageHeap::GetDefault().Free(ptr);
+    if (freed)
+    {
+        L_(DEBUG) << "Huge page heap free memory";
+    }
+    else
+    {
+        L_(DEBUG) << "System free memory";
+        freed = malloc_usable_size(ptr);
+        std::free(ptr);
+    }
+
+    auto compartment = CCompartment::GetCurrent();
+    if (compartment)
+    {
+        compartment->GetAccount().OnFree(freed);
+    }
+    CAPMGR_TRACE(kFree, CTracer::InternName("cheri_free"), freed);
+}
+
+bool cheri_dlopen(const char* so_name)
+{
+    std::string name;
+    auto compartment = CCompartment::GetCurrent();
+    if (!compartment || !CompartmentString(so_name, name))
+    {
+        L_(ERROR) << "cheri_dlopen() needs a library name from a compartment";
+        return false;
+    }
+
+    L_(DEBUG) << "Compartment loading plugin " << name;
+    return compartment->OpenPlugin(name);
+}
+
+void* cheri_dlsym(const char* fn_name)
+{
+    std::string name;
+    auto compartment = CCompartment::GetCurrent();
+    if (!compartment || !CompartmentString(fn_name, name))
+    {
+        L_(ERROR) << "cheri_dlsym() needs a function name from a compartment";
+        return nullptr;
+    }
+
+    return compartment->GetRestrictedFunction(name);
 }
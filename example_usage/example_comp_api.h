@@ -35,6 +35,18 @@ extern "C" {
 
     bool example_set_compartment_debug_level(int32_t debug_level);
 
+    // Call example_add_two_numbers(a, b) in another compartment, through the call gate of that name
+    int32_t example_call_gate(const char* gate_name, int32_t a, int32_t b);
+
+    // Busy for ms milliseconds, e.g. to try call deadlines.  If cooperative, stops early when the call's soft
+    // deadline has passed.  Returns the milliseconds it was busy.
+    int32_t example_spin(int32_t ms, bool cooperative);
+
+    // Take a fault, e.g. to try fault containment: 0 for a store past the bounds of a heap buffer (a capability
+    // bounds fault, or a null store without capabilities), 1 for a store through a pointer made from an integer.
+    // Does not return.
+    int32_t example_fault(int32_t kind);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,7 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <cheriintrin.h>
 
 #include "example_comp_api.h"
@@ -43,6 +44,12 @@ extern "C" char* example_copy_string_to_heap(const char* str)
 
 extern "C" bool example_print_heap_string_and_free(char* str, int16_t chars_to_print)
 {
+    if (!str)
+    {
+        LOG_ERROR("example_print_heap_string_and_free: No string");
+        return false;
+    }
+
     LOG_VERBOSE("example_print_heap_string_and_free(\"%s\", %d)", str, chars_to_print);
 
     auto sz = strlen(str);
@@ -83,3 +90,72 @@ extern "C" bool example_set_compartment_debug_level(int32_t debug_level)
     LOG_DEBUG("Log level updated");
     return true;
 }
+
+extern "C" int32_t example_call_gate(const char* gate_name, int32_t a, int32_t b)
+{
+    LOG_VERBOSE("example_call_gate(\"%s\", %d, %d)", gate_name, a, b);
+
+    void* gate = CServiceCallProxy::GetInstance()->FindGate(gate_name);
+    if (!gate)
+    {
+        LOG_ERROR("example_call_gate: No gate \"%s\" granted to this compartment", gate_name);
+        return 0;
+    }
+
+    // Straight to the other compartment, without a service call
+    int32_t c = (int32_t)CServiceCallProxy::GetInstance()->CallGate(gate, a, b);
+    LOG_DEBUG("example_call_gate: result = %d", c);
+    LOG_VERBOSE("example_call_gate: finished");
+    return c;
+}
+
+extern "C" int32_t example_spin(int32_t ms, bool cooperative)
+{
+    LOG_VERBOSE("example_spin(%d, %s)", ms, cooperative ? "true" : "false");
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int32_t elapsed_ms = 0;
+    while (elapsed_ms < ms)
+    {
+        if (cooperative && CServiceCallProxy::GetInstance()->DeadlinePassed())
+        {
+            LOG_DEBUG("example_spin: deadline passed, stopping early");
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (int32_t)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+    }
+
+    LOG_VERBOSE("example_spin: finished after %d ms", elapsed_ms);
+    return elapsed_ms;
+}
+
+extern "C" int32_t example_fault(int32_t kind)
+{
+    LOG_VERBOSE("example_fault(%d)", kind);
+
+    volatile char* target = nullptr;
+#if __CHERI_PURE_CAPABILITY__ && !CAPMGR_EMULATED_CAPS
+    // On the stack, so nothing is left allocated once the faulting call is abandoned
+    volatile char buffer[16];
+    if (kind == 0)
+    {
+        // Bounded to the 16 bytes of the buffer, so the store past them is a bounds fault
+        target = buffer + 4096;
+    }
+#endif
+    if (kind == 1)
+    {
+        // An integer is never a valid capability, so the store is a tag fault
+        target = reinterpret_cast<volatile char*>(static_cast<uintptr_t>(0x1000));
+    }
+
+    LOG_DEBUG("example_fault: storing to %p", (void*)target);
+    *target = 1;
+
+    LOG_ERROR("example_fault: store did not fault");
+    return 0;
+}
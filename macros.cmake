@@ -14,3 +14,68 @@ MACRO(ALL_FILES_AND_INC_FOLDERS curr_dir return_files return_inc_folders)
 	list(REMOVE_DUPLICATES dir_list)
 	set(${return_inc_folders} ${dir_list})
 ENDMACRO()
+
+# Synthetic compartment library for the relocation scaling benchmark, generated by bench/synthetic/gen_synthetic_lib.cmake.
+# ADD_SYNTHETIC_COMPLIB(<name> [RELOCS n] [INIT n] [FINI n] [NEEDED n] [DATA_KB n] [TEXT_KB n])
+# Builds synthetic/libsynth_<name>.so with RELOCS capability relocations, INIT/FINI constructors/destructors and
+# DATA_KB/TEXT_KB of data/code, which depends on NEEDED generated libraries (synthetic/libsynth_<name>_dep<n>.so).
+# The libraries are added to the synthetic-complibs target and their paths, relative to the build folder, to the
+# SYNTHETIC_COMPLIBS global property.
+FUNCTION(ADD_SYNTHETIC_COMPLIB name)
+	cmake_parse_arguments(SYNTH "" "RELOCS;INIT;FINI;NEEDED;DATA_KB;TEXT_KB" "" ${ARGN})
+	foreach(param RELOCS INIT FINI NEEDED TEXT_KB)
+		if (NOT DEFINED SYNTH_${param})
+			set(SYNTH_${param} 0)
+		endif()
+	endforeach()
+	if (NOT DEFINED SYNTH_DATA_KB)
+		set(SYNTH_DATA_KB 64)
+	endif()
+
+	set(generator ${CMAKE_CURRENT_SOURCE_DIR}/bench/synthetic/gen_synthetic_lib.cmake)
+	set(out_dir ${CMAKE_BINARY_DIR}/synthetic)
+
+	# Each dependency is small: just an exported object and a constructor, with a few relocations of its own
+	set(deps "")
+	if (SYNTH_NEEDED GREATER 0)
+		math(EXPR last "${SYNTH_NEEDED} - 1")
+		foreach(i RANGE ${last})
+			list(APPEND deps ${name}_dep${i})
+		endforeach()
+	endif()
+
+	foreach(lib ${deps} ${name})
+		if (lib STREQUAL name)
+			# The dependencies are passed as a comma separated list, since a ; would split the argument
+			string(REPLACE ";" "," dep_list "${deps}")
+			set(args -DRELOCS=${SYNTH_RELOCS} -DINIT=${SYNTH_INIT} -DFINI=${SYNTH_FINI} -DDEPS=${dep_list}
+				-DDATA_KB=${SYNTH_DATA_KB} -DTEXT_KB=${SYNTH_TEXT_KB})
+		else()
+			set(args -DRELOCS=64 -DINIT=1 -DFINI=1)
+		endif()
+
+		add_custom_command(
+			OUTPUT ${out_dir}/synth_${lib}.c
+			COMMAND ${CMAKE_COMMAND} -DNAME=${lib} -DOUTPUT=${out_dir}/synth_${lib}.c ${args} -P ${generator}
+			DEPENDS ${generator}
+			COMMENT "Generating synthetic compartment library source synth_${lib}.c"
+			VERBATIM)
+
+		add_library(synth_${lib} SHARED ${out_dir}/synth_${lib}.c)
+		set_target_properties(synth_${lib} PROPERTIES
+			LIBRARY_OUTPUT_DIRECTORY ${out_dir}
+			LINKER_LANGUAGE C
+			BUILD_WITH_INSTALL_RPATH ON
+			INSTALL_RPATH "$ORIGIN")
+
+		# No C library, so the relocations are only the generated ones
+		target_link_options(synth_${lib} PRIVATE -nostdlib)
+		add_dependencies(synthetic-complibs synth_${lib})
+	endforeach()
+
+	foreach(dep ${deps})
+		target_link_libraries(synth_${name} PRIVATE synth_${dep})
+	endforeach()
+
+	set_property(GLOBAL APPEND PROPERTY SYNTHETIC_COMPLIBS ./synthetic/libsynth_${name}.so)
+ENDFUNCTION()
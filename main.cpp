@@ -19,8 +19,10 @@
 // C++ includes
 #include <iostream>
 #include <fstream>
+#include <future>
 #include <string>
 #include <memory>
+#include <sstream>
 #include <vector>
 
 // CapMgr Includes
@@ -28,8 +30,13 @@
 #include "CCompartment.h"
 #include "CCompartmentData.h"
 #include "CCompartmentLibs.h"
+#include "CCapMgrException.h"
 #include "CCapMgrLogger.h"
 #include "CCompartmentApiProxy.h"
+#include "CCompartmentRegistry.h"
+#include "CShardedCompartmentProxy.h"
+#include "CHugePages.h"
+#include "CTracer.h"
 
 // The example API we will call proxy functions for
 #include "example_comp_api.h"
@@ -42,16 +49,41 @@ void set_capmgr_log_level(uint32_t log_level)
     if (log_level > (uint32_t)VERBOSE)
         log_level = (uint32_t)VERBOSE;
 
-    Log::Level() = (TLogLevel)log_level;
+    Log::SetLevel((TLogLevel)log_level);
 }
 
 
 /* Capability Manager Support: Load compartment library and patch relocation symbols */
-static bool lib_load_and_fix(const std::string& libname, CCompartmentLibs*& plibs, bool dump_tables = false)
+static bool lib_load_and_fix(const std::string& libname, CCompartmentLibs*& plibs, bool dump_tables = false,
+    unsigned fixup_threads = 1, const std::string& fixup_plan_dir = "", bool fixup_report = false,
+    bool native_loader = false)
 {
     auto rwcap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
     auto fixup_cap{ Capability(getauxptr(AT_CHERI_EXEC_RW_CAP)) };
 
+    if (native_loader)
+    {
+        // Relocated straight into restricted capabilities, so there are no fixups to do
+        auto rxcap{ Capability(getauxptr(AT_CHERI_EXEC_RX_CAP)) };
+        try
+        {
+            std::unique_ptr<CCompartmentLoader> loader{ new CCompartmentLoader({}, rwcap, rxcap) };
+            plibs = new CCompartmentLibs{ libname, rwcap, fixup_cap, std::move(loader) };
+        }
+        catch (const CCapMgrException& e)
+        {
+            L_(ERROR) << "Compartment loader cannot load " << libname << ": " << e.what();
+            return false;
+        }
+
+        if (dump_tables)
+        {
+            L_(ALWAYS) << "Dump libs phdrs: " << *plibs;
+            L_(ALWAYS) << "Dump reloc tables: " << plibs->DumpRelocTables();
+        }
+        return true;
+    }
+
 #if CAPMGR_BUILT_STATIC_ENABLE
     bool load_new = false;  // For static build, the cap mgr has no linkmap so cannot load a new one
 #else
@@ -65,23 +97,58 @@ static bool lib_load_and_fix(const std::string& libname, CCompartmentLibs*& plib
         L_(ALWAYS) << "Dump reloc tables: " << plibs->DumpRelocTables();
     }
 
+    if (!fixup_plan_dir.empty() && !plibs->UseFixupPlanCache(fixup_plan_dir))
+    {
+        L_(WARNING) << "Fixup plan cache not used";
+    }
+
     L_(DEBUG) << "Do capability relocation fixups...";
-    return plibs->DoAllLibCapFixups();
+    if (!plibs->DoAllLibCapFixups(true, fixup_threads))
+    {
+        return false;
+    }
+
+    if (fixup_report)
+    {
+        auto stats{ plibs->GetFixupPageStats() };
+        L_(ALWAYS) << "Fixup pages: " << stats.unprotected_pages << " made writable (" << stats.target_pages
+            << " hold fixups) of " << stats.load_pages << " LOAD pages, saving "
+            << (stats.load_pages - stats.unprotected_pages) << " pages";
+        L_(ALWAYS) << "Fixup mprotect calls: " << stats.Syscalls() << " instead of " << stats.BaselineSyscalls()
+            << " per fixup pass (" << stats.runs << " runs)";
+    }
+    return true;
 }
 
 /* Capability Manager Support: Fixup relocation symbols ahead of program exit */
 // @todo: make it part of CCompartmentLibs destructor?
-static bool lib_restore_and_end(CCompartmentLibs* plibs)
+static bool lib_restore_and_end(CCompartmentLibs* plibs, unsigned fixup_threads = 1)
 {
 #if CAPMGR_BUILT_STATIC_ENABLE
     (void)plibs;    // Silence the warning
+    (void)fixup_threads;
     L_(VERBOSE) << "No action to revert fixups needed for static build";
     return true;
 #else
 
+    if (plibs->IsNativeLoaded())
+    {
+        // Loaded straight into restricted capabilities, so there are no fixups to revert
+        delete plibs;
+        return true;
+    }
+
     L_(DEBUG) << "Revert capability relocation fixups...";
 
-    auto result = plibs->DoAllLibCapFixups(false);
+    auto result = plibs->DoAllLibCapFixups(false, fixup_threads);
+
+    auto stats{ plibs->GetRevertStats() };
+    L_(DEBUG) << "Reverted " << stats.reverted << " capabilities from the fixup journal, " << stats.changed
+        << " changed since patching";
+    if (stats.skipped)
+    {
+        L_(WARNING) << stats.skipped << " capabilities not reverted as the tag is no longer valid";
+    }
 
     L_(DEBUG) << "Delete the libs and dlclose()";
     delete plibs;
@@ -89,6 +156,271 @@ static bool lib_restore_and_end(CCompartmentLibs* plibs)
 #endif
 }
 
+/* Multiple compartments: host a compartment for each library in a registry, then call into each of them */
+static bool run_registry_compartments(const std::string& lib_list, int32_t log_level, uint32_t stack_size,
+    unsigned fixup_threads, bool native_loader)
+{
+    CCompartmentRegistry registry;
+    std::istringstream list_stream(lib_list);
+    std::string lib;
+
+    try
+    {
+        while (std::getline(list_stream, lib, ','))
+        {
+            CCompartmentRegistry::Config config;
+            config.library = lib;
+            config.stack_size = stack_size;
+            config.fixup_threads = fixup_threads;
+            config.native_loader = native_loader;
+            registry.Register(config);
+        }
+
+        for (auto id : registry.GetIds())
+        {
+            CCompartmentApiProxy proxy(registry.Get(id));
+            proxy.example_set_compartment_debug_level(log_level);
+
+            int32_t id_num = static_cast<int32_t>(id);
+            auto result = proxy.example_add_two_numbers(id_num, 100);
+            L_(ALWAYS) << "Compartment " << id_num << " (" << registry.GetLibs(id).GetName() << ", seal id "
+                << registry.Get(id).GetSealId() << "): example_add_two_numbers(" << id_num << ", 100) = " << result
+                << std::endl;
+        }
+
+        // Pipeline: each compartment calls the next directly, through a call gate
+        auto ids = registry.GetIds();
+        if (ids.size() > 1)
+        {
+            for (size_t i = 0; i < ids.size(); i++)
+            {
+                registry.GrantCall(ids[i], ids[(i + 1) % ids.size()], "example_add_two_numbers", "next_add");
+            }
+
+            for (auto id : ids)
+            {
+                CCompartmentApiProxy proxy(registry.Get(id));
+                int32_t id_num = static_cast<int32_t>(id);
+                auto result = proxy.example_call_gate("next_add", id_num, 1000);
+                L_(ALWAYS) << "Compartment " << id_num << ": example_call_gate(\"next_add\", " << id_num
+                    << ", 1000) = " << result << " (gate calls " << registry.GetGateCalls(id, "next_add") << ")"
+                    << std::endl;
+            }
+        }
+    }
+    catch (const CCompartmentException& e)
+    {
+        L_(ERROR) << "Registry compartments: " << e.what() << std::endl;
+        return false;
+    }
+
+    L_(ALWAYS) << "Called " << registry.Size() << " registry compartments" << std::endl;
+    return true;
+}
+
+/* Sharded replicas: route keyed calls to replicas of the compartment, then rebalance by adding and removing one */
+static bool run_sharded_replicas(const std::string& comp_lib, uint32_t num_replicas, int32_t log_level,
+    uint32_t stack_size, unsigned fixup_threads, bool native_loader)
+{
+    constexpr uint64_t kNumKeys = 1000;
+
+    CCompartmentRegistry registry;
+    CShardedCompartmentProxy::Config config;
+    config.compartment.library = comp_lib;
+    config.compartment.stack_size = stack_size;
+    config.compartment.fixup_threads = fixup_threads;
+    config.compartment.native_loader = native_loader;
+    config.pin_threads = true;
+
+    size_t moved = 0;
+    config.on_move = [&moved](uint32_t, const CShardedCompartmentProxy::ReplicaId* from, CShardedCompartmentProxy::ReplicaId)
+    {
+        if (from)
+        {
+            moved++;
+        }
+    };
+
+    // The calls for every key, in flight at once; each returns its key so any misrouted or lost call shows
+    auto call_all_keys = [](CShardedCompartmentProxy& sharded)
+    {
+        std::vector<std::future<int32_t>> results;
+        for (uint64_t key = 0; key < kNumKeys; key++)
+        {
+            results.push_back(sharded.Submit(key, [key](CCompartmentApiProxy& proxy)
+                {
+                    return proxy.example_add_two_numbers(static_cast<int32_t>(key), 0);
+                }));
+        }
+
+        bool ok = true;
+        for (uint64_t key = 0; key < kNumKeys; key++)
+        {
+            ok = (results[key].get() == static_cast<int32_t>(key)) && ok;
+        }
+        return ok;
+    };
+
+    auto log_shards = [](CShardedCompartmentProxy& sharded, const char* when)
+    {
+        std::ostringstream shards;
+        for (auto id : sharded.GetReplicaIds())
+        {
+            shards << " " << id << ":" << sharded.GetNumShards(id);
+        }
+        L_(ALWAYS) << "Sharded replicas " << when << ", shards per replica" << shards.str() << std::endl;
+    };
+
+    try
+    {
+        CShardedCompartmentProxy sharded(registry, config, num_replicas);
+        for (auto id : sharded.GetReplicaIds())
+        {
+            sharded.CallReplica(id, [log_level](CCompartmentApiProxy& proxy)
+                {
+                    return proxy.example_set_compartment_debug_level(log_level);
+                });
+        }
+        log_shards(sharded, "created");
+        bool ok = call_all_keys(sharded);
+
+        moved = 0;
+        auto added = sharded.AddReplica();
+        sharded.CallReplica(added, [log_level](CCompartmentApiProxy& proxy)
+            {
+                return proxy.example_set_compartment_debug_level(log_level);
+            });
+        log_shards(sharded, "after adding one");
+        L_(ALWAYS) << "Adding a replica moved " << moved << " shards" << std::endl;
+        ok = call_all_keys(sharded) && ok;
+
+        moved = 0;
+        sharded.RemoveReplica(sharded.GetReplicaIds().front());
+        log_shards(sharded, "after removing one");
+        L_(ALWAYS) << "Removing a replica moved " << moved << " shards" << std::endl;
+        ok = call_all_keys(sharded) && ok;
+
+        if (!ok)
+        {
+            L_(ERROR) << "Sharded replicas: wrong results" << std::endl;
+            return false;
+        }
+    }
+    catch (const CCompartmentException& e)
+    {
+        L_(ERROR) << "Sharded replicas: " << e.what() << std::endl;
+        return false;
+    }
+
+    L_(ALWAYS) << "Called " << kNumKeys << " keys through the sharded replicas" << std::endl;
+    return true;
+}
+
+/* Call deadlines: a cooperative function stops at the soft deadline, a busy one is abandoned at the hard deadline */
+static bool run_deadline_calls(const std::string& comp_lib, int32_t log_level, uint32_t stack_size,
+    unsigned fixup_threads, bool native_loader)
+{
+    constexpr uint64_t kSoftTimeoutNs = 20 * 1000 * 1000;
+    constexpr uint64_t kHardTimeoutNs = 50 * 1000 * 1000;
+    constexpr int32_t kSpinMs = 1000;
+
+    CCompartmentRegistry registry;
+    CCompartmentRegistry::Config config;
+    config.library = comp_lib;
+    config.stack_size = stack_size;
+    config.fixup_threads = fixup_threads;
+    config.native_loader = native_loader;
+
+    try
+    {
+        CCompartmentApiProxy proxy(registry.Get(registry.Register(config)));
+        proxy.example_set_compartment_debug_level(log_level);
+        proxy.SetResetBaseline();
+        proxy.SetCallTimeouts(kSoftTimeoutNs, kHardTimeoutNs);
+
+        auto spun = proxy.example_spin(kSpinMs, true);
+        L_(ALWAYS) << "Cooperative example_spin(" << kSpinMs << ") stopped at the soft deadline after " << spun
+            << " ms" << std::endl;
+
+        try
+        {
+            spun = proxy.example_spin(kSpinMs, false);
+            L_(ERROR) << "Busy example_spin(" << kSpinMs << ") was not abandoned, finished after " << spun << " ms"
+                << std::endl;
+            return false;
+        }
+        catch (const CCompartmentDeadlineException& e)
+        {
+            L_(ALWAYS) << "Busy example_spin(" << kSpinMs << "): " << e.what() << ", needs reset = "
+                << proxy.NeedsReset() << std::endl;
+        }
+
+        auto stats = proxy.Reset();
+        auto result = proxy.example_add_two_numbers(2, 3);
+        L_(ALWAYS) << "Reset " << stats.dirty_pages << " pages, then example_add_two_numbers(2, 3) = " << result
+            << std::endl;
+        if (result != 5)
+        {
+            return false;
+        }
+    }
+    catch (const CCompartmentException& e)
+    {
+        L_(ERROR) << "Deadline calls: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* Fault containment: a compartment which faults fails just its call, and is back in service after a reset */
+static bool run_fault_calls(const std::string& comp_lib, int32_t log_level, uint32_t stack_size,
+    unsigned fixup_threads, bool native_loader)
+{
+    CCompartmentRegistry registry;
+    CCompartmentRegistry::Config config;
+    config.library = comp_lib;
+    config.stack_size = stack_size;
+    config.fixup_threads = fixup_threads;
+    config.native_loader = native_loader;
+
+    try
+    {
+        CCompartmentApiProxy faulting(registry.Get(registry.Register(config)));
+        CCompartmentApiProxy bystander(registry.Get(registry.Register(config)));
+        faulting.example_set_compartment_debug_level(log_level);
+        bystander.example_set_compartment_debug_level(log_level);
+        faulting.SetResetBaseline();
+
+        for (int32_t kind = 0; kind < 2; kind++)
+        {
+            try
+            {
+                faulting.example_fault(kind);
+                L_(ERROR) << "example_fault(" << kind << ") returned" << std::endl;
+                return false;
+            }
+            catch (const CCompartmentFaultException& e)
+            {
+                L_(ALWAYS) << "example_fault(" << kind << "): " << e.what() << ", needs reset = "
+                    << faulting.NeedsReset() << std::endl;
+            }
+
+            // The other compartment never noticed
+            auto result = bystander.example_add_two_numbers(kind, 10);
+            auto stats = faulting.Reset();
+            L_(ALWAYS) << "Other compartment example_add_two_numbers(" << kind << ", 10) = " << result << "; reset "
+                << stats.dirty_pages << " pages, then example_add_two_numbers(2, 3) = "
+                << faulting.example_add_two_numbers(2, 3) << std::endl;
+        }
+    }
+    catch (const CCompartmentException& e)
+    {
+        L_(ERROR) << "Fault calls: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
 static int print_help(const char *exe_name)
 {
     printf("Usage: %s [-options]\n", exe_name);
@@ -100,6 +432,23 @@ static int print_help(const char *exe_name)
     printf("  -v=n                   Set log verbose level (0 to 4, default is 2) larger\n"
         "                           level gives higher verbosity.\n");
     printf("  --dump_tables          Dump relocation tables to stdout\n");
+    printf("  --fixup_threads=n      Number of threads used to patch relocations (default 1)\n");
+    printf("  --fixup_plan_dir=<dir> Folder to cache relocation fixup plans, to speed up later loads\n");
+    printf("  --fixup_report         Report pages and mprotect calls used for the relocation fixups\n");
+    printf("  --native_loader        Load the compartment library with the built-in loader instead of dlmopen()\n");
+    printf("  --stack_size=n         Compartment stack size in bytes (default 1MiB); the stack used is reported at\n"
+        "                           the end, to tune this\n");
+    printf("  --huge_pages=thp|explicit  Back compartment stacks, heap and library segments with transparent or\n"
+        "                           explicit (hugetlbfs) huge pages\n");
+    printf("  --trace=<file>         Trace compartment calls, service calls, allocations and fixup phases to a Chrome\n"
+        "                           trace JSON file (open in chrome://tracing or ui.perfetto.dev)\n");
+    printf("  --heap_quota=n         Fail compartment heap allocations beyond n bytes\n");
+    printf("  --registry_libs=<lib>,<lib>...  Also host a compartment for each library in a compartment registry,\n"
+        "                           each with its own seal id, and call into each one\n");
+    printf("  --sharded_replicas=n   Also route keyed calls to n replicas of the compartment library, and rebalance\n"
+        "                           by adding and removing a replica\n");
+    printf("  --deadline_calls       Also make calls with soft and hard deadlines, one of which is abandoned\n");
+    printf("  --fault_calls          Also make calls which fault in the compartment, which is then reset\n");
     return 1;
 }
 
@@ -117,6 +466,18 @@ int main(int argc, char* argv[])
     int32_t ret = -1;
     bool dump_relocation_tables = false;
     int32_t log_verbose_level = (uint32_t)WARNING;
+    unsigned fixup_threads = 1;
+    std::string fixup_plan_dir;
+    bool fixup_report = false;
+    bool native_loader = false;
+    uint32_t stack_size = CALL_FUNC_STACK_SIZE;
+    CHugePages::Mode huge_pages = CHugePages::Mode::kOff;
+    size_t heap_quota = 0;
+    std::string trace_file;
+    std::string registry_libs;
+    uint32_t sharded_replicas = 0;
+    bool deadline_calls = false;
+    bool fault_calls = false;
 
     std::string comp_lib{"./libcompartment.so"};    // Test shared object library
 
@@ -138,6 +499,63 @@ int main(int argc, char* argv[])
         else if (!strncmp(argv[0], "--dump_tables", 13)) {
             dump_relocation_tables = true;
         }
+        else if (!strncmp(argv[0], "--fixup_threads=", 16)) {
+            int threads = atoi(argv[0] + 16);
+            if (threads < 1)
+                return print_help(argv[0]);
+            fixup_threads = (unsigned)threads;
+        }
+        else if (!strncmp(argv[0], "--fixup_plan_dir=", 17)) {
+            if (argv[0][17] == '\0')
+                return print_help(argv[0]);
+            fixup_plan_dir = argv[0] + 17;
+        }
+        else if (!strncmp(argv[0], "--fixup_report", 14)) {
+            fixup_report = true;
+        }
+        else if (!strncmp(argv[0], "--native_loader", 15)) {
+            native_loader = true;
+        }
+        else if (!strncmp(argv[0], "--stack_size=", 13)) {
+            int size = atoi(argv[0] + 13);
+            if (size < 4096)
+                return print_help(argv[0]);
+            stack_size = (uint32_t)size;
+        }
+        else if (!strcmp(argv[0], "--huge_pages=thp")) {
+            huge_pages = CHugePages::Mode::kTransparent;
+        }
+        else if (!strcmp(argv[0], "--huge_pages=explicit")) {
+            huge_pages = CHugePages::Mode::kExplicit;
+        }
+        else if (!strncmp(argv[0], "--trace=", 8)) {
+            if (argv[0][8] == '\0')
+                return print_help(argv[0]);
+            trace_file = argv[0] + 8;
+        }
+        else if (!strncmp(argv[0], "--heap_quota=", 13)) {
+            long long quota = atoll(argv[0] + 13);
+            if (quota <= 0)
+                return print_help(argv[0]);
+            heap_quota = static_cast<size_t>(quota);
+        }
+        else if (!strncmp(argv[0], "--registry_libs=", 16)) {
+            if (argv[0][16] == '\0')
+                return print_help(argv[0]);
+            registry_libs = argv[0] + 16;
+        }
+        else if (!strncmp(argv[0], "--sharded_replicas=", 19)) {
+            int replicas = atoi(argv[0] + 19);
+            if (replicas <= 0)
+                return print_help(argv[0]);
+            sharded_replicas = static_cast<uint32_t>(replicas);
+        }
+        else if (!strcmp(argv[0], "--deadline_calls")) {
+            deadline_calls = true;
+        }
+        else if (!strcmp(argv[0], "--fault_calls")) {
+            fault_calls = true;
+        }
         else
             return print_help(argv[0]);
     }
@@ -147,6 +565,11 @@ int main(int argc, char* argv[])
 
     
     set_capmgr_log_level(log_verbose_level);
+    CHugePages::SetMode(huge_pages);
+    if (!trace_file.empty())
+    {
+        CTracer::Enable();
+    }
 
     L_(ALWAYS) << "Running " << argv[0] << " Examples..." << std::endl;
 
@@ -154,14 +577,35 @@ int main(int argc, char* argv[])
      * Then create proxy object for compartment calls
      */
     CCompartmentLibs* plibs = nullptr;
-    if (!lib_load_and_fix(comp_lib, plibs, dump_relocation_tables))
+    if (!lib_load_and_fix(comp_lib, plibs, dump_relocation_tables, fixup_threads, fixup_plan_dir, fixup_report,
+        native_loader))
     {
         L_(ERROR) << "Compartment Libary " << comp_lib << " is not valid or could not be found" << std::endl;
         return -1;
     }
 
-    // Create the proxy - note the compartment sizes are defined in CCompartment.h
-    CCompartmentApiProxy proxy(plibs, CCompartment::CompartmentId::kCompartmentExampleId, CALL_FUNC_STACK_SIZE, CALL_FUNC_SEAL_ID);
+    if (CHugePages::IsEnabled())
+    {
+        try
+        {
+            size_t remapped = plibs->RemapHugePages();
+            L_(ALWAYS) << "Huge pages: " << remapped << " bytes of library segments remapped" << std::endl;
+        }
+        catch (const CCapMgrException& e)
+        {
+            L_(WARNING) << "Library segments not remapped onto huge pages: " << e.what() << std::endl;
+        }
+    }
+
+    // Create the proxy - note the default compartment sizes are defined in CCompartment.h
+    CCompartmentApiProxy proxy(plibs, CCompartment::CompartmentId::kCompartmentExampleId, stack_size, CALL_FUNC_SEAL_ID);
+
+    if (heap_quota)
+    {
+        CResourceAccount::Quotas quotas;
+        quotas.heap_hard_bytes = heap_quota;
+        proxy.GetAccount().SetQuotas(quotas);
+    }
 
     L_(ALWAYS) << "Set compartment debug level using capability manager's log level" << std::endl;
     auto log_result = proxy.example_set_compartment_debug_level(log_verbose_level);
@@ -177,29 +621,81 @@ int main(int argc, char* argv[])
     std::string test_str{ "This is a test" };
     L_(ALWAYS) << "Perform example_copy_string_to_heap()" << std::endl;
     auto buff = proxy.example_copy_string_to_heap(test_str.c_str());
-    L_(ALWAYS) << "Result of example_copy_string_to_heap(\"" << test_str << "\") = " << buff << std::endl;
+    if (!buff)
+    {
+        L_(ALWAYS) << "Result of example_copy_string_to_heap(\"" << test_str << "\"): allocation refused by quota"
+            << std::endl;
+    }
+    else
+    {
+        L_(ALWAYS) << "Result of example_copy_string_to_heap(\"" << test_str << "\") = " << buff << std::endl;
 
-    int32_t num = 7;
-    L_(ALWAYS) << "Perform example_print_heap_string_and_free()" << std::endl;
-    bool success = proxy.example_print_heap_string_and_free(buff, num);
-    L_(ALWAYS) << "Result of example_print_heap_string_and_free(<buffer>, " << num << ") = "
-        << std::boolalpha << success << std::endl;
+        int32_t num = 7;
+        L_(ALWAYS) << "Perform example_print_heap_string_and_free()" << std::endl;
+        bool success = proxy.example_print_heap_string_and_free(buff, num);
+        L_(ALWAYS) << "Result of example_print_heap_string_and_free(<buffer>, " << num << ") = "
+            << std::boolalpha << success << std::endl;
+    }
 
     struct example_struct test_struct { 99, false, '!' };
     L_(ALWAYS) << "Perform example_dump_struct("<< test_struct << ")" << std::endl;
     proxy.example_dump_struct(&test_struct);
     L_(ALWAYS) << "example_dump_struct() completed" << std::endl;
 
-    L_(ALWAYS) << "*EXAMPLE ENDS*" << std::endl;
+    L_(ALWAYS) << "Compartment stack used " << proxy.GetStackHighWater() << " of " << stack_size << " bytes"
+        << std::endl;
+
+    auto usage = proxy.GetAccount().GetUsage();
+    L_(ALWAYS) << "Compartment used " << usage.calls << " calls, " << usage.service_calls << " service calls, "
+        << usage.cpu_ns / 1000 << "us CPU (" << usage.service_cpu_ns / 1000 << "us in services), heap peak "
+        << usage.heap_peak_bytes << " bytes (" << usage.heap_bytes << " still allocated), "
+        << usage.denied_allocs << " allocations denied" << std::endl;
+
     ret = 0;
+    if (!registry_libs.empty() &&
+        !run_registry_compartments(registry_libs, log_verbose_level, stack_size, fixup_threads, native_loader))
+    {
+        ret = -1;
+    }
+    if (sharded_replicas &&
+        !run_sharded_replicas(comp_lib, sharded_replicas, log_verbose_level, stack_size, fixup_threads, native_loader))
+    {
+        ret = -1;
+    }
+    if (deadline_calls &&
+        !run_deadline_calls(comp_lib, log_verbose_level, stack_size, fixup_threads, native_loader))
+    {
+        ret = -1;
+    }
+    if (fault_calls &&
+        !run_fault_calls(comp_lib, log_verbose_level, stack_size, fixup_threads, native_loader))
+    {
+        ret = -1;
+    }
+
+    L_(ALWAYS) << "*EXAMPLE ENDS*" << std::endl;
 
     /* Cleanup the relocation symbols*/
-    if (!lib_restore_and_end(plibs))
+    if (!lib_restore_and_end(plibs, fixup_threads))
     {
         L_(ERROR) << "Error unloading compartment library " << comp_lib << std::endl;
         ret = -1;
     }
 
+    if (!trace_file.empty())
+    {
+        CTracer::Disable();
+        try
+        {
+            size_t events = CTracer::ExportChromeJson(trace_file);
+            L_(ALWAYS) << "Trace of " << events << " events written to " << trace_file << std::endl;
+        }
+        catch (const CCapMgrException& e)
+        {
+            L_(ERROR) << e.what() << std::endl;
+        }
+    }
+
     L_(DEBUG) << "Capability Manager exits with return code: " << ret << "!";
     return ret;
 }
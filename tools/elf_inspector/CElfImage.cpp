@@ -0,0 +1,90 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CElfImage
+
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include "CElfImage.h"
+#include "CCapMgrException.h"
+
+CElfImage::CElfImage(const std::string& path) : m_path(path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw CCapMgrException("Cannot open " + path);
+    }
+
+    std::vector<uint8_t> contents{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+
+    if (contents.size() < sizeof(Elf64_Ehdr))
+    {
+        throw CCapMgrException(path + " is too small to be an ELF file");
+    }
+
+    auto ehdr = reinterpret_cast<const Elf64_Ehdr*>(contents.data());
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_ident[EI_DATA] != ELFDATA2LSB)
+    {
+        throw CCapMgrException(path + " is not a 64 bit little endian ELF file");
+    }
+
+    if (ehdr->e_type != ET_DYN)
+    {
+        throw CCapMgrException(path + " is not a shared object");
+    }
+
+    if (ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+        ehdr->e_phoff + static_cast<uint64_t>(ehdr->e_phnum) * sizeof(Elf64_Phdr) > contents.size())
+    {
+        throw CCapMgrException(path + " has invalid program headers");
+    }
+
+    m_machine = ehdr->e_machine;
+
+    auto phdrs = reinterpret_cast<const Elf64_Phdr*>(&contents[ehdr->e_phoff]);
+    uint64_t image_size = 0;
+
+    for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i)
+    {
+        m_phdrs.insert({ phdrs[i].p_type, phdrs[i] });
+
+        if (phdrs[i].p_type == PT_LOAD)
+        {
+            if (phdrs[i].p_filesz > phdrs[i].p_memsz || phdrs[i].p_offset + phdrs[i].p_filesz > contents.size())
+            {
+                throw CCapMgrException(path + " has a LOAD block outside of the file");
+            }
+            image_size = std::max(image_size, phdrs[i].p_vaddr + phdrs[i].p_memsz);
+        }
+    }
+
+    // Lay out the LOAD blocks - anything else (e.g. bss) stays zero
+    m_image.assign(image_size, 0);
+
+    auto itrs = m_phdrs.equal_range(PT_LOAD);
+    for (auto itr = itrs.first; itr != itrs.second; ++itr)
+    {
+        const Elf64_Phdr& phdr = itr->second;
+        memcpy(m_image.data() + phdr.p_vaddr, contents.data() + phdr.p_offset, phdr.p_filesz);
+    }
+
+    // As for CSharedObject, the dynamic section is readonly on Morello
+    auto dyn = m_phdrs.find(PT_DYNAMIC);
+    if (dyn != m_phdrs.end())
+    {
+        if (dyn->second.p_vaddr + dyn->second.p_memsz > image_size)
+        {
+            throw CCapMgrException(path + " has a dynamic section outside of the LOAD blocks");
+        }
+
+        m_dynsec = CDynamicSection(reinterpret_cast<elfptr_t>(m_image.data()), dyn->second.p_vaddr, dyn->second.p_memsz, true);
+        m_has_dynamic = true;
+    }
+}
+
+bool CElfImage::Contains(const Range& range) const
+{
+    return range.base <= range.top && Range(reinterpret_cast<uintptr_t>(m_image.data()), m_image.size()).Contains(range);
+}
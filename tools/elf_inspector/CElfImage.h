@@ -0,0 +1,47 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CElfImage: A shared object read from disk and laid out in memory as the loader would, without relocating it
+
+#ifndef __CELFIMAGE_H_
+#define __CELFIMAGE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "shared_object_common.h"
+#include "CDynamicSection.h"
+#include "Range.h"
+
+// CElfImage: Each LOAD block is copied to its p_vaddr offset from the base of a buffer, so that all the addresses
+// in the dynamic section can be used from the base just as for a loaded shared object.
+// Throws CCapMgrException if the file is not a valid 64 bit ELF shared object.
+class CElfImage
+{
+private:
+    std::string m_path;
+    Elf64_Half m_machine = EM_NONE;
+    std::vector<uint8_t> m_image;
+    std::multimap<Elf64_Word, Elf64_Phdr> m_phdrs;     // Individual phdrs, keyed by type
+    CDynamicSection m_dynsec;
+    bool m_has_dynamic = false;
+
+public:
+    explicit CElfImage(const std::string& path);
+
+    CElfImage(const CElfImage&) = delete;
+    CElfImage& operator=(const CElfImage&) = delete;
+
+    const std::string& GetPath() const { return m_path; }
+    Elf64_Half GetMachine() const { return m_machine; }
+
+    uint8_t* GetBase() { return m_image.data(); }
+    const std::multimap<Elf64_Word, Elf64_Phdr>& GetPhdrs() const { return m_phdrs; }
+
+    bool HasDynamicSection() const { return m_has_dynamic; }
+    const CDynamicSection& GetDynamicSection() const { return m_dynsec; }
+
+    // Check a range of absolute addresses from the dynamic section lies within the image
+    bool Contains(const Range& range) const;
+};
+
+#endif /* __CELFIMAGE_H_ */
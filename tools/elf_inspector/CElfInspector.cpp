@@ -0,0 +1,352 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CElfInspector
+
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "CElfInspector.h"
+#include "CCapMgrException.h"
+#include "reloc_scan_kernel.h"
+
+namespace
+{
+    const std::map<Elf64_Xword, const char*> reloc_names = {
+        {R_MORELLO_CAPINIT, "R_MORELLO_CAPINIT"},
+        {R_MORELLO_GLOB_DAT, "R_MORELLO_GLOB_DAT"},
+        {R_MORELLO_JUMP_SLOT, "R_MORELLO_JUMP_SLOT"},
+        {R_MORELLO_RELATIVE, "R_MORELLO_RELATIVE"},
+        {R_MORELLO_IRELATIVE, "R_MORELLO_IRELATIVE"},
+        {R_MORELLO_TLSDESC, "R_MORELLO_TLSDESC"},
+        {R_MORELLO_TPREL128, "R_MORELLO_TPREL128"}
+    };
+
+    std::string RelocName(Elf64_Xword type)
+    {
+        auto itr = reloc_names.find(type);
+        return (itr != reloc_names.end()) ? itr->second : std::to_string(type);
+    }
+
+    std::string Hex(uint64_t value)
+    {
+        std::ostringstream strstr;
+        strstr << "0x" << std::hex << value;
+        return strstr.str();
+    }
+
+    bool FileExists(const std::string& path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    std::string DirName(const std::string& path)
+    {
+        auto pos = path.rfind('/');
+        return (pos == std::string::npos) ? "." : path.substr(0, pos);
+    }
+
+    std::string BaseName(const std::string& path)
+    {
+        auto pos = path.rfind('/');
+        return (pos == std::string::npos) ? path : path.substr(pos + 1);
+    }
+
+    // The dynamic loader is skipped by CCompartmentLibs unless asked for
+    bool IsLoader(const std::string& name)
+    {
+        return name.compare(0, 3, "ld-") == 0 || name.compare(0, 5, "ld.so") == 0;
+    }
+
+    // Getters from the dynamic section throw std::out_of_range when the tag is missing
+    template <typename Getter>
+    bool TryGet(Getter&& getter, Range& range)
+    {
+        try
+        {
+            range = getter();
+            return true;
+        }
+        catch (std::out_of_range&)
+        {
+            return false;
+        }
+    }
+}
+
+double CElfInspector::LibReport::EstimatedPatchTimeUs(const CostModel& cost) const
+{
+    return (reloc_entries * cost.scan_ns_per_entry + fixups * cost.patch_ns_per_fixup) / 1000.0 +
+        pages.Syscalls() * cost.mprotect_us_per_call;
+}
+
+std::string CElfInspector::FindLibrary(const std::string& name, const std::string& runpath,
+    const std::string& origin) const
+{
+    if (name.find('/') != std::string::npos)
+    {
+        return FileExists(name) ? name : std::string();
+    }
+
+    std::vector<std::string> dirs;
+
+    std::istringstream runpath_dirs(runpath);
+    std::string dir;
+    while (std::getline(runpath_dirs, dir, ':'))
+    {
+        auto pos = dir.find("$ORIGIN");
+        if (pos != std::string::npos)
+        {
+            dir.replace(pos, 7, origin);
+        }
+        dirs.push_back(dir);
+    }
+
+    dirs.insert(dirs.end(), m_lib_paths.begin(), m_lib_paths.end());
+    dirs.push_back(m_reports.empty() ? origin : DirName(m_reports.front().path));
+
+    for (const auto& search_dir : dirs)
+    {
+        if (!search_dir.empty() && FileExists(search_dir + "/" + name))
+        {
+            return search_dir + "/" + name;
+        }
+    }
+    return std::string();
+}
+
+CElfInspector::LibReport CElfInspector::InspectLibrary(const std::string& name, CElfImage& image) const
+{
+    LibReport report;
+    report.name = name;
+    report.path = image.GetPath();
+    report.machine = image.GetMachine();
+
+    if (!image.HasDynamicSection())
+    {
+        return report;
+    }
+
+    const CDynamicSection& dynsec = image.GetDynamicSection();
+    auto base = reinterpret_cast<uintptr_t>(image.GetBase());
+
+    report.needed = dynsec.GetNeeded();
+
+    // The same exclusions as CSharedObject::parseUnmodifyRanges()
+    std::vector<Range> unmodify_ranges;
+    auto exclude = [&](const char* source, const Range& range)
+    {
+        unmodify_ranges.push_back(range);
+        report.exclusions.push_back(ExclusionRange{ source, range.base - base, range.Size() });
+    };
+
+    Range range;
+    if (TryGet([&]() { return dynsec.GetInitFn(); }, range))
+        exclude("DT_INIT", range);
+    if (TryGet([&]() { return dynsec.GetFiniFn(); }, range))
+        exclude("DT_FINI", range);
+    if (TryGet([&]() { return dynsec.GetInitArray(); }, range))
+        exclude("DT_INIT_ARRAY", range);
+    if (TryGet([&]() { return dynsec.GetFiniArray(); }, range))
+        exclude("DT_FINI_ARRAY", range);
+
+    RangeSet unmodify_offsets(unmodify_ranges, base);
+    std::vector<uint64_t> offsets;
+
+    auto scan_table = [&](const char* table_name, const Range& table, bool is_rela, size_t elem_size)
+    {
+        size_t actual_elem_size = is_rela ? sizeof(Elf64_Rela) : sizeof(Elf64_Rel);
+        if (elem_size != actual_elem_size || (table.Size() % actual_elem_size) != 0 || !image.Contains(table))
+        {
+            throw CCapMgrException(report.path + ": invalid relocation table " + table_name);
+        }
+
+        size_t num_entries = table.Size() / actual_elem_size;
+        report.tables[table_name] += num_entries;
+        report.reloc_entries += num_entries;
+
+        auto on_fixup = [&](const auto* p) { offsets.push_back(p->r_offset); };
+        auto on_skipped = [&](const auto*) { report.excluded++; };
+
+        if (is_rela)
+        {
+            auto first = reinterpret_cast<const Elf64_Rela*>(table.base);
+            for (size_t i = 0; i < num_entries; ++i)
+                report.reloc_types[ELF64_R_TYPE(first[i].r_info)]++;
+            RelocScan::ScanFixupTargets(first, first + num_entries, unmodify_offsets, on_fixup, on_skipped);
+        }
+        else
+        {
+            auto first = reinterpret_cast<const Elf64_Rel*>(table.base);
+            for (size_t i = 0; i < num_entries; ++i)
+                report.reloc_types[ELF64_R_TYPE(first[i].r_info)]++;
+            RelocScan::ScanFixupTargets(first, first + num_entries, unmodify_offsets, on_fixup, on_skipped);
+        }
+    };
+
+    // The same tables as CSharedObject::Load()
+    size_t elem_size = 0;
+    if (TryGet([&]() { return dynsec.GetRelaRel(elem_size); }, range))
+        scan_table(".rela.dyn", range, true, elem_size);
+    if (TryGet([&]() { return dynsec.GetRelRel(elem_size); }, range))
+        scan_table(".rel.dyn", range, false, elem_size);
+
+    bool plt_is_rela = false;
+    if (TryGet([&]() { return dynsec.GetPltRel(plt_is_rela, elem_size); }, range))
+        scan_table(".rel(a).plt", range, plt_is_rela, elem_size);
+
+    // As CSharedObject::BuildFixupPlan()
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    report.fixups = offsets.size();
+
+    std::vector<FixupPages::Run> runs;
+    report.pages = FixupPages::BuildRuns(offsets.data(), offsets.size(), image.GetPhdrs(), m_page_size, runs);
+
+    return report;
+}
+
+void CElfInspector::Inspect(const std::string& root_path)
+{
+    m_reports.clear();
+    m_missing.clear();
+
+    std::set<std::string> seen{ BaseName(root_path) };
+    std::deque<std::pair<std::string, std::string>> pending{ { BaseName(root_path), root_path } };
+
+    while (!pending.empty())
+    {
+        std::string name = pending.front().first;
+        std::string path = pending.front().second;
+        pending.pop_front();
+
+        CElfImage image(path);
+        m_reports.push_back(InspectLibrary(name, image));
+
+        std::string runpath;
+        if (image.HasDynamicSection())
+        {
+            try
+            {
+                runpath = image.GetDynamicSection().GetRunPath();
+            }
+            catch (std::out_of_range&) {}
+        }
+
+        for (const auto& needed : m_reports.back().needed)
+        {
+            if (!seen.insert(needed).second || (!m_include_loader && IsLoader(needed)))
+            {
+                continue;
+            }
+
+            std::string needed_path = FindLibrary(needed, runpath, DirName(path));
+            if (needed_path.empty())
+            {
+                m_missing.push_back(needed);
+            }
+            else
+            {
+                pending.emplace_back(needed, needed_path);
+            }
+        }
+    }
+}
+
+void CElfInspector::WriteJson(CJsonWriter& json, const CostModel& cost) const
+{
+    LibReport totals;
+    double total_time_us = 0;
+
+    json.BeginObject();
+    json.Key("page_size").Value(static_cast<uint64_t>(m_page_size));
+
+    json.Key("cost_model").BeginObject();
+    json.Key("scan_ns_per_entry").Value(cost.scan_ns_per_entry);
+    json.Key("patch_ns_per_fixup").Value(cost.patch_ns_per_fixup);
+    json.Key("mprotect_us_per_call").Value(cost.mprotect_us_per_call);
+    json.EndObject();
+
+    json.Key("libraries").BeginArray();
+    for (const auto& report : m_reports)
+    {
+        json.BeginObject();
+        json.Key("name").Value(report.name);
+        json.Key("path").Value(report.path);
+        json.Key("machine").Value(report.machine == EM_AARCH64 ? "aarch64" : Hex(report.machine));
+
+        json.Key("needed").BeginArray();
+        for (const auto& needed : report.needed)
+            json.Value(needed);
+        json.EndArray();
+
+        json.Key("relocations").BeginObject();
+        json.Key("total").Value(report.reloc_entries);
+        json.Key("tables").BeginObject();
+        for (const auto& table : report.tables)
+            json.Key(table.first).Value(table.second);
+        json.EndObject();
+        json.Key("by_type").BeginObject();
+        for (const auto& type : report.reloc_types)
+            json.Key(RelocName(type.first)).Value(type.second);
+        json.EndObject();
+        json.EndObject();
+
+        json.Key("fixups").BeginObject();
+        json.Key("patched").Value(report.fixups);
+        json.Key("excluded").Value(report.excluded);
+        json.EndObject();
+
+        json.Key("exclusion_ranges").BeginArray();
+        for (const auto& exclusion : report.exclusions)
+        {
+            json.BeginObject();
+            json.Key("source").Value(exclusion.source);
+            json.Key("offset").Value(Hex(exclusion.offset));
+            json.Key("size").Value(exclusion.size);
+            json.EndObject();
+        }
+        json.EndArray();
+
+        json.Key("pages").BeginObject();
+        json.Key("load_pages").Value(report.pages.load_pages);
+        json.Key("target_pages").Value(report.pages.target_pages);
+        json.Key("unprotected_pages").Value(report.pages.unprotected_pages);
+        json.Key("runs").Value(report.pages.runs);
+        json.Key("mprotect_calls").Value(report.pages.Syscalls());
+        json.Key("baseline_mprotect_calls").Value(report.pages.BaselineSyscalls());
+        json.EndObject();
+
+        double time_us = report.EstimatedPatchTimeUs(cost);
+        json.Key("estimated_patch_time_us").Value(time_us);
+        json.EndObject();
+
+        totals.reloc_entries += report.reloc_entries;
+        totals.fixups += report.fixups;
+        totals.excluded += report.excluded;
+        totals.pages += report.pages;
+        total_time_us += time_us;
+    }
+    json.EndArray();
+
+    json.Key("missing").BeginArray();
+    for (const auto& missing : m_missing)
+        json.Value(missing);
+    json.EndArray();
+
+    json.Key("totals").BeginObject();
+    json.Key("libraries").Value(static_cast<uint64_t>(m_reports.size()));
+    json.Key("relocations").Value(totals.reloc_entries);
+    json.Key("patched").Value(totals.fixups);
+    json.Key("excluded").Value(totals.excluded);
+    json.Key("target_pages").Value(totals.pages.target_pages);
+    json.Key("unprotected_pages").Value(totals.pages.unprotected_pages);
+    json.Key("mprotect_calls").Value(totals.pages.Syscalls());
+    json.Key("estimated_patch_time_us").Value(total_time_us);
+    json.EndObject();
+
+    json.EndObject();
+}
@@ -0,0 +1,81 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CElfInspector: Offline analysis of the capability fixups the capability manager will do for a compartment library
+
+#ifndef __CELFINSPECTOR_H_
+#define __CELFINSPECTOR_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "CElfImage.h"
+#include "CJsonWriter.h"
+#include "fixup_page_runs.h"
+
+// CElfInspector: Finds the library and its DT_NEEDED closure on disk, and for each one works out the same fixups
+// as CSharedObject does for a loaded library: the relocation tables are scanned with the same kernel and the same
+// init/fini exclusions, and the pages made writable are from the same page run calculation.
+// Targets with no valid tag are skipped at run time, which cannot be known offline, so the counts are upper bounds.
+class CElfInspector
+{
+public:
+    // Per operation costs used to estimate the patch time.  Calibrate with capmgr-bench on the target.
+    struct CostModel
+    {
+        double scan_ns_per_entry = 2.0;     // Scanning one relocation table entry
+        double patch_ns_per_fixup = 10.0;   // Deriving and storing one capability
+        double mprotect_us_per_call = 2.0;  // One mprotect() call
+    };
+
+    struct ExclusionRange
+    {
+        std::string source;                 // Dynamic section tag
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct LibReport
+    {
+        std::string name;
+        std::string path;
+        Elf64_Half machine = EM_NONE;
+        std::vector<std::string> needed;
+        std::map<std::string, uint64_t> tables;         // Table name to number of entries
+        std::map<Elf64_Xword, uint64_t> reloc_types;    // Relocation type to number of entries
+        uint64_t reloc_entries = 0;
+        uint64_t fixups = 0;                            // Targets patched
+        uint64_t excluded = 0;                          // Targets skipped due to the exclusion ranges
+        std::vector<ExclusionRange> exclusions;
+        FixupPages::Stats pages;
+
+        double EstimatedPatchTimeUs(const CostModel& cost) const;
+    };
+
+private:
+    std::vector<std::string> m_lib_paths;
+    size_t m_page_size;
+    bool m_include_loader;
+
+    std::vector<LibReport> m_reports;
+    std::vector<std::string> m_missing;
+
+    // Find a needed library: the needing library's run path, then the library paths, then alongside the root
+    std::string FindLibrary(const std::string& name, const std::string& runpath, const std::string& origin) const;
+
+    LibReport InspectLibrary(const std::string& name, CElfImage& image) const;
+
+public:
+    CElfInspector(const std::vector<std::string>& lib_paths, size_t page_size, bool include_loader) :
+        m_lib_paths(lib_paths), m_page_size(page_size), m_include_loader(include_loader) {}
+
+    // Inspect the library and its closure, breadth first in DT_NEEDED order as the loader does.
+    // Throws CCapMgrException if the root library cannot be read.
+    void Inspect(const std::string& root_path);
+
+    const std::vector<LibReport>& GetReports() const { return m_reports; }
+    const std::vector<std::string>& GetMissing() const { return m_missing; }
+
+    void WriteJson(CJsonWriter& json, const CostModel& cost) const;
+};
+
+#endif /* __CELFINSPECTOR_H_ */
@@ -0,0 +1,138 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CJsonWriter: Minimal streaming JSON writer for the inspector report
+
+#ifndef __CJSONWRITER_H_
+#define __CJSONWRITER_H_
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// CJsonWriter: Objects and arrays are opened and closed explicitly; within an object every value must be preceded
+// by Key().  Output is indented by two spaces per level.
+class CJsonWriter
+{
+private:
+    std::ostream& m_out;
+    std::vector<bool> m_first;      // Per open object/array: nothing written in it yet
+    bool m_after_key = false;
+
+    void Indent()
+    {
+        m_out << std::string(2 * m_first.size(), ' ');
+    }
+
+    // Separator and indent before a key or array element
+    void Next()
+    {
+        if (m_after_key)
+        {
+            m_after_key = false;
+            return;
+        }
+
+        if (!m_first.empty())
+        {
+            m_out << (m_first.back() ? "\n" : ",\n");
+            m_first.back() = false;
+            Indent();
+        }
+    }
+
+    void Open(char c)
+    {
+        Next();
+        m_out << c;
+        m_first.push_back(true);
+    }
+
+    void Close(char c)
+    {
+        bool empty = m_first.back();
+        m_first.pop_back();
+        if (!empty)
+        {
+            m_out << "\n";
+            Indent();
+        }
+        m_out << c;
+        if (m_first.empty())
+        {
+            m_out << std::endl;
+        }
+    }
+
+public:
+    explicit CJsonWriter(std::ostream& out) : m_out(out) {}
+
+    void BeginObject() { Open('{'); }
+    void EndObject() { Close('}'); }
+    void BeginArray() { Open('['); }
+    void EndArray() { Close(']'); }
+
+    CJsonWriter& Key(const std::string& key)
+    {
+        Next();
+        String(key);
+        m_out << ": ";
+        m_after_key = true;
+        return *this;
+    }
+
+    void Value(const std::string& value)
+    {
+        Next();
+        String(value);
+    }
+
+    void Value(const char* value) { Value(std::string(value)); }
+
+    void Value(uint64_t value)
+    {
+        Next();
+        m_out << value;
+    }
+
+    void Value(double value)
+    {
+        Next();
+        m_out << std::fixed << std::setprecision(3) << value << std::defaultfloat;
+    }
+
+    void Value(bool value)
+    {
+        Next();
+        m_out << (value ? "true" : "false");
+    }
+
+private:
+    void String(const std::string& str)
+    {
+        m_out << '"';
+        for (char c : str)
+        {
+            switch (c)
+            {
+            case '"': m_out << "\\\""; break;
+            case '\\': m_out << "\\\\"; break;
+            case '\n': m_out << "\\n"; break;
+            case '\t': m_out << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    m_out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c)
+                        << std::dec << std::setfill(' ');
+                }
+                else
+                {
+                    m_out << c;
+                }
+            }
+        }
+        m_out << '"';
+    }
+};
+
+#endif /* __CJSONWRITER_H_ */
@@ -0,0 +1,10 @@
+// Copyright (C) 2024 Verifoxx Limited
+// cheriintrin.h: Stand in for the CHERI intrinsics header on a non-CHERI host.
+// Only the ELF parsing code is built for the host tools, which does not use any of the intrinsics.
+
+#ifndef __HOST_CHERIINTRIN_H_
+#define __HOST_CHERIINTRIN_H_
+
+#include "morello_elf_host.h"
+
+#endif /* __HOST_CHERIINTRIN_H_ */
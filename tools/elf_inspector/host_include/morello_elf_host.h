@@ -0,0 +1,25 @@
+// Copyright (C) 2024 Verifoxx Limited
+// morello_elf_host: Morello ELF definitions missing from a non-CHERI host, so the ELF parsing can be built there.
+// Force included ahead of every source file of the host tools.
+
+#ifndef __MORELLO_ELF_HOST_H_
+#define __MORELLO_ELF_HOST_H_
+
+#include <stdint.h>
+#include <elf.h>
+
+// On a purecap target this is a capability; on the host it is only ever an address in the host's copy of the image
+typedef uintptr_t elfptr_t;
+
+// Ref Morello Aarch64 ELF ABI
+#ifndef R_MORELLO_CAPINIT
+#define R_MORELLO_CAPINIT       59392
+#define R_MORELLO_GLOB_DAT      59393
+#define R_MORELLO_JUMP_SLOT     59394
+#define R_MORELLO_RELATIVE      59395
+#define R_MORELLO_IRELATIVE     59396
+#define R_MORELLO_TLSDESC       59397
+#define R_MORELLO_TPREL128      59398
+#endif
+
+#endif /* __MORELLO_ELF_HOST_H_ */
@@ -0,0 +1,118 @@
+// Copyright (C) 2024 Verifoxx Limited
+// capmgr-elf-inspector: Reports the capability fixup cost of a compartment library, run on the build host
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "CElfInspector.h"
+#include "CCapMgrException.h"
+
+static int print_help(const char* exe_name)
+{
+    printf("Usage: %s [-options] <lib.so>\n", exe_name);
+    printf("Reports the Morello capability fixups the capability manager will do for a compartment library\n"
+        "and its DT_NEEDED closure, as JSON.\n");
+    printf("options:\n");
+    printf("  --lib-path=<dirs>           Colon separated folders to search for needed libraries\n");
+    printf("                                (after DT_RUNPATH, before the folder of <lib.so>)\n");
+    printf("  --include-loader            Include the dynamic loader if it is needed\n");
+    printf("  --page-size=n               Page size of the target (default 4096)\n");
+    printf("  --scan-ns=x                 Estimated ns to scan one relocation entry\n");
+    printf("  --patch-ns=x                Estimated ns to patch one capability\n");
+    printf("  --mprotect-us=x             Estimated us for one mprotect() call\n");
+    printf("  --output=<file>             Write the JSON to a file instead of stdout\n");
+    return 1;
+}
+
+static bool get_opt(const char* arg, const char* name, std::string& value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=')
+    {
+        value = arg + len + 1;
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* exe_name = argv[0];
+    std::vector<std::string> lib_paths;
+    bool include_loader = false;
+    size_t page_size = 4096;
+    CElfInspector::CostModel cost;
+    std::string output;
+    std::string value;
+
+    /* Process options. */
+    for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+        if (get_opt(argv[0], "--lib-path", value)) {
+            std::istringstream dirs(value);
+            std::string dir;
+            while (std::getline(dirs, dir, ':'))
+                lib_paths.push_back(dir);
+        }
+        else if (!strcmp(argv[0], "--include-loader")) {
+            include_loader = true;
+        }
+        else if (get_opt(argv[0], "--page-size", value)) {
+            page_size = strtoul(value.c_str(), nullptr, 0);
+            if (page_size == 0 || (page_size & (page_size - 1)) != 0)
+                return print_help(exe_name);
+        }
+        else if (get_opt(argv[0], "--scan-ns", value)) {
+            cost.scan_ns_per_entry = atof(value.c_str());
+        }
+        else if (get_opt(argv[0], "--patch-ns", value)) {
+            cost.patch_ns_per_fixup = atof(value.c_str());
+        }
+        else if (get_opt(argv[0], "--mprotect-us", value)) {
+            cost.mprotect_us_per_call = atof(value.c_str());
+        }
+        else if (get_opt(argv[0], "--output", value)) {
+            output = value;
+        }
+        else
+            return print_help(exe_name);
+    }
+
+    if (argc != 1)
+        return print_help(exe_name);
+
+    CElfInspector inspector(lib_paths, page_size, include_loader);
+
+    try
+    {
+        inspector.Inspect(argv[0]);
+    }
+    catch (CCapMgrException& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+
+    if (output.empty())
+    {
+        CJsonWriter json(std::cout);
+        inspector.WriteJson(json, cost);
+    }
+    else
+    {
+        std::ofstream file(output);
+        if (!file)
+        {
+            std::cerr << "Error: cannot write " << output << std::endl;
+            return 2;
+        }
+        CJsonWriter json(file);
+        inspector.WriteJson(json, cost);
+    }
+
+    // Missing libraries are in the report, but are still an error for CI
+    return inspector.GetMissing().empty() ? 0 : 3;
+}
@@ -8,19 +8,44 @@
 #include <sstream>
 #include <string>
 #include <array>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using namespace std::chrono;
 
+// Log statements with a level above this are compiled out
+#ifndef CAPMGR_LOG_MAX_LEVEL
+#define CAPMGR_LOG_MAX_LEVEL 4
+#endif
+
+// Set to format and write log lines on the logging thread, e.g. where a background thread cannot be started
+#ifndef CAPMGR_LOG_SYNC
+#define CAPMGR_LOG_SYNC 0
+#endif
+
+// Logging is asynchronous: a log statement encodes its arguments (numbers, copies of strings) into a per-thread
+// buffer, and a background thread formats and writes them, so the logging thread does not format or block on I/O.
+// Each thread's buffer is a lock-free single producer/consumer ring.  Lines from different threads are merged in
+// time order.  Types with no raw encoding (e.g. Capability, Range) are formatted when logged, and manipulators with
+// arguments such as std::setw() only apply to those.
+// Log::Flush() waits for the lines logged so far to be written, e.g. before an expected crash.
+
 namespace CapMgr
 {
-    inline std::string NowTime()
+    inline std::string FormatTime(uint64_t time_ns)
     {
         char buf[32] = { 0 };
 
-        auto now_time = steady_clock::now();
-        auto duration = now_time.time_since_epoch();
+        nanoseconds duration(time_ns);
         auto h = duration_cast<hours>(duration);
         duration -= h;
         auto m = duration_cast<minutes>(duration);
@@ -29,11 +54,22 @@ namespace CapMgr
         duration -= s;
         auto ms = duration_cast<milliseconds>(duration);
 
-        snprintf(buf, sizeof(buf), "%02ld:%02ld:%02ld:%03ld", h.count(), m.count(), s.count(), ms.count());
+        snprintf(buf, sizeof(buf), "%02ld:%02ld:%02ld:%03ld", (long)h.count(), (long)m.count(), (long)s.count(),
+            (long)ms.count());
 
         return buf;
     }
 
+    inline uint64_t NowTimeNs()
+    {
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    inline std::string NowTime()
+    {
+        return FormatTime(NowTimeNs());
+    }
+
     enum TLogLevel
     {
         ALWAYS = 0,
@@ -46,53 +82,602 @@ namespace CapMgr
     constexpr std::array<const char*, VERBOSE - ALWAYS + 1> logLevelString =
     { "INFO ", "ERROR", "WARN ", "DEBUG", "VRBSE" };
 
-    template <typename T>
-    class LogBase
+    class Output2Stream
     {
     public:
-        LogBase() {}
-        LogBase(const LogBase&) = delete;
-        LogBase& operator=(const LogBase&) = delete;
+        static void Output(const std::string& msg)
+        {
+            std::cout << msg << std::flush;
+        }
+    };
 
-        virtual ~LogBase()
+    namespace LogDetail
+    {
+        typedef std::ostream& (*OstreamManip)(std::ostream&);
+        typedef std::ios_base& (*IosManip)(std::ios_base&);
+
+        // Encoded argument types
+        enum ArgType : uint8_t
+        {
+            kBool,
+            kChar,
+            kShort,
+            kUShort,
+            kInt,
+            kUInt,
+            kLong,
+            kULong,
+            kLongLong,
+            kULongLong,
+            kDouble,
+            kLongDouble,
+            kString,            // uint32_t length then the characters
+            kOstreamManip,      // uint8_t index in OstreamManips()
+            kIosManip           // uint8_t index in IosManips()
+        };
+
+        // Start of each encoded line, followed by its arguments
+        struct RecordHeader
         {
-            
-            os << std::endl;
-            T::Output(os.str());
+            uint32_t size;      // Including the header
+            uint32_t level;
+            uint64_t time_ns;
+        };
+
+        // Manipulators are encoded by index, since function pointers cannot be copied as bytes (on CHERI they are
+        // capabilities)
+        inline const std::array<OstreamManip, 3>& OstreamManips()
+        {
+            static const std::array<OstreamManip, 3> manips = { { std::endl, std::ends, std::flush } };
+            return manips;
         }
 
-        std::ostringstream& Get(TLogLevel level=DEBUG)
+        inline const std::array<IosManip, 20>& IosManips()
         {
-            os << "[" << NowTime() << " - CAPMGR:" << ToString(level) << "]: ";
-            os << std::string(level > VERBOSE ? level - VERBOSE : 0, '\t');
-            return os;
+            static const std::array<IosManip, 20> manips = { {
+                std::boolalpha, std::noboolalpha, std::showbase, std::noshowbase, std::showpoint, std::noshowpoint,
+                std::showpos, std::noshowpos, std::uppercase, std::nouppercase, std::dec, std::hex, std::oct,
+                std::fixed, std::scientific, std::hexfloat, std::defaultfloat, std::left, std::right, std::internal
+            } };
+            return manips;
         }
 
-        static TLogLevel& Level()
+        inline void ResetFormat(std::ostream& os)
         {
-            static TLogLevel reportingLevel = ALWAYS;
-            return reportingLevel;
+            os.flags(std::ios_base::dec | std::ios_base::skipws);
+            os.width(0);
+            os.precision(6);
+            os.fill(' ');
         }
 
-        static std::string ToString(TLogLevel level) { return logLevelString[level]; }
+        template <typename T>
+        inline T ReadArg(const char*& pos)
+        {
+            T value;
+            memcpy(&value, pos, sizeof(value));
+            pos += sizeof(value);
+            return value;
+        }
 
-    protected:
-        std::ostringstream os;
-    };
+        // Format an encoded line, as the original synchronous logger did
+        inline void FormatRecord(const char* record, std::ostream& os)
+        {
+            RecordHeader header;
+            memcpy(&header, record, sizeof(header));
 
-    class Output2Stream
+            auto level = std::min<uint32_t>(header.level, VERBOSE);
+            ResetFormat(os);
+            os << "[" << FormatTime(header.time_ns) << " - CAPMGR:" << logLevelString[level] << "]: ";
+
+            const char* pos = record + sizeof(header);
+            const char* end = record + header.size;
+            while (pos < end)
+            {
+                switch (static_cast<ArgType>(*pos++))
+                {
+                case kBool: os << ReadArg<bool>(pos); break;
+                case kChar: os << ReadArg<char>(pos); break;
+                case kShort: os << ReadArg<short>(pos); break;
+                case kUShort: os << ReadArg<unsigned short>(pos); break;
+                case kInt: os << ReadArg<int>(pos); break;
+                case kUInt: os << ReadArg<unsigned>(pos); break;
+                case kLong: os << ReadArg<long>(pos); break;
+                case kULong: os << ReadArg<unsigned long>(pos); break;
+                case kLongLong: os << ReadArg<long long>(pos); break;
+                case kULongLong: os << ReadArg<unsigned long long>(pos); break;
+                case kDouble: os << ReadArg<double>(pos); break;
+                case kLongDouble: os << ReadArg<long double>(pos); break;
+                case kString:
+                {
+                    auto length = ReadArg<uint32_t>(pos);
+                    os.write(pos, length);
+                    pos += length;
+                    break;
+                }
+                case kOstreamManip: OstreamManips()[ReadArg<uint8_t>(pos)](os); break;
+                case kIosManip: IosManips()[ReadArg<uint8_t>(pos)](os); break;
+                default: pos = end; break;
+                }
+            }
+            os << '\n';
+        }
+
+        inline std::string FormatRecord(const std::string& record)
+        {
+            std::ostringstream os;
+            FormatRecord(record.data(), os);
+            return os.str();
+        }
+
+        // Lock-free ring of encoded lines, written by one thread and read by the logging thread
+        class RingBuffer
+        {
+        public:
+            static constexpr size_t kCapacity = 64 * 1024;
+
+        private:
+            std::unique_ptr<char[]> m_data;
+            char m_pad0[64];
+            std::atomic<size_t> m_head{ 0 };        // Written up to (producer)
+            char m_pad1[64];
+            std::atomic<size_t> m_tail{ 0 };        // Read up to (consumer)
+            std::atomic<size_t> m_flushed{ 0 };     // Written to the output up to (consumer)
+
+        public:
+            std::atomic<bool> retired{ false };     // The thread has exited
+
+            RingBuffer() : m_data(new char[kCapacity]) {}
+
+            // Append a line, or return false if there is no room
+            bool Write(const char* src, size_t size)
+            {
+                size_t head = m_head.load(std::memory_order_relaxed);
+                if (kCapacity - (head - m_tail.load(std::memory_order_acquire)) < size)
+                {
+                    return false;
+                }
+
+                size_t offset = head % kCapacity;
+                size_t first = (size < kCapacity - offset) ? size : kCapacity - offset;
+                memcpy(&m_data[offset], src, first);
+                memcpy(&m_data[0], src + first, size - first);
+                m_head.store(head + size, std::memory_order_release);
+                return true;
+            }
+
+            size_t Head() const { return m_head.load(std::memory_order_acquire); }
+            size_t Flushed() const { return m_flushed.load(std::memory_order_acquire); }
+            void SetFlushed(size_t pos) { m_flushed.store(pos, std::memory_order_release); }
+
+            // Read the next line written before limit into record, or return false if there is none
+            bool Read(size_t limit, std::string& record)
+            {
+                size_t tail = m_tail.load(std::memory_order_relaxed);
+                if (tail == limit)
+                {
+                    return false;
+                }
+
+                RecordHeader header;
+                Copy(tail, reinterpret_cast<char*>(&header), sizeof(header));
+                record.resize(header.size);
+                Copy(tail, &record[0], header.size);
+                m_tail.store(tail + header.size, std::memory_order_release);
+                return true;
+            }
+
+        private:
+            void Copy(size_t pos, char* dst, size_t size) const
+            {
+                size_t offset = pos % kCapacity;
+                size_t first = (size < kCapacity - offset) ? size : kCapacity - offset;
+                memcpy(dst, &m_data[offset], first);
+                memcpy(dst + first, &m_data[0], size - first);
+            }
+        };
+
+        // The background thread which formats and writes the lines of all threads
+        class Backend
+        {
+            std::mutex m_mutex;
+            std::condition_variable m_wake;
+            std::vector<std::shared_ptr<RingBuffer>> m_buffers;
+            bool m_stop = false;
+            bool m_flush_requested = false;
+            std::mutex m_output_mutex;
+            std::thread m_thread;
+
+            static std::atomic<bool>& Destroyed()
+            {
+                static std::atomic<bool> destroyed{ false };
+                return destroyed;
+            }
+
+            struct Entry
+            {
+                uint64_t time_ns;
+                std::string record;
+            };
+
+            // Write out everything buffered so far, returning false if there was nothing
+            bool Drain()
+            {
+                std::vector<std::shared_ptr<RingBuffer>> buffers;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    buffers = m_buffers;
+                }
+
+                std::vector<Entry> entries;
+                std::vector<size_t> limits(buffers.size());
+                std::string record;
+                for (size_t i = 0; i < buffers.size(); i++)
+                {
+                    // A thread's lines keep their order, even if a line was started before an earlier one (nesting)
+                    uint64_t time_ns = 0;
+                    limits[i] = buffers[i]->Head();
+                    while (buffers[i]->Read(limits[i], record))
+                    {
+                        RecordHeader header;
+                        memcpy(&header, record.data(), sizeof(header));
+                        time_ns = std::max(time_ns, header.time_ns);
+                        entries.push_back(Entry{ time_ns, record });
+                    }
+                }
+
+                if (!entries.empty())
+                {
+                    std::stable_sort(entries.begin(), entries.end(),
+                        [](const Entry& a, const Entry& b) { return a.time_ns < b.time_ns; });
+
+                    std::ostringstream os;
+                    for (const auto& entry : entries)
+                    {
+                        FormatRecord(entry.record.data(), os);
+                    }
+                    Output(os.str());
+                }
+
+                for (size_t i = 0; i < buffers.size(); i++)
+                {
+                    buffers[i]->SetFlushed(limits[i]);
+                }
+
+                // Forget the buffers of threads which have exited, once written out
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_buffers.erase(std::remove_if(m_buffers.begin(), m_buffers.end(),
+                    [](const std::shared_ptr<RingBuffer>& buffer)
+                    { return buffer->retired.load() && buffer->Flushed() == buffer->Head(); }),
+                    m_buffers.end());
+
+                return !entries.empty();
+            }
+
+            void Run()
+            {
+                for (;;)
+                {
+                    bool written = Drain();
+
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    if (m_stop)
+                    {
+                        break;
+                    }
+                    if (!written && !m_flush_requested)
+                    {
+                        m_wake.wait_for(lock, milliseconds(2));
+                    }
+                    m_flush_requested = false;
+                }
+                Drain();
+            }
+
+        public:
+            Backend() : m_thread(&Backend::Run, this) {}
+
+            ~Backend()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_stop = true;
+                }
+                m_wake.notify_one();
+                m_thread.join();
+                Destroyed() = true;
+            }
+
+            // The backend, started on first use, or nullptr once it has been shut down at exit
+            static Backend* Get()
+            {
+                if (Destroyed())
+                {
+                    return nullptr;
+                }
+                static Backend backend;
+                return &backend;
+            }
+
+            std::shared_ptr<RingBuffer> Register()
+            {
+                auto buffer = std::make_shared<RingBuffer>();
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_buffers.push_back(buffer);
+                return buffer;
+            }
+
+            void Wake()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_flush_requested = true;
+                }
+                m_wake.notify_one();
+            }
+
+            void Output(const std::string& msg)
+            {
+                std::lock_guard<std::mutex> lock(m_output_mutex);
+                Output2Stream::Output(msg);
+            }
+
+            // Wait until the buffer has been written out up to pos
+            void WaitFlushed(const RingBuffer& buffer, size_t pos)
+            {
+                while (buffer.Flushed() < pos)
+                {
+                    Wake();
+                    std::this_thread::sleep_for(microseconds(50));
+                }
+            }
+
+            void Flush()
+            {
+                std::vector<std::shared_ptr<RingBuffer>> buffers;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    buffers = m_buffers;
+                }
+                for (const auto& buffer : buffers)
+                {
+                    WaitFlushed(*buffer, buffer->Head());
+                }
+            }
+        };
+
+        // A line being encoded, one per nesting depth (a value's operator<< may itself log)
+        struct Staging
+        {
+            std::string record;
+            std::ostringstream eager;       // Formats values with no raw encoding
+        };
+
+        struct ThreadState
+        {
+            std::shared_ptr<RingBuffer> buffer;     // Registered on first use
+            std::vector<std::unique_ptr<Staging>> staging;
+            size_t depth = 0;
+
+            ~ThreadState()
+            {
+                if (buffer)
+                {
+                    buffer->retired = true;
+                }
+            }
+        };
+
+        // The calling thread's state, or nullptr if it has been destroyed (logging from thread exit)
+        inline ThreadState* GetThreadState()
+        {
+            static thread_local bool destroyed = false;
+            struct Holder
+            {
+                ThreadState state;
+                ~Holder() { destroyed = true; }
+            };
+
+            if (destroyed)
+            {
+                return nullptr;
+            }
+            static thread_local Holder holder;
+            return &holder.state;
+        }
+
+        // Hand over an encoded line for output
+        inline void Commit(ThreadState* thread, const std::string& record)
+        {
+            Backend* backend = CAPMGR_LOG_SYNC ? nullptr : Backend::Get();
+
+            // Lines too big for the buffer are written here, after the thread's earlier lines
+            if (!thread || !backend || record.size() > RingBuffer::kCapacity / 4)
+            {
+                if (!backend)
+                {
+                    Output2Stream::Output(FormatRecord(record));
+                    return;
+                }
+                if (thread && thread->buffer)
+                {
+                    backend->WaitFlushed(*thread->buffer, thread->buffer->Head());
+                }
+                backend->Output(FormatRecord(record));
+                return;
+            }
+
+            if (!thread->buffer)
+            {
+                thread->buffer = backend->Register();
+            }
+            while (!thread->buffer->Write(record.data(), record.size()))
+            {
+                // Full: wait for the logging thread to catch up
+                backend->Wake();
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    class Log
     {
+        LogDetail::ThreadState* m_thread;
+        LogDetail::Staging* m_staging;
+        std::unique_ptr<LogDetail::Staging> m_own_staging;     // If the thread state has gone
+
+        static std::atomic<int>& LevelValue()
+        {
+            static std::atomic<int> level{ ALWAYS };
+            return level;
+        }
+
+        template <typename T>
+        Log& PutArg(LogDetail::ArgType type, T value)
+        {
+            m_staging->record.push_back(static_cast<char>(type));
+            m_staging->record.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            return *this;
+        }
+
+        Log& PutString(const char* str, size_t length)
+        {
+            PutArg(LogDetail::kString, static_cast<uint32_t>(length));
+            m_staging->record.append(str, length);
+            return *this;
+        }
+
     public:
-        static void Output(const std::string& msg)
+        Log() : m_thread(LogDetail::GetThreadState())
         {
-            std::cout << msg;
+            if (m_thread)
+            {
+                if (m_thread->staging.size() <= m_thread->depth)
+                {
+                    m_thread->staging.emplace_back(new LogDetail::Staging);
+                }
+                m_staging = m_thread->staging[m_thread->depth++].get();
+            }
+            else
+            {
+                m_own_staging.reset(new LogDetail::Staging);
+                m_staging = m_own_staging.get();
+            }
+            m_staging->record.clear();
+            LogDetail::ResetFormat(m_staging->eager);
         }
-    };
 
-    class Log : public LogBase<Output2Stream> {};
+        Log(const Log&) = delete;
+        Log& operator=(const Log&) = delete;
+
+        ~Log()
+        {
+            if (m_staging->record.empty())
+            {
+                return;
+            }
+
+            uint32_t size = static_cast<uint32_t>(m_staging->record.size());
+            memcpy(&m_staging->record[0], &size, sizeof(size));
+            LogDetail::Commit(m_thread, m_staging->record);
+
+            if (m_thread)
+            {
+                m_thread->depth--;
+            }
+        }
+
+        Log& Get(TLogLevel level=DEBUG)
+        {
+            LogDetail::RecordHeader header{ 0, static_cast<uint32_t>(level), NowTimeNs() };
+            m_staging->record.append(reinterpret_cast<const char*>(&header), sizeof(header));
+            if (level > VERBOSE)
+            {
+                *this << std::string(level - VERBOSE, '\t');
+            }
+            return *this;
+        }
+
+        static TLogLevel GetLevel() { return static_cast<TLogLevel>(LevelValue().load(std::memory_order_relaxed)); }
+        static void SetLevel(TLogLevel level) { LevelValue().store(level, std::memory_order_relaxed); }
+
+        static std::string ToString(TLogLevel level) { return logLevelString[level]; }
+
+        // Wait until everything logged so far has been written
+        static void Flush()
+        {
+            auto backend = CAPMGR_LOG_SYNC ? nullptr : LogDetail::Backend::Get();
+            if (backend)
+            {
+                backend->Flush();
+            }
+        }
+
+        Log& operator<<(bool value) { return PutArg(LogDetail::kBool, value); }
+        Log& operator<<(char value) { return PutArg(LogDetail::kChar, value); }
+        Log& operator<<(signed char value) { return PutArg(LogDetail::kChar, static_cast<char>(value)); }
+        Log& operator<<(unsigned char value) { return PutArg(LogDetail::kChar, static_cast<char>(value)); }
+        Log& operator<<(short value) { return PutArg(LogDetail::kShort, value); }
+        Log& operator<<(unsigned short value) { return PutArg(LogDetail::kUShort, value); }
+        Log& operator<<(int value) { return PutArg(LogDetail::kInt, value); }
+        Log& operator<<(unsigned value) { return PutArg(LogDetail::kUInt, value); }
+        Log& operator<<(long value) { return PutArg(LogDetail::kLong, value); }
+        Log& operator<<(unsigned long value) { return PutArg(LogDetail::kULong, value); }
+        Log& operator<<(long long value) { return PutArg(LogDetail::kLongLong, value); }
+        Log& operator<<(unsigned long long value) { return PutArg(LogDetail::kULongLong, value); }
+        Log& operator<<(float value) { return PutArg(LogDetail::kDouble, static_cast<double>(value)); }
+        Log& operator<<(double value) { return PutArg(LogDetail::kDouble, value); }
+        Log& operator<<(long double value) { return PutArg(LogDetail::kLongDouble, value); }
+        Log& operator<<(const std::string& value) { return PutString(value.data(), value.size()); }
+        Log& operator<<(char* value) { return *this << static_cast<const char*>(value); }
+        Log& operator<<(const char* value)
+        {
+            return value ? PutString(value, strlen(value)) : PutString("(null)", 6);
+        }
+
+        Log& operator<<(LogDetail::OstreamManip manip)
+        {
+            const auto& manips = LogDetail::OstreamManips();
+            auto itr = std::find(manips.begin(), manips.end(), manip);
+            if (itr == manips.end())
+            {
+                return Eager(manip);
+            }
+            return PutArg(LogDetail::kOstreamManip, static_cast<uint8_t>(itr - manips.begin()));
+        }
+
+        Log& operator<<(LogDetail::IosManip manip)
+        {
+            manip(m_staging->eager);
+            const auto& manips = LogDetail::IosManips();
+            auto itr = std::find(manips.begin(), manips.end(), manip);
+            if (itr == manips.end())
+            {
+                return *this;
+            }
+            return PutArg(LogDetail::kIosManip, static_cast<uint8_t>(itr - manips.begin()));
+        }
+
+        // Anything else is formatted now, with the format flags set so far
+        template <typename T>
+        Log& operator<<(const T& value)
+        {
+            return Eager(value);
+        }
+
+    private:
+        template <typename T>
+        Log& Eager(const T& value)
+        {
+            auto& eager = m_staging->eager;
+            eager.str(std::string());
+            eager << value;
+            std::string text = eager.str();
+            return PutString(text.data(), text.size());
+        }
+    };
 
 #define L_(level) \
-    if (level > Log::Level()) ; \
+    if ((level) > CAPMGR_LOG_MAX_LEVEL || (level) > Log::GetLevel()) ; \
     else Log().Get(level)
 
 }
@@ -10,6 +10,13 @@
 #include <cheriintrin.h>
 #include <cstddef>
 
+// printf() format for a capability: with CHERI, %#p also shows the bounds and permissions
+#if CAPMGR_EMULATED_CAPS
+#define CAP_PRINTF_FORMAT "%p"
+#else
+#define CAP_PRINTF_FORMAT "%#p"
+#endif
+
 class Capability
 {
 
@@ -111,7 +118,7 @@ public:
     friend std::ostream& operator<<(std::ostream& ostr, const Capability& cap)
     {
         char buff[256];
-        snprintf(buff, sizeof(buff), "%#p", cap.m_cap);
+        snprintf(buff, sizeof(buff), CAP_PRINTF_FORMAT, cap.m_cap);
 
         ostr << std::string(buff);
 
@@ -0,0 +1,217 @@
+// Copyright (C) 2024 Verifoxx Limited
+// Implements CTracer
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "CTracer.h"
+#include "CCapMgrException.h"
+
+std::atomic<bool> CTracer::s_enabled{ false };
+
+namespace
+{
+    // One thread's events
+    struct ThreadEvents
+    {
+        std::vector<CTracer::Event> events;
+        std::atomic<size_t> count{ 0 };     // Ever recorded; the ring holds the last events.size()
+        long tid;
+
+        ThreadEvents(size_t size, long tid_) : events(size), tid(tid_) {}
+    };
+
+    struct TracerState
+    {
+        std::mutex mutex;
+        size_t events_per_thread = CTracer::kDefaultEventsPerThread;
+        std::vector<std::shared_ptr<ThreadEvents>> threads;     // Kept after the thread exits, for export
+        std::unordered_map<std::string, uint32_t> ids;
+        std::vector<std::string> names;                         // By id
+    };
+
+    TracerState& GetState()
+    {
+        static TracerState state;
+        return state;
+    }
+
+    ThreadEvents& GetThreadEvents()
+    {
+        static thread_local std::shared_ptr<ThreadEvents> thread_events;
+        if (!thread_events)
+        {
+            auto& state = GetState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            thread_events = std::make_shared<ThreadEvents>(state.events_per_thread, syscall(SYS_gettid));
+            state.threads.push_back(thread_events);
+        }
+        return *thread_events;
+    }
+
+    void WriteJsonString(std::ostream& out, const std::string& str)
+    {
+        out << '"';
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out << '\\' << c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+                out << buf;
+            }
+            else
+            {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+    // Chrome trace category and phase for an event type
+    void GetCategoryAndPhase(CTracer::EventType type, const char*& category, const char*& phase)
+    {
+        switch (type)
+        {
+        case CTracer::EventType::kCompartmentEnter: category = "compartment"; phase = "B"; break;
+        case CTracer::EventType::kCompartmentExit: category = "compartment"; phase = "E"; break;
+        case CTracer::EventType::kServiceEnter: category = "service"; phase = "B"; break;
+        case CTracer::EventType::kServiceExit: category = "service"; phase = "E"; break;
+        case CTracer::EventType::kAlloc: category = "alloc"; phase = "i"; break;
+        case CTracer::EventType::kFree: category = "free"; phase = "i"; break;
+        case CTracer::EventType::kPhaseBegin: category = "capmgr"; phase = "B"; break;
+        case CTracer::EventType::kPhaseEnd: category = "capmgr"; phase = "E"; break;
+        default: category = "unknown"; phase = "i"; break;
+        }
+    }
+}
+
+void CTracer::Enable(size_t events_per_thread)
+{
+    {
+        auto& state = GetState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.events_per_thread = events_per_thread ? events_per_thread : 1;
+    }
+    s_enabled.store(true, std::memory_order_relaxed);
+}
+
+void CTracer::Disable()
+{
+    s_enabled.store(false, std::memory_order_relaxed);
+}
+
+void CTracer::Clear()
+{
+    auto& state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for (auto& thread : state.threads)
+    {
+        thread->count.store(0, std::memory_order_relaxed);
+    }
+}
+
+uint32_t CTracer::InternName(const std::string& name)
+{
+    auto& state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    auto itr = state.ids.find(name);
+    if (itr != state.ids.end())
+    {
+        return itr->second;
+    }
+
+    uint32_t id = static_cast<uint32_t>(state.names.size());
+    state.names.push_back(name);
+    state.ids.emplace(name, id);
+    return id;
+}
+
+void CTracer::Record(EventType type, uint32_t id, uint64_t arg)
+{
+    auto& thread = GetThreadEvents();
+    size_t count = thread.count.load(std::memory_order_relaxed);
+
+    Event& event = thread.events[count % thread.events.size()];
+    event.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    event.arg = arg;
+    event.id = id;
+    event.type = type;
+
+    thread.count.store(count + 1, std::memory_order_release);
+}
+
+size_t CTracer::ExportChromeJson(const std::string& path)
+{
+    auto& state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    std::ofstream out(path);
+    if (!out)
+    {
+        throw CCapMgrException("Cannot create trace file " + path + ": " + strerror(errno));
+    }
+
+    long pid = getpid();
+    size_t written = 0;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+
+    for (const auto& thread : state.threads)
+    {
+        size_t count = thread->count.load(std::memory_order_acquire);
+        size_t size = thread->events.size();
+        size_t first = (count > size) ? count - size : 0;
+
+        for (size_t i = first; i < count; i++)
+        {
+            const Event& event = thread->events[i % size];
+            const char* category;
+            const char* phase;
+            GetCategoryAndPhase(event.type, category, phase);
+
+            char timestamp[32];
+            snprintf(timestamp, sizeof(timestamp), "%llu.%03llu", static_cast<unsigned long long>(event.time_ns / 1000),
+                static_cast<unsigned long long>(event.time_ns % 1000));
+
+            out << (written ? ",\n" : "") << "{\"name\":";
+            WriteJsonString(out, (event.id < state.names.size()) ? state.names[event.id] : std::string("?"));
+            out << ",\"cat\":\"" << category << "\",\"ph\":\"" << phase << "\",\"ts\":" << timestamp
+                << ",\"pid\":" << pid << ",\"tid\":" << thread->tid;
+
+            if (phase[0] == 'i')
+            {
+                out << ",\"s\":\"t\"";
+            }
+            if (event.arg && event.type != EventType::kCompartmentExit && event.type != EventType::kServiceExit &&
+                event.type != EventType::kPhaseEnd)
+            {
+                out << ",\"args\":{\"" << ((phase[0] == 'i') ? "bytes" : "count") << "\":" << event.arg << "}";
+            }
+            out << "}";
+            written++;
+        }
+    }
+
+    out << "\n]}\n";
+    if (!out)
+    {
+        throw CCapMgrException("Cannot write trace file " + path);
+    }
+    return written;
+}
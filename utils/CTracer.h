@@ -0,0 +1,97 @@
+// Copyright (C) 2024 Verifoxx Limited
+// CTracer: Optional tracing of domain transitions, allocations and fixup phases, exported as a Chrome trace
+
+#ifndef _CTRACER_H__
+#define _CTRACER_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// CTracer: When enabled, records timestamped events into a fixed size ring per thread (the oldest events are
+// overwritten), with no locks or allocation once the thread's ring exists.  Events name what they are about by an
+// id from InternName(), e.g. the compartment function called.
+// ExportChromeJson() writes the events of all threads in the Chrome trace event format, which chrome://tracing and
+// the Perfetto UI (ui.perfetto.dev) open.  Export once the traced work has finished.
+// While disabled, CAPMGR_TRACE costs one load and a branch, and its arguments are not evaluated.
+class CTracer
+{
+public:
+    static constexpr size_t kDefaultEventsPerThread = 64 * 1024;
+
+    enum class EventType : uint8_t
+    {
+        kCompartmentEnter,      // id: function called
+        kCompartmentExit,
+        kServiceEnter,          // id: service function
+        kServiceExit,
+        kAlloc,                 // id: allocator, arg: bytes
+        kFree,
+        kPhaseBegin,            // id: phase, arg: e.g. number of fixups
+        kPhaseEnd
+    };
+
+    struct Event
+    {
+        uint64_t time_ns;       // steady_clock
+        uint64_t arg;
+        uint32_t id;
+        EventType type;
+    };
+
+private:
+    static std::atomic<bool> s_enabled;
+
+public:
+    static bool IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    // Start recording, with rings of events_per_thread for threads which have not traced yet
+    static void Enable(size_t events_per_thread = kDefaultEventsPerThread);
+    static void Disable();
+
+    // Drop all events recorded so far
+    static void Clear();
+
+    // Id for a name, the same for each use of the name
+    static uint32_t InternName(const std::string& name);
+
+    static void Record(EventType type, uint32_t id, uint64_t arg = 0);
+
+    // Write all threads' events to path, returning the number of events written.  Throws CCapMgrException on failure.
+    static size_t ExportChromeJson(const std::string& path);
+};
+
+// Record an event if tracing is enabled
+#define CAPMGR_TRACE(type, id, arg) \
+    if (__builtin_expect(!CTracer::IsEnabled(), 1)) ; \
+    else CTracer::Record(CTracer::EventType::type, id, arg)
+
+// CTraceScope: Records a phase for the lifetime of the object, if tracing is enabled when it is constructed
+class CTraceScope
+{
+    uint32_t m_id;
+    bool m_recording;
+
+public:
+    CTraceScope(uint32_t id, uint64_t arg = 0) : m_id(id), m_recording(CTracer::IsEnabled())
+    {
+        if (m_recording)
+        {
+            CTracer::Record(CTracer::EventType::kPhaseBegin, m_id, arg);
+        }
+    }
+
+    ~CTraceScope()
+    {
+        if (m_recording)
+        {
+            CTracer::Record(CTracer::EventType::kPhaseEnd, m_id);
+        }
+    }
+
+    CTraceScope(const CTraceScope&) = delete;
+    CTraceScope& operator=(const CTraceScope&) = delete;
+};
+
+#endif /* _CTRACER_H__ */
@@ -7,6 +7,8 @@
 #include <cstddef>
 #include <cstdint>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 // Basic range class
 struct Range
@@ -52,4 +54,72 @@ struct Range
 
 };
 
+// Set of ranges, sorted and with overlapping or adjacent ranges merged, for fast intersection tests
+class RangeSet
+{
+    std::vector<Range> m_ranges;
+    Range m_hull;           // Smallest range covering all ranges, to reject most tests with two compares
+
+public:
+    RangeSet() {}
+
+    // Ranges may be given in any order; empty ranges are dropped.
+    // Each range is moved down by rebase, e.g so that absolute addresses become offsets from a base address
+    explicit RangeSet(const std::vector<Range>& ranges, uintptr_t rebase = 0)
+    {
+        for (const auto& range : ranges)
+        {
+            if (range.Size())
+            {
+                Range r;
+                r.base = range.base - rebase;
+                r.top = range.top - rebase;
+                m_ranges.push_back(r);
+            }
+        }
+
+        std::sort(m_ranges.begin(), m_ranges.end(),
+            [](const Range& a, const Range& b) { return a.base < b.base; });
+
+        // Merge so that bases and tops are both strictly ascending
+        size_t out = 0;
+        for (size_t i = 0; i < m_ranges.size(); ++i)
+        {
+            if (out && m_ranges[i].base <= m_ranges[out - 1].top)
+            {
+                m_ranges[out - 1].top = std::max(m_ranges[out - 1].top, m_ranges[i].top);
+            }
+            else
+            {
+                m_ranges[out++] = m_ranges[i];
+            }
+        }
+        m_ranges.resize(out);
+
+        if (!m_ranges.empty())
+        {
+            m_hull.base = m_ranges.front().base;
+            m_hull.top = m_ranges.back().top;
+        }
+    }
+
+    bool Empty() const { return m_ranges.empty(); }
+
+    const std::vector<Range>& GetRanges() const { return m_ranges; }
+
+    bool Intersects(const Range& other) const
+    {
+        if (!m_hull.Intersects(other))
+        {
+            return false;
+        }
+
+        // First range which ends after the start of other
+        auto itr = std::upper_bound(m_ranges.begin(), m_ranges.end(), other.base,
+            [](uintptr_t addr, const Range& r) { return addr < r.top; });
+
+        return itr != m_ranges.end() && itr->base < other.top;
+    }
+};
+
 #endif /* __RANGE_H_ */